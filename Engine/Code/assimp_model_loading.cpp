@@ -4,6 +4,40 @@
 #include <assimp/postprocess.h>
 #include "engine.h"
 #include "platform.h"
+#include "buffer_management.h"
+#include "material_system.h"
+#include "software_occlusion.h"
+#include "meshlets.h"
+#include "lod.h"
+
+// Box first, then the smallest sphere around its center containing every vertex
+void ComputeSubmeshBounds(aiMesh* mesh, Submesh& submesh)
+{
+    vec3 aabbMin = vec3(FLT_MAX);
+    vec3 aabbMax = vec3(-FLT_MAX);
+    for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+    {
+        const vec3 position = vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+        aabbMin = glm::min(aabbMin, position);
+        aabbMax = glm::max(aabbMax, position);
+    }
+
+    if (mesh->mNumVertices == 0)
+        aabbMin = aabbMax = vec3(0.0f);
+
+    const vec3 center = (aabbMin + aabbMax) * 0.5f;
+    f32 radiusSq = 0.0f;
+    for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+    {
+        const vec3 offset = vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z) - center;
+        radiusSq = glm::max(radiusSq, glm::dot(offset, offset));
+    }
+
+    submesh.aabbMin = aabbMin;
+    submesh.aabbMax = aabbMax;
+    submesh.sphereCenter = center;
+    submesh.sphereRadius = sqrtf(radiusSq);
+}
 
 void ProcessAssimpMesh(const aiScene* scene, aiMesh *mesh, Mesh *myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices)
 {
@@ -85,6 +119,13 @@ void ProcessAssimpMesh(const aiScene* scene, aiMesh *mesh, Mesh *myMesh, u32 bas
 
     // add the submesh into the mesh
     Submesh submesh = {};
+    ComputeSubmeshBounds(mesh, submesh);
+    std::vector<vec3> positions(mesh->mNumVertices);
+    for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+        positions[i] = vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+    BuildOccluderMesh(positions, indices, submesh.aabbMin, submesh.aabbMax, submesh.occluderPositions, submesh.occluderIndices, submesh.occluderError);
+    BuildMeshlets(positions, indices, submesh.meshlets);
+    BuildLodChain(positions, indices, submesh.lods, submesh.lodCount);
     submesh.vertexBufferLayout = vertexBufferLayout;
     submesh.vertices.swap(vertices);
     submesh.indices.swap(indices);
@@ -115,35 +156,35 @@ void ProcessAssimpMaterial(App* app, aiMaterial *material, Material& myMaterial,
         material->GetTexture(aiTextureType_DIFFUSE, 0, &aiFilename);
         String filename = MakeString(aiFilename.C_Str());
         String filepath = MakePath(directory, filename);
-        myMaterial.albedoTextureIdx = LoadTexture2D(app, filepath.str);
+        myMaterial.albedoTextureIdx = LoadMaterialTexture(app, filepath.str);
     }
     if (material->GetTextureCount(aiTextureType_EMISSIVE) > 0)
     {
         material->GetTexture(aiTextureType_EMISSIVE, 0, &aiFilename);
         String filename = MakeString(aiFilename.C_Str());
         String filepath = MakePath(directory, filename);
-        myMaterial.emissiveTextureIdx = LoadTexture2D(app, filepath.str);
+        myMaterial.emissiveTextureIdx = LoadMaterialTexture(app, filepath.str);
     }
     if (material->GetTextureCount(aiTextureType_SPECULAR) > 0)
     {
         material->GetTexture(aiTextureType_SPECULAR, 0, &aiFilename);
         String filename = MakeString(aiFilename.C_Str());
         String filepath = MakePath(directory, filename);
-        myMaterial.specularTextureIdx = LoadTexture2D(app, filepath.str);
+        myMaterial.specularTextureIdx = LoadMaterialTexture(app, filepath.str);
     }
     if (material->GetTextureCount(aiTextureType_NORMALS) > 0)
     {
         material->GetTexture(aiTextureType_NORMALS, 0, &aiFilename);
         String filename = MakeString(aiFilename.C_Str());
         String filepath = MakePath(directory, filename);
-        myMaterial.normalsTextureIdx = LoadTexture2D(app, filepath.str);
+        myMaterial.normalsTextureIdx = LoadMaterialTexture(app, filepath.str);
     }
     if (material->GetTextureCount(aiTextureType_HEIGHT) > 0)
     {
         material->GetTexture(aiTextureType_HEIGHT, 0, &aiFilename);
         String filename = MakeString(aiFilename.C_Str());
         String filepath = MakePath(directory, filename);
-        myMaterial.bumpTextureIdx = LoadTexture2D(app, filepath.str);
+        myMaterial.bumpTextureIdx = LoadMaterialTexture(app, filepath.str);
     }
 
     //myMaterial.createNormalFromBump();
@@ -207,46 +248,29 @@ u32 LoadModel(App* app, const char* filename)
 
     aiReleaseImport(scene);
 
-    u32 vertexBufferSize = 0;
-    u32 indexBufferSize = 0;
-
     for (u32 i = 0; i < mesh.submeshes.size(); ++i)
     {
-        vertexBufferSize += mesh.submeshes[i].vertices.size() * sizeof(float);
-        indexBufferSize  += mesh.submeshes[i].indices.size()  * sizeof(u32);
+        AllocateSubmeshGeometry(app, mesh.submeshes[i]);
     }
 
-    glGenBuffers(1, &mesh.vertexBufferHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
-
-    glGenBuffers(1, &mesh.indexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
+    return modelIdx;
+}
 
-    u32 indicesOffset = 0;
-    u32 verticesOffset = 0;
+void ReloadModelGeometry(App* app, u32 modelIdx)
+{
+    Model& model = app->models[modelIdx];
+    Mesh& mesh = app->meshes[model.meshIdx];
 
+    // All the blocks go back first, so the model may land in the space it
+    // coalesces with its neighbours. Submeshes keep their CPU copy to upload again.
     for (u32 i = 0; i < mesh.submeshes.size(); ++i)
     {
-        const void* verticesData = mesh.submeshes[i].vertices.data();
-        const u32   verticesSize = mesh.submeshes[i].vertices.size() * sizeof(float);
-        glBufferSubData(GL_ARRAY_BUFFER, verticesOffset, verticesSize, verticesData);
-        mesh.submeshes[i].vertexOffset = verticesOffset;
-        verticesOffset += verticesSize;
-
-        const void* indicesData = mesh.submeshes[i].indices.data();
-        const u32   indicesSize = mesh.submeshes[i].indices.size() * sizeof(u32);
-        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indicesOffset, indicesSize, indicesData);
-        mesh.submeshes[i].indexOffset = indicesOffset;
-        indicesOffset += indicesSize;
+        FreeSubmeshGeometry(app, mesh.submeshes[i]);
+    }
+    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+    {
+        AllocateSubmeshGeometry(app, mesh.submeshes[i]);
     }
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-
-    return modelIdx;
 }
 
 
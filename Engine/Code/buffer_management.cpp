@@ -1,5 +1,7 @@
 #include "platform.h"
 #include "engine.h"
+#include "upload_manager.h"
+#include "gl_state.h"
 
 bool IsPowerOf2(u32 value)
 {
@@ -55,4 +57,263 @@ void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment)
     AlignHead(buffer, alignment);
     memcpy((u8*)buffer.data + buffer.head, data, size);
     buffer.head += size;
-}
\ No newline at end of file
+}
+void CreateBufferHeap(BufferHeap& heap, GLenum type, u32 elementSize, u32 capacity)
+{
+    heap = {};
+    heap.buffer = CreateBuffer(elementSize * capacity, type, GL_STATIC_DRAW);
+    heap.elementSize = elementSize;
+    heap.capacity = capacity;
+    heap.usedCount = 0;
+    heap.freeBlocks.push_back(HeapBlock{ 0, capacity });
+}
+
+bool HeapAllocate(BufferHeap& heap, u32 count, u32& offset)
+{
+    if (count == 0)
+    {
+        offset = 0;
+        return true;
+    }
+
+    // Best fit keeps the big free blocks around for big meshes
+    u32 bestIdx = UINT32_MAX;
+    for (u32 i = 0; i < heap.freeBlocks.size(); ++i)
+    {
+        const HeapBlock& block = heap.freeBlocks[i];
+        if (block.count >= count && (bestIdx == UINT32_MAX || block.count < heap.freeBlocks[bestIdx].count))
+            bestIdx = i;
+    }
+
+    if (bestIdx == UINT32_MAX)
+        return false;
+
+    HeapBlock& block = heap.freeBlocks[bestIdx];
+    offset = block.offset;
+    block.offset += count;
+    block.count -= count;
+    if (block.count == 0)
+        heap.freeBlocks.erase(heap.freeBlocks.begin() + bestIdx);
+
+    heap.usedCount += count;
+    return true;
+}
+
+void HeapFree(BufferHeap& heap, u32 offset, u32 count)
+{
+    if (count == 0)
+        return;
+
+    ASSERT(heap.usedCount >= count, "Freeing more elements than allocated");
+    heap.usedCount -= count;
+
+    // Find the insertion point that keeps the list sorted by offset
+    u32 idx = 0;
+    while (idx < heap.freeBlocks.size() && heap.freeBlocks[idx].offset < offset)
+        ++idx;
+
+    heap.freeBlocks.insert(heap.freeBlocks.begin() + idx, HeapBlock{ offset, count });
+
+    // Coalesce with the next block
+    if (idx + 1 < heap.freeBlocks.size())
+    {
+        HeapBlock& next = heap.freeBlocks[idx + 1];
+        if (offset + count == next.offset)
+        {
+            heap.freeBlocks[idx].count += next.count;
+            heap.freeBlocks.erase(heap.freeBlocks.begin() + idx + 1);
+        }
+    }
+
+    // Coalesce with the previous block
+    if (idx > 0)
+    {
+        HeapBlock& prev = heap.freeBlocks[idx - 1];
+        if (prev.offset + prev.count == heap.freeBlocks[idx].offset)
+        {
+            prev.count += heap.freeBlocks[idx].count;
+            heap.freeBlocks.erase(heap.freeBlocks.begin() + idx);
+        }
+    }
+}
+
+void GrowBufferHeap(BufferHeap& heap, u32 minCapacity)
+{
+    u32 newCapacity = heap.capacity > 0 ? heap.capacity * 2 : 1;
+    while (newCapacity < minCapacity)
+        newCapacity *= 2;
+
+    Buffer newBuffer = CreateBuffer(heap.elementSize * newCapacity, heap.buffer.type, GL_STATIC_DRAW);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, heap.buffer.handle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer.handle);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, heap.elementSize * heap.capacity);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+    glDeleteBuffers(1, &heap.buffer.handle);
+    heap.buffer = newBuffer;
+
+    // The new tail is free space, merged with the last block if it touches it
+    u32 oldCapacity = heap.capacity;
+    heap.capacity = newCapacity;
+    if (!heap.freeBlocks.empty() && heap.freeBlocks.back().offset + heap.freeBlocks.back().count == oldCapacity)
+        heap.freeBlocks.back().count += newCapacity - oldCapacity;
+    else
+        heap.freeBlocks.push_back(HeapBlock{ oldCapacity, newCapacity - oldCapacity });
+}
+
+void InitGeometryHeap(GeometryHeap& geometry, u32 vertexHeapSize, u32 indexHeapSize)
+{
+    geometry.vertexHeaps.clear();
+    geometry.vertexHeapSize = vertexHeapSize;
+    CreateBufferHeap(geometry.indexHeap, GL_ELEMENT_ARRAY_BUFFER, sizeof(u32), indexHeapSize / sizeof(u32));
+}
+
+bool SameVertexLayout(const VertexBufferLayout& a, const VertexBufferLayout& b)
+{
+    if (a.stride != b.stride || a.attributes.size() != b.attributes.size())
+        return false;
+
+    for (u32 i = 0; i < a.attributes.size(); ++i)
+    {
+        if (a.attributes[i].location != b.attributes[i].location ||
+            a.attributes[i].componentCount != b.attributes[i].componentCount ||
+            a.attributes[i].offset != b.attributes[i].offset)
+            return false;
+    }
+
+    return true;
+}
+
+u32 FindOrCreateVertexHeap(GeometryHeap& geometry, const VertexBufferLayout& layout)
+{
+    for (u32 i = 0; i < geometry.vertexHeaps.size(); ++i)
+        if (SameVertexLayout(geometry.vertexHeaps[i].layout, layout))
+            return i;
+
+    VertexHeap vertexHeap = {};
+    vertexHeap.layout = layout;
+    CreateBufferHeap(vertexHeap.heap, GL_ARRAY_BUFFER, layout.stride, geometry.vertexHeapSize / layout.stride);
+    vertexHeap.positions = CreateBuffer(vertexHeap.heap.capacity * sizeof(vec3), GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+    vertexHeap.positionVao = 0;
+    geometry.vertexHeaps.push_back(vertexHeap);
+
+    return geometry.vertexHeaps.size() - 1;
+}
+
+// Points every cached VAO at the current heap buffers, formats are left untouched
+void RebindVAOBuffers(App* app)
+{
+    for (auto& entry : app->vaoCache)
+    {
+        const Vao& vao = entry.second;
+        const VertexHeap& vertexHeap = app->geometry.vertexHeaps[vao.vertexHeapIdx];
+
+        StateBindVertexArray(app->glState, vao.handle);
+        glBindVertexBuffer(VERTEX_BINDING_VERTICES, vertexHeap.heap.buffer.handle, 0, vertexHeap.layout.stride);
+        glBindVertexBuffer(VERTEX_BINDING_DRAW_INFO, app->indirect.drawInfoBuffer.handle, 0, sizeof(DrawInfo));
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->geometry.indexHeap.buffer.handle);
+    }
+
+    for (const VertexHeap& vertexHeap : app->geometry.vertexHeaps)
+    {
+        if (vertexHeap.positionVao == 0)
+            continue;
+
+        StateBindVertexArray(app->glState, vertexHeap.positionVao);
+        glBindVertexBuffer(VERTEX_BINDING_VERTICES, vertexHeap.positions.handle, 0, sizeof(vec3));
+        glBindVertexBuffer(VERTEX_BINDING_DRAW_INFO, app->indirect.drawInfoBuffer.handle, 0, sizeof(DrawInfo));
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->geometry.indexHeap.buffer.handle);
+    }
+
+    StateBindVertexArray(app->glState, 0);
+}
+
+// Keeps the position stream as big as its vertex heap, old positions are copied over
+void GrowPositionStream(VertexHeap& vertexHeap)
+{
+    const u32 oldSize = vertexHeap.positions.size;
+    Buffer newBuffer = CreateBuffer(vertexHeap.heap.capacity * sizeof(vec3), GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, vertexHeap.positions.handle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer.handle);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldSize);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+    glDeleteBuffers(1, &vertexHeap.positions.handle);
+    vertexHeap.positions = newBuffer;
+}
+
+// Pulls the location 0 attribute out of interleaved vertices
+std::vector<vec3> ExtractPositions(const Submesh& submesh, u32 vertexCount)
+{
+    const VertexBufferLayout& layout = submesh.vertexBufferLayout;
+
+    u32 positionOffset = UINT32_MAX;
+    for (const VertexBufferAttribute& attribute : layout.attributes)
+        if (attribute.location == 0)
+            positionOffset = attribute.offset;
+    ASSERT(positionOffset != UINT32_MAX, "Vertex format without positions");
+
+    std::vector<vec3> positions(vertexCount);
+    for (u32 i = 0; i < vertexCount; ++i)
+        memcpy(&positions[i], (const u8*)submesh.vertices.data() + i * layout.stride + positionOffset, sizeof(vec3));
+
+    return positions;
+}
+
+void UploadHeapData(App* app, BufferHeap& heap, u32 offset, const void* data, u32 count)
+{
+    StageBufferUpload(app, heap.buffer.handle, offset * heap.elementSize, data, count * heap.elementSize);
+}
+
+void AllocateSubmeshGeometry(App* app, Submesh& submesh)
+{
+    GeometryHeap& geometry = app->geometry;
+
+    submesh.vertexHeapIdx = FindOrCreateVertexHeap(geometry, submesh.vertexBufferLayout);
+    VertexHeap& formatHeap = geometry.vertexHeaps[submesh.vertexHeapIdx];
+    BufferHeap& vertexHeap = formatHeap.heap;
+
+    const u32 vertexCount = submesh.vertices.size() * sizeof(float) / vertexHeap.elementSize;
+    const u32 indexCount = submesh.indices.size();
+
+    // Growing a heap replaces its buffer, so every VAO pointing to it must be
+    // rebound and queued uploads targeting the old buffer must land before the copy.
+    // The free space may be fragmented, only the new tail is sure to fit the request.
+    if (!HeapAllocate(vertexHeap, vertexCount, submesh.baseVertex))
+    {
+        FlushUploads(app);
+        GrowBufferHeap(vertexHeap, vertexHeap.capacity + vertexCount);
+        GrowPositionStream(formatHeap);
+        RebindVAOBuffers(app);
+        const bool allocated = HeapAllocate(vertexHeap, vertexCount, submesh.baseVertex);
+        ASSERT(allocated, "Vertex heap still full after growing");
+        (void)allocated;
+    }
+    if (!HeapAllocate(geometry.indexHeap, indexCount, submesh.firstIndex))
+    {
+        FlushUploads(app);
+        GrowBufferHeap(geometry.indexHeap, geometry.indexHeap.capacity + indexCount);
+        RebindVAOBuffers(app);
+        const bool allocated = HeapAllocate(geometry.indexHeap, indexCount, submesh.firstIndex);
+        ASSERT(allocated, "Index heap still full after growing");
+        (void)allocated;
+    }
+
+    UploadHeapData(app, vertexHeap, submesh.baseVertex, submesh.vertices.data(), vertexCount);
+    std::vector<vec3> positions = ExtractPositions(submesh, vertexCount);
+    StageBufferUpload(app, formatHeap.positions.handle, submesh.baseVertex * sizeof(vec3), positions.data(), vertexCount * sizeof(vec3));
+    UploadHeapData(app, geometry.indexHeap, submesh.firstIndex, submesh.indices.data(), indexCount);
+}
+
+void FreeSubmeshGeometry(App* app, Submesh& submesh)
+{
+    GeometryHeap& geometry = app->geometry;
+    BufferHeap& vertexHeap = geometry.vertexHeaps[submesh.vertexHeapIdx].heap;
+
+    HeapFree(vertexHeap, submesh.baseVertex, submesh.vertices.size() * sizeof(float) / vertexHeap.elementSize);
+    HeapFree(geometry.indexHeap, submesh.firstIndex, submesh.indices.size());
+}
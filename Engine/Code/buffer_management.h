@@ -3,6 +3,8 @@
 #include "platform.h"
 #include "engine.h"
 
+u32 Align(u32 value, u32 alignment);
+
 Buffer CreateBuffer(u32 size, GLenum type, GLenum usage);
 
 void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment);
@@ -13,6 +15,18 @@ void AlignHead(Buffer& buffer, u32 alignment);
 void MapBuffer(Buffer& buffer, GLenum access);
 void UnmapBuffer(Buffer& buffer);
 
+void CreateBufferHeap(BufferHeap& heap, GLenum type, u32 elementSize, u32 capacity);
+bool HeapAllocate(BufferHeap& heap, u32 count, u32& offset);
+void HeapFree(BufferHeap& heap, u32 offset, u32 count);
+void GrowBufferHeap(BufferHeap& heap, u32 minCapacity);
+
+void InitGeometryHeap(GeometryHeap& geometry, u32 vertexHeapSize, u32 indexHeapSize);
+u32  FindOrCreateVertexHeap(GeometryHeap& geometry, const VertexBufferLayout& layout);
+bool SameVertexLayout(const VertexBufferLayout& a, const VertexBufferLayout& b);
+void RebindVAOBuffers(App* app);
+void AllocateSubmeshGeometry(App* app, Submesh& submesh);
+void FreeSubmeshGeometry(App* app, Submesh& submesh);
+
 #define CreateConstantBuffer(size) CreateBuffer(size, GL_UNIFORM_BUFFER, GL_STREAM_DRAW);
 #define CreateStaticVertexBuffer(size) CreateBuffer(size, GL_ARRAY_BUFFER, GL_STATIC_DRAW);
 #define CreateStaticIndexBuffer(size) CreateBuffer(size, GL_ELEMENT_ARRAY_BUFFER, GL_STATIC_DRAW);
@@ -0,0 +1,408 @@
+#include "bvh.h"
+#include <float.h>
+#include <algorithm>
+#include <numeric>
+
+#define BVH_NO_PARENT 0xFFFFFFFF
+
+Aabb EmptyAabb()
+{
+    return Aabb{ vec3(FLT_MAX), vec3(-FLT_MAX) };
+}
+
+void GrowAabb(Aabb& box, const Aabb& other)
+{
+    box.min = glm::min(box.min, other.min);
+    box.max = glm::max(box.max, other.max);
+}
+
+f32 SurfaceArea(const Aabb& box)
+{
+    const vec3 d = glm::max(box.max - box.min, vec3(0.0f));
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+void MakeBvhLeaf(Bvh& bvh, u32 nodeIdx, u32 first, u32 count)
+{
+    bvh.nodes[nodeIdx].first = first;
+    bvh.nodes[nodeIdx].count = count;
+    for (u32 i = first; i < first + count; ++i)
+        bvh.primitiveLeaf[bvh.indices[i]] = nodeIdx;
+}
+
+void BuildBvhNode(Bvh& bvh, u32 nodeIdx, u32 first, u32 count, u32 depth, const std::vector<vec3>& centroids)
+{
+    Aabb box = EmptyAabb();
+    Aabb centroidBox = EmptyAabb();
+    for (u32 i = first; i < first + count; ++i)
+    {
+        GrowAabb(box, bvh.primitives[bvh.indices[i]]);
+        GrowAabb(centroidBox, Aabb{ centroids[bvh.indices[i]], centroids[bvh.indices[i]] });
+    }
+    bvh.nodes[nodeIdx].box = box;
+
+    if (count == 1 || depth + 1 >= BVH_MAX_DEPTH)
+    {
+        MakeBvhLeaf(bvh, nodeIdx, first, count);
+        return;
+    }
+
+    // Binned SAH: centroids are dropped into bins along each axis and every
+    // bin boundary is scored by child area times primitive count
+    f32 bestCost = FLT_MAX;
+    i32 bestAxis = -1;
+    u32 bestSplit = 0;
+    for (u32 axis = 0; axis < 3; ++axis)
+    {
+        const f32 extent = centroidBox.max[axis] - centroidBox.min[axis];
+        if (extent <= 0.0f)
+            continue;
+
+        Aabb bins[BVH_BINS];
+        u32 binCounts[BVH_BINS] = {};
+        for (u32 b = 0; b < BVH_BINS; ++b)
+            bins[b] = EmptyAabb();
+
+        const f32 scale = BVH_BINS / extent;
+        for (u32 i = first; i < first + count; ++i)
+        {
+            const u32 b = glm::min((u32)((centroids[bvh.indices[i]][axis] - centroidBox.min[axis]) * scale), (u32)BVH_BINS - 1);
+            GrowAabb(bins[b], bvh.primitives[bvh.indices[i]]);
+            binCounts[b]++;
+        }
+
+        // Right side costs swept from the last bin, then the left side on the way back
+        f32 rightCosts[BVH_BINS] = {};
+        Aabb right = EmptyAabb();
+        u32 rightCount = 0;
+        for (u32 b = BVH_BINS - 1; b > 0; --b)
+        {
+            GrowAabb(right, bins[b]);
+            rightCount += binCounts[b];
+            rightCosts[b] = rightCount > 0 ? rightCount * SurfaceArea(right) : 0.0f;
+        }
+
+        Aabb left = EmptyAabb();
+        u32 leftCount = 0;
+        for (u32 split = 1; split < BVH_BINS; ++split)
+        {
+            GrowAabb(left, bins[split - 1]);
+            leftCount += binCounts[split - 1];
+            if (leftCount == 0 || leftCount == count)
+                continue;
+
+            const f32 cost = leftCount * SurfaceArea(left) + rightCosts[split];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+            }
+        }
+    }
+
+    u32 leftCount = count / 2;
+    if (bestAxis >= 0)
+    {
+        // One traversal step plus the children against testing every primitive
+        const f32 area = SurfaceArea(box);
+        if (count <= BVH_LEAF_SIZE && area + bestCost >= count * area)
+        {
+            MakeBvhLeaf(bvh, nodeIdx, first, count);
+            return;
+        }
+
+        const f32 scale = BVH_BINS / (centroidBox.max[bestAxis] - centroidBox.min[bestAxis]);
+        const f32 minimum = centroidBox.min[bestAxis];
+        u32* begin = bvh.indices.data() + first;
+        u32* middle = std::partition(begin, begin + count, [&](u32 primitive)
+        {
+            return glm::min((u32)((centroids[primitive][bestAxis] - minimum) * scale), (u32)BVH_BINS - 1) < bestSplit;
+        });
+        leftCount = middle - begin;
+    }
+    else if (count <= BVH_LEAF_SIZE)
+    {
+        MakeBvhLeaf(bvh, nodeIdx, first, count);
+        return;
+    }
+    // Else every centroid is the same point, any halves are as good
+
+    const u32 leftIdx = bvh.nodes.size();
+    bvh.nodes.resize(leftIdx + 2);
+    bvh.parents.resize(leftIdx + 2, nodeIdx);
+    bvh.nodes[nodeIdx].first = leftIdx;
+    bvh.nodes[nodeIdx].count = 0;
+
+    BuildBvhNode(bvh, leftIdx, first, leftCount, depth + 1, centroids);
+    BuildBvhNode(bvh, leftIdx + 1, first + leftCount, count - leftCount, depth + 1, centroids);
+}
+
+// Expected cost of a random ray through the root, in box tests
+f32 BvhCost(const Bvh& bvh)
+{
+    const f32 rootArea = SurfaceArea(bvh.nodes[0].box);
+    if (rootArea <= 0.0f)
+        return 0.0f;
+
+    f32 cost = 0.0f;
+    for (const BvhNode& node : bvh.nodes)
+        cost += SurfaceArea(node.box) * (node.count > 0 ? node.count : 1);
+    return cost / rootArea;
+}
+
+void BuildBvh(Bvh& bvh, const std::vector<Aabb>& boxes)
+{
+    bvh.primitives = boxes;
+    bvh.indices.resize(boxes.size());
+    std::iota(bvh.indices.begin(), bvh.indices.end(), 0);
+    bvh.primitiveLeaf.assign(boxes.size(), 0);
+    bvh.dirtyLeaves.clear();
+
+    bvh.nodes.clear();
+    bvh.nodes.reserve(boxes.size() * 2);
+    bvh.nodes.resize(1);
+    bvh.parents.assign(1, BVH_NO_PARENT);
+    bvh.rebuilds++;
+
+    if (boxes.empty())
+    {
+        bvh.nodes[0] = BvhNode{ EmptyAabb(), 0, 0 };
+        bvh.builtCost = 0.0f;
+        return;
+    }
+
+    std::vector<vec3> centroids(boxes.size());
+    for (u32 i = 0; i < boxes.size(); ++i)
+        centroids[i] = (boxes[i].min + boxes[i].max) * 0.5f;
+
+    BuildBvhNode(bvh, 0, 0, boxes.size(), 0, centroids);
+    bvh.builtCost = BvhCost(bvh);
+}
+
+void SetBvhPrimitive(Bvh& bvh, u32 primitive, const Aabb& box)
+{
+    bvh.primitives[primitive] = box;
+    bvh.dirtyLeaves.push_back(bvh.primitiveLeaf[primitive]);
+}
+
+bool RefitBvh(Bvh& bvh)
+{
+    if (bvh.dirtyLeaves.empty())
+        return false;
+
+    std::sort(bvh.dirtyLeaves.begin(), bvh.dirtyLeaves.end());
+    bvh.dirtyLeaves.erase(std::unique(bvh.dirtyLeaves.begin(), bvh.dirtyLeaves.end()), bvh.dirtyLeaves.end());
+
+    for (u32 leafIdx : bvh.dirtyLeaves)
+    {
+        BvhNode& leaf = bvh.nodes[leafIdx];
+        leaf.box = EmptyAabb();
+        for (u32 i = leaf.first; i < leaf.first + leaf.count; ++i)
+            GrowAabb(leaf.box, bvh.primitives[bvh.indices[i]]);
+
+        // Ancestors stop changing as soon as one of them keeps its box
+        for (u32 nodeIdx = bvh.parents[leafIdx]; nodeIdx != BVH_NO_PARENT; nodeIdx = bvh.parents[nodeIdx])
+        {
+            BvhNode& node = bvh.nodes[nodeIdx];
+            Aabb box = bvh.nodes[node.first].box;
+            GrowAabb(box, bvh.nodes[node.first + 1].box);
+            if (box.min == node.box.min && box.max == node.box.max)
+                break;
+            node.box = box;
+        }
+    }
+    bvh.dirtyLeaves.clear();
+
+    // Refitting keeps the topology, entities that moved far apart leave
+    // large overlapping nodes behind
+    if (BvhCost(bvh) > 2.0f * bvh.builtCost)
+    {
+        const std::vector<Aabb> boxes = bvh.primitives;
+        BuildBvh(bvh, boxes);
+        return true;
+    }
+    return false;
+}
+
+// False when the box is outside, clears the bits of the planes it is fully inside of
+bool ClipAabb(const Frustum& frustum, const Aabb& box, u32& planeMask)
+{
+    const vec3 center = (box.min + box.max) * 0.5f;
+    const vec3 extent = (box.max - box.min) * 0.5f;
+    for (u32 p = 0; p < 6; ++p)
+    {
+        if (!(planeMask & (1 << p)))
+            continue;
+
+        const vec3 normal = vec3(frustum.planes[p]);
+        const f32 distance = glm::dot(normal, center) + frustum.planes[p].w;
+        const f32 radius = glm::dot(glm::abs(normal), extent);
+        if (distance + radius < 0.0f)
+            return false;
+        if (distance - radius >= 0.0f)
+            planeMask &= ~(1 << p);
+    }
+    return true;
+}
+
+void BvhQueryFrustum(const Bvh& bvh, const Frustum& frustum, std::vector<u8>& visible, CullStats& stats)
+{
+    visible.assign(bvh.primitives.size(), 0);
+    stats.tested = 0;
+    stats.visible = 0;
+    if (bvh.primitives.empty())
+        return;
+
+    // Planes a node is fully inside of are not tested again below it
+    struct Entry { u32 node; u32 planeMask; };
+    Entry stack[BVH_MAX_DEPTH + 1];
+    u32 top = 0;
+    stack[top++] = Entry{ 0, 0x3F };
+
+    while (top > 0)
+    {
+        Entry entry = stack[--top];
+        const BvhNode& node = bvh.nodes[entry.node];
+
+        if (entry.planeMask != 0)
+        {
+            stats.tested++;
+            if (!ClipAabb(frustum, node.box, entry.planeMask))
+                continue;
+        }
+
+        if (node.count == 0)
+        {
+            stack[top++] = Entry{ node.first, entry.planeMask };
+            stack[top++] = Entry{ node.first + 1, entry.planeMask };
+            continue;
+        }
+
+        for (u32 i = node.first; i < node.first + node.count; ++i)
+        {
+            const u32 primitive = bvh.indices[i];
+            u32 planeMask = entry.planeMask;
+            if (planeMask != 0)
+            {
+                stats.tested++;
+                if (!ClipAabb(frustum, bvh.primitives[primitive], planeMask))
+                    continue;
+            }
+            visible[primitive] = 1;
+            stats.visible++;
+        }
+    }
+}
+
+bool AabbTouchesSphere(const Aabb& box, const vec3& center, f32 radius)
+{
+    const vec3 d = glm::clamp(center, box.min, box.max) - center;
+    return glm::dot(d, d) <= radius * radius;
+}
+
+void BvhQuerySphere(const Bvh& bvh, const vec3& center, f32 radius, std::vector<u32>& results)
+{
+    if (bvh.primitives.empty())
+        return;
+
+    u32 stack[BVH_MAX_DEPTH + 1];
+    u32 top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--top]];
+        if (!AabbTouchesSphere(node.box, center, radius))
+            continue;
+
+        if (node.count == 0)
+        {
+            stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+            continue;
+        }
+
+        for (u32 i = node.first; i < node.first + node.count; ++i)
+        {
+            if (AabbTouchesSphere(bvh.primitives[bvh.indices[i]], center, radius))
+                results.push_back(bvh.indices[i]);
+        }
+    }
+}
+
+// Slab test, returns the entry and exit distances along the ray
+bool IntersectAabb(const Aabb& box, const vec3& origin, const vec3& inverseDirection, f32& tEnter, f32& tExit)
+{
+    const vec3 t0 = (box.min - origin) * inverseDirection;
+    const vec3 t1 = (box.max - origin) * inverseDirection;
+    const vec3 tNear = glm::min(t0, t1);
+    const vec3 tFar = glm::max(t0, t1);
+    tEnter = glm::max(tNear.x, glm::max(tNear.y, tNear.z));
+    tExit = glm::min(tFar.x, glm::min(tFar.y, tFar.z));
+    return tExit >= glm::max(tEnter, 0.0f);
+}
+
+bool BvhRaycast(const Bvh& bvh, const vec3& origin, const vec3& direction, f32 maxDistance, BvhHit& hit)
+{
+    hit.primitive = 0;
+    hit.distance = maxDistance;
+    if (bvh.primitives.empty())
+        return false;
+
+    const vec3 inverseDirection = 1.0f / direction;
+    bool found = false;
+
+    struct Entry { u32 node; f32 distance; };
+    Entry stack[BVH_MAX_DEPTH + 1];
+    u32 top = 0;
+
+    f32 tEnter, tExit;
+    if (!IntersectAabb(bvh.nodes[0].box, origin, inverseDirection, tEnter, tExit))
+        return false;
+    stack[top++] = Entry{ 0, glm::max(tEnter, 0.0f) };
+
+    while (top > 0)
+    {
+        const Entry entry = stack[--top];
+        if (entry.distance >= hit.distance)
+            continue;
+
+        const BvhNode& node = bvh.nodes[entry.node];
+        if (node.count > 0)
+        {
+            for (u32 i = node.first; i < node.first + node.count; ++i)
+            {
+                const u32 primitive = bvh.indices[i];
+                if (!IntersectAabb(bvh.primitives[primitive], origin, inverseDirection, tEnter, tExit))
+                    continue;
+
+                // A box around the origin counts from where the ray leaves it,
+                // so enclosing boxes such as a room do not hide what is inside
+                const f32 distance = tEnter >= 0.0f ? tEnter : tExit;
+                if (distance < hit.distance)
+                {
+                    hit.primitive = primitive;
+                    hit.distance = distance;
+                    found = true;
+                }
+            }
+            continue;
+        }
+
+        // Nearer child on top of the stack
+        Entry children[2];
+        u32 childCount = 0;
+        for (u32 c = 0; c < 2; ++c)
+        {
+            if (IntersectAabb(bvh.nodes[node.first + c].box, origin, inverseDirection, tEnter, tExit) && glm::max(tEnter, 0.0f) < hit.distance)
+                children[childCount++] = Entry{ node.first + c, glm::max(tEnter, 0.0f) };
+        }
+        if (childCount == 2 && children[0].distance < children[1].distance)
+            std::swap(children[0], children[1]);
+        for (u32 c = 0; c < childCount; ++c)
+            stack[top++] = children[c];
+    }
+
+    return found;
+}
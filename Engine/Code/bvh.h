@@ -0,0 +1,29 @@
+//
+// bvh.h: Bounding volume hierarchy over world space boxes, with frustum, sphere and ray queries.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// Builds the whole tree from scratch, primitive i is boxes[i]
+void BuildBvh(Bvh& bvh, const std::vector<Aabb>& boxes);
+
+// Moves a primitive, the tree is only updated by the next RefitBvh
+void SetBvhPrimitive(Bvh& bvh, u32 primitive, const Aabb& box);
+
+// Grows and shrinks the ancestors of the moved primitives, rebuilding instead
+// when the tree got too loose. Returns true when it rebuilt.
+bool RefitBvh(Bvh& bvh);
+
+// Read only queries, safe to run from any number of threads at once
+
+// Sets one visibility flag per primitive, tested counts the boxes checked against planes
+void BvhQueryFrustum(const Bvh& bvh, const Frustum& frustum, std::vector<u8>& visible, CullStats& stats);
+
+// Appends the primitives whose box touches the sphere
+void BvhQuerySphere(const Bvh& bvh, const vec3& center, f32 radius, std::vector<u32>& results);
+
+// Nearest box hit along the ray, the direction does not need to be normalized
+bool BvhRaycast(const Bvh& bvh, const vec3& origin, const vec3& direction, f32 maxDistance, BvhHit& hit);
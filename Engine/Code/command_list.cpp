@@ -0,0 +1,375 @@
+#include "command_list.h"
+#include "gl_state.h"
+#include "buffer_management.h"
+#include "render_queue.h"
+#include "occlusion_culling.h"
+#include "meshlets.h"
+#include "culling.h"
+
+void ResetCommandList(CommandList& list)
+{
+    list.commands.clear();
+    list.data.clear();
+    list.indirectCommands.clear();
+    list.drawInfos.clear();
+    list.occlusionCulled = false;
+    list.occlusionCandidates.clear();
+    list.meshletDraws.clear();
+    list.meshletViewOffset = UINT32_MAX;
+    list.meshletViewFlags = 0;
+}
+
+Command& PushCommand(CommandList& list, CommandType type)
+{
+    Command command;
+    memset(&command, 0, sizeof(command));
+    command.type = type;
+    list.commands.push_back(command);
+    return list.commands.back();
+}
+
+void CmdBindFramebuffer(CommandList& list, GLenum target, GLuint framebuffer)
+{
+    Command& command = PushCommand(list, COMMAND_BIND_FRAMEBUFFER);
+    command.bindFramebuffer.target = target;
+    command.bindFramebuffer.framebuffer = framebuffer;
+}
+
+void CmdDrawBuffers(CommandList& list, u32 count, const GLenum* buffers)
+{
+    ASSERT(count <= MAX_COMMAND_DRAW_BUFFERS, "Too many draw buffers for a command");
+    Command& command = PushCommand(list, COMMAND_DRAW_BUFFERS);
+    command.drawBuffers.count = count;
+    for (u32 i = 0; i < count; ++i)
+        command.drawBuffers.buffers[i] = buffers[i];
+}
+
+void CmdViewport(CommandList& list, i32 x, i32 y, i32 width, i32 height)
+{
+    Command& command = PushCommand(list, COMMAND_VIEWPORT);
+    command.viewport.x = x;
+    command.viewport.y = y;
+    command.viewport.width = width;
+    command.viewport.height = height;
+}
+
+void CmdClear(CommandList& list, GLbitfield mask, const vec4& color)
+{
+    Command& command = PushCommand(list, COMMAND_CLEAR);
+    command.clear.mask = mask;
+    command.clear.color[0] = color.r;
+    command.clear.color[1] = color.g;
+    command.clear.color[2] = color.b;
+    command.clear.color[3] = color.a;
+}
+
+void CmdEnable(CommandList& list, GLenum capability, bool enabled)
+{
+    Command& command = PushCommand(list, COMMAND_ENABLE);
+    command.enable.capability = capability;
+    command.enable.enabled = enabled;
+}
+
+void CmdBlendFunc(CommandList& list, GLenum src, GLenum dst)
+{
+    Command& command = PushCommand(list, COMMAND_BLEND_FUNC);
+    command.blendFunc.src = src;
+    command.blendFunc.dst = dst;
+}
+
+void CmdDepthMask(CommandList& list, bool write)
+{
+    PushCommand(list, COMMAND_DEPTH_MASK).depthMask.write = write;
+}
+
+void CmdDepthFunc(CommandList& list, GLenum func)
+{
+    PushCommand(list, COMMAND_DEPTH_FUNC).depthFunc.func = func;
+}
+
+void CmdUseProgram(CommandList& list, GLuint program)
+{
+    PushCommand(list, COMMAND_USE_PROGRAM).useProgram.program = program;
+}
+
+void CmdBindVertexArray(CommandList& list, GLuint vao)
+{
+    PushCommand(list, COMMAND_BIND_VERTEX_ARRAY).bindVertexArray.vao = vao;
+}
+
+void CmdBindTexture(CommandList& list, u32 unit, GLenum target, GLuint texture)
+{
+    Command& command = PushCommand(list, COMMAND_BIND_TEXTURE);
+    command.bindTexture.unit = unit;
+    command.bindTexture.target = target;
+    command.bindTexture.texture = texture;
+}
+
+void CmdBindUniformRange(CommandList& list, u32 binding, GLuint buffer, u32 offset, u32 size)
+{
+    Command& command = PushCommand(list, COMMAND_BIND_UNIFORM_RANGE);
+    command.bindUniformRange.binding = binding;
+    command.bindUniformRange.buffer = buffer;
+    command.bindUniformRange.offset = offset;
+    command.bindUniformRange.size = size;
+}
+
+void CmdUniform1i(CommandList& list, GLint location, i32 value)
+{
+    Command& command = PushCommand(list, COMMAND_UNIFORM_1I);
+    command.uniformInt.location = location;
+    command.uniformInt.value = value;
+}
+
+void CmdUniformFloats(CommandList& list, CommandType type, GLint location, f32 x, f32 y, f32 z, f32 w)
+{
+    Command& command = PushCommand(list, type);
+    command.uniformFloat.location = location;
+    command.uniformFloat.values[0] = x;
+    command.uniformFloat.values[1] = y;
+    command.uniformFloat.values[2] = z;
+    command.uniformFloat.values[3] = w;
+}
+
+void CmdUniform1f(CommandList& list, GLint location, f32 value)
+{
+    CmdUniformFloats(list, COMMAND_UNIFORM_1F, location, value, 0.0f, 0.0f, 0.0f);
+}
+
+void CmdUniform2f(CommandList& list, GLint location, f32 x, f32 y)
+{
+    CmdUniformFloats(list, COMMAND_UNIFORM_2F, location, x, y, 0.0f, 0.0f);
+}
+
+void CmdUniform3f(CommandList& list, GLint location, f32 x, f32 y, f32 z)
+{
+    CmdUniformFloats(list, COMMAND_UNIFORM_3F, location, x, y, z, 0.0f);
+}
+
+void CmdUniform4f(CommandList& list, GLint location, f32 x, f32 y, f32 z, f32 w)
+{
+    CmdUniformFloats(list, COMMAND_UNIFORM_4F, location, x, y, z, w);
+}
+
+void CmdUniformMatrix4(CommandList& list, GLint location, const glm::mat4& matrix)
+{
+    Command& command = PushCommand(list, COMMAND_UNIFORM_MATRIX4);
+    command.uniformMatrix.location = location;
+    command.uniformMatrix.dataOffset = list.data.size();
+
+    const f32* values = &matrix[0][0];
+    list.data.insert(list.data.end(), values, values + 16);
+}
+
+u32 PushIndirectCommand(CommandList& list, const DrawElementsIndirectCommand& command)
+{
+    list.indirectCommands.push_back(command);
+    return list.indirectCommands.size() - 1;
+}
+
+void CmdMultiDrawIndirect(CommandList& list, u32 firstCommand, u32 commandCount, u32 phase)
+{
+    Command& command = PushCommand(list, COMMAND_MULTI_DRAW_INDIRECT);
+    command.multiDrawIndirect.firstCommand = firstCommand;
+    command.multiDrawIndirect.commandCount = commandCount;
+    command.multiDrawIndirect.phase = phase;
+}
+
+void CmdDrawArraysInstanced(CommandList& list, GLenum mode, u32 vertexCount, u32 firstDrawInfo, u32 instanceCount)
+{
+    Command& command = PushCommand(list, COMMAND_DRAW_ARRAYS_INSTANCED);
+    command.drawArraysInstanced.mode = mode;
+    command.drawArraysInstanced.vertexCount = vertexCount;
+    command.drawArraysInstanced.firstDrawInfo = firstDrawInfo;
+    command.drawArraysInstanced.instanceCount = instanceCount;
+}
+
+void CmdBeginQuery(CommandList& list, GLenum target, GLuint query)
+{
+    Command& command = PushCommand(list, COMMAND_BEGIN_QUERY);
+    command.query.target = target;
+    command.query.query = query;
+}
+
+void CmdEndQuery(CommandList& list, GLenum target)
+{
+    PushCommand(list, COMMAND_END_QUERY).query.target = target;
+}
+
+void CmdOcclusionCull(CommandList& list, u32 phase)
+{
+    ASSERT(list.occlusionCulled, "Occlusion culling a list recorded without candidates");
+    PushCommand(list, COMMAND_OCCLUSION_CULL).occlusionCull.phase = phase;
+}
+
+void CmdMeshletView(CommandList& list, const glm::mat4& viewProjection, const vec3& eye, const vec4& clipPlane, u32 flags)
+{
+    // Six planes, the eye and the clip plane, as uploaded by RunMeshletCull
+    const Frustum frustum = FrustumFromMatrix(viewProjection);
+    list.meshletViewOffset = list.data.size();
+    list.meshletViewFlags = flags;
+    list.data.insert(list.data.end(), &frustum.planes[0][0], &frustum.planes[0][0] + 24);
+    list.data.insert(list.data.end(), { eye.x, eye.y, eye.z, 0.0f });
+    list.data.insert(list.data.end(), &clipPlane[0], &clipPlane[0] + 4);
+}
+
+void CmdCullMeshlets(CommandList& list, u32 firstDraw, u32 drawCount)
+{
+    ASSERT(list.meshletViewOffset != UINT32_MAX, "Meshlet draws recorded without a view to cull them against");
+    Command& command = PushCommand(list, COMMAND_CULL_MESHLETS);
+    command.cullMeshlets.firstDraw = firstDraw;
+    command.cullMeshlets.drawCount = drawCount;
+    command.cullMeshlets.dataOffset = list.meshletViewOffset;
+    command.cullMeshlets.flags = list.meshletViewFlags;
+}
+
+void SubmitCommandList(App* app, CommandList& list)
+{
+    GLStateCache& state = app->glState;
+    IndirectStream& stream = app->indirect;
+
+    // Indirect data goes up first, rebased onto where the list lands in the stream.
+    // Occlusion culled lists get an empty copy of their commands and room for
+    // their draw infos per phase, which the cull shader fills.
+    u32 commandOffset = 0;
+    u32 commandBytes = 0;
+    u32 firstDrawInfo = 0;
+    const bool hasIndirectData = !list.indirectCommands.empty() || !list.drawInfos.empty();
+    if (hasIndirectData)
+    {
+        const u32 copies = list.occlusionCulled ? 1 + OCCLUSION_PHASE_COUNT : 1;
+        ReserveIndirectData(stream, list.indirectCommands.size() * copies, list.drawInfos.size() * copies);
+
+        firstDrawInfo = stream.drawInfoCursor / sizeof(DrawInfo);
+        for (DrawElementsIndirectCommand& command : list.indirectCommands)
+            command.baseInstance += firstDrawInfo;
+
+        commandBytes = list.indirectCommands.size() * sizeof(DrawElementsIndirectCommand);
+        const u32 drawInfoBytes = list.drawInfos.size() * sizeof(DrawInfo);
+
+        BindBuffer(stream.drawInfoBuffer);
+        glBufferSubData(stream.drawInfoBuffer.type, stream.drawInfoCursor, drawInfoBytes, list.drawInfos.data());
+        glBindBuffer(stream.drawInfoBuffer.type, 0);
+        BindBuffer(stream.commandBuffer);
+        glBufferSubData(stream.commandBuffer.type, stream.commandCursor, commandBytes, list.indirectCommands.data());
+
+        if (list.occlusionCulled)
+        {
+            BeginOcclusionList(app->occlusion, list, stream.commandCursor, firstDrawInfo);
+            for (u32 phase = 1; phase <= OCCLUSION_PHASE_COUNT; ++phase)
+            {
+                for (DrawElementsIndirectCommand& command : list.indirectCommands)
+                {
+                    command.instanceCount = 0;
+                    command.baseInstance += list.drawInfos.size();
+                }
+                glBufferSubData(stream.commandBuffer.type, stream.commandCursor + phase * commandBytes, commandBytes, list.indirectCommands.data());
+            }
+        }
+
+        // Meshlet draws write their own commands, point them at where those landed
+        if (!list.meshletDraws.empty())
+        {
+            for (MeshletDraw& draw : list.meshletDraws)
+            {
+                draw.commandWord = (stream.commandCursor + draw.commandWord * sizeof(DrawElementsIndirectCommand)) / sizeof(u32);
+                draw.drawInfo += firstDrawInfo;
+            }
+            BeginMeshletList(app->meshlets, list);
+        }
+
+        commandOffset = stream.commandCursor;
+        stream.commandCursor += commandBytes * copies;
+        stream.drawInfoCursor += drawInfoBytes * copies;
+    }
+
+    for (const Command& command : list.commands)
+    {
+        switch (command.type)
+        {
+            case COMMAND_BIND_FRAMEBUFFER:
+                glBindFramebuffer(command.bindFramebuffer.target, command.bindFramebuffer.framebuffer);
+                break;
+            case COMMAND_DRAW_BUFFERS:
+                glDrawBuffers(command.drawBuffers.count, command.drawBuffers.buffers);
+                break;
+            case COMMAND_VIEWPORT:
+                glViewport(command.viewport.x, command.viewport.y, command.viewport.width, command.viewport.height);
+                break;
+            case COMMAND_CLEAR:
+                glClearColor(command.clear.color[0], command.clear.color[1], command.clear.color[2], command.clear.color[3]);
+                glClear(command.clear.mask);
+                break;
+            case COMMAND_ENABLE:
+                StateEnable(state, command.enable.capability, command.enable.enabled);
+                break;
+            case COMMAND_BLEND_FUNC:
+                StateBlendFunc(state, command.blendFunc.src, command.blendFunc.dst);
+                break;
+            case COMMAND_DEPTH_MASK:
+                StateDepthMask(state, command.depthMask.write);
+                break;
+            case COMMAND_DEPTH_FUNC:
+                StateDepthFunc(state, command.depthFunc.func);
+                break;
+            case COMMAND_USE_PROGRAM:
+                StateUseProgram(state, command.useProgram.program);
+                break;
+            case COMMAND_BIND_VERTEX_ARRAY:
+                StateBindVertexArray(state, command.bindVertexArray.vao);
+                break;
+            case COMMAND_BIND_TEXTURE:
+                StateBindTexture(state, command.bindTexture.unit, command.bindTexture.target, command.bindTexture.texture);
+                break;
+            case COMMAND_BIND_UNIFORM_RANGE:
+                StateBindUniformRange(state, command.bindUniformRange.binding, command.bindUniformRange.buffer, command.bindUniformRange.offset, command.bindUniformRange.size);
+                break;
+            case COMMAND_UNIFORM_1I:
+                StateUniform1i(state, command.uniformInt.location, command.uniformInt.value);
+                break;
+            case COMMAND_UNIFORM_1F:
+                StateUniform1f(state, command.uniformFloat.location, command.uniformFloat.values[0]);
+                break;
+            case COMMAND_UNIFORM_2F:
+                StateUniform2f(state, command.uniformFloat.location, command.uniformFloat.values[0], command.uniformFloat.values[1]);
+                break;
+            case COMMAND_UNIFORM_3F:
+                StateUniform3f(state, command.uniformFloat.location, command.uniformFloat.values[0], command.uniformFloat.values[1], command.uniformFloat.values[2]);
+                break;
+            case COMMAND_UNIFORM_4F:
+                StateUniform4f(state, command.uniformFloat.location, command.uniformFloat.values[0], command.uniformFloat.values[1], command.uniformFloat.values[2], command.uniformFloat.values[3]);
+                break;
+            case COMMAND_UNIFORM_MATRIX4:
+                StateUniformMatrix4fv(state, command.uniformMatrix.location, &list.data[command.uniformMatrix.dataOffset]);
+                break;
+            case COMMAND_MULTI_DRAW_INDIRECT:
+                glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                    (void*)(u64)(commandOffset + command.multiDrawIndirect.phase * commandBytes + command.multiDrawIndirect.firstCommand * sizeof(DrawElementsIndirectCommand)),
+                    command.multiDrawIndirect.commandCount, 0);
+                stream.multiDrawCalls++;
+                stream.drawCommands += command.multiDrawIndirect.commandCount;
+                break;
+            case COMMAND_DRAW_ARRAYS_INSTANCED:
+                glDrawArraysInstancedBaseInstance(command.drawArraysInstanced.mode, 0, command.drawArraysInstanced.vertexCount,
+                    command.drawArraysInstanced.instanceCount, firstDrawInfo + command.drawArraysInstanced.firstDrawInfo);
+                break;
+            case COMMAND_BEGIN_QUERY:
+                glBeginQuery(command.query.target, command.query.query);
+                break;
+            case COMMAND_END_QUERY:
+                glEndQuery(command.query.target);
+                break;
+            case COMMAND_OCCLUSION_CULL:
+                RunOcclusionCull(app, command.occlusionCull.phase);
+                break;
+            case COMMAND_CULL_MESHLETS:
+                RunMeshletCull(app, command, list);
+                break;
+        }
+    }
+
+    if (hasIndirectData)
+        glBindBuffer(stream.commandBuffer.type, 0);
+
+    app->submittedCommands += list.commands.size();
+}
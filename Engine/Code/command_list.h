@@ -0,0 +1,58 @@
+//
+// command_list.h: CPU side command lists recorded on worker threads and replayed on the GL thread.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+void ResetCommandList(CommandList& list);
+
+// Recording never touches GL and is safe on any thread, one thread per list
+void CmdBindFramebuffer(CommandList& list, GLenum target, GLuint framebuffer);
+void CmdDrawBuffers(CommandList& list, u32 count, const GLenum* buffers);
+void CmdViewport(CommandList& list, i32 x, i32 y, i32 width, i32 height);
+void CmdClear(CommandList& list, GLbitfield mask, const vec4& color);
+
+void CmdEnable(CommandList& list, GLenum capability, bool enabled);
+void CmdBlendFunc(CommandList& list, GLenum src, GLenum dst);
+void CmdDepthMask(CommandList& list, bool write);
+void CmdDepthFunc(CommandList& list, GLenum func);
+
+void CmdUseProgram(CommandList& list, GLuint program);
+void CmdBindVertexArray(CommandList& list, GLuint vao);
+void CmdBindTexture(CommandList& list, u32 unit, GLenum target, GLuint texture);
+void CmdBindUniformRange(CommandList& list, u32 binding, GLuint buffer, u32 offset, u32 size);
+
+void CmdUniform1i(CommandList& list, GLint location, i32 value);
+void CmdUniform1f(CommandList& list, GLint location, f32 value);
+void CmdUniform2f(CommandList& list, GLint location, f32 x, f32 y);
+void CmdUniform3f(CommandList& list, GLint location, f32 x, f32 y, f32 z);
+void CmdUniform4f(CommandList& list, GLint location, f32 x, f32 y, f32 z, f32 w);
+void CmdUniformMatrix4(CommandList& list, GLint location, const glm::mat4& matrix);
+
+// Appends an indirect command and returns its index within the list
+u32 PushIndirectCommand(CommandList& list, const DrawElementsIndirectCommand& command);
+
+// Phase 0 draws the commands as recorded, phases 1 and 2 their occlusion culled copies
+void CmdMultiDrawIndirect(CommandList& list, u32 firstCommand, u32 commandCount, u32 phase);
+
+// Non-indexed instanced draw, instance i reads the list's draw info firstDrawInfo + i
+void CmdDrawArraysInstanced(CommandList& list, GLenum mode, u32 vertexCount, u32 firstDrawInfo, u32 instanceCount);
+
+void CmdBeginQuery(CommandList& list, GLenum target, GLuint query);
+void CmdEndQuery(CommandList& list, GLenum target);
+
+// Runs one phase of the Hi-Z occlusion culling of the list's draws, see OcclusionCuller
+void CmdOcclusionCull(CommandList& list, u32 phase);
+
+// Frustum planes, eye and clip plane the meshlet draws recorded after it are culled against
+void CmdMeshletView(CommandList& list, const glm::mat4& viewProjection, const vec3& eye, const vec4& clipPlane, u32 flags);
+
+// Culls the given meshlet draws of the list against the last view set
+void CmdCullMeshlets(CommandList& list, u32 firstDraw, u32 drawCount);
+
+// Uploads the indirect data of the list to the frame stream and replays its
+// commands through the GL state cache. GL thread only.
+void SubmitCommandList(App* app, CommandList& list);
@@ -0,0 +1,335 @@
+#include "culling.h"
+#include "bvh.h"
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE__)
+#include <xmmintrin.h>
+#define CULL_SSE 1
+#else
+#define CULL_SSE 0
+#endif
+
+#define CULL_BENCHMARK_RUNS     8
+#define CULL_BENCHMARK_QUERIES  1000
+
+void ResizeWorldBounds(WorldBounds& bounds, u32 count)
+{
+    // Padding boxes are zero sized and their flags are never read
+    const u32 padded = (count + CULL_BATCH - 1) / CULL_BATCH * CULL_BATCH;
+    bounds.count = count;
+    bounds.centerX.assign(padded, 0.0f);
+    bounds.centerY.assign(padded, 0.0f);
+    bounds.centerZ.assign(padded, 0.0f);
+    bounds.extentX.assign(padded, 0.0f);
+    bounds.extentY.assign(padded, 0.0f);
+    bounds.extentZ.assign(padded, 0.0f);
+    bounds.spheres.assign(count, vec4(0.0f));
+}
+
+std::vector<Aabb> WorldBoundsBoxes(const WorldBounds& bounds)
+{
+    std::vector<Aabb> boxes(bounds.count);
+    for (u32 i = 0; i < bounds.count; ++i)
+    {
+        const vec3 center = vec3(bounds.centerX[i], bounds.centerY[i], bounds.centerZ[i]);
+        const vec3 extent = vec3(bounds.extentX[i], bounds.extentY[i], bounds.extentZ[i]);
+        boxes[i] = Aabb{ center - extent, center + extent };
+    }
+    return boxes;
+}
+
+void UpdateWorldBounds(App* app)
+{
+    WorldBounds& bounds = app->worldBounds;
+
+    // Entities and models are only added at load time, any change in the layout rebuilds every box
+    u32 count = 0;
+    bool relayout = bounds.entityOffsets.size() != app->entities.size();
+    bounds.entityOffsets.resize(app->entities.size());
+    for (u32 i = 0; i < app->entities.size(); ++i)
+    {
+        relayout = relayout || bounds.entityOffsets[i] != count;
+        bounds.entityOffsets[i] = count;
+        count += app->meshes[app->models[app->entities[i].modelIdx].meshIdx].submeshes.size();
+    }
+    relayout = relayout || bounds.count != count;
+
+    if (relayout)
+        ResizeWorldBounds(bounds, count);
+
+    bool moved = false;
+    for (u32 i = 0; i < app->entities.size(); ++i)
+    {
+        Entity& entity = app->entities[i];
+        if (entity.boundsValid && !relayout)
+            continue;
+
+        const glm::mat4 world = MatrixFromPositionRotationScale(entity.position, entity.rotation, entity.scale);
+        const glm::mat3 absolute = glm::mat3(glm::abs(world[0]), glm::abs(world[1]), glm::abs(world[2]));
+        const f32 maxScale = glm::max(glm::length(vec3(world[0])), glm::max(glm::length(vec3(world[1])), glm::length(vec3(world[2]))));
+
+        const Mesh& mesh = app->meshes[app->models[entity.modelIdx].meshIdx];
+        for (u32 j = 0; j < mesh.submeshes.size(); ++j)
+        {
+            const Submesh& submesh = mesh.submeshes[j];
+            const u32 box = bounds.entityOffsets[i] + j;
+
+            // Transformed box of a box: center goes through the matrix, extents through its absolute value
+            const vec3 center = vec3(world * vec4((submesh.aabbMin + submesh.aabbMax) * 0.5f, 1.0f));
+            const vec3 extent = absolute * ((submesh.aabbMax - submesh.aabbMin) * 0.5f);
+
+            bounds.centerX[box] = center.x;
+            bounds.centerY[box] = center.y;
+            bounds.centerZ[box] = center.z;
+            bounds.extentX[box] = extent.x;
+            bounds.extentY[box] = extent.y;
+            bounds.extentZ[box] = extent.z;
+            bounds.spheres[box] = vec4(vec3(world * vec4(submesh.sphereCenter, 1.0f)), submesh.sphereRadius * maxScale);
+
+            if (!relayout)
+                SetBvhPrimitive(app->sceneBvh, box, Aabb{ center - extent, center + extent });
+        }
+
+        entity.boundsValid = true;
+        moved = true;
+    }
+
+    if (relayout)
+        BuildBvh(app->sceneBvh, WorldBoundsBoxes(bounds));
+    else if (moved)
+        RefitBvh(app->sceneBvh);
+
+    if (relayout || moved)
+        app->sceneVersion++;
+}
+
+Frustum FrustumFromMatrix(const glm::mat4& viewProjection)
+{
+    // Rows of the matrix, combined as in Gribb and Hartmann
+    vec4 rows[4];
+    for (u32 row = 0; row < 4; ++row)
+        rows[row] = vec4(viewProjection[0][row], viewProjection[1][row], viewProjection[2][row], viewProjection[3][row]);
+
+    Frustum frustum;
+    frustum.planes[0] = rows[3] + rows[0];  // left
+    frustum.planes[1] = rows[3] - rows[0];  // right
+    frustum.planes[2] = rows[3] + rows[1];  // bottom
+    frustum.planes[3] = rows[3] - rows[1];  // top
+    frustum.planes[4] = rows[3] + rows[2];  // near
+    frustum.planes[5] = rows[3] - rows[2];  // far
+
+    for (vec4& plane : frustum.planes)
+        plane /= glm::length(vec3(plane));
+
+    return frustum;
+}
+
+void CullBounds(const WorldBounds& bounds, const Frustum& frustum, std::vector<u8>& visible, CullStats& stats)
+{
+    const u32 padded = bounds.centerX.size();
+    visible.resize(padded);
+
+    // A box is outside when even its corner furthest along a plane normal is behind the plane
+#if CULL_SSE
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 planeX[6], planeY[6], planeZ[6], planeW[6];
+    __m128 absX[6], absY[6], absZ[6];
+    for (u32 p = 0; p < 6; ++p)
+    {
+        planeX[p] = _mm_set1_ps(frustum.planes[p].x);
+        planeY[p] = _mm_set1_ps(frustum.planes[p].y);
+        planeZ[p] = _mm_set1_ps(frustum.planes[p].z);
+        planeW[p] = _mm_set1_ps(frustum.planes[p].w);
+        absX[p] = _mm_andnot_ps(signMask, planeX[p]);
+        absY[p] = _mm_andnot_ps(signMask, planeY[p]);
+        absZ[p] = _mm_andnot_ps(signMask, planeZ[p]);
+    }
+
+    for (u32 i = 0; i < padded; i += CULL_BATCH)
+    {
+        const __m128 cx = _mm_loadu_ps(&bounds.centerX[i]);
+        const __m128 cy = _mm_loadu_ps(&bounds.centerY[i]);
+        const __m128 cz = _mm_loadu_ps(&bounds.centerZ[i]);
+        const __m128 ex = _mm_loadu_ps(&bounds.extentX[i]);
+        const __m128 ey = _mm_loadu_ps(&bounds.extentY[i]);
+        const __m128 ez = _mm_loadu_ps(&bounds.extentZ[i]);
+
+        __m128 inside = _mm_cmpeq_ps(cx, cx);
+        for (u32 p = 0; p < 6; ++p)
+        {
+            __m128 distance = _mm_add_ps(_mm_mul_ps(planeX[p], cx), planeW[p]);
+            distance = _mm_add_ps(distance, _mm_mul_ps(planeY[p], cy));
+            distance = _mm_add_ps(distance, _mm_mul_ps(planeZ[p], cz));
+
+            __m128 radius = _mm_mul_ps(absX[p], ex);
+            radius = _mm_add_ps(radius, _mm_mul_ps(absY[p], ey));
+            radius = _mm_add_ps(radius, _mm_mul_ps(absZ[p], ez));
+
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+        }
+
+        const int mask = _mm_movemask_ps(inside);
+        for (u32 lane = 0; lane < CULL_BATCH; ++lane)
+            visible[i + lane] = (mask >> lane) & 1;
+    }
+#else
+    for (u32 i = 0; i < padded; ++i)
+    {
+        bool inside = true;
+        for (u32 p = 0; p < 6 && inside; ++p)
+        {
+            const vec4& plane = frustum.planes[p];
+            const f32 distance = plane.x * bounds.centerX[i] + plane.y * bounds.centerY[i] + plane.z * bounds.centerZ[i] + plane.w;
+            const f32 radius = fabsf(plane.x) * bounds.extentX[i] + fabsf(plane.y) * bounds.extentY[i] + fabsf(plane.z) * bounds.extentZ[i];
+            inside = distance + radius >= 0.0f;
+        }
+        visible[i] = inside;
+    }
+#endif
+
+    stats.tested = bounds.count;
+    stats.visible = 0;
+    for (u32 i = 0; i < bounds.count; ++i)
+        stats.visible += visible[i];
+}
+
+void CullView(const FramePacket& frame, const Frustum& frustum, std::vector<u8>& visible, CullStats& stats)
+{
+    if (frame.bvhCulling)
+        BvhQueryFrustum(frame.bvh, frustum, visible, stats);
+    else
+        CullBounds(frame.bounds, frustum, visible, stats);
+}
+
+u32 CullClipPlane(const WorldBounds& bounds, const vec4& plane, std::vector<u8>& visible, std::vector<u8>& clipped, CullStats& stats)
+{
+    clipped.assign(visible.size(), 0);
+    const vec3 absNormal = glm::abs(vec3(plane));
+
+    u32 clippedCount = 0;
+    stats.tested = 0;
+    stats.visible = 0;
+    for (u32 i = 0; i < bounds.count; ++i)
+    {
+        if (!visible[i])
+            continue;
+        stats.tested++;
+
+        const f32 distance = plane.x * bounds.centerX[i] + plane.y * bounds.centerY[i] + plane.z * bounds.centerZ[i] + plane.w;
+        const f32 radius = absNormal.x * bounds.extentX[i] + absNormal.y * bounds.extentY[i] + absNormal.z * bounds.extentZ[i];
+        if (distance + radius < 0.0f)
+        {
+            visible[i] = 0;
+            continue;
+        }
+
+        stats.visible++;
+        if (distance - radius < 0.0f)
+        {
+            visible[i] = 0;
+            clipped[i] = 1;
+            clippedCount++;
+        }
+    }
+    return clippedCount;
+}
+
+i32 PickEntity(App* app, const vec2& ndc)
+{
+    const glm::mat4 inverseViewProjection = glm::inverse(app->projectionMat * app->viewMat);
+    const vec4 nearPoint = inverseViewProjection * vec4(ndc, -1.0f, 1.0f);
+    const vec4 farPoint = inverseViewProjection * vec4(ndc, 1.0f, 1.0f);
+    const vec3 origin = vec3(nearPoint) / nearPoint.w;
+    const vec3 direction = vec3(farPoint) / farPoint.w - origin;
+
+    BvhHit hit;
+    if (!BvhRaycast(app->sceneBvh, origin, direction, 1.0f, hit))
+        return -1;
+
+    // Boxes of an entity are contiguous, the owner is the last one starting at or before the hit
+    const std::vector<u32>& offsets = app->worldBounds.entityOffsets;
+    return (i32)(std::upper_bound(offsets.begin(), offsets.end(), hit.primitive) - offsets.begin()) - 1;
+}
+
+f32 ElapsedMilliseconds(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration<f32, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+CullBenchmark RunCullBenchmark(u32 count)
+{
+    // Boxes from half a unit to two units wide spread over a cube, about
+    // as dense at every count, viewed from one of its faces
+    std::mt19937 random(count);
+    const f32 side = 8.0f * cbrtf((f32)count);
+    std::uniform_real_distribution<f32> position(-side * 0.5f, side * 0.5f);
+    std::uniform_real_distribution<f32> size(0.25f, 1.0f);
+
+    WorldBounds bounds;
+    ResizeWorldBounds(bounds, count);
+    for (u32 i = 0; i < count; ++i)
+    {
+        bounds.centerX[i] = position(random);
+        bounds.centerY[i] = position(random);
+        bounds.centerZ[i] = position(random);
+        bounds.extentX[i] = size(random);
+        bounds.extentY[i] = size(random);
+        bounds.extentZ[i] = size(random);
+    }
+
+    const vec3 eye = vec3(0.0f, 0.0f, side * 0.5f);
+    const glm::mat4 viewProjection = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, side * 0.5f) * glm::lookAt(eye, vec3(0.0f), vec3(0.0f, 1.0f, 0.0f));
+    const Frustum frustum = FrustumFromMatrix(viewProjection);
+
+    CullBenchmark result = {};
+    result.count = count;
+
+    Bvh bvh = {};
+    const std::vector<Aabb> boxes = WorldBoundsBoxes(bounds);
+    auto start = std::chrono::high_resolution_clock::now();
+    BuildBvh(bvh, boxes);
+    result.build = ElapsedMilliseconds(start);
+
+    // A tenth of the boxes take a small step
+    start = std::chrono::high_resolution_clock::now();
+    for (u32 i = 0; i < count; i += 10)
+        SetBvhPrimitive(bvh, i, Aabb{ boxes[i].min + vec3(0.5f), boxes[i].max + vec3(0.5f) });
+    RefitBvh(bvh);
+    result.refit = ElapsedMilliseconds(start);
+
+    std::vector<u8> visible;
+    CullStats stats;
+    start = std::chrono::high_resolution_clock::now();
+    for (u32 run = 0; run < CULL_BENCHMARK_RUNS; ++run)
+        CullBounds(bounds, frustum, visible, stats);
+    result.flatFrustum = ElapsedMilliseconds(start) / CULL_BENCHMARK_RUNS;
+
+    start = std::chrono::high_resolution_clock::now();
+    for (u32 run = 0; run < CULL_BENCHMARK_RUNS; ++run)
+        BvhQueryFrustum(bvh, frustum, visible, stats);
+    result.bvhFrustum = ElapsedMilliseconds(start) / CULL_BENCHMARK_RUNS;
+
+    std::vector<u32> touched;
+    start = std::chrono::high_resolution_clock::now();
+    for (u32 query = 0; query < CULL_BENCHMARK_QUERIES; ++query)
+    {
+        touched.clear();
+        BvhQuerySphere(bvh, vec3(position(random), position(random), position(random)), 10.0f, touched);
+    }
+    result.sphere = ElapsedMilliseconds(start);
+
+    std::uniform_real_distribution<f32> ndc(-1.0f, 1.0f);
+    const glm::mat4 inverseViewProjection = glm::inverse(viewProjection);
+    start = std::chrono::high_resolution_clock::now();
+    for (u32 query = 0; query < CULL_BENCHMARK_QUERIES; ++query)
+    {
+        const vec4 target = inverseViewProjection * vec4(ndc(random), ndc(random), 1.0f, 1.0f);
+        BvhHit hit;
+        BvhRaycast(bvh, eye, vec3(target) / target.w - eye, 1.0f, hit);
+    }
+    result.rays = ElapsedMilliseconds(start);
+
+    return result;
+}
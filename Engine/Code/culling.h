@@ -0,0 +1,37 @@
+//
+// culling.h: World space bounds of the entity submeshes and frustum culling against them.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+#include <chrono>
+
+// Sizes the arrays for count boxes, padded to CULL_BATCH, and zeroes them
+void ResizeWorldBounds(WorldBounds& bounds, u32 count);
+
+// Simulation thread, recomputes the boxes and spheres of the entities whose transform changed
+void UpdateWorldBounds(App* app);
+
+Frustum FrustumFromMatrix(const glm::mat4& viewProjection);
+
+// Writes one visibility flag per box, CULL_BATCH boxes are tested at a time
+void CullBounds(const WorldBounds& bounds, const Frustum& frustum, std::vector<u8>& visible, CullStats& stats);
+
+// Splits the visible boxes by a clip plane (xyz normal, w offset) keeping its positive side.
+// Boxes wholly behind it are culled, boxes crossing it move from visible to clipped.
+// Returns the number of clipped boxes.
+u32 CullClipPlane(const WorldBounds& bounds, const vec4& plane, std::vector<u8>& visible, std::vector<u8>& clipped, CullStats& stats);
+
+// Frustum culling of a recording job, through the scene BVH or the flat loop
+void CullView(const FramePacket& frame, const Frustum& frustum, std::vector<u8>& visible, CullStats& stats);
+
+// Entity under a point of the scene view, -1 when the ray hits nothing
+i32 PickEntity(App* app, const vec2& ndc);
+
+// Build, refit and query timings over count random boxes
+CullBenchmark RunCullBenchmark(u32 count);
+
+// Milliseconds since start, for the benchmarks
+f32 ElapsedMilliseconds(std::chrono::high_resolution_clock::time_point start);
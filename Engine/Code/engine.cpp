@@ -6,6 +6,23 @@
 //
 
 #include "buffer_management.h"
+#include "upload_manager.h"
+#include "render_queue.h"
+#include "gl_state.h"
+#include "material_system.h"
+#include "command_list.h"
+#include "job_system.h"
+#include "culling.h"
+#include "bvh.h"
+#include "occlusion_culling.h"
+#include "software_occlusion.h"
+#include "water_visibility.h"
+#include "meshlets.h"
+#include "lod.h"
+#include "impostors.h"
+#include "light_culling.h"
+#include "render_targets.h"
+#include "render_thread.h"
 #include <imgui.h>
 #include <stb_image.h>
 #include <stb_image_write.h>
@@ -91,6 +108,57 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
     return programHandle;
 }
 
+GLuint CreateComputeProgramFromSource(String programSource, const char* shaderName)
+{
+    GLchar  infoLogBuffer[1024] = {};
+    GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
+    GLsizei infoLogSize;
+    GLint   success;
+
+    char versionString[] = "#version 430\n";
+    char shaderNameDefine[128];
+    sprintf(shaderNameDefine, "#define %s\n", shaderName);
+    char computeShaderDefine[] = "#define COMPUTE\n";
+
+    const GLchar* computeShaderSource[] = {
+        versionString,
+        shaderNameDefine,
+        computeShaderDefine,
+        programSource.str
+    };
+    const GLint computeShaderLengths[] = {
+        (GLint) strlen(versionString),
+        (GLint) strlen(shaderNameDefine),
+        (GLint) strlen(computeShaderDefine),
+        (GLint) programSource.len
+    };
+
+    GLuint cshader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(cshader, ARRAY_COUNT(computeShaderSource), computeShaderSource, computeShaderLengths);
+    glCompileShader(cshader);
+    glGetShaderiv(cshader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(cshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        ELOG("glCompileShader() failed with compute shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+    }
+
+    GLuint programHandle = glCreateProgram();
+    glAttachShader(programHandle, cshader);
+    glLinkProgram(programHandle);
+    glGetProgramiv(programHandle, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(programHandle, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        ELOG("glLinkProgram() failed with program %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+    }
+
+    glDetachShader(programHandle, cshader);
+    glDeleteShader(cshader);
+
+    return programHandle;
+}
+
 u32 LoadProgram(App* app, const char* filepath, const char* programName)
 {
     String programSource = ReadTextFile(filepath);
@@ -105,6 +173,21 @@ u32 LoadProgram(App* app, const char* filepath, const char* programName)
     return app->programs.size() - 1;
 }
 
+u32 LoadComputeProgram(App* app, const char* filepath, const char* programName)
+{
+    String programSource = ReadTextFile(filepath);
+
+    Program program = {};
+    program.handle = CreateComputeProgramFromSource(programSource, programName);
+    program.filepath = filepath;
+    program.programName = programName;
+    program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
+    program.compute = true;
+    app->programs.push_back(program);
+
+    return app->programs.size() - 1;
+}
+
 Image LoadImage(const char* filename)
 {
     Image img = {};
@@ -126,7 +209,7 @@ void FreeImage(Image image)
     stbi_image_free(image.pixels);
 }
 
-GLuint CreateTexture2DFromImage(Image image)
+GLuint CreateTexture2DFromImage(App* app, Image image)
 {
     GLenum internalFormat = GL_RGB8;
     GLenum dataFormat     = GL_RGB;
@@ -142,22 +225,24 @@ GLuint CreateTexture2DFromImage(Image image)
     GLuint texHandle;
     glGenTextures(1, &texHandle);
     glBindTexture(GL_TEXTURE_2D, texHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.size.x, image.size.y, 0, dataFormat, dataType, image.pixels);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.size.x, image.size.y, 0, dataFormat, dataType, NULL);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glGenerateMipmap(GL_TEXTURE_2D);
     glBindTexture(GL_TEXTURE_2D, 0);
 
+    // Pixels are streamed in later frames, mipmaps are built once the last rows land
+    StageTextureUpload(app, texHandle, GL_TEXTURE_2D, GL_TEXTURE_2D, image.size, dataFormat, dataType, image.pixels, image.stride, true);
+
     return texHandle;
 }
 
 u32 LoadTexture2D(App* app, const char* filepath)
 {
     for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
-        if (app->textures[texIdx].filepath == filepath)
+        if (app->textures[texIdx].filepath == filepath && app->textures[texIdx].arrayIdx == UINT32_MAX)
             return texIdx;
 
     Image image = LoadImage(filepath);
@@ -165,8 +250,9 @@ u32 LoadTexture2D(App* app, const char* filepath)
     if (image.pixels)
     {
         Texture tex = {};
-        tex.handle = CreateTexture2DFromImage(image);
+        tex.handle = CreateTexture2DFromImage(app, image);
         tex.filepath = filepath;
+        tex.arrayIdx = UINT32_MAX;
 
         u32 texIdx = app->textures.size();
         app->textures.push_back(tex);
@@ -196,12 +282,14 @@ unsigned int loadCubemap(std::vector<std::string> faces, App* app)
     int width, height, nrChannels;
     for (unsigned int i = 0; i < faces.size(); i++)
     {
-        unsigned char* data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 0);
+        unsigned char* data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 3);
         if (data)
         {
             glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-                0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data
+                0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL
             );
+            StageTextureUpload(app, textureID, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
+                ivec2(width, height), GL_RGB, GL_UNSIGNED_BYTE, data, width * 3, false);
             stbi_image_free(data);
         }
         else
@@ -215,6 +303,7 @@ unsigned int loadCubemap(std::vector<std::string> faces, App* app)
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
 
     return textureID;
 }
@@ -254,6 +343,7 @@ unsigned int loadIrradiancemap(std::vector<std::string> faces, App* app)
 
 void Init(App* app)
 {
+    InvalidateGLState(app->glState);
 
     // Set up error callback
     if (GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 3))
@@ -308,6 +398,10 @@ void Init(App* app)
     app->programUniformTexture = glGetUniformLocation(texturedGeometryProgram.handle, "uTexture");
 
     app->ConvolutionShader = LoadProgram(app, "ConvolutionShader.glsl", "CONVOLUTION");
+
+    // Staging ring for mesh and texture uploads
+    InitUploadManager(app, MB(32), MB(4));
+    app->uploadFrameBudget = app->uploads.frameBudget;
     
     app->diceTexIdx = LoadTexture2D(app, "dice.png");
     app->whiteTexIdx = LoadTexture2D(app, "color_white.png");
@@ -323,6 +417,36 @@ void Init(App* app)
 
     app->uniformBuffer = CreateConstantBuffer(app->maxUniformBufferSize);
 
+    // Per instance transforms and material colors, resized when needed
+    app->instanceBuffer = CreateBuffer(KB(64), GL_SHADER_STORAGE_BUFFER, GL_STREAM_DRAW);
+    app->materialBuffer = CreateBuffer(KB(16), GL_SHADER_STORAGE_BUFFER, GL_STREAM_DRAW);
+    app->lightBuffer = CreateBuffer(KB(4), GL_SHADER_STORAGE_BUFFER, GL_STREAM_DRAW);
+
+    // Indirect commands and their draw infos, written by the render queues
+    InitIndirectStream(app->indirect, KB(64), KB(64));
+    InitJobSystem(app->jobs, 0);
+
+    app->depthPrePass = true;
+    app->bvhCulling = true;
+    app->occlusionCulling = true;
+    app->softwareOcclusionCulling = false;
+    app->conditionalWater = true;
+    app->meshletCulling = true;
+    app->meshletConeCulling = false;
+    app->lodSelection = true;
+    app->reloadModelIdx = UINT32_MAX;
+    app->reflectionLodBias = 1;
+    app->impostors = true;
+    app->lightingMode = LIGHTING_TILED;
+    app->impostorDistance = 60.0f;
+    app->selectedEntity = -1;
+    app->sceneVersion = 1;      // packets start at 0, so the first of each copies the scene
+    glGenQueries(GBUFFER_SAMPLE_QUERY_COUNT, app->gbufferSampleQueries);
+    glGenQueries(GBUFFER_SAMPLE_QUERY_COUNT * 2, &app->lightingTimestamps[0][0]);
+
+    // Create the global geometry heap (grows on demand)
+    InitGeometryHeap(app->geometry, MB(64), MB(32));
+
     // Load models
     app->patrickModelIdx = LoadModel(app, "Patrick/Patrick.obj");
     app->roomModelIdx = LoadModel(app, "Lake/Erlaufsee.obj");
@@ -382,7 +506,10 @@ void Init(App* app)
     }
     
     app->texturedMeshProgram_uTexture = glGetUniformLocation(texturedMeshProgram.handle, "uTexture");
-    app->texturedMeshProgram_uColor = glGetUniformLocation(texturedMeshProgram.handle, "uColor");
+    app->texturedMeshProgram_uSkybox = glGetUniformLocation(texturedMeshProgram.handle, "skybox");
+    app->texturedMeshProgram_uIrradiance = glGetUniformLocation(texturedMeshProgram.handle, "irradianceMap");
+    app->texturedMeshProgram_uCameraPos = glGetUniformLocation(texturedMeshProgram.handle, "cameraPos");
+    app->texturedMeshProgram_uViewProjection = glGetUniformLocation(texturedMeshProgram.handle, "uViewProjection");
 
     // [Water] Clipping plane Program
     app->clippedMeshIdx = LoadProgram(app, "shaders.glsl", "CLIPPED_MESHES");
@@ -410,11 +537,9 @@ void Init(App* app)
 
     app->clippedProgram_uProj = glGetUniformLocation(clippedMeshProgram.handle, "uProj");
     app->clippedProgram_uView = glGetUniformLocation(clippedMeshProgram.handle, "uView");
-    app->clippedProgram_uModel = glGetUniformLocation(clippedMeshProgram.handle, "uModel");
     app->clippedProgram_uClippingPlane = glGetUniformLocation(clippedMeshProgram.handle, "uClippingPlane");
     app->clipperProgram_uTexture = glGetUniformLocation(clippedMeshProgram.handle, "uTexture");
     app->clipperProgram_uSkybox = glGetUniformLocation(clippedMeshProgram.handle, "uSkybox");
-    app->clipperProgram_uColor = glGetUniformLocation(clippedMeshProgram.handle, "uColor");
 
     // [Water] Effect Program
     app->waterEffectProgramIdx = LoadProgram(app, "shaders.glsl", "WATER_EFFECT");
@@ -453,6 +578,13 @@ void Init(App* app)
     app->waterEffectProgram_uDudvMap = glGetUniformLocation(waterEffectProgram.handle, "dudvMap");
     app->waterEffectProgram_uSkybox = glGetUniformLocation(waterEffectProgram.handle, "skyBox");
 
+    // [Water] Surface visibility query program, positions only
+    app->water.queryProgramIdx = LoadProgram(app, "shaders.glsl", "WATER_QUERY");
+    Program& waterQueryProgram = app->programs[app->water.queryProgramIdx];
+    app->water.queryProgram_uProj = glGetUniformLocation(waterQueryProgram.handle, "uProj");
+    app->water.queryProgram_uView = glGetUniformLocation(waterQueryProgram.handle, "uView");
+    InitWaterVisibility(app);
+
     // [Deferred Render] Geometry Pass Program
     app->deferredGeometryPassProgramIdx = LoadProgram(app, "shaders.glsl", "DEFERRED_GEOMETRY_PASS");
 
@@ -480,9 +612,67 @@ void Init(App* app)
     }
 
     app->deferredGeometryProgram_uTexture = glGetUniformLocation(deferredGeoPassProgram.handle, "uTexture");
-    app->deferredGeometryProgram_uColor = glGetUniformLocation(deferredGeoPassProgram.handle, "uColor");
     app->deferredGeometryProgram_uSkybox = glGetUniformLocation(deferredGeoPassProgram.handle, "skybox");
     app->deferredGeometryProgram_uIrradiance = glGetUniformLocation(deferredGeoPassProgram.handle, "irradianceMap");
+    app->deferredGeometryProgram_uCameraPos = glGetUniformLocation(deferredGeoPassProgram.handle, "cameraPos");
+    app->deferredGeometryProgram_uViewProjection = glGetUniformLocation(deferredGeoPassProgram.handle, "uViewProjection");
+
+    // [Deferred Render] Depth pre-pass program, positions only
+    app->depthPrePassProgramIdx = LoadProgram(app, "shaders.glsl", "DEPTH_PREPASS");
+    Program& depthPrePassProgram = app->programs[app->depthPrePassProgramIdx];
+    app->depthPrePassProgram_uViewProjection = glGetUniformLocation(depthPrePassProgram.handle, "uViewProjection");
+
+    // [Deferred Render] Hi-Z occlusion culling compute programs
+    OcclusionCuller& occlusion = app->occlusion;
+    occlusion.hiZBuildProgramIdx = LoadComputeProgram(app, "shaders.glsl", "HIZ_BUILD");
+    Program& hiZBuildProgram = app->programs[occlusion.hiZBuildProgramIdx];
+    occlusion.hiZBuildProgram_uLevel = glGetUniformLocation(hiZBuildProgram.handle, "uLevel");
+    occlusion.hiZBuildProgram_uDepth = glGetUniformLocation(hiZBuildProgram.handle, "uDepth");
+    occlusion.hiZBuildProgram_uSourceSize = glGetUniformLocation(hiZBuildProgram.handle, "uSourceSize");
+    occlusion.hiZBuildProgram_uDestinationSize = glGetUniformLocation(hiZBuildProgram.handle, "uDestinationSize");
+
+    occlusion.cullProgramIdx = LoadComputeProgram(app, "shaders.glsl", "OCCLUSION_CULL");
+    Program& cullProgram = app->programs[occlusion.cullProgramIdx];
+    occlusion.cullProgram_uPhase = glGetUniformLocation(cullProgram.handle, "uPhase");
+    occlusion.cullProgram_uCandidateCount = glGetUniformLocation(cullProgram.handle, "uCandidateCount");
+    occlusion.cullProgram_uFirstCommand = glGetUniformLocation(cullProgram.handle, "uFirstCommand");
+    occlusion.cullProgram_uFirstDrawInfo = glGetUniformLocation(cullProgram.handle, "uFirstDrawInfo");
+    occlusion.cullProgram_uViewProjection = glGetUniformLocation(cullProgram.handle, "uViewProjection");
+    occlusion.cullProgram_uHiZ = glGetUniformLocation(cullProgram.handle, "uHiZ");
+    occlusion.cullProgram_uHiZSize = glGetUniformLocation(cullProgram.handle, "uHiZSize");
+    occlusion.cullProgram_uHiZLevels = glGetUniformLocation(cullProgram.handle, "uHiZLevels");
+
+    // Meshlet culling compute program, every mesh is loaded by now
+    MeshletCuller& meshlets = app->meshlets;
+    meshlets.cullProgramIdx = LoadComputeProgram(app, "shaders.glsl", "MESHLET_CULL");
+    Program& meshletCullProgram = app->programs[meshlets.cullProgramIdx];
+    meshlets.cullProgram_uFirstDraw = glGetUniformLocation(meshletCullProgram.handle, "uFirstDraw");
+    meshlets.cullProgram_uPlanes = glGetUniformLocation(meshletCullProgram.handle, "uPlanes");
+    meshlets.cullProgram_uCameraPosition = glGetUniformLocation(meshletCullProgram.handle, "uCameraPosition");
+    meshlets.cullProgram_uClipPlane = glGetUniformLocation(meshletCullProgram.handle, "uClipPlane");
+    meshlets.cullProgram_uFlags = glGetUniformLocation(meshletCullProgram.handle, "uFlags");
+    InitMeshletCuller(app);
+
+    // [Deferred Render] Impostor bake and draw programs, baked once the textures are resident
+    ImpostorAtlas& impostorAtlas = app->impostorAtlas;
+    impostorAtlas.bakeProgramIdx = LoadProgram(app, "shaders.glsl", "IMPOSTOR_BAKE");
+    Program& impostorBakeProgram = app->programs[impostorAtlas.bakeProgramIdx];
+    impostorAtlas.bakeProgram_uViewProjection = glGetUniformLocation(impostorBakeProgram.handle, "uViewProjection");
+    impostorAtlas.bakeProgram_uSphere = glGetUniformLocation(impostorBakeProgram.handle, "uSphere");
+    impostorAtlas.bakeProgram_uDirection = glGetUniformLocation(impostorBakeProgram.handle, "uDirection");
+    impostorAtlas.bakeProgram_uAlbedo = glGetUniformLocation(impostorBakeProgram.handle, "uAlbedo");
+    impostorAtlas.bakeProgram_uAlbedoLayer = glGetUniformLocation(impostorBakeProgram.handle, "uAlbedoLayer");
+    impostorAtlas.bakeProgram_uTexture = glGetUniformLocation(impostorBakeProgram.handle, "uTexture");
+
+    impostorAtlas.programIdx = LoadProgram(app, "shaders.glsl", "IMPOSTOR");
+    Program& impostorProgram = app->programs[impostorAtlas.programIdx];
+    impostorAtlas.program_uViewProjection = glGetUniformLocation(impostorProgram.handle, "uViewProjection");
+    impostorAtlas.program_uCameraPosition = glGetUniformLocation(impostorProgram.handle, "uCameraPosition");
+    impostorAtlas.program_uGrid = glGetUniformLocation(impostorProgram.handle, "uGrid");
+    impostorAtlas.program_uAlbedo = glGetUniformLocation(impostorProgram.handle, "uAlbedo");
+    impostorAtlas.program_uNormalDepth = glGetUniformLocation(impostorProgram.handle, "uNormalDepth");
+    impostorAtlas.program_uSkybox = glGetUniformLocation(impostorProgram.handle, "uSkybox");
+    impostorAtlas.program_uIrradiance = glGetUniformLocation(impostorProgram.handle, "uIrradiance");
    
     Program& skyBoxProgram = app->programs[app->skyBox];
     app->skyboxProgram_uSkybox = glGetUniformLocation(skyBoxProgram.handle, "skybox");
@@ -516,273 +706,57 @@ void Init(App* app)
         deferredLightingPassProgram.vertexInputLayout.attributes.push_back({ (u8)attrLocation, GetAttribComponentCount(attrType) });
     }
 
-    app->deferredLightingProgram_uGPosition = glGetUniformLocation(deferredLightingPassProgram.handle, "uGPosition");
+    app->deferredLightingProgram_uDepth = glGetUniformLocation(deferredLightingPassProgram.handle, "uDepth");
     app->deferredLightingProgram_uGNormals = glGetUniformLocation(deferredLightingPassProgram.handle, "uGNormals");
     app->deferredLightingProgram_uGDiffuse = glGetUniformLocation(deferredLightingPassProgram.handle, "uGDiffuse");
-
-    // [Framebuffers]
-
-    // FORWARD BUFFERS
-    // [Framebuffer] Forward Buffer
-    // [Texture] Depth
-    glGenTextures(1, &app->forwardDepthAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->forwardDepthAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    // [Texture] Render
-    glGenTextures(1, &app->forwardRenderAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->forwardRenderAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    glGenFramebuffers(1, &app->forwardFrameBuffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, app->forwardFrameBuffer);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->forwardRenderAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->forwardDepthAttachmentHandle, 0);
-
-    GLenum drawForwardBuffer[] = { GL_COLOR_ATTACHMENT0 };
-    glDrawBuffers(ARRAY_COUNT(drawForwardBuffer), drawForwardBuffer);
-
-    GLenum forwardFrameBufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (forwardFrameBufferStatus != GL_FRAMEBUFFER_COMPLETE)
-    {
-        switch (forwardFrameBufferStatus)
-        {
-        case GL_FRAMEBUFFER_UNDEFINED:                          ELOG("Framebuffer status error: GL_FRAMEBUFFER_UNDEFINED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:              ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT:      ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER"); break;
-        case GL_FRAMEBUFFER_UNSUPPORTED:                        ELOG("Framebuffer status error: GL_FRAMEBUFFER_UNSUPPORTED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS:           ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS"); break;
-
-        default: ELOG("Unknown framebuffer status error"); break;
-        }
-    }
-
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    // DEFERRED BUFFERS
-    // [Framebuffer] GBuffer
-    // [Texture] Positions
-    glGenTextures(1, &app->positionAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    // [Texture] Normals
-    glGenTextures(1, &app->normalsAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    // [Texture] Diffuse
-    glGenTextures(1, &app->diffuseAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->diffuseAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    // [Texture] Depth
-    glGenTextures(1, &app->depthAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    glGenFramebuffers(1, &app->gBuffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, app->gBuffer);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->positionAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, app->normalsAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, app->diffuseAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->depthAttachmentHandle, 0);
-
-    GLenum drawBuffersGBuffer[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
-    glDrawBuffers(ARRAY_COUNT(drawBuffersGBuffer), drawBuffersGBuffer);
-
-    GLenum frameBufferStatusGBuffer = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (frameBufferStatusGBuffer != GL_FRAMEBUFFER_COMPLETE)
-    {
-        switch (frameBufferStatusGBuffer)
-        {
-        case GL_FRAMEBUFFER_UNDEFINED:                          ELOG("Framebuffer status error: GL_FRAMEBUFFER_UNDEFINED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:              ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT:      ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER"); break;
-        case GL_FRAMEBUFFER_UNSUPPORTED:                        ELOG("Framebuffer status error: GL_FRAMEBUFFER_UNSUPPORTED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS:           ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS"); break;
-
-        default: ELOG("Unknown framebuffer status error"); break;
-        }
-    }
-
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    // [Framebuffer] FBuffer
-    glGenTextures(1, &app->finalRenderAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->finalRenderAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    glGenFramebuffers(1, &app->fBuffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, app->fBuffer);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, app->finalRenderAttachmentHandle, 0);
-
-    GLenum drawBuffersFBuffer[] = { GL_COLOR_ATTACHMENT3 };
-    glDrawBuffers(ARRAY_COUNT(drawBuffersFBuffer), drawBuffersFBuffer);
-
-    GLenum frameBufferStatusFBuffer = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (frameBufferStatusFBuffer != GL_FRAMEBUFFER_COMPLETE)
-    {
-        switch (frameBufferStatusFBuffer)
-        {
-        case GL_FRAMEBUFFER_UNDEFINED:                          ELOG("Framebuffer status error: GL_FRAMEBUFFER_UNDEFINED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:              ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT:      ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER"); break;
-        case GL_FRAMEBUFFER_UNSUPPORTED:                        ELOG("Framebuffer status error: GL_FRAMEBUFFER_UNSUPPORTED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS:           ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS"); break;
-
-        default: ELOG("Unknown framebuffer status error"); break;
-        }
-    }
-
-    // [Texture] Reflection color
-    glGenTextures(1, &app->waterReflectionAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->waterReflectionAttachmentHandle);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    // [Texture] Reflection depth
-    glGenTextures(1, &app->waterReflectionDepthAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->waterReflectionDepthAttachmentHandle);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    // [Framebuffer] Reflection buffer
-    glGenFramebuffers(1, &app->waterReflectionFrameBuffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, app->waterReflectionFrameBuffer);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, app->waterReflectionAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->waterReflectionDepthAttachmentHandle, 0);
-
-    GLenum waterReflectionBuffer[] = { GL_COLOR_ATTACHMENT5 };
-    glDrawBuffers(ARRAY_COUNT(waterReflectionBuffer), waterReflectionBuffer);
-
-    GLenum waterReflectionFrameBufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (waterReflectionFrameBufferStatus != GL_FRAMEBUFFER_COMPLETE)
-    {
-        switch (waterReflectionFrameBufferStatus)
-        {
-        case GL_FRAMEBUFFER_UNDEFINED:                          ELOG("Framebuffer status error: GL_FRAMEBUFFER_UNDEFINED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:              ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT:      ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER"); break;
-        case GL_FRAMEBUFFER_UNSUPPORTED:                        ELOG("Framebuffer status error: GL_FRAMEBUFFER_UNSUPPORTED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS:           ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS"); break;
-
-        default: ELOG("Unknown framebuffer status error"); break;
-        }
-    }
-
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    // [Texture] Refraction color
-    glGenTextures(1, &app->waterRefractionAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->waterRefractionAttachmentHandle);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    // [Texture] Refraction depth
-    glGenTextures(1, &app->waterRefractionDepthAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->waterRefractionDepthAttachmentHandle);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    // [Framebuffer] Refraction buffer
-    glGenFramebuffers(1, &app->waterRefractionFrameBuffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, app->waterRefractionFrameBuffer);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT5, app->waterRefractionAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->waterRefractionDepthAttachmentHandle, 0);
-
-    GLenum waterRefractionBuffer[] = { GL_COLOR_ATTACHMENT5 };
-    glDrawBuffers(ARRAY_COUNT(waterRefractionBuffer), waterRefractionBuffer);
-
-    GLenum waterRefractionFrameBufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (waterRefractionFrameBufferStatus != GL_FRAMEBUFFER_COMPLETE)
-    {
-        switch (waterRefractionFrameBufferStatus)
-        {
-        case GL_FRAMEBUFFER_UNDEFINED:                          ELOG("Framebuffer status error: GL_FRAMEBUFFER_UNDEFINED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:              ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT:      ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER"); break;
-        case GL_FRAMEBUFFER_UNSUPPORTED:                        ELOG("Framebuffer status error: GL_FRAMEBUFFER_UNSUPPORTED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS:           ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS"); break;
-
-        default: ELOG("Unknown framebuffer status error"); break;
-        }
-    }
-
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    app->deferredLightingProgram_uInverseViewProjection = glGetUniformLocation(deferredLightingPassProgram.handle, "uInverseViewProjection");
+    app->deferredLightingProgram_uDirectionalOnly = glGetUniformLocation(deferredLightingPassProgram.handle, "uDirectionalOnly");
+
+    // [Deferred Render] Tiled lighting compute program
+    TiledLighting& tiledLighting = app->tiledLighting;
+    tiledLighting.programIdx = LoadComputeProgram(app, "shaders.glsl", "TILED_LIGHTING");
+    Program& tiledLightingProgram = app->programs[tiledLighting.programIdx];
+    tiledLighting.program_uDepth = glGetUniformLocation(tiledLightingProgram.handle, "uDepth");
+    tiledLighting.program_uGNormals = glGetUniformLocation(tiledLightingProgram.handle, "uGNormals");
+    tiledLighting.program_uGDiffuse = glGetUniformLocation(tiledLightingProgram.handle, "uGDiffuse");
+    tiledLighting.program_uProjection = glGetUniformLocation(tiledLightingProgram.handle, "uProjection");
+    tiledLighting.program_uView = glGetUniformLocation(tiledLightingProgram.handle, "uView");
+    tiledLighting.program_uInverseViewProjection = glGetUniformLocation(tiledLightingProgram.handle, "uInverseViewProjection");
+    tiledLighting.program_uLightCount = glGetUniformLocation(tiledLightingProgram.handle, "uLightCount");
+    tiledLighting.program_uScreenSize = glGetUniformLocation(tiledLightingProgram.handle, "uScreenSize");
+
+    // [Deferred Render] Point light volumes program
+    LightVolumes& lightVolumes = app->lightVolumes;
+    lightVolumes.programIdx = LoadProgram(app, "shaders.glsl", "LIGHT_VOLUME");
+    Program& lightVolumeProgram = app->programs[lightVolumes.programIdx];
+    lightVolumes.program_uDepth = glGetUniformLocation(lightVolumeProgram.handle, "uDepth");
+    lightVolumes.program_uGNormals = glGetUniformLocation(lightVolumeProgram.handle, "uGNormals");
+    lightVolumes.program_uGDiffuse = glGetUniformLocation(lightVolumeProgram.handle, "uGDiffuse");
+    lightVolumes.program_uProjection = glGetUniformLocation(lightVolumeProgram.handle, "uProjection");
+    lightVolumes.program_uView = glGetUniformLocation(lightVolumeProgram.handle, "uView");
+    lightVolumes.program_uInverseViewProjection = glGetUniformLocation(lightVolumeProgram.handle, "uInverseViewProjection");
+    lightVolumes.program_uLightIndex = glGetUniformLocation(lightVolumeProgram.handle, "uLightIndex");
+
+    // [Deferred Render] Decoded G-buffer channels for the scene panel
+    app->gbufferDebugProgramIdx = LoadProgram(app, "shaders.glsl", "GBUFFER_DEBUG");
+    Program& gbufferDebugProgram = app->programs[app->gbufferDebugProgramIdx];
+    app->gbufferDebugProgram_uDepth = glGetUniformLocation(gbufferDebugProgram.handle, "uDepth");
+    app->gbufferDebugProgram_uGNormals = glGetUniformLocation(gbufferDebugProgram.handle, "uGNormals");
+    app->gbufferDebugProgram_uGDiffuse = glGetUniformLocation(gbufferDebugProgram.handle, "uGDiffuse");
+    app->gbufferDebugProgram_uInverseViewProjection = glGetUniformLocation(gbufferDebugProgram.handle, "uInverseViewProjection");
+    app->gbufferDebugProgram_uView = glGetUniformLocation(gbufferDebugProgram.handle, "uView");
+
+    // Light clusters of the forward, clipped mesh and water programs
+    LightClusters& lightClusters = app->lightClusters;
+    lightClusters.buildProgramIdx = LoadComputeProgram(app, "shaders.glsl", "LIGHT_CLUSTER_BUILD");
+    Program& clusterBuildProgram = app->programs[lightClusters.buildProgramIdx];
+    lightClusters.buildProgram_uLightCount = glGetUniformLocation(clusterBuildProgram.handle, "uLightCount");
+    lightClusters.buildProgram_uInverseProjection = glGetUniformLocation(clusterBuildProgram.handle, "uInverseProjection");
+    InitLightClusters(app);
+
+    // [Framebuffers] Created at the Scene panel size by the first rendered frame
+    InitOcclusionCuller(app->occlusion);
+    InitRenderTargets(app);
 
     app->currentFBOAttachmentType = FBOAttachmentType::FINAL;
     app->mode = Mode_Deferred;
@@ -807,6 +781,9 @@ void Init(App* app)
     
 
     app->cubeMapId = loadCubemap(faces, app);
+
+    // The convolution samples the skybox right away, it has to be resident
+    FlushUploads(app);
     LoadIrradianceMap(app);
   //  app->irradianceMapId = loadIrradiancemap(faces, app);
 
@@ -814,7 +791,8 @@ void Init(App* app)
 
     glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
 
-
+    // Material textures were flushed above, so the atlases bake with them
+    BakeImpostors(app);
 }
 
 void LoadIrradianceMap(App* app)
@@ -917,6 +895,8 @@ void Gui(App* app)
 
     ImGui::Begin("Menu");
     ImGui::Text("FPS: %f", 1.0f / app->deltaTime);
+    if (app->revealSelection)
+        ImGui::SetNextItemOpen(true);
     if (ImGui::CollapsingHeader("Entities"))
     {
         std::string name;
@@ -924,26 +904,38 @@ void Gui(App* app)
         {
             Entity& e = app->entities[i];
             name = ("Entity " + std::to_string(i));
-            if (ImGui::TreeNode(name.c_str()))
+            if (app->revealSelection && (i32)i == app->selectedEntity)
+                ImGui::SetNextItemOpen(true);
+            if (ImGui::TreeNodeEx(name.c_str(), (i32)i == app->selectedEntity ? ImGuiTreeNodeFlags_Selected : 0))
             {
                 // Position edit
-                ImGui::DragFloat3("Position", (float*)&e.position, 0.01F);
+                if (ImGui::DragFloat3("Position", (float*)&e.position, 0.01F))
+                    e.boundsValid = false;
                 ImGui::Spacing();
 
                 // Rotation edit
-                ImGui::DragFloat3("Rotation", (float*)&e.rotation, 0.01F);
+                if (ImGui::DragFloat3("Rotation", (float*)&e.rotation, 0.01F))
+                    e.boundsValid = false;
                 ImGui::Spacing();
 
                 // Scale edit
-                ImGui::DragFloat3("Scale", (float*)&e.scale, 0.01F);
+                if (ImGui::DragFloat3("Scale", (float*)&e.scale, 0.01F))
+                    e.boundsValid = false;
+                ImGui::Spacing();
+
+                if (ImGui::DragFloat("Metallic", (float*)&e.metallic, 0.01F, 0, 1))
+                    app->sceneVersion++;
                 ImGui::Spacing();
 
-                ImGui::DragFloat("Metallic", (float*)&e.metallic, 0.01F, 0, 1);
+                // Returns the model's blocks to the geometry heap and allocates them again
+                if (ImGui::Button("Reload model geometry"))
+                    app->reloadModelIdx = e.modelIdx;
 
                 ImGui::TreePop();
             }
         }
     }
+    app->revealSelection = false;
     if (ImGui::CollapsingHeader("Lights"))
     {
         std::string name;
@@ -981,14 +973,25 @@ void Gui(App* app)
                     ImGui::DragFloat("Radius", &l.radius, 0.01F, 0.0F, 0.0F, "%.04f");
                     l.radius = (l.radius < 0.0F) ? 0.0F : l.radius;
                     ImGui::Spacing();
+
+                    std::vector<u32> influenced;
+                    BvhQuerySphere(app->sceneBvh, l.position, l.radius, influenced);
+                    ImGui::Text("Influences %u submeshes", (u32)influenced.size());
                 }
 
                 ImGui::TreePop();
             }
         }
+        if (ImGui::Button("Add point light"))
+        {
+            const vec3 position = app->cam.position + app->cam.front * 5.0F;
+            app->lights.push_back(Light{ LIGHTTYPE_POINT, vec3(1,1,1), position, vec3(0,0,0), 5.0F, 1.0F });
+        }
     }
     if (ImGui::CollapsingHeader("Render"))
     {
+        // Whatever the render thread counts is only read from the last published frame
+        const RenderStats& rendered = LatestRenderStats(app);
         const char* items[] = { "Forward", "Deferred"};
         static const char* curr = items[1];
         if (ImGui::BeginCombo("##combo", curr))
@@ -1010,8 +1013,20 @@ void Gui(App* app)
             }
             ImGui::EndCombo();
         }
-        const char* items2[] = { "Position", "Normals", "Diffuse", "Depth", "Final" };
-        static const char* curr2 = items2[4];
+        if (app->mode == Mode_Deferred)
+        {
+            const char* lightingModes[] = { "Full screen quad", "Tiled (compute)", "Light volumes (stencil)" };
+            int lightingMode = (int)app->lightingMode;
+            if (ImGui::Combo("Lighting", &lightingMode, lightingModes, IM_ARRAYSIZE(lightingModes)))
+                app->lightingMode = (LightingMode)lightingMode;
+            if (app->lightingMode == LIGHTING_TILED)
+                ImGui::Text("%d x %d tiles of %d pixels, %u lights", (app->renderTargets.size.x + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE,
+                    (app->renderTargets.size.y + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE, LIGHT_TILE_SIZE, (u32)app->lights.size());
+            if (app->lightingMode == LIGHTING_VOLUMES)
+                ImGui::Text("%u point light volumes drawn", rendered.drawnLightVolumes);
+        }
+        const char* items2[] = { "Position", "Normals", "Diffuse", "Metallic", "Depth", "Final" };
+        static const char* curr2 = items2[5];
         if (curr == "Deferred" && ImGui::BeginCombo("##combo2", curr2))
         {
             for (int n = 0; n < IM_ARRAYSIZE(items2); n++)
@@ -1031,12 +1046,130 @@ void Gui(App* app)
                 if (strcmp(curr2, items2[2]) == 0)
                     app->currentFBOAttachmentType = FBOAttachmentType::DIFFUSE;
                 if (strcmp(curr2, items2[3]) == 0)
-                    app->currentFBOAttachmentType = FBOAttachmentType::DEPTH;
+                    app->currentFBOAttachmentType = FBOAttachmentType::METALLIC;
                 if (strcmp(curr2, items2[4]) == 0)
+                    app->currentFBOAttachmentType = FBOAttachmentType::DEPTH;
+                if (strcmp(curr2, items2[5]) == 0)
                     app->currentFBOAttachmentType = FBOAttachmentType::FINAL;
             }
             ImGui::EndCombo();
         }
+        ImGui::Text("GL state calls: %u issued, %u filtered", rendered.glIssuedCalls, rendered.glSkippedCalls);
+        ImGui::Text("Indirect: %u multi-draw calls, %u commands", rendered.multiDrawCalls, rendered.drawCommands);
+        ImGui::Text("Command lists: %u commands replayed, %u workers", rendered.submittedCommands, (u32)app->jobs.workers.size());
+        const char* cullPassNames[] = { "Forward", "Reflection", "Refraction", "G-buffer" };
+        const RenderPass cullPasses[] = { RENDERPASS_FORWARD, RENDERPASS_WATER_REFLECTION, RENDERPASS_WATER_REFRACTION, RENDERPASS_GBUFFER };
+        for (u32 i = 0; i < ARRAY_COUNT(cullPasses); ++i)
+        {
+            const CullStats& stats = rendered.cullStats[cullPasses[i]];
+            ImGui::Text("%s culling: %u submeshes visible, %u boxes tested", cullPassNames[i], stats.visible, stats.tested);
+        }
+        for (u32 i = 1; i <= 2; ++i)
+        {
+            const CullStats& stats = rendered.clipPlaneStats[cullPasses[i]];
+            ImGui::Text("%s water plane: %u submeshes culled, %u clipped", cullPassNames[i], stats.tested - stats.visible, rendered.clippedCount[cullPasses[i]]);
+        }
+        ImGui::Checkbox("BVH culling", &app->bvhCulling);
+        ImGui::SameLine();
+        ImGui::Text("(%u nodes, %u rebuilds)", (u32)app->sceneBvh.nodes.size(), app->sceneBvh.rebuilds);
+        if (ImGui::Button("Run culling benchmark"))
+        {
+            app->cullBenchmarks.clear();
+            for (u32 count : { 1000u, 10000u, 100000u })
+                app->cullBenchmarks.push_back(RunCullBenchmark(count));
+        }
+        for (const CullBenchmark& benchmark : app->cullBenchmarks)
+        {
+            ImGui::Text("%6u boxes: build %.2f ms, refit %.2f ms, frustum %.3f ms (flat %.3f ms)",
+                benchmark.count, benchmark.build, benchmark.refit, benchmark.bvhFrustum, benchmark.flatFrustum);
+            ImGui::Text("              1000 spheres %.2f ms, 1000 rays %.2f ms", benchmark.sphere, benchmark.rays);
+        }
+        ImGui::Checkbox("Software occlusion culling", &app->softwareOcclusionCulling);
+        if (app->softwareOcclusionCulling)
+        {
+            ImGui::Text("Software occlusion: %u occluders, %u triangles, %.2f ms", rendered.softwareOccluders, rendered.softwareTriangles, rendered.softwareRasterTime);
+            const RenderPass occlusionPasses[] = { RENDERPASS_FORWARD, RENDERPASS_GBUFFER };
+            for (RenderPass pass : occlusionPasses)
+            {
+                const CullStats& stats = rendered.softwareOcclusionStats[pass];
+                ImGui::Text("%s: %u of %u boxes occluded", pass == RENDERPASS_FORWARD ? "Forward" : "G-buffer", stats.tested - stats.visible, stats.tested);
+            }
+        }
+        if (ImGui::Button("Run software occlusion benchmark"))
+        {
+            app->softwareOcclusionBenchmarks.clear();
+            for (u32 count : { 10000u, 100000u })
+                app->softwareOcclusionBenchmarks.push_back(RunSoftwareOcclusionBenchmark(count));
+        }
+        for (const SoftwareOcclusionBenchmark& benchmark : app->softwareOcclusionBenchmarks)
+        {
+            ImGui::Text("%6u boxes: %u occluded, setup %.2f ms, raster %.2f ms, test %.2f ms",
+                benchmark.boxes, benchmark.occluded, benchmark.setup, benchmark.raster, benchmark.test);
+            ImGui::Text("              occluder %u of %u triangles, simplified in %.2f ms", benchmark.occluderTriangles, benchmark.sourceTriangles, benchmark.simplify);
+        }
+        ImGui::Text("Render targets: %d x %d, %u sets pooled, %u allocated so far", app->renderTargets.size.x, app->renderTargets.size.y,
+            rendered.pooledRenderTargets, rendered.renderTargetAllocations);
+        ImGui::Checkbox("Depth pre-pass", &app->depthPrePass);
+        const f32 screenSamples = (f32)glm::max(app->renderTargets.size.x * app->renderTargets.size.y, 1);
+        ImGui::Text("G-buffer shaded samples: %llu (%.2fx screen)", (unsigned long long)rendered.gbufferSamples, rendered.gbufferSamples / screenSamples);
+        ImGui::Checkbox("Hi-Z occlusion culling", &app->occlusionCulling);
+        if (app->occlusionCulling)
+        {
+            ImGui::Text("Occlusion: %u candidates, %u drawn from last frame, %u newly visible",
+                rendered.occlusionCandidates, rendered.occlusionPhaseInstances[0], rendered.occlusionPhaseInstances[1]);
+        }
+        ImGui::Checkbox("Meshlet culling", &app->meshletCulling);
+        if (ImGui::IsItemHovered())
+            ImGui::SetTooltip("Frustum and water plane tests per meshlet on the GPU. Hi-Z culled lists keep whole submeshes.");
+        if (app->meshletCulling)
+        {
+            ImGui::Checkbox("Meshlet cone culling", &app->meshletConeCulling);
+            if (ImGui::IsItemHovered())
+                ImGui::SetTooltip("Drops meshlets facing away from the eye. The passes draw back faces, so open or single sided meshes lose visible triangles.");
+            ImGui::Text("Meshlets: %u of %u visible (%u built)", rendered.meshletsVisible, rendered.meshletsTested, rendered.meshletCount);
+        }
+        ImGui::Checkbox("LOD selection", &app->lodSelection);
+        if (app->lodSelection)
+        {
+            ImGui::SliderInt("Reflection LOD bias", &app->reflectionLodBias, 0, LOD_MAX_COUNT - 1);
+            const RenderPass lodPasses[] = { RENDERPASS_FORWARD, RENDERPASS_GBUFFER, RENDERPASS_WATER_REFLECTION };
+            const char* lodPassNames[] = { "Forward", "G-buffer", "Reflection" };
+            for (u32 i = 0; i < ARRAY_COUNT(lodPasses); ++i)
+            {
+                const u32* instances = rendered.lodInstances[lodPasses[i]];
+                ImGui::Text("%s LODs: %u / %u / %u / %u", lodPassNames[i], instances[0], instances[1], instances[2], instances[3]);
+            }
+        }
+        ImGui::Checkbox("Impostors", &app->impostors);
+        if (app->impostors)
+        {
+            ImGui::SliderFloat("Impostor distance", &app->impostorDistance, 5.0f, 500.0f);
+            ImGui::Text("Impostors: %u instances in one draw (%u models baked)",
+                rendered.impostorCount, (u32)app->impostorAtlas.spheres.size());
+        }
+        int framesInFlight = (int)app->renderThread.framesInFlight;
+        if (ImGui::SliderInt("Frames in flight", &framesInFlight, 1, FRAME_PACKET_COUNT))
+            app->renderThread.framesInFlight = (u32)framesInFlight;
+        if (ImGui::IsItemHovered())
+            ImGui::SetTooltip("1: lower input latency, 2: simulation overlaps a whole frame of rendering");
+        ImGui::Text("Render thread: %.2f ms", rendered.renderTime * 1000.0f);
+        ImGui::Checkbox("Skip hidden water passes", &app->conditionalWater);
+        if (ImGui::IsItemHovered())
+            ImGui::SetTooltip("Bounds check against the view, then the GPU skips them when the surface was occluded last frame");
+        ImGui::Text("Water passes: %.2f ms GPU, %.2f ms saved, %u frames skipped", rendered.waterPassTime, rendered.waterSavedTime, rendered.waterSkippedFrames);
+        const char* lightingPasses[] = { "full screen quad", "tiled", "light volumes" };
+        ImGui::Text("Lighting pass (%s): %.2f ms GPU", lightingPasses[app->lightingMode], rendered.lightingTime);
+    }
+    if (ImGui::CollapsingHeader("Uploads"))
+    {
+        const RenderStats& rendered = LatestRenderStats(app);
+        int budgetKB = app->uploadFrameBudget / KB(1);
+        if (ImGui::DragInt("Frame budget (KB)", &budgetKB, 16.0F, 64, app->uploads.ringSize / KB(1)))
+            app->uploadFrameBudget = (u32)budgetKB * KB(1);
+        ImGui::Text("Staging ring: %u / %u KB", rendered.uploadRingUsed / KB(1), app->uploads.ringSize / KB(1));
+        ImGui::Text("Pending: %u KB", rendered.uploadPendingBytes / KB(1));
+        ImGui::Text("Uploaded last frame: %u KB", rendered.uploadedLastFrame / KB(1));
+        ImGui::Text("Persistent mapping: %s", app->uploads.persistentlyMapped ? "yes" : "no");
     }
     if (ImGui::CollapsingHeader("Info"))
     {
@@ -1057,42 +1190,37 @@ void Gui(App* app)
 
     ImGui::Begin("Scene");
     ImVec2 size = ImGui::GetContentRegionAvail();
+    app->renderTargets.panelSize = ivec2((i32)size.x, (i32)size.y);
+
+    // The image stretches over a resize until the targets settle on the new size
+    const RenderTargetSet* targets = CurrentRenderTargets(app);
     GLuint currentAttachment = 0;
-    switch (app->mode)
+    switch (targets ? app->mode : Mode_Count)
     {
     case Mode::Mode_TexturedMesh:
-        currentAttachment = app->forwardRenderAttachmentHandle;
+        currentAttachment = targets->forwardRenderAttachmentHandle;
         break;
     case Mode::Mode_Deferred:
         switch (app->currentFBOAttachmentType)
         {
         case FBOAttachmentType::POSITION:
-        {
-            currentAttachment = app->positionAttachmentHandle;
-        }
-        break;
-
         case FBOAttachmentType::NORMALS:
-        {
-            currentAttachment = app->normalsAttachmentHandle;
-        }
-        break;
-
         case FBOAttachmentType::DIFFUSE:
+        case FBOAttachmentType::METALLIC:
         {
-            currentAttachment = app->diffuseAttachmentHandle;
+            currentAttachment = targets->gbufferDebugAttachmentHandle;
         }
         break;
 
         case FBOAttachmentType::DEPTH:
         {
-            currentAttachment = app->depthAttachmentHandle;
+            currentAttachment = targets->depthAttachmentHandle;
         }
         break;
 
         case FBOAttachmentType::FINAL:
         {
-            currentAttachment = app->finalRenderAttachmentHandle;
+            currentAttachment = targets->finalRenderAttachmentHandle;
         }
         break;
 
@@ -1105,6 +1233,17 @@ void Gui(App* app)
     }
 
     ImGui::Image((ImTextureID)currentAttachment, size, { 0, 1 }, { 1, 0 });
+
+    // A click that did not drag the camera selects the entity under the cursor
+    if (ImGui::IsItemHovered() && ImGui::IsMouseReleased(ImGuiMouseButton_Left) &&
+        ImGui::GetIO().MouseDragMaxDistanceSqr[ImGuiMouseButton_Left] < 4.0f && size.x > 0.0f && size.y > 0.0f)
+    {
+        const ImVec2 imageMin = ImGui::GetItemRectMin();
+        const ImVec2 mouse = ImGui::GetMousePos();
+        const vec2 ndc = vec2((mouse.x - imageMin.x) / size.x * 2.0f - 1.0f, 1.0f - (mouse.y - imageMin.y) / size.y * 2.0f);
+        app->selectedEntity = PickEntity(app, ndc);
+        app->revealSelection = app->selectedEntity >= 0;
+    }
     app->isFocused = ImGui::IsWindowFocused();
     ImGui::End(); // End scene
 
@@ -1115,12 +1254,367 @@ void Gui(App* app)
 
 void Update(App* app)
 {
+    UpdateRenderTargetSize(app);
 
     HandleInput(app);
 
     app->projectionMat = GetProjectionMatrix(app->cam);
     app->viewMat = GetViewMatrix(app->cam);
 
+    UpdateWorldBounds(app);
+}
+
+void FillFramePacket(App* app, FramePacket& packet)
+{
+    packet.mode = app->mode;
+    packet.displaySize = app->renderTargets.size;
+    packet.camera = app->cam;
+    packet.viewMat = app->viewMat;
+    packet.projectionMat = app->projectionMat;
+    packet.sceneProjectionMat = BiasDepthProjection(app->projectionMat, SCENE_DEPTH_BIAS);
+    packet.inverseViewProjection = glm::inverse(packet.sceneProjectionMat * app->viewMat);
+    packet.depthPrePass = app->depthPrePass;
+    // The scene is only copied when something changed since this packet last carried it
+    if (packet.sceneVersion != app->sceneVersion)
+    {
+        packet.entities = app->entities;
+        packet.bounds = app->worldBounds;
+        packet.bvh = app->sceneBvh;
+        packet.sceneVersion = app->sceneVersion;
+    }
+    packet.reloadModelIdx = app->reloadModelIdx;
+    packet.uploadFrameBudget = app->uploadFrameBudget;
+    app->reloadModelIdx = UINT32_MAX;
+    packet.bvhCulling = app->bvhCulling;
+    packet.occlusionCulling = app->occlusionCulling;
+    packet.softwareOcclusionCulling = app->softwareOcclusionCulling;
+    packet.conditionalWater = app->conditionalWater;
+    packet.meshletCulling = app->meshletCulling;
+    packet.meshletConeCulling = app->meshletConeCulling;
+    packet.lodSelection = app->lodSelection;
+    packet.reflectionLodBias = (u32)app->reflectionLodBias;
+    packet.impostors = app->impostors;
+    packet.impostorDistance = app->impostorDistance;
+    packet.lightingMode = app->lightingMode;
+    packet.gbufferView = app->currentFBOAttachmentType;
+    packet.lights = app->lights;
+}
+
+void FillRenderStats(App* app, RenderStats& stats)
+{
+    stats.glIssuedCalls = app->glState.issuedCalls;
+    stats.glSkippedCalls = app->glState.skippedCalls;
+    stats.multiDrawCalls = app->indirect.multiDrawCalls;
+    stats.drawCommands = app->indirect.drawCommands;
+    stats.submittedCommands = app->submittedCommands;
+
+    for (u32 i = 0; i < RENDERPASS_COUNT; ++i)
+    {
+        const RenderQueue& queue = app->renderQueues[i];
+        stats.cullStats[i] = queue.cullStats;
+        stats.clipPlaneStats[i] = queue.clipPlaneStats;
+        stats.clippedCount[i] = queue.clippedCount;
+        stats.softwareOcclusionStats[i] = queue.softwareOcclusionStats;
+        for (u32 lod = 0; lod < LOD_MAX_COUNT; ++lod)
+            stats.lodInstances[i][lod] = queue.lodInstances[lod];
+    }
+    stats.impostorCount = app->renderQueues[RENDERPASS_GBUFFER].impostorCount;
+
+    stats.softwareOccluders = app->softwareOcclusion.occluders;
+    stats.softwareTriangles = (u32)app->softwareOcclusion.triangles.size() / 3;
+    stats.softwareRasterTime = app->softwareOcclusion.rasterTime;
+    stats.occlusionCandidates = app->occlusion.candidates;
+    for (u32 phase = 0; phase < OCCLUSION_PHASE_COUNT; ++phase)
+        stats.occlusionPhaseInstances[phase] = app->occlusion.phaseInstances[phase];
+    stats.meshletsVisible = app->meshlets.visible;
+    stats.meshletsTested = app->meshlets.tested;
+    stats.meshletCount = app->meshlets.meshletCount;
+
+    stats.gbufferSamples = app->gbufferSamples;
+    stats.pooledRenderTargets = app->renderTargets.pooledSets;
+    stats.renderTargetAllocations = app->renderTargets.allocations;
+    stats.waterPassTime = app->water.passTime;
+    stats.waterSavedTime = app->water.savedTime;
+    stats.waterSkippedFrames = app->water.skippedFrames;
+    stats.lightingTime = app->lightingTime;
+    stats.drawnLightVolumes = app->lightVolumes.drawnLights;
+
+    stats.uploadRingUsed = app->uploads.ringUsed;
+    stats.uploadPendingBytes = app->uploads.pendingBytes;
+    stats.uploadedLastFrame = app->uploads.uploadedLastFrame;
+
+    stats.renderTime = app->renderThread.renderTime;
+}
+
+
+// Scene passes recorded by the job system. They only read app state and
+// write to their own queue and command list, never to GL.
+
+void RecordForwardPass(App* app, CommandList& list)
+{
+    const FramePacket& frame = *app->frame;
+    ResetCommandList(list);
+
+    CmdBindFramebuffer(list, GL_FRAMEBUFFER, app->forwardFrameBuffer);
+    CmdClear(list, GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, vec4(0.0f, 0.0f, 0.0f, 1.0f));
+
+    CmdViewport(list, 0, 0, frame.displaySize.x, frame.displaySize.y);
+
+    CmdEnable(list, GL_DEPTH_TEST, true);
+
+    CmdEnable(list, GL_BLEND, true);
+    CmdBlendFunc(list, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    Program& texturedMeshProgram = app->programs[app->texturedMeshProgramIdx];
+    CmdUseProgram(list, texturedMeshProgram.handle);
+    CmdUniform3f(list, app->texturedMeshProgram_uCameraPos, frame.camera.position.x, frame.camera.position.y, frame.camera.position.z);
+    CmdUniformMatrix4(list, app->texturedMeshProgram_uViewProjection, frame.sceneProjectionMat * frame.viewMat);
+
+    CmdBindTexture(list, 1, GL_TEXTURE_CUBE_MAP, app->irradianceMapId);
+    CmdUniform1i(list, app->texturedMeshProgram_uIrradiance, 1);
+    CmdBindTexture(list, 2, GL_TEXTURE_CUBE_MAP, app->cubeMapId);
+    CmdUniform1i(list, app->texturedMeshProgram_uSkybox, 2);
+
+    CmdBindUniformRange(list, BINDING(0), app->uniformBuffer.handle, app->globalParamsOffset, app->globalParamsSize);
+    CmdMeshletView(list, frame.projectionMat * frame.viewMat, frame.camera.position, vec4(0.0f), frame.meshletConeCulling ? MESHLET_CULL_CONES : 0);
+
+    RenderQueue& queue = app->renderQueues[RENDERPASS_FORWARD];
+    CullView(frame, FrustumFromMatrix(frame.projectionMat * frame.viewMat), queue.visible, queue.cullStats);
+    if (frame.softwareOcclusionCulling)
+        TestSoftwareOcclusion(app->softwareOcclusion, frame.bounds, queue.visible, queue.softwareOcclusionStats);
+    SelectLods(app, queue, frame.camera.position, PixelsPerUnit(frame.camera, frame.displaySize.y), 0);
+    ClearRenderQueue(queue, SORTMODE_FRONT_TO_BACK);
+    PushInstanceDraws(app, queue, app->texturedMeshProgramIdx, frame.camera.position, frame.camera.front, frame.camera.farPlane, queue.visible, queue.lods);
+    SortRenderQueue(queue);
+
+    DrawPassParams params = { 0, app->texturedMeshProgram_uTexture };
+    RecordRenderQueue(app, queue, params, list);
+}
+
+// Submeshes wholly on the kept side of the water plane are drawn with
+// clipping off, only the ones crossing it evaluate the clip distance
+void RecordClipPlaneDraws(App* app, RenderQueue& queue, const DrawPassParams& params, const Camera& camera, CommandList& list)
+{
+    const std::vector<u8>* passes[] = { &queue.visible, &queue.clipped };
+    for (u32 i = 0; i < ARRAY_COUNT(passes); ++i)
+    {
+        CmdEnable(list, GL_CLIP_DISTANCE0, i == 1);
+        ClearRenderQueue(queue, SORTMODE_STATE);
+        PushInstanceDraws(app, queue, app->clippedMeshIdx, camera.position, camera.front, camera.farPlane, *passes[i], queue.lods);
+        SortRenderQueue(queue);
+        RecordRenderQueue(app, queue, params, list);
+    }
+}
+
+void RecordWaterReflectionPass(App* app, CommandList& list)
+{
+    const FramePacket& frame = *app->frame;
+    ResetCommandList(list);
+
+    CmdBindFramebuffer(list, GL_FRAMEBUFFER, app->waterReflectionFrameBuffer);
+    GLenum buffers[] = { GL_COLOR_ATTACHMENT4 };
+    CmdDrawBuffers(list, ARRAY_COUNT(buffers), buffers);
+
+    CmdViewport(list, 0, 0, frame.displaySize.x, frame.displaySize.y);
+
+    CmdEnable(list, GL_DEPTH_TEST, true);
+    CmdClear(list, GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, vec4(0.0f, 0.0f, 0.0f, 1.0f));
+
+    Program& clippedMeshProgram = app->programs[app->clippedMeshIdx];
+    CmdUseProgram(list, clippedMeshProgram.handle);
+
+    Camera reflectCamera = frame.camera;
+    reflectCamera.position.y = -reflectCamera.position.y;
+    reflectCamera.pitch = -reflectCamera.pitch;
+    reflectCamera.aspectRatio = frame.displaySize.x / frame.displaySize.y;
+
+    CmdBindUniformRange(list, BINDING(0), app->uniformBuffer.handle, app->globalParamsOffset, app->globalParamsSize);
+    CmdUniform4f(list, app->clippedProgram_uClippingPlane, 0, 1, 0, 0);
+    CmdUniformMatrix4(list, app->clippedProgram_uProj, BiasDepthProjection(GetProjectionMatrix(reflectCamera), SCENE_DEPTH_BIAS));
+    CmdUniformMatrix4(list, app->clippedProgram_uView, GetViewMatrix(reflectCamera));
+
+    CmdBindTexture(list, 5, GL_TEXTURE_CUBE_MAP, app->cubeMapId);
+    CmdUniform1i(list, app->clipperProgram_uSkybox, 5);
+
+    RenderQueue& queue = app->renderQueues[RENDERPASS_WATER_REFLECTION];
+    CullView(frame, FrustumFromMatrix(GetProjectionMatrix(reflectCamera) * GetViewMatrix(reflectCamera)), queue.visible, queue.cullStats);
+    SelectLods(app, queue, reflectCamera.position, PixelsPerUnit(reflectCamera, frame.displaySize.y), frame.reflectionLodBias);
+    queue.clippedCount = CullClipPlane(frame.bounds, vec4(0, 1, 0, 0), queue.visible, queue.clipped, queue.clipPlaneStats);
+
+    // No cones, faces are never culled and the camera under the water sees the backs of open surfaces
+    CmdMeshletView(list, GetProjectionMatrix(reflectCamera) * GetViewMatrix(reflectCamera), reflectCamera.position, vec4(0, 1, 0, 0), MESHLET_CULL_CLIP_PLANE);
+
+    DrawPassParams params = { 4, app->clipperProgram_uTexture };
+    RecordClipPlaneDraws(app, queue, params, reflectCamera, list);
+    CmdBindFramebuffer(list, GL_FRAMEBUFFER, 0);
+}
+
+void RecordWaterRefractionPass(App* app, CommandList& list)
+{
+    const FramePacket& frame = *app->frame;
+    ResetCommandList(list);
+
+    CmdBindFramebuffer(list, GL_FRAMEBUFFER, app->waterRefractionFrameBuffer);
+    GLenum buffers[] = { GL_COLOR_ATTACHMENT5 };
+    CmdDrawBuffers(list, ARRAY_COUNT(buffers), buffers);
+
+    CmdClear(list, GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, vec4(0.0f, 0.0f, 0.0f, 1.0f));
+
+    CmdViewport(list, 0, 0, frame.displaySize.x, frame.displaySize.y);
+
+    CmdEnable(list, GL_DEPTH_TEST, true);
+
+    CmdEnable(list, GL_BLEND, true);
+    CmdBlendFunc(list, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    Program& clippedMeshProgram = app->programs[app->clippedMeshIdx];
+    CmdUseProgram(list, clippedMeshProgram.handle);
+
+    CmdBindUniformRange(list, BINDING(0), app->uniformBuffer.handle, app->globalParamsOffset, app->globalParamsSize);
+
+    CmdUniform4f(list, app->clippedProgram_uClippingPlane, 0, -1, 0, 0);
+    CmdUniformMatrix4(list, app->clippedProgram_uProj, frame.sceneProjectionMat);
+    CmdUniformMatrix4(list, app->clippedProgram_uView, frame.viewMat);
+
+    CmdBindTexture(list, 5, GL_TEXTURE_CUBE_MAP, app->cubeMapId);
+    CmdUniform1i(list, app->clipperProgram_uSkybox, 5);
+
+    RenderQueue& queue = app->renderQueues[RENDERPASS_WATER_REFRACTION];
+    CullView(frame, FrustumFromMatrix(frame.projectionMat * frame.viewMat), queue.visible, queue.cullStats);
+    SelectLods(app, queue, frame.camera.position, PixelsPerUnit(frame.camera, frame.displaySize.y), 0);
+    queue.clippedCount = CullClipPlane(frame.bounds, vec4(0, -1, 0, 0), queue.visible, queue.clipped, queue.clipPlaneStats);
+    CmdMeshletView(list, frame.projectionMat * frame.viewMat, frame.camera.position, vec4(0, -1, 0, 0), MESHLET_CULL_CLIP_PLANE | (frame.meshletConeCulling ? MESHLET_CULL_CONES : 0));
+
+    DrawPassParams params = { 4, app->clipperProgram_uTexture };
+    RecordClipPlaneDraws(app, queue, params, frame.camera, list);
+    CmdBindFramebuffer(list, GL_FRAMEBUFFER, 0);
+}
+
+void RecordGeometryPass(App* app, CommandList& list)
+{
+    const FramePacket& frame = *app->frame;
+    ResetCommandList(list);
+
+    CmdBindFramebuffer(list, GL_FRAMEBUFFER, app->gBuffer);
+
+    CmdClear(list, GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, vec4(0.0f, 0.0f, 0.0f, 1.0f));
+
+    GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    CmdDrawBuffers(list, ARRAY_COUNT(buffers), buffers);
+
+    CmdViewport(list, 0, 0, frame.displaySize.x, frame.displaySize.y);
+
+    CmdEnable(list, GL_DEPTH_TEST, true);
+    CmdEnable(list, GL_CLIP_DISTANCE0, false);
+
+    // The albedo alpha holds the metallic factor, nothing is blended
+    CmdEnable(list, GL_BLEND, false);
+
+    CmdDepthMask(list, true);
+
+    const glm::mat4 viewProjection = frame.sceneProjectionMat * frame.viewMat;
+
+    // Culled once, the pre-pass and the G-buffer draw the same submeshes
+    RenderQueue& queue = app->renderQueues[RENDERPASS_GBUFFER];
+    CullView(frame, FrustumFromMatrix(frame.projectionMat * frame.viewMat), queue.visible, queue.cullStats);
+    if (frame.softwareOcclusionCulling)
+        TestSoftwareOcclusion(app->softwareOcclusion, frame.bounds, queue.visible, queue.softwareOcclusionStats);
+    SelectLods(app, queue, frame.camera.position, PixelsPerUnit(frame.camera, frame.displaySize.y), 0);
+
+    // Distant instances leave the queue before the pre-pass sees them
+    if (frame.impostors)
+    {
+        CollectImpostors(app, queue, frame.camera.position);
+    }
+    else
+    {
+        queue.impostors.clear();
+        queue.impostorCount = 0;
+    }
+
+    // Frustum survivors are then left to the GPU, phase 1 only draws what
+    // passed the occlusion test last frame
+    list.occlusionCulled = frame.occlusionCulling;
+    CmdMeshletView(list, frame.projectionMat * frame.viewMat, frame.camera.position, vec4(0.0f), frame.meshletConeCulling ? MESHLET_CULL_CONES : 0);
+    const u32 firstPhase = list.occlusionCulled ? 1 : 0;
+    if (list.occlusionCulled)
+        CmdOcclusionCull(list, 1);
+
+    // Depth only first, so the G-buffer shader runs once per visible pixel
+    if (frame.depthPrePass)
+    {
+        GLenum noBuffers[] = { GL_NONE };
+        CmdDrawBuffers(list, ARRAY_COUNT(noBuffers), noBuffers);
+        CmdDepthFunc(list, GL_LESS);
+
+        Program& depthPrePassProgram = app->programs[app->depthPrePassProgramIdx];
+        CmdUseProgram(list, depthPrePassProgram.handle);
+        CmdUniformMatrix4(list, app->depthPrePassProgram_uViewProjection, viewProjection);
+
+        RenderQueue& depthQueue = app->renderQueues[RENDERPASS_DEPTH_PREPASS];
+        ClearRenderQueue(depthQueue, SORTMODE_FRONT_TO_BACK);
+        PushInstanceDepthDraws(app, depthQueue, app->depthPrePassProgramIdx, frame.camera.position, frame.camera.front, frame.camera.farPlane, queue.visible, queue.lods);
+        SortRenderQueue(depthQueue);
+
+        DrawPassParams depthParams = { 0, -1 };
+        const u32 firstDepthCommand = RecordRenderQueueCommands(app, depthQueue, list);
+        RecordRenderQueueDraws(app, depthQueue, depthParams, firstDepthCommand, firstPhase, list);
+
+        CmdDrawBuffers(list, ARRAY_COUNT(buffers), buffers);
+        CmdDepthFunc(list, GL_EQUAL);
+        CmdDepthMask(list, false);
+    }
+
+    Program& deferredGeometryPassProgram = app->programs[app->deferredGeometryPassProgramIdx];
+    CmdUseProgram(list, deferredGeometryPassProgram.handle);
+    CmdUniform3f(list, app->deferredGeometryProgram_uCameraPos, frame.camera.position.x, frame.camera.position.y, frame.camera.position.z);
+    CmdUniformMatrix4(list, app->deferredGeometryProgram_uViewProjection, viewProjection);
+
+    CmdBindTexture(list, 1, GL_TEXTURE_CUBE_MAP, app->irradianceMapId);
+    CmdUniform1i(list, app->deferredGeometryProgram_uIrradiance, 1);
+    CmdBindTexture(list, 2, GL_TEXTURE_CUBE_MAP, app->cubeMapId);
+    CmdUniform1i(list, app->deferredGeometryProgram_uSkybox, 2);
+
+    ClearRenderQueue(queue, SORTMODE_FRONT_TO_BACK);
+    PushInstanceDraws(app, queue, app->deferredGeometryPassProgramIdx, frame.camera.position, frame.camera.front, frame.camera.farPlane, queue.visible, queue.lods);
+    SortRenderQueue(queue);
+
+    DrawPassParams params = { 0, app->deferredGeometryProgram_uTexture };
+    const u32 firstCommand = RecordRenderQueueCommands(app, queue, list);
+    const GLuint sampleQuery = app->gbufferSampleQueries[frame.frameIndex % GBUFFER_SAMPLE_QUERY_COUNT];
+    CmdBeginQuery(list, GL_SAMPLES_PASSED, sampleQuery);
+    RecordRenderQueueDraws(app, queue, params, firstCommand, firstPhase, list);
+
+    // Newly visible submeshes have no pre-pass depth, they depth test as usual
+    if (list.occlusionCulled)
+    {
+        CmdOcclusionCull(list, 2);
+        CmdDepthFunc(list, GL_LESS);
+        CmdDepthMask(list, true);
+        RecordRenderQueueDraws(app, queue, params, firstCommand, 2, list);
+    }
+
+    // Impostors have no pre-pass depth either
+    if (!queue.impostors.empty())
+    {
+        CmdDepthFunc(list, GL_LESS);
+        CmdDepthMask(list, true);
+        RecordImpostors(app, queue, viewProjection, frame.camera.position, list);
+    }
+    CmdEndQuery(list, GL_SAMPLES_PASSED);
+
+    if (frame.depthPrePass)
+    {
+        CmdDepthFunc(list, GL_LESS);
+        CmdDepthMask(list, true);
+    }
+}
+
+// GL side of the frame update, fed from the packet being rendered
+void UpdateFrameData(App* app)
+{
+    const FramePacket& frame = *app->frame;
+
     // Shader hot-reload
     for (u64 i = 0; i < app->programs.size(); ++i)
     {
@@ -1128,10 +1622,12 @@ void Update(App* app)
         u64 currentTimestamp = GetFileLastWriteTimestamp(program.filepath.c_str());
         if (currentTimestamp > program.lastWriteTimestamp)
         {
+            ForgetProgramUniforms(app->glState, program.handle);
             glDeleteProgram(program.handle);
             String programSource = ReadTextFile(program.filepath.c_str());
             const char* programName = program.programName.c_str();
-            program.handle = CreateProgramFromSource(programSource, programName);
+            program.handle = program.compute ? CreateComputeProgramFromSource(programSource, programName)
+                                             : CreateProgramFromSource(programSource, programName);
             program.lastWriteTimestamp = currentTimestamp;
         }
     }
@@ -1144,14 +1640,14 @@ void Update(App* app)
     // Global parameters
     app->globalParamsOffset = app->uniformBuffer.head;
 
-    PushVec3(app->uniformBuffer, app->cam.position);
-    PushUInt(app->uniformBuffer, app->lights.size());
+    PushVec3(app->uniformBuffer, frame.camera.position);
+    PushUInt(app->uniformBuffer, frame.lights.size());
 
-    for (u32 i = 0; i < app->lights.size(); ++i)
+    for (u32 i = 0; i < frame.lights.size(); ++i)
     {
         AlignHead(app->uniformBuffer, sizeof(vec4));
 
-        Light& light = app->lights[i];
+        const Light& light = frame.lights[i];
         PushUInt(app->uniformBuffer, light.type);
         PushVec3(app->uniformBuffer, light.color);
         PushVec3(app->uniformBuffer, light.direction);
@@ -1162,448 +1658,326 @@ void Update(App* app)
 
     app->globalParamsSize = app->uniformBuffer.head - app->globalParamsOffset;
 
-    // Local parameters
-    for (u32 i = 0; i < app->entities.size(); ++i)
-    {
-        AlignHead(app->uniformBuffer, app->uniformBlockAlignment);
-
-        Entity& ref = app->entities[i];
-
-        glm::mat4 world = MatrixFromPositionRotationScale(ref.position, ref.rotation, ref.scale);
-        glm::mat4 worldViewProjectionMatrix = app->projectionMat * app->viewMat * world;
-
-        ref.localParamsOffset = app->uniformBuffer.head;
-
-        PushMat4(app->uniformBuffer, world);
-        PushMat4(app->uniformBuffer, worldViewProjectionMatrix);
-        PushFloat(app->uniformBuffer, ref.metallic);
-        ref.localParamsSize = app->uniformBuffer.head - ref.localParamsOffset;
-    }
-
     // Unmap buffer
     glUnmapBuffer(GL_UNIFORM_BUFFER);
     glBindBuffer(GL_UNIFORM_BUFFER, 0);
-}
 
+    // Per instance, per material and per light parameters
+    BuildInstanceGroups(app);
+    UpdateMaterialBuffer(app);
+    UpdateLightBuffer(app);
+}
 
 void Render(App* app)
 {
+    const FramePacket& frame = *app->frame;
+
+    // Before the uploads, so the reloaded geometry lands this frame
+    app->uploads.frameBudget = frame.uploadFrameBudget;
+    if (frame.reloadModelIdx != UINT32_MAX)
+        ReloadModelGeometry(app, frame.reloadModelIdx);
+
+    ProcessUploads(app);
+    UpdateFrameData(app);
+    AcquireRenderTargets(app);
+
+    // Anything may have changed GL bindings since the last frame (uploads, ImGui)
+    InvalidateGLState(app->glState);
+    app->glState.issuedCalls = 0;
+    app->glState.skippedCalls = 0;
+    app->submittedCommands = 0;
+
+    BeginIndirectFrame(app->indirect);
+    BeginMeshletFrame(app);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, STORAGE_BINDING_TRANSFORMS, app->instanceBuffer.handle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, STORAGE_BINDING_MATERIALS, app->materialBuffer.handle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, STORAGE_BINDING_IMPOSTORS, app->impostorAtlas.sphereBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, STORAGE_BINDING_LIGHTS, app->lightBuffer.handle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, STORAGE_BINDING_CLUSTERS, app->lightClusters.buffer);
+
+    // Before any pass that shades with the clustered lights
+    BuildLightClusters(app);
+
     glClearColor(0.f, 0.f, 0.f, 1.0f);
-    switch (app->mode)
+    switch (frame.mode)
     {
         case Mode_TexturedQuad:
             {
                 glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-                glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+                glViewport(0, 0, frame.displaySize.x, frame.displaySize.y);
 
-                glEnable(GL_DEPTH_TEST);
+                StateEnable(app->glState, GL_DEPTH_TEST, true);
 
                 Program& programTexturedGeometry = app->programs[app->texturedGeometryProgramIdx];
-                glUseProgram(programTexturedGeometry.handle);
-                glBindVertexArray(app->vao);
+                StateUseProgram(app->glState, programTexturedGeometry.handle);
+                StateBindVertexArray(app->glState, app->vao);
 
-                glEnable(GL_BLEND);
-                glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+                StateEnable(app->glState, GL_BLEND, true);
+                StateBlendFunc(app->glState, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-                glUniform1i(app->programUniformTexture, 0);
-                glActiveTexture(GL_TEXTURE0);
+                StateUniform1i(app->glState, app->programUniformTexture, 0);
                 GLuint textureHandle = app->textures[app->diceTexIdx].handle;
-                glBindTexture(GL_TEXTURE_2D, textureHandle);
+                StateBindTexture(app->glState, 0, GL_TEXTURE_2D, textureHandle);
 
                 glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-
-                glBindVertexArray(0);
-                glUseProgram(0);
             }
             break;
         case Mode_TexturedMesh:
             {
-            glBindFramebuffer(GL_FRAMEBUFFER, app->forwardFrameBuffer);
-            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-                glViewport(0, 0, app->displaySize.x, app->displaySize.y);
-
-                glEnable(GL_DEPTH_TEST);
-
-                glEnable(GL_BLEND);
-                glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-                Program& texturedMeshProgram = app->programs[app->texturedMeshProgramIdx];
-                glUseProgram(texturedMeshProgram.handle);
-                GLuint cp = glGetUniformLocation(texturedMeshProgram.handle, "cameraPos");
-
-                glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->uniformBuffer.handle, app->globalParamsOffset, app->globalParamsSize);
-
-                for (u32 it = 0; it < app->entities.size(); ++it)
-                {
-                    Entity& ref = app->entities[it];
-                    Model& model = app->models[ref.modelIdx];
-                    Mesh& mesh = app->meshes[model.meshIdx];
-
-                    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->uniformBuffer.handle, ref.localParamsOffset, ref.localParamsSize);
+            CommandList& forwardList = app->commandLists[RENDERPASS_FORWARD];
+            if (frame.softwareOcclusionCulling)
+                UpdateSoftwareOcclusion(app);
 
-                    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-                    {
-                        GLuint vao = FindVAO(mesh, i, texturedMeshProgram);
-                        glBindVertexArray(vao);
-
-                        u32 submeshMaterialIdx = model.materialIdx[i];
-                        Material& submeshMaterial = app->materials[submeshMaterialIdx];
-                        bool hasTex = submeshMaterial.albedoTextureIdx < UINT32_MAX && submeshMaterial.albedoTextureIdx != 0 ? true : false;
-
-                        glActiveTexture(GL_TEXTURE0);
-                        glBindTexture(GL_TEXTURE_2D, app->textures[hasTex ? submeshMaterial.albedoTextureIdx : app->whiteTexIdx].handle);
-                        glUniform1i(app->texturedMeshProgram_uTexture, 0);
-                        glUniform3f(app->texturedMeshProgram_uColor, (hasTex) ? 1.0F : submeshMaterial.albedo.r, (hasTex) ? 1.0F : submeshMaterial.albedo.g, (hasTex) ? 1.0F : submeshMaterial.albedo.b);
-                        glUniform3f(cp, app->cam.position.x, app->cam.position.y, app->cam.position.z);
-
-                        glActiveTexture(GL_TEXTURE1);
-                        glBindTexture(GL_TEXTURE_CUBE_MAP, app->irradianceMapId);
-                        glUniform1i(app->deferredGeometryProgram_uIrradiance, 1);
-                        glActiveTexture(GL_TEXTURE2);
-                        glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMapId);
-                        glUniform1i(app->deferredGeometryProgram_uSkybox, 2);
+            JobCounter recorded(0);
+            RunJob(app->jobs, recorded, [app, &forwardList] { RecordForwardPass(app, forwardList); });
+            WaitForJobs(app->jobs, recorded);
 
-                        Submesh& submesh = mesh.submeshes[i];
-                        glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
-                    }
-                }
-                 glUseProgram(0);
+            SubmitCommandList(app, forwardList);
 
-            glDepthMask(GL_FALSE);
+            StateDepthMask(app->glState, false);
 
             Program& skyBoxProgram = app->programs[app->skyBox];
-            glUseProgram(skyBoxProgram.handle);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMapId);
-            glUniform1i(app->deferredGeometryProgram_uSkybox, 0);
+            StateUseProgram(app->glState, skyBoxProgram.handle);
+            StateBindTexture(app->glState, 0, GL_TEXTURE_CUBE_MAP, app->cubeMapId);
+            StateUniform1i(app->glState, app->deferredGeometryProgram_uSkybox, 0);
 
-            glDepthFunc(GL_LEQUAL); 
+            StateDepthFunc(app->glState, GL_LEQUAL);
 
 
             i32 projLoc = glGetUniformLocation(skyBoxProgram.handle, "projection");
             i32 viewLoc = glGetUniformLocation(skyBoxProgram.handle, "view");
 
-            glUniformMatrix4fv(projLoc, 1, GL_FALSE, &app->projectionMat[0][0]);
-            glUniformMatrix4fv(viewLoc, 1, GL_FALSE, &app->viewMat[0][0]);
+            StateUniformMatrix4fv(app->glState, projLoc, &frame.projectionMat[0][0]);
+            StateUniformMatrix4fv(app->glState, viewLoc, &frame.viewMat[0][0]);
 
           //  glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMapId);
             //    glBindTexture(GL_TEXTURE_CUBE_MAP, app->irradianceMapId);
             RenderSkybox(app);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-            glUseProgram(0);
-            glDepthMask(GL_TRUE);
+            StateDepthMask(app->glState, true);
 
             glBindFramebuffer(GL_FRAMEBUFFER, 0);
-                RenderQuad(app);
-                glUseProgram(0);
-                glBindFramebuffer(GL_FRAMEBUFFER, 0);
             }
             break;
         case Mode_Deferred:
             {
 
-            /* Water reflection */
-
-            glBindFramebuffer(GL_FRAMEBUFFER, app->waterReflectionFrameBuffer);
-            GLenum buffers[] = { GL_COLOR_ATTACHMENT4 };
-            glDrawBuffers(ARRAY_COUNT(buffers), buffers);
-
-
-            glViewport(0, 0, app->displaySize.x, app->displaySize.y);
-
-            glEnable(GL_DEPTH_TEST);
-           // glEnable(GL_BLEND);
-            //glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-            glEnable(GL_CLIP_DISTANCE0);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+            // The three scene passes are culled, sorted and recorded in parallel,
+            // then replayed in their original order
+            CommandList& reflectionList = app->commandLists[RENDERPASS_WATER_REFLECTION];
+            CommandList& refractionList = app->commandLists[RENDERPASS_WATER_REFRACTION];
+            CommandList& gbufferList = app->commandLists[RENDERPASS_GBUFFER];
 
-            Program& clippedMeshProgram = app->programs[app->clippedMeshIdx];
-            glUseProgram(clippedMeshProgram.handle);
-
-            Camera reflectCamera = app->cam;
-            reflectCamera.position.y = -reflectCamera.position.y;
-            reflectCamera.pitch = -reflectCamera.pitch;
-            reflectCamera.aspectRatio = app->displaySize.x / app->displaySize.y;
-
-            glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->uniformBuffer.handle, app->globalParamsOffset, app->globalParamsSize);
-            glUniform4i(app->clippedProgram_uClippingPlane, 0, 1, 0, 0);
-            for (int i = 0; i < app->entities.size(); ++i)
+            // Samples of the G-buffer pass issued with this query slot a few frames ago
+            const u32 querySlot = frame.frameIndex % GBUFFER_SAMPLE_QUERY_COUNT;
+            if (app->gbufferSampleQueryIssued[querySlot])
             {
-                Entity& e = app->entities[i];
-                Model& model = app->models[e.modelIdx];
-                Mesh& mesh = app->meshes[model.meshIdx];
-
-                glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->uniformBuffer.handle, e.localParamsOffset, e.localParamsSize);
-
-                glUniformMatrix4fv(app->clippedProgram_uProj, 1, GL_FALSE, &GetProjectionMatrix(reflectCamera)[0][0]);
-                glUniformMatrix4fv(app->clippedProgram_uView, 1, GL_FALSE, &GetViewMatrix(reflectCamera)[0][0]);
-                glUniformMatrix4fv(app->clippedProgram_uModel, 1, GL_FALSE, &MatrixFromPositionRotationScale(e.position, e.rotation, e.scale)[0][0]);
-                
-                for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+                GLuint available = GL_FALSE;
+                glGetQueryObjectuiv(app->gbufferSampleQueries[querySlot], GL_QUERY_RESULT_AVAILABLE, &available);
+                if (available)
                 {
-                    GLuint vao = FindVAO(mesh, i, clippedMeshProgram);
-                    glBindVertexArray(vao);
-
-                    u32 subMatIdx = model.materialIdx[i];
-                    Material& submesh_material = app->materials[subMatIdx];
-                    bool hasTex = submesh_material.albedoTextureIdx < UINT32_MAX&& submesh_material.albedoTextureIdx != 0 ? true : false;
-
-                    glActiveTexture(GL_TEXTURE4);
-                    glBindTexture(GL_TEXTURE_2D, app->textures[(hasTex) ? submesh_material.albedoTextureIdx : app->whiteTexIdx].handle);
-                    glUniform1i(app->clipperProgram_uTexture, 4);
-                    glActiveTexture(GL_TEXTURE5);
-                    glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMapId);
-                    glUniform1i(app->clipperProgram_uSkybox, 5);
-
-                    glUniform3f(app->clipperProgram_uColor, (hasTex) ? 1.0F : submesh_material.albedo.r, (hasTex) ? 1.0F : submesh_material.albedo.g, (hasTex) ? 1.0F : submesh_material.albedo.b);
-
-                    Submesh& submesh = mesh.submeshes[i];
-                    glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
-
-                    glBindVertexArray(0);
+                    GLuint64 samples = 0;
+                    glGetQueryObjectui64v(app->gbufferSampleQueries[querySlot], GL_QUERY_RESULT, &samples);
+                    app->gbufferSamples = samples;
                 }
-            }
-            glUseProgram(0);
-            glDisable(GL_CLIP_DISTANCE0);
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-            /* Water refraction */
-            glBindFramebuffer(GL_FRAMEBUFFER, app->waterRefractionFrameBuffer);
-            GLenum wbuffers[] = { GL_COLOR_ATTACHMENT5 };
-            glDrawBuffers(ARRAY_COUNT(wbuffers), wbuffers);
-
-            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-            glViewport(0, 0, app->displaySize.x, app->displaySize.y);
-
-            glEnable(GL_DEPTH_TEST);
-
-            glEnable(GL_BLEND);
-            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-            glEnable(GL_CLIP_DISTANCE0);
-
-            glUseProgram(clippedMeshProgram.handle);
-
-            glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->uniformBuffer.handle, app->globalParamsOffset, app->globalParamsSize);
-
-            glUniform4i(app->clippedProgram_uClippingPlane, 0, -1, 0, 0);
-
-            for (int i = 0; i < app->entities.size(); ++i)
-            {
-                Entity& e = app->entities[i];
-                Model& model = app->models[e.modelIdx];
-                Mesh& mesh = app->meshes[model.meshIdx];
-
-                glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->uniformBuffer.handle, e.localParamsOffset, e.localParamsSize);
-
-                glUniformMatrix4fv(app->clippedProgram_uProj, 1, GL_FALSE, &GetProjectionMatrix(app->cam)[0][0]);
-                glUniformMatrix4fv(app->clippedProgram_uView, 1, GL_FALSE, &GetViewMatrix(app->cam)[0][0]);
-                glUniformMatrix4fv(app->clippedProgram_uModel, 1, GL_FALSE, &MatrixFromPositionRotationScale(e.position, e.rotation, e.scale)[0][0]);
-
-                for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+                // The lighting timestamps of a slot are issued in the same frames as its samples query
+                glGetQueryObjectuiv(app->lightingTimestamps[querySlot][1], GL_QUERY_RESULT_AVAILABLE, &available);
+                if (available)
                 {
-                    GLuint vao = FindVAO(mesh, i, clippedMeshProgram);
-                    glBindVertexArray(vao);
-
-                    u32 subMatIdx = model.materialIdx[i];
-                    Material& submesh_material = app->materials[subMatIdx];
-                    bool hasTex = submesh_material.albedoTextureIdx < UINT32_MAX&& submesh_material.albedoTextureIdx != 0 ? true : false;
-
-                    glActiveTexture(GL_TEXTURE4);
-                    glBindTexture(GL_TEXTURE_2D, app->textures[(hasTex) ? submesh_material.albedoTextureIdx : app->whiteTexIdx].handle);
-                    glUniform1i(app->clipperProgram_uTexture, 4);
-                    glActiveTexture(GL_TEXTURE5);
-                    glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMapId);
-                    glUniform1i(app->clipperProgram_uSkybox, 5);
-
-                    glUniform3f(app->clipperProgram_uColor, (hasTex) ? 1.0F : submesh_material.albedo.r, (hasTex) ? 1.0F : submesh_material.albedo.g, (hasTex) ? 1.0F : submesh_material.albedo.b);
-
-                    Submesh& submesh = mesh.submeshes[i];
-                    glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
-
-                    glBindVertexArray(0);
+                    GLuint64 begin = 0, end = 0;
+                    glGetQueryObjectui64v(app->lightingTimestamps[querySlot][0], GL_QUERY_RESULT, &begin);
+                    glGetQueryObjectui64v(app->lightingTimestamps[querySlot][1], GL_QUERY_RESULT, &end);
+                    app->lightingTime = (end - begin) / 1000000.0f;
                 }
             }
-            glUseProgram(0);
-            glDisable(GL_CLIP_DISTANCE0);
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-            /* First pass (geometry) */
-
-            glBindFramebuffer(GL_FRAMEBUFFER, app->gBuffer);
-
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            app->gbufferSampleQueryIssued[querySlot] = true;
+            ReadOcclusionStats(app->occlusion, frame.frameIndex);
 
-            GLenum drawBuffersGBuffer[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
-            glDrawBuffers(ARRAY_COUNT(drawBuffersGBuffer), drawBuffersGBuffer);
+            // The CPU depth buffer is done before any pass that tests against it is recorded
+            if (frame.softwareOcclusionCulling)
+                UpdateSoftwareOcclusion(app);
 
-            glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+            // Water passes are neither recorded nor submitted with the surface out of
+            // view, and the GPU drops them when the scene hid it last frame
+            const bool waterPasses = UpdateWaterVisibility(app);
 
-            glEnable(GL_DEPTH_TEST);
-
-            glEnable(GL_BLEND);
-            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-            glDepthMask(GL_TRUE);
-
-            Program& deferredGeometryPassProgram = app->programs[app->deferredGeometryPassProgramIdx];
-            glUseProgram(deferredGeometryPassProgram.handle);
-            GLuint cp = glGetUniformLocation(deferredGeometryPassProgram.handle, "cameraPos");
-            for (const Entity& entity : app->entities)
+            JobCounter recorded(0);
+            if (waterPasses)
             {
-                Model& model = app->models[entity.modelIdx];
-                Mesh& mesh = app->meshes[model.meshIdx];
-
-                glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->uniformBuffer.handle, entity.localParamsOffset, entity.localParamsSize);
+                RunJob(app->jobs, recorded, [app, &reflectionList] { RecordWaterReflectionPass(app, reflectionList); });
+                RunJob(app->jobs, recorded, [app, &refractionList] { RecordWaterRefractionPass(app, refractionList); });
+            }
+            RunJob(app->jobs, recorded, [app, &gbufferList] { RecordGeometryPass(app, gbufferList); });
+            WaitForJobs(app->jobs, recorded);
 
-                for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-                {
-                    GLuint vao = FindVAO(mesh, i, deferredGeometryPassProgram);
-                    glBindVertexArray(vao);
-
-                    u32 submesh_material_index = model.materialIdx[i];
-                    Material& submesh_material = app->materials[submesh_material_index];
-                    bool hasTex = submesh_material.albedoTextureIdx < UINT32_MAX && submesh_material.albedoTextureIdx != 0 ? true : false;
-
-                    glActiveTexture(GL_TEXTURE0);
-                    glBindTexture(GL_TEXTURE_2D, app->textures[(hasTex) ? submesh_material.albedoTextureIdx : app->whiteTexIdx].handle);
-                    glUniform1i(app->deferredGeometryProgram_uTexture, 0);
-                    glActiveTexture(GL_TEXTURE1);
-                    glBindTexture(GL_TEXTURE_CUBE_MAP, app->irradianceMapId);
-                    glUniform1i(app->deferredGeometryProgram_uIrradiance, 1);
-                    glActiveTexture(GL_TEXTURE2);
-                    glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMapId);
-                    glUniform1i(app->deferredGeometryProgram_uSkybox, 2);
-
-                    glUniform3f(app->deferredGeometryProgram_uColor, (hasTex) ? 1.0F : submesh_material.albedo.r, (hasTex) ? 1.0F : submesh_material.albedo.g, (hasTex) ? 1.0F : submesh_material.albedo.b);
-                    glUniform3f(cp, app->cam.position.x, app->cam.position.y, app->cam.position.z);
-
-                    Submesh& submesh = mesh.submeshes[i];
-                    glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
-
-                    glBindVertexArray(0);
-                }
+            if (waterPasses)
+            {
+                BeginWaterPasses(app, 0);
+                SubmitCommandList(app, reflectionList);
+                SubmitCommandList(app, refractionList);
+                EndWaterPasses(app, 0);
             }
-            glUseProgram(0);
+            SubmitCommandList(app, gbufferList);
 
-            glDepthMask(GL_FALSE);
+            StateDepthMask(app->glState, false);
 
             Program& skyBoxProgram = app->programs[app->skyBox];
-            glUseProgram(skyBoxProgram.handle);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMapId);
-            glUniform1i(app->deferredGeometryProgram_uSkybox, 0);
+            StateUseProgram(app->glState, skyBoxProgram.handle);
+            StateBindTexture(app->glState, 0, GL_TEXTURE_CUBE_MAP, app->cubeMapId);
+            StateUniform1i(app->glState, app->deferredGeometryProgram_uSkybox, 0);
 
-            glDepthFunc(GL_LEQUAL); 
+            StateDepthFunc(app->glState, GL_LEQUAL);
 
 
             i32 projLoc = glGetUniformLocation(skyBoxProgram.handle, "projection");
             i32 viewLoc = glGetUniformLocation(skyBoxProgram.handle, "view");
 
-            glUniformMatrix4fv(projLoc, 1, GL_FALSE, &app->projectionMat[0][0]);
-            glUniformMatrix4fv(viewLoc, 1, GL_FALSE, &app->viewMat[0][0]);
+            StateUniformMatrix4fv(app->glState, projLoc, &frame.projectionMat[0][0]);
+            StateUniformMatrix4fv(app->glState, viewLoc, &frame.viewMat[0][0]);
+
+            // The sky colour goes to the albedo only, its pixels keep the cleared normals,
+            // metallic and depth and the lighting passes them through unlit
+            GLenum drawBuffersSkybox[] = { GL_COLOR_ATTACHMENT1 };
+            glDrawBuffers(ARRAY_COUNT(drawBuffersSkybox), drawBuffersSkybox);
+            glColorMaski(0, GL_TRUE, GL_TRUE, GL_TRUE, GL_FALSE);
             RenderSkybox(app);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-            glUseProgram(0);
-            glDepthMask(GL_TRUE);
-            glEnable(GL_DEPTH_TEST);
+            glColorMaski(0, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            StateDepthMask(app->glState, true);
+            StateEnable(app->glState, GL_DEPTH_TEST, true);
             glBindFramebuffer(GL_FRAMEBUFFER, 0);
             //glEnable(GL_BLEND);
             //glBlendFunc(GL_ONE, GL_ONE);
-            glBindFramebuffer(GL_FRAMEBUFFER, app->gBuffer);
-            Program& waterEffectProgram = app->programs[app->waterEffectProgramIdx];
-            glUseProgram(waterEffectProgram.handle);
-            GLenum drawwBuffersGBuffer[] = {GL_COLOR_ATTACHMENT2 };
-            glDrawBuffers(ARRAY_COUNT(drawwBuffersGBuffer), drawwBuffersGBuffer);
-
-            glUniformMatrix4fv(app->waterEffectProgram_uProj, 1, GL_FALSE, &app->projectionMat[0][0]);
-            glUniformMatrix4fv(app->waterEffectProgram_uView, 1, GL_FALSE, &app->viewMat[0][0]);
-            glUniform2f(app->waterEffectProgram_uViewportSize, app->displaySize.x, app->displaySize.y);
-            glUniformMatrix4fv(app->waterEffectProgram_uViewMatInv, 1, GL_FALSE, &glm::inverse(app->viewMat)[0][0]);
-            glUniformMatrix4fv(app->waterEffectProgram_uProjMatInv, 1, GL_FALSE, &glm::inverse(app->projectionMat)[0][0]);
-
-            glActiveTexture(GL_TEXTURE6);
-            glBindTexture(GL_TEXTURE_2D, app->waterReflectionAttachmentHandle);
-            glUniform1i(app->waterEffectProgram_uReflectionMap, 6);
-            glActiveTexture(GL_TEXTURE7);
-            glBindTexture(GL_TEXTURE_2D, app->waterReflectionDepthAttachmentHandle);
-            glUniform1i(app->waterEffectProgram_uReflectionDepth, 7);
-            glActiveTexture(GL_TEXTURE8);
-            glBindTexture(GL_TEXTURE_2D, app->waterRefractionAttachmentHandle);
-            glUniform1i(app->waterEffectProgram_uRefractionMap, 8);
-            glActiveTexture(GL_TEXTURE9);
-            glBindTexture(GL_TEXTURE_2D, app->waterRefractionDepthAttachmentHandle);
-            glUniform1i(app->waterEffectProgram_uRefractionDepth, 9);
-
-            glActiveTexture(GL_TEXTURE10);
-            glBindTexture(GL_TEXTURE_2D, app->waterNormalMapIdx);
-            glUniform1i(app->waterEffectProgram_uNormalMap, 10);
-            glActiveTexture(GL_TEXTURE11);
-            glBindTexture(GL_TEXTURE_2D, app->waterDudvMapIdx);
-            glUniform1i(app->waterEffectProgram_uDudvMap, 11);
-            glActiveTexture(GL_TEXTURE12);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMapId);
-            glUniform1i(app->waterEffectProgram_uSkybox, 12);
+            if (waterPasses)
             {
-                Model& model = app->models[app->planeModelIdx];
-                Mesh& mesh = app->meshes[model.meshIdx];
-
-                for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+                glBindFramebuffer(GL_FRAMEBUFFER, app->gBuffer);
+                QueryWaterSurface(app);
+
+                Program& waterEffectProgram = app->programs[app->waterEffectProgramIdx];
+                StateUseProgram(app->glState, waterEffectProgram.handle);
+                GLenum drawwBuffersGBuffer[] = {GL_COLOR_ATTACHMENT1 };
+                glDrawBuffers(ARRAY_COUNT(drawwBuffersGBuffer), drawwBuffersGBuffer);
+                // The water writes its colour over the albedo, the metallic below is kept
+                glColorMaski(0, GL_TRUE, GL_TRUE, GL_TRUE, GL_FALSE);
+
+                StateUniformMatrix4fv(app->glState, app->waterEffectProgram_uProj, &frame.sceneProjectionMat[0][0]);
+                StateUniformMatrix4fv(app->glState, app->waterEffectProgram_uView, &frame.viewMat[0][0]);
+                StateUniform2f(app->glState, app->waterEffectProgram_uViewportSize, frame.displaySize.x, frame.displaySize.y);
+                StateUniformMatrix4fv(app->glState, app->waterEffectProgram_uViewMatInv, &glm::inverse(frame.viewMat)[0][0]);
+                StateUniformMatrix4fv(app->glState, app->waterEffectProgram_uProjMatInv, &glm::inverse(frame.projectionMat)[0][0]);
+
+                StateBindTexture(app->glState, 6, GL_TEXTURE_2D, app->waterReflectionAttachmentHandle);
+                StateUniform1i(app->glState, app->waterEffectProgram_uReflectionMap, 6);
+                StateBindTexture(app->glState, 7, GL_TEXTURE_2D, app->waterReflectionDepthAttachmentHandle);
+                StateUniform1i(app->glState, app->waterEffectProgram_uReflectionDepth, 7);
+                StateBindTexture(app->glState, 8, GL_TEXTURE_2D, app->waterRefractionAttachmentHandle);
+                StateUniform1i(app->glState, app->waterEffectProgram_uRefractionMap, 8);
+                StateBindTexture(app->glState, 9, GL_TEXTURE_2D, app->waterRefractionDepthAttachmentHandle);
+                StateUniform1i(app->glState, app->waterEffectProgram_uRefractionDepth, 9);
+
+                StateBindTexture(app->glState, 10, GL_TEXTURE_2D, app->waterNormalMapIdx);
+                StateUniform1i(app->glState, app->waterEffectProgram_uNormalMap, 10);
+                StateBindTexture(app->glState, 11, GL_TEXTURE_2D, app->waterDudvMapIdx);
+                StateUniform1i(app->glState, app->waterEffectProgram_uDudvMap, 11);
+                StateBindTexture(app->glState, 12, GL_TEXTURE_CUBE_MAP, app->cubeMapId);
+                StateUniform1i(app->glState, app->waterEffectProgram_uSkybox, 12);
+                BeginWaterPasses(app, 2);
                 {
-                    GLuint vao = FindVAO(mesh, i, waterEffectProgram);
-                    glBindVertexArray(vao);
+                    Model& model = app->models[app->planeModelIdx];
+                    Mesh& mesh = app->meshes[model.meshIdx];
+
+                    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+                    {
+                        GLuint vao = FindVAO(app, mesh.submeshes[i]);
+                        StateBindVertexArray(app->glState, vao);
 
-                    Submesh& submesh = mesh.submeshes[i];
-                    glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
+                        Submesh& submesh = mesh.submeshes[i];
+                        glDrawElementsBaseVertex(GL_TRIANGLES, submesh.lods[0].indexCount, GL_UNSIGNED_INT, (void*)(u64)(submesh.firstIndex * sizeof(u32)), submesh.baseVertex);
+                    }
                 }
+                EndWaterPasses(app, 2);
+                glColorMaski(0, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
             }
-            //glBlitFramebuffer(0, 0, app->displaySize.x, app->displaySize.x, 0, 0, app->displaySize.x, app->displaySize.x, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+            //glBlitFramebuffer(0, 0, frame.displaySize.x, frame.displaySize.x, 0, 0, frame.displaySize.x, frame.displaySize.x, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
             glBindFramebuffer(GL_FRAMEBUFFER, 0);
             /* Second pass (lighting) */
+            glQueryCounter(app->lightingTimestamps[querySlot][0], GL_TIMESTAMP);
 
-            glBindFramebuffer(GL_FRAMEBUFFER, app->fBuffer);
-            glClear(GL_COLOR_BUFFER_BIT);
-            GLenum drawBuffersFBuffer[] = { GL_COLOR_ATTACHMENT3 };
-            glDrawBuffers(ARRAY_COUNT(drawBuffersFBuffer), drawBuffersFBuffer);
+            // Tiles cull the lights in compute, the full screen quad is the fallback.
+            // With light volumes the quad only adds the directional lights.
+            const bool lightVolumes = frame.lightingMode == LIGHTING_VOLUMES;
+            if (frame.lightingMode == LIGHTING_TILED)
+            {
+                RunTiledLighting(app);
+            }
+            else
+            {
+                glBindFramebuffer(GL_FRAMEBUFFER, lightVolumes ? app->lightVolumes.framebuffer : app->fBuffer);
+                glClear(GL_COLOR_BUFFER_BIT);
+                GLenum drawBuffersFBuffer[] = { GL_COLOR_ATTACHMENT3 };
+                glDrawBuffers(ARRAY_COUNT(drawBuffersFBuffer), drawBuffersFBuffer);
 
-            glEnable(GL_BLEND);
-            glBlendFunc(GL_ONE, GL_ONE);
-            //glDepthMask(GL_FALSE);
+                StateEnable(app->glState, GL_BLEND, true);
+                StateBlendFunc(app->glState, GL_ONE, GL_ONE);
+                //glDepthMask(GL_FALSE);
 
-            Program& deferredLightingPassProgram = app->programs[app->deferredLightingPassProgramIdx];
-            glUseProgram(deferredLightingPassProgram.handle);
+                Program& deferredLightingPassProgram = app->programs[app->deferredLightingPassProgramIdx];
+                StateUseProgram(app->glState, deferredLightingPassProgram.handle);
 
-            glUniform1i(app->deferredLightingProgram_uGPosition, 1);
-            glUniform1i(app->deferredLightingProgram_uGNormals, 2);
-            glUniform1i(app->deferredLightingProgram_uGDiffuse, 3);
+                StateUniform1i(app->glState, app->deferredLightingProgram_uDepth, 1);
+                StateUniform1i(app->glState, app->deferredLightingProgram_uGNormals, 2);
+                StateUniform1i(app->glState, app->deferredLightingProgram_uGDiffuse, 3);
+                StateUniformMatrix4fv(app->glState, app->deferredLightingProgram_uInverseViewProjection, &frame.inverseViewProjection[0][0]);
+                StateUniform1i(app->glState, app->deferredLightingProgram_uDirectionalOnly, lightVolumes ? 1 : 0);
 
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
+                StateBindTexture(app->glState, 1, GL_TEXTURE_2D, app->depthAttachmentHandle);
 
-            glActiveTexture(GL_TEXTURE2);
-            glBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
+                StateBindTexture(app->glState, 2, GL_TEXTURE_2D, app->normalsAttachmentHandle);
 
-            glActiveTexture(GL_TEXTURE3);
-            glBindTexture(GL_TEXTURE_2D, app->diffuseAttachmentHandle);
+                StateBindTexture(app->glState, 3, GL_TEXTURE_2D, app->diffuseAttachmentHandle);
 
-            glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->uniformBuffer.handle, app->globalParamsOffset, app->globalParamsSize);
+                StateBindUniformRange(app->glState, BINDING(0), app->uniformBuffer.handle, app->globalParamsOffset, app->globalParamsSize);
 
-            glBindFramebuffer(GL_READ_FRAMEBUFFER, app->gBuffer);
-            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, app->fBuffer);
+                if (lightVolumes)
+                {
+                    // The light volume framebuffer already tests against the G-buffer depth
+                    StateEnable(app->glState, GL_DEPTH_TEST, false);
+                    RenderQuad(app);
+                    RunLightVolumes(app);
+                }
+                else
+                {
+                    glBindFramebuffer(GL_READ_FRAMEBUFFER, app->gBuffer);
+                    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, app->fBuffer);
 
-            glBlitFramebuffer(0, 0, app->displaySize.x, app->displaySize.x, 0, 0, app->displaySize.x, app->displaySize.x, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+                    glBlitFramebuffer(0, 0, frame.displaySize.x, frame.displaySize.x, 0, 0, frame.displaySize.x, frame.displaySize.x, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
 
-            RenderQuad(app);
+                    RenderQuad(app);
+                }
+            }
+            glQueryCounter(app->lightingTimestamps[querySlot][1], GL_TIMESTAMP);
+
+            // The packed G-buffer channels are decoded for the scene panel only when shown
+            if (frame.gbufferView <= FBOAttachmentType::METALLIC)
+            {
+                glBindFramebuffer(GL_FRAMEBUFFER, app->gbufferDebugBuffer);
+                StateEnable(app->glState, GL_BLEND, false);
+                StateEnable(app->glState, GL_DEPTH_TEST, false);
+
+                StateUseProgram(app->glState, app->programs[app->gbufferDebugProgramIdx].handle);
+                StateUniform1i(app->glState, app->gbufferDebugProgram_uDepth, 1);
+                StateUniform1i(app->glState, app->gbufferDebugProgram_uGNormals, 2);
+                StateUniform1i(app->glState, app->gbufferDebugProgram_uGDiffuse, 3);
+                StateUniformMatrix4fv(app->glState, app->gbufferDebugProgram_uInverseViewProjection, &frame.inverseViewProjection[0][0]);
+                StateUniform1i(app->glState, app->gbufferDebugProgram_uView, (i32)frame.gbufferView);
+                StateBindTexture(app->glState, 1, GL_TEXTURE_2D, app->depthAttachmentHandle);
+                StateBindTexture(app->glState, 2, GL_TEXTURE_2D, app->normalsAttachmentHandle);
+                StateBindTexture(app->glState, 3, GL_TEXTURE_2D, app->diffuseAttachmentHandle);
+                RenderQuad(app);
+
+                StateEnable(app->glState, GL_DEPTH_TEST, true);
+            }
 
-            glUseProgram(0);
 
             glBindFramebuffer(GL_FRAMEBUFFER, 0);
             glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -1614,54 +1988,76 @@ void Render(App* app)
     }
 }
 
-GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program)
+void Shutdown(App* app)
 {
-    Submesh& submesh = mesh.submeshes[submeshIndex];
+    ShutdownJobSystem(app->jobs);
+}
 
-    for (u32 i = 0; i < (u32)submesh.vaos.size(); ++i)
-    {
-        if (submesh.vaos[i].programHandle == program.handle)
-            return submesh.vaos[i].handle;
-    }
+GLuint FindVAO(App* app, const Submesh& submesh)
+{
+    const VertexHeap& vertexHeap = app->geometry.vertexHeaps[submesh.vertexHeapIdx];
+
+    auto it = app->vaoCache.find(submesh.vertexHeapIdx);
+    if (it != app->vaoCache.end())
+        return it->second.handle;
 
     GLuint vaoHandle = 0;
 
     glGenVertexArrays(1, &vaoHandle);
-    glBindVertexArray(vaoHandle);
-
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
+    StateBindVertexArray(app->glState, vaoHandle);
 
-    for (u32 i = 0; i < program.vertexInputLayout.attributes.size(); ++i)
+    // Every attribute of the format is enabled, programs ignore the ones they do not read
+    for (const VertexBufferAttribute& attribute : vertexHeap.layout.attributes)
     {
-        bool attributeWasLinked = false;
+        glVertexAttribFormat(attribute.location, attribute.componentCount, GL_FLOAT, GL_FALSE, attribute.offset);
+        glVertexAttribBinding(attribute.location, VERTEX_BINDING_VERTICES);
+        glEnableVertexAttribArray(attribute.location);
+    }
 
-        for (u32 j = 0; j < submesh.vertexBufferLayout.attributes.size(); ++j)
-        {
-            if (program.vertexInputLayout.attributes[i].location == submesh.vertexBufferLayout.attributes[j].location)
-            {
-                const u32 index = submesh.vertexBufferLayout.attributes[j].location;
-                const u32 ncomp = submesh.vertexBufferLayout.attributes[j].componentCount;
-                const u32 offset = submesh.vertexBufferLayout.attributes[j].offset+submesh.vertexOffset;
-                const u32 stride = submesh.vertexBufferLayout.stride;
+    // The draw info comes from the indirect stream, one per draw instance
+    glVertexAttribIFormat(DRAW_INFO_ATTRIBUTE, 2, GL_UNSIGNED_INT, 0);
+    glVertexAttribBinding(DRAW_INFO_ATTRIBUTE, VERTEX_BINDING_DRAW_INFO);
+    glVertexBindingDivisor(VERTEX_BINDING_DRAW_INFO, 1);
+    glEnableVertexAttribArray(DRAW_INFO_ATTRIBUTE);
 
-                glVertexAttribPointer(index, ncomp, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
-                glEnableVertexAttribArray(index);
+    glBindVertexBuffer(VERTEX_BINDING_VERTICES, vertexHeap.heap.buffer.handle, 0, vertexHeap.layout.stride);
+    glBindVertexBuffer(VERTEX_BINDING_DRAW_INFO, app->indirect.drawInfoBuffer.handle, 0, sizeof(DrawInfo));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->geometry.indexHeap.buffer.handle);
 
-                attributeWasLinked = true;
-                break;
-            }
-        }
-    }
-
-    glBindVertexArray(0);
+    StateBindVertexArray(app->glState, 0);
 
-    Vao vao = { vaoHandle, program.handle };
-    submesh.vaos.push_back(vao);
+    app->vaoCache[submesh.vertexHeapIdx] = Vao{ vaoHandle, submesh.vertexHeapIdx };
 
     return vaoHandle;
 }
 
+GLuint FindPositionVAO(App* app, const Submesh& submesh)
+{
+    VertexHeap& vertexHeap = app->geometry.vertexHeaps[submesh.vertexHeapIdx];
+    if (vertexHeap.positionVao != 0)
+        return vertexHeap.positionVao;
+
+    glGenVertexArrays(1, &vertexHeap.positionVao);
+    StateBindVertexArray(app->glState, vertexHeap.positionVao);
+
+    glVertexAttribFormat(0, 3, GL_FLOAT, GL_FALSE, 0);
+    glVertexAttribBinding(0, VERTEX_BINDING_VERTICES);
+    glEnableVertexAttribArray(0);
+
+    glVertexAttribIFormat(DRAW_INFO_ATTRIBUTE, 2, GL_UNSIGNED_INT, 0);
+    glVertexAttribBinding(DRAW_INFO_ATTRIBUTE, VERTEX_BINDING_DRAW_INFO);
+    glVertexBindingDivisor(VERTEX_BINDING_DRAW_INFO, 1);
+    glEnableVertexAttribArray(DRAW_INFO_ATTRIBUTE);
+
+    glBindVertexBuffer(VERTEX_BINDING_VERTICES, vertexHeap.positions.handle, 0, sizeof(vec3));
+    glBindVertexBuffer(VERTEX_BINDING_DRAW_INFO, app->indirect.drawInfoBuffer.handle, 0, sizeof(DrawInfo));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->geometry.indexHeap.buffer.handle);
+
+    StateBindVertexArray(app->glState, 0);
+
+    return vertexHeap.positionVao;
+}
+
 void OnGlError(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam)
 {
     if (severity == GL_DEBUG_SEVERITY_NOTIFICATION)
@@ -1725,7 +2121,7 @@ void RenderQuad(App* app)
         glGenVertexArrays(1, &app->quadVAO);
         glGenBuffers(1, &app->quadVBO);
 
-        glBindVertexArray(app->quadVAO);
+        StateBindVertexArray(app->glState, app->quadVAO);
         glBindBuffer(GL_ARRAY_BUFFER, app->quadVBO);
         glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), &vertices, GL_STATIC_DRAW);
 
@@ -1736,9 +2132,8 @@ void RenderQuad(App* app)
         glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
     }
 
-    glBindVertexArray(app->quadVAO);
+    StateBindVertexArray(app->glState, app->quadVAO);
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-    glBindVertexArray(0);
 
 
 }
@@ -1771,6 +2166,16 @@ glm::mat4 GetProjectionMatrix(Camera& cam)
     return glm::perspective(glm::radians(cam.fov), cam.aspectRatio, cam.nearPlane, cam.farPlane);
 }
 
+glm::mat4 BiasDepthProjection(const glm::mat4& projection, f32 bias)
+{
+    // Window depth is ndc * 0.5 + 0.5, so a window offset is twice that in ndc,
+    // applied as z_clip -= 2 * bias * w_clip to survive the perspective divide
+    glm::mat4 biased = projection;
+    for (u32 column = 0; column < 4; ++column)
+        biased[column][2] -= 2.0f * bias * projection[column][3];
+    return biased;
+}
+
 void HandleInput(App* app)
 {
     if (app->input.keys[K_W] == BUTTON_PRESSED)app->cam.position += (app->cam.front * app->cam.speed);      // Forward
@@ -1803,7 +2208,7 @@ void HandleInput(App* app)
             app->cam.up = glm::normalize(glm::cross(app->cam.right, app->cam.front));
         }
     }
-    SetAspectRatio(app->cam, (float)app->displaySize.x, (float)app->displaySize.y);
+    SetAspectRatio(app->cam, (float)app->renderTargets.size.x, (float)app->renderTargets.size.y);
 }
 
 u8 GetAttribComponentCount(const GLenum& type)
@@ -1951,17 +2356,15 @@ void LoadSphere(App* app)
 
 void RenderSphere(App* app)
 {
-    glBindVertexArray(app->sphereVAO);
+    StateBindVertexArray(app->glState, app->sphereVAO);
 
     glDrawElements(GL_TRIANGLE_STRIP, app->sphereIdxCount, GL_UNSIGNED_INT, 0);
-
-    glBindVertexArray(0);
 }
 
 void RenderSkybox(App* app)
 {
-    glDepthFunc(GL_LEQUAL);
-    glDepthMask(GL_FALSE);
+    StateDepthFunc(app->glState, GL_LEQUAL);
+    StateDepthMask(app->glState, false);
 
     if (app->SKyboxVAO == 0)
     {
@@ -2013,25 +2416,20 @@ void RenderSkybox(App* app)
                 // skybox VAO
         glGenVertexArrays(1, &app->SKyboxVAO);
         glGenBuffers(1, &app->SkyboxVBO);
-        glBindVertexArray(app->SKyboxVAO);
+        StateBindVertexArray(app->glState, app->SKyboxVAO);
         glBindBuffer(GL_ARRAY_BUFFER, app->SkyboxVBO);
         glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
         glEnableVertexAttribArray(0);
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-
-        //Unbinding
-        glBindVertexArray(0);
     }
   
 
-    glBindVertexArray(app->SKyboxVAO);
+    StateBindVertexArray(app->glState, app->SKyboxVAO);
 
     glDrawArrays(GL_TRIANGLES, 0, 36);
 
-    glBindVertexArray(0);
-
-    glDepthFunc(GL_LESS);
-    glDepthMask(GL_TRUE);
+    StateDepthFunc(app->glState, GL_LESS);
+    StateDepthMask(app->glState, true);
 
 }
 
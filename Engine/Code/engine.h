@@ -19,6 +19,14 @@
 
 #include "platform.h"
 #include <glad/glad.h>
+#include <imgui.h>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 
 typedef glm::vec2  vec2;
 typedef glm::vec3  vec3;
@@ -37,10 +45,25 @@ struct Image
 
 struct Texture
 {
-    GLuint      handle;
+    GLuint      handle;         // 0 for material textures, which live in an array layer
     std::string filepath;
+    u32         arrayIdx;       // UINT32_MAX for standalone textures
+    u32         arrayLayer;
 };
 
+// Material textures of one size and format share a GL_TEXTURE_2D_ARRAY
+struct TextureArray
+{
+    GLuint  handle;
+    ivec2   size;
+    GLenum  internalFormat;
+    u32     levels;
+    u32     layerCount;
+    u32     layerCapacity;
+};
+
+#define NO_TEXTURE_LAYER UINT32_MAX
+
 struct VertexBufferAttribute
 {
     u8 location;
@@ -72,6 +95,7 @@ struct Program
     std::string        programName;
     VertexShaderLayout vertexInputLayout;
     u64                lastWriteTimestamp;
+    bool               compute;
 };
 
 struct Model
@@ -80,10 +104,49 @@ struct Model
     std::vector<u32>    materialIdx;
 };
 
+// Vertex array describing one vertex format with separate attribute
+// formats: binding 0 is the vertex heap of that format, binding 1 the
+// per draw instance stream. Works with any program.
 struct Vao
 {
     GLuint  handle;
-    GLuint  programHandle;
+    u32     vertexHeapIdx;
+};
+
+#define VERTEX_BINDING_VERTICES     0
+#define VERTEX_BINDING_DRAW_INFO    1
+
+#define MESHLET_MAX_VERTICES    64
+#define MESHLET_MAX_TRIANGLES   124
+#define MESHLET_MIN_COUNT       8       // submeshes with fewer meshlets are drawn whole
+#define MESHLET_GROUP_SIZE      64
+
+// Contiguous index range of a submesh with its own bounds and normal cone, in
+// the std430 layout of the meshlet cull shader. Every triangle faces away from
+// an eye that sees the apex within the cone, see BuildMeshlets.
+struct Meshlet
+{
+    vec3    center;
+    f32     radius;
+    vec3    coneApex;
+    f32     coneCutoff;     // above 1 when the normals spread too wide for a cone
+    vec3    coneAxis;
+    u32     firstIndex;     // relative to the submesh
+    u32     indexCount;
+    u32     padding[3];
+};
+
+#define LOD_MAX_COUNT           4
+#define LOD_REDUCTION           0.5f    // triangles kept by every level from the one before
+#define LOD_MIN_TRIANGLES       64
+#define LOD_SCREEN_SIZE         256.0f  // pixels across below which level 1 is used, halved for every level after
+#define LOD_HYSTERESIS          0.15f   // fraction past a threshold before the level changes
+
+// Index range of one level of detail, relative to the submesh indices
+struct SubmeshLod
+{
+    u32 firstIndex;
+    u32 indexCount;
 };
 
 struct Submesh
@@ -91,17 +154,35 @@ struct Submesh
     VertexBufferLayout  vertexBufferLayout;
     std::vector<float>  vertices;
     std::vector<u32>    indices;
-    u32                 vertexOffset;
-    u32                 indexOffset;
 
-    std::vector<Vao>    vaos;
+    // Placement inside the global geometry heap
+    u32                 vertexHeapIdx;
+    u32                 baseVertex;
+    u32                 firstIndex;
+
+    // Local space bounds, computed at import
+    vec3                aabbMin;
+    vec3                aabbMax;
+    vec3                sphereCenter;
+    f32                 sphereRadius;
+
+    // Simplified copy of the triangles, rasterized by the software occlusion
+    std::vector<vec3>   occluderPositions;
+    std::vector<u32>    occluderIndices;
+    f32                 occluderError;  // object space distance the occluder vertices may have moved
+
+    std::vector<Meshlet> meshlets;
+    u32                 firstMeshlet;   // into the meshlet buffer of MeshletCuller
+
+    // Level 0 is the imported mesh, the simplified levels follow it in the
+    // indices and reuse its vertices
+    SubmeshLod          lods[LOD_MAX_COUNT];
+    u32                 lodCount;
 };
 
 struct Mesh
 {
     std::vector<Submesh>    submeshes;
-    GLuint                  vertexBufferHandle;
-    GLuint                  indexBufferHandle;
 };
 
 struct Material
@@ -143,6 +224,27 @@ enum Mode
     Mode_Count
 };
 
+// How the deferred lighting pass walks the lights
+enum LightingMode
+{
+    LIGHTING_FULLSCREEN_QUAD,   // every light for every pixel
+    LIGHTING_TILED,             // compute, only the lights of the pixel's screen tile
+    LIGHTING_VOLUMES,           // directional lights full screen, a stencil tested sphere per point light
+    LIGHTING_MODE_COUNT
+};
+
+// Scene panel view of the deferred mode. The G-buffer channels are decoded
+// into a debug attachment first, it stores no position and packs the normals.
+enum class FBOAttachmentType
+{
+    POSITION,
+    NORMALS,
+    DIFFUSE,
+    METALLIC,
+    DEPTH,
+    FINAL
+};
+
 struct VertexV3V2
 {
     vec3 pos;
@@ -166,8 +268,138 @@ struct Entity
     vec3        scale;
     u32         modelIdx;
     float       metallic;
-    u32         localParamsOffset;
-    u32         localParamsSize;
+    bool        boundsValid = false;    // cleared when the transform changes, see UpdateWorldBounds
+};
+
+#define CULL_BATCH 4
+
+// World space boxes (center and half extents) and spheres of every entity
+// submesh. Structure of arrays padded to CULL_BATCH, so the frustum test
+// loads a whole register per component.
+struct WorldBounds
+{
+    u32                 count;
+    std::vector<u32>    entityOffsets;  // first box of every entity, its submeshes follow
+    std::vector<f32>    centerX, centerY, centerZ;
+    std::vector<f32>    extentX, extentY, extentZ;
+    std::vector<vec4>   spheres;        // xyz center, w radius
+};
+
+// Normalized planes pointing inwards
+struct Frustum
+{
+    vec4 planes[6];
+};
+
+struct CullStats
+{
+    u32 tested;
+    u32 visible;
+};
+
+#define BVH_LEAF_SIZE   4
+#define BVH_MAX_DEPTH   64
+#define BVH_BINS        12
+
+struct Aabb
+{
+    vec3 min;
+    vec3 max;
+};
+
+// Leaves own indices[first, first + count), interior nodes have count 0
+// and their two children at first and first + 1
+struct BvhNode
+{
+    Aabb    box;
+    u32     first;
+    u32     count;
+};
+
+// Bounding volume hierarchy over the submesh boxes of WorldBounds, built
+// with a binned SAH and refitted when entities move. Queries only read it,
+// any number of threads may run them at once.
+struct Bvh
+{
+    std::vector<BvhNode>    nodes;          // root at 0
+    std::vector<u32>        parents;
+    std::vector<u32>        indices;        // primitives in leaf order
+    std::vector<Aabb>       primitives;
+    std::vector<u32>        primitiveLeaf;
+    std::vector<u32>        dirtyLeaves;
+    f32                     builtCost;      // SAH cost after the last build, refits rebuild past twice it
+    u32                     rebuilds;
+};
+
+struct BvhHit
+{
+    u32 primitive;
+    f32 distance;
+};
+
+// Timings in milliseconds of the culling structures over a synthetic scene
+struct CullBenchmark
+{
+    u32 count;
+    f32 build;
+    f32 refit;
+    f32 flatFrustum;
+    f32 bvhFrustum;
+    f32 sphere;
+    f32 rays;
+};
+
+#define SOFTWARE_DEPTH_WIDTH    256
+#define SOFTWARE_DEPTH_HEIGHT   144
+#define SOFTWARE_DEPTH_BANDS    4       // rows split between the workers, SOFTWARE_DEPTH_HEIGHT must divide evenly
+#define OCCLUDER_GRID           32      // vertex clustering cells per axis when simplifying occluders
+#define OCCLUDER_MIN_SIZE       0.1f    // world radius over distance below which a submesh is not an occluder
+#define OCCLUDER_MAX_COUNT      32
+
+// Low resolution depth buffer rasterized on the CPU from the simplified
+// meshes of the largest submeshes in view. Boxes whose nearest point is
+// behind every pixel they cover are dropped before draw submission.
+struct SoftwareOcclusion
+{
+    glm::mat4           viewProjection;
+    vec3                eye;
+    std::vector<f32>    depth;          // window space depth, SOFTWARE_DEPTH_WIDTH wide rows from the bottom
+    std::vector<vec3>   triangles;      // three pixel space vertices per triangle, z is the depth
+    u32                 occluders;
+    f32                 rasterTime;     // milliseconds of the last frame, setup included
+};
+
+// Timings in milliseconds of the software occlusion over a synthetic scene
+struct SoftwareOcclusionBenchmark
+{
+    u32 sourceTriangles;
+    u32 occluderTriangles;
+    u32 boxes;
+    u32 occluded;
+    f32 simplify;
+    f32 setup;
+    f32 raster;
+    f32 test;
+};
+
+// Per instance transforms (world matrix, then metallic padded to a vec4)
+// and material colors are read from shader storage buffers. Each draw
+// instance gets a DrawInfo through an integer attribute with divisor 1,
+// addressed by the base instance of its indirect command.
+#define INSTANCE_STRIDE             (sizeof(glm::mat4) + sizeof(vec4))
+#define DRAW_INFO_ATTRIBUTE         8
+#define STORAGE_BINDING_TRANSFORMS  0
+#define STORAGE_BINDING_MATERIALS   1
+#define STORAGE_BINDING_IMPOSTORS   8   // after the bindings the cull shaders use
+#define STORAGE_BINDING_LIGHTS      9
+#define STORAGE_BINDING_CLUSTERS    10
+
+// Entities sharing a model, stored contiguously in the instance buffer
+struct InstanceGroup
+{
+    u32 modelIdx;
+    u32 firstInstance;
+    u32 instanceCount;
 };
 
 enum LightType
@@ -195,13 +427,759 @@ struct Buffer
     void*   data;
 };
 
-enum class FBOAttachmentType
+struct HeapBlock
 {
-    POSITION,
-    NORMALS,
-    DIFFUSE,
-    DEPTH,
-    FINAL
+    u32 offset;
+    u32 count;
+};
+
+// Sub-allocator over a single GL buffer. Offsets and counts are expressed
+// in elements (vertices or indices), free blocks are kept sorted by offset
+// so they can be coalesced with their neighbours when released.
+struct BufferHeap
+{
+    Buffer                  buffer;
+    u32                     elementSize;
+    u32                     capacity;
+    u32                     usedCount;
+    std::vector<HeapBlock>  freeBlocks;
+};
+
+// Positions are also kept in a tightly packed stream, addressed with the same
+// base vertex as the full vertices, for passes that only need depth
+struct VertexHeap
+{
+    VertexBufferLayout  layout;
+    BufferHeap          heap;
+    Buffer              positions;
+    GLuint              positionVao;
+};
+
+// Global vertex/index storage: one vertex heap per vertex format and a
+// single index heap shared by every format. Submeshes address it through
+// a base vertex and a first index.
+struct GeometryHeap
+{
+    std::vector<VertexHeap> vertexHeaps;
+    BufferHeap              indexHeap;
+    u32                     vertexHeapSize;
+};
+
+enum UploadType
+{
+    UPLOADTYPE_BUFFER,
+    UPLOADTYPE_TEXTURE
+};
+
+struct UploadRequest
+{
+    UploadType  type;
+    u32         stagingOffset;
+    u32         size;
+    u32         ringBytes;      // size plus alignment and wrap-around padding
+
+    // Buffer destination
+    GLuint      dstBuffer;
+    u32         dstOffset;
+
+    // Texture destination
+    GLuint      texture;
+    GLenum      bindTarget;
+    GLenum      imageTarget;
+    u32         texLayer;       // only used by GL_TEXTURE_2D_ARRAY
+    ivec2       texOffset;
+    ivec2       texSize;
+    GLenum      dataFormat;
+    GLenum      dataType;
+    bool        generateMipmaps;
+};
+
+struct UploadFence
+{
+    GLsync  sync;
+    u32     ringTail;
+    u32     ringBytes;
+};
+
+// Streams loader data to the GPU through a staging ring. Loaders (from any
+// thread) copy into the ring, the GL thread turns the staged data into
+// buffer copies and PBO texture uploads under a per-frame byte budget.
+struct UploadManager
+{
+    GLuint                      stagingBuffer;
+    u8*                         stagingMemory;
+    bool                        persistentlyMapped;
+    u32                         ringSize;
+    u32                         ringHead;
+    u32                         ringTail;
+    u32                         ringUsed;
+    u32                         frameBudget;
+
+    std::deque<UploadRequest>   pending;
+    std::vector<UploadFence>    fences;
+    std::mutex                  mutex;
+    std::thread::id             glThread;
+
+    u32                         pendingBytes;
+    u32                         uploadedLastFrame;
+};
+
+#define STATE_TEXTURE_UNITS     16
+#define STATE_UNIFORM_BINDINGS  8
+
+enum StateTextureTarget
+{
+    STATETEXTURE_2D,
+    STATETEXTURE_CUBE_MAP,
+    STATETEXTURE_2D_ARRAY,
+    STATETEXTURE_COUNT
+};
+
+struct CachedUniform
+{
+    bool    valid;
+    u32     words[16];
+};
+
+struct ProgramUniformCache
+{
+    GLuint                      program;
+    std::vector<CachedUniform>  uniforms;   // indexed by location
+};
+
+struct UniformRange
+{
+    GLuint      buffer;
+    GLintptr    offset;
+    GLsizeiptr  size;
+};
+
+// Shadow copy of the GL state touched by Render(). Calls that would not
+// change anything are skipped. Bindings are invalidated every frame because
+// ImGui and the platform layer change them behind our back, uniform values
+// live in the program objects and survive across frames.
+struct GLStateCache
+{
+    GLuint                  program;
+    GLuint                  vao;
+    u32                     activeUnit;
+    GLuint                  textures[STATE_TEXTURE_UNITS][STATETEXTURE_COUNT];
+    UniformRange            uniformRanges[STATE_UNIFORM_BINDINGS];
+
+    // Fixed function state, -1 (or GL_NONE for enums) when unknown
+    i32                     blend;
+    GLenum                  blendSrc;
+    GLenum                  blendDst;
+    i32                     depthTest;
+    i32                     depthWrite;
+    GLenum                  depthFunc;
+    i32                     clipDistance0;
+
+    std::vector<ProgramUniformCache> programUniforms;
+    ProgramUniformCache*    currentUniforms;
+
+    u32                     issuedCalls;
+    u32                     skippedCalls;
+};
+
+enum RenderPass
+{
+    RENDERPASS_FORWARD,
+    RENDERPASS_WATER_REFLECTION,
+    RENDERPASS_WATER_REFRACTION,
+    RENDERPASS_GBUFFER,
+    RENDERPASS_DEPTH_PREPASS,
+    RENDERPASS_COUNT
+};
+
+enum SortMode
+{
+    SORTMODE_FRONT_TO_BACK,     // Opaque passes that benefit from early depth rejection
+    SORTMODE_STATE              // Passes where minimizing state changes matters more than depth
+};
+
+struct DrawItem
+{
+    u64     key;
+    u32     programIdx;
+    GLuint  vao;
+    u32     materialIdx;
+    GLuint  albedoArray;    // 0 when the material has no albedo texture
+    u32     depthBucket;
+    u32     indexCount;
+    u32     firstIndex;
+    u32     baseVertex;
+    u32     firstInstance;  // into the visible instances of the queue
+    u32     instanceCount;
+    u32     firstMeshlet;
+    u32     meshletCount;   // 0 draws the whole submesh, else one command per meshlet and instance
+};
+
+struct DrawElementsIndirectCommand
+{
+    u32 count;
+    u32 instanceCount;
+    u32 firstIndex;
+    i32 baseVertex;
+    u32 baseInstance;
+};
+
+struct DrawInfo
+{
+    u32 transformIdx;
+    u32 materialIdx;
+};
+
+// Frame-wide streams the render queues write their indirect commands and
+// draw infos to. Orphaned once per frame, appended to by every pass.
+struct IndirectStream
+{
+    Buffer                                      commandBuffer;
+    Buffer                                      drawInfoBuffer;
+    u32                                         commandCursor;
+    u32                                         drawInfoCursor;
+    u32                                         multiDrawCalls;
+    u32                                         drawCommands;
+};
+
+struct RenderQueue
+{
+    SortMode                mode;
+    std::vector<DrawItem>   items;
+    std::vector<DrawItem>   scratch;
+
+    // Frustum culling result of the pass view, one flag per world box,
+    // and the transform indices of the instances that survived it
+    std::vector<u8>         visible;
+    std::vector<u32>        instances;
+    std::vector<u32>        instanceBoxes;  // world box of each visible instance
+    CullStats               cullStats;
+    CullStats               softwareOcclusionStats;
+
+    // First list command of every item, recorded with the commands
+    std::vector<u32>        itemCommands;
+
+    // Distant instances of baked models, drawn as impostors instead. The
+    // draw info holds the transform and the atlas layer.
+    std::vector<DrawInfo>   impostors;
+    u32                     impostorCount;
+
+    // Level of detail of every world box, kept between frames for the hysteresis
+    std::vector<u8>         lods;
+    u32                     lodInstances[LOD_MAX_COUNT];
+
+    // Water passes only: boxes crossing the water plane, drawn with clipping on
+    std::vector<u8>         clipped;
+    CullStats               clipPlaneStats;
+    u32                     clippedCount;
+};
+
+#define IMPOSTOR_GRID           8       // octahedral views per side of an atlas layer
+#define IMPOSTOR_FRAME_SIZE     128
+#define IMPOSTOR_MAX_MODELS     16
+#define IMPOSTOR_MIP_LEVELS     4
+
+// Every model rendered from IMPOSTOR_GRID x IMPOSTOR_GRID directions spread
+// over the sphere with an octahedral mapping, one layer per model
+struct ImpostorAtlas
+{
+    GLuint              albedoArray;        // alpha is coverage
+    GLuint              normalDepthArray;   // object space normal, depth towards the view in sphere radii
+    GLuint              sphereBuffer;       // object space bounds of every layer
+    GLuint              vao;                // no vertices, only the draw info stream
+    std::vector<u32>    modelLayers;        // UINT32_MAX for models without an impostor
+    std::vector<vec4>   spheres;
+
+    u32                 bakeProgramIdx;
+    GLint               bakeProgram_uViewProjection;
+    GLint               bakeProgram_uSphere;
+    GLint               bakeProgram_uDirection;
+    GLint               bakeProgram_uAlbedo;
+    GLint               bakeProgram_uAlbedoLayer;
+    GLint               bakeProgram_uTexture;
+
+    u32                 programIdx;
+    GLint               program_uViewProjection;
+    GLint               program_uCameraPosition;
+    GLint               program_uGrid;
+    GLint               program_uAlbedo;
+    GLint               program_uNormalDepth;
+    GLint               program_uSkybox;
+    GLint               program_uIrradiance;
+};
+
+#define LIGHT_TILE_SIZE         16      // pixels per side, the workgroup size of the tiled shader
+#define LIGHT_TILE_MAX_LIGHTS   256     // a crowded tile drops the lights past this
+
+// Compute lighting over screen tiles: every tile reduces its depth range,
+// culls the lights against its frustum into shared memory and shades its
+// pixels with those only
+struct TiledLighting
+{
+    u32     programIdx;
+    GLint   program_uDepth;
+    GLint   program_uGNormals;
+    GLint   program_uGDiffuse;
+    GLint   program_uProjection;
+    GLint   program_uView;
+    GLint   program_uInverseViewProjection;
+    GLint   program_uLightCount;
+    GLint   program_uScreenSize;
+};
+
+// Point lights as spheres over the G-buffer: a stencil pass counts where the
+// sphere surrounds the stored depth, then the lighting pass draws its back
+// faces onto those pixels only and resets their stencil
+struct LightVolumes
+{
+    GLuint  framebuffer;        // the final render attachment over a copy of the G-buffer depth
+    u32     programIdx;
+    GLint   program_uDepth;
+    GLint   program_uGNormals;
+    GLint   program_uGDiffuse;
+    GLint   program_uProjection;
+    GLint   program_uView;
+    GLint   program_uInverseViewProjection;
+    GLint   program_uLightIndex;
+    u32     drawnLights;        // point lights inside the view last frame
+};
+
+#define LIGHT_CLUSTER_X             16
+#define LIGHT_CLUSTER_Y             9
+#define LIGHT_CLUSTER_Z             24      // slices spaced logarithmically between the camera planes
+#define LIGHT_CLUSTER_COUNT         (LIGHT_CLUSTER_X * LIGHT_CLUSTER_Y * LIGHT_CLUSTER_Z)
+#define LIGHT_CLUSTER_MAX_LIGHTS    64      // a crowded cluster drops the lights past this
+#define LIGHT_CLUSTER_GROUP_SIZE    64
+#define LIGHT_CLUSTER_HEADER_SIZE   (2 * sizeof(glm::mat4) + sizeof(vec4))
+
+// Froxel grid of the main camera with the lights reaching every cell, rebuilt
+// by a compute pass each frame. The forward, clipped mesh and water programs
+// find their cell from the world position and loop over its lights only.
+// The buffer starts with the view, projection and depth slicing of the grid,
+// then every cluster holds its light count followed by the light indices.
+struct LightClusters
+{
+    GLuint  buffer;
+    u32     buildProgramIdx;
+    GLint   buildProgram_uLightCount;
+    GLint   buildProgram_uInverseProjection;
+};
+
+// Per pass uniform locations used while executing a render queue
+struct DrawPassParams
+{
+    GLint   textureUnit;
+    GLint   uTexture;
+};
+
+// Two-phase occlusion culling of the G-buffer pass against a hierarchical
+// depth buffer. Phase 1 draws what was visible last frame, the depth it
+// leaves is reduced into the Hi-Z pyramid, then phase 2 tests every
+// candidate against it and draws the ones that just became visible.
+// Both phases are compacted on the GPU into copies of the list's indirect
+// commands, so occluded instances only cost one compute thread.
+#define OCCLUSION_PHASE_COUNT   2
+#define OCCLUSION_GROUP_SIZE    64
+#define HIZ_GROUP_SIZE          8
+#define OCCLUSION_STATS_COUNT   3
+#define OCCLUSION_BINDING_COMMANDS  2   // first of the six storage bindings of the cull shader
+
+// Matches the std430 layout of the cull shader
+struct OcclusionCandidate
+{
+    vec3    boxMin;
+    u32     box;
+    vec3    boxMax;
+    u32     command;    // index within the list's indirect commands
+};
+
+struct OcclusionCuller
+{
+    GLuint  hiZTexture;
+    ivec2   hiZSize;
+    u32     hiZLevels;
+
+    // Visibility flag per world box, last frame's is read while this frame's is written
+    GLuint  visibilityBuffers[2];
+    u32     visibilityCount;
+    u32     previousVisibility;
+
+    GLuint  candidateBuffer;
+    u32     candidateCapacity;
+    u32     candidateCount;
+
+    // Where the culled list landed in the indirect stream, phase copies follow it
+    u32     commandOffset;
+    u32     commandCount;
+    u32     firstDrawInfo;
+    u32     drawInfoCount;
+
+    // Instances drawn per phase, read back a few frames late
+    GLuint  counterBuffer;
+    GLuint  statsBuffers[OCCLUSION_STATS_COUNT];
+    bool    statsIssued[OCCLUSION_STATS_COUNT];
+    u32     phaseInstances[OCCLUSION_PHASE_COUNT];
+    u32     candidates;
+
+    u32     hiZBuildProgramIdx;
+    GLint   hiZBuildProgram_uLevel;
+    GLint   hiZBuildProgram_uDepth;
+    GLint   hiZBuildProgram_uSourceSize;
+    GLint   hiZBuildProgram_uDestinationSize;
+
+    u32     cullProgramIdx;
+    GLint   cullProgram_uPhase;
+    GLint   cullProgram_uCandidateCount;
+    GLint   cullProgram_uFirstCommand;
+    GLint   cullProgram_uFirstDrawInfo;
+    GLint   cullProgram_uViewProjection;
+    GLint   cullProgram_uHiZ;
+    GLint   cullProgram_uHiZSize;
+    GLint   cullProgram_uHiZLevels;
+};
+
+#define MESHLET_STATS_COUNT     3
+#define MESHLET_CULL_CLIP_PLANE 1
+#define MESHLET_CULL_CONES      2
+#define MESHLET_BINDING_COMMANDS 2  // first of the four storage bindings of the cull shader
+#define MESHLET_MAX_GROUPS      65535
+
+// One instance of a meshlet split submesh, in the std430 layout of the cull
+// shader. Its meshletCount commands are rewritten every frame with the visible
+// meshlets first. Command word and draw info are rebased when submitted.
+struct MeshletDraw
+{
+    u32 firstMeshlet;
+    u32 meshletCount;
+    u32 commandWord;
+    u32 drawInfo;
+    u32 firstIndex;     // of the submesh in the geometry heap
+    u32 baseVertex;
+    u32 transform;
+    u32 padding;
+};
+
+// Per view culling of meshlets against the frustum, the water clip plane and
+// their normal cones, writing compacted indirect commands
+struct MeshletCuller
+{
+    GLuint  meshletBuffer;      // every meshlet of every mesh, built after loading
+    u32     meshletCount;
+    GLuint  drawBuffer;         // meshlet draws of the frame, orphaned like the indirect stream
+    u32     drawCapacity;
+    u32     drawCursor;
+    u32     listFirstDraw;      // where the draws of the list being submitted landed
+
+    // Meshlets tested and drawn, read back a few frames late
+    GLuint  counterBuffer;
+    GLuint  statsBuffers[MESHLET_STATS_COUNT];
+    bool    statsIssued[MESHLET_STATS_COUNT];
+    u32     tested;
+    u32     visible;
+
+    u32     cullProgramIdx;
+    GLint   cullProgram_uFirstDraw;
+    GLint   cullProgram_uPlanes;
+    GLint   cullProgram_uCameraPosition;
+    GLint   cullProgram_uClipPlane;
+    GLint   cullProgram_uFlags;
+};
+
+enum CommandType : u8
+{
+    COMMAND_BIND_FRAMEBUFFER,
+    COMMAND_DRAW_BUFFERS,
+    COMMAND_VIEWPORT,
+    COMMAND_CLEAR,
+    COMMAND_ENABLE,
+    COMMAND_BLEND_FUNC,
+    COMMAND_DEPTH_MASK,
+    COMMAND_DEPTH_FUNC,
+    COMMAND_USE_PROGRAM,
+    COMMAND_BIND_VERTEX_ARRAY,
+    COMMAND_BIND_TEXTURE,
+    COMMAND_BIND_UNIFORM_RANGE,
+    COMMAND_UNIFORM_1I,
+    COMMAND_UNIFORM_1F,
+    COMMAND_UNIFORM_2F,
+    COMMAND_UNIFORM_3F,
+    COMMAND_UNIFORM_4F,
+    COMMAND_UNIFORM_MATRIX4,
+    COMMAND_MULTI_DRAW_INDIRECT,
+    COMMAND_DRAW_ARRAYS_INSTANCED,
+    COMMAND_BEGIN_QUERY,
+    COMMAND_END_QUERY,
+    COMMAND_OCCLUSION_CULL,
+    COMMAND_CULL_MESHLETS
+};
+
+#define MAX_COMMAND_DRAW_BUFFERS 4
+
+// Plain data, so it can be recorded on any thread and replayed on the GL one.
+// Matrices are stored in the data array of the list, indirect commands are
+// indices into the list's own indirect commands.
+struct Command
+{
+    CommandType type;
+    union
+    {
+        struct { GLenum target; GLuint framebuffer; }                       bindFramebuffer;
+        struct { u32 count; GLenum buffers[MAX_COMMAND_DRAW_BUFFERS]; }     drawBuffers;
+        struct { i32 x, y, width, height; }                                 viewport;
+        struct { GLbitfield mask; f32 color[4]; }                           clear;
+        struct { GLenum capability; bool enabled; }                         enable;
+        struct { GLenum src, dst; }                                         blendFunc;
+        struct { bool write; }                                              depthMask;
+        struct { GLenum func; }                                             depthFunc;
+        struct { GLuint program; }                                          useProgram;
+        struct { GLuint vao; }                                              bindVertexArray;
+        struct { u32 unit; GLenum target; GLuint texture; }                 bindTexture;
+        struct { u32 binding; GLuint buffer; u32 offset, size; }            bindUniformRange;
+        struct { GLint location; i32 value; }                               uniformInt;
+        struct { GLint location; f32 values[4]; }                           uniformFloat;
+        struct { GLint location; u32 dataOffset; }                          uniformMatrix;
+        struct { u32 firstCommand, commandCount, phase; }                   multiDrawIndirect;
+        struct { GLenum mode; u32 vertexCount, firstDrawInfo, instanceCount; } drawArraysInstanced;
+        struct { GLenum target; GLuint query; }                             query;
+        struct { u32 phase; }                                               occlusionCull;
+        struct { u32 firstDraw, drawCount, dataOffset, flags; }             cullMeshlets;
+    };
+};
+
+// Commands of one pass. Base instances of the indirect commands are relative to
+// the list's draw infos until the list is submitted.
+struct CommandList
+{
+    std::vector<Command>                        commands;
+    std::vector<f32>                            data;
+    std::vector<DrawElementsIndirectCommand>    indirectCommands;
+    std::vector<DrawInfo>                       drawInfos;
+
+    // One per draw info when the list is occlusion culled
+    bool                                        occlusionCulled;
+    std::vector<OcclusionCandidate>             occlusionCandidates;
+
+    // Meshlet instances and the view they are culled against, see CmdMeshletView
+    std::vector<MeshletDraw>                    meshletDraws;
+    u32                                         meshletViewOffset;
+    u32                                         meshletViewFlags;
+};
+
+// Counts the unfinished jobs of a batch
+typedef std::atomic<u32> JobCounter;
+
+struct Job
+{
+    std::function<void()>   function;
+    JobCounter*             counter;
+};
+
+// Fixed pool of worker threads fed from a single queue
+struct JobSystem
+{
+    std::vector<std::thread>    workers;
+    std::deque<Job>             queue;
+    std::mutex                  mutex;
+    std::condition_variable     wake;
+    bool                        quit;
+};
+
+// Everything the render thread needs from one simulated frame. Written by the
+// simulation thread, read only once handed over.
+struct FramePacket
+{
+    u64                         frameIndex;
+    Mode                        mode;
+    ivec2                       displaySize;
+    Camera                      camera;
+    glm::mat4                   viewMat;
+    glm::mat4                   projectionMat;
+    glm::mat4                   sceneProjectionMat;     // projectionMat with the scene depth bias
+    glm::mat4                   inverseViewProjection;  // of the scene projection, G-buffer positions come from depth
+    bool                        depthPrePass;
+    std::vector<Entity>         entities;
+    std::vector<Light>          lights;
+    WorldBounds                 bounds;
+    u64                         sceneVersion;           // of the entities, bounds and bvh copies above
+    u32                         reloadModelIdx;         // model whose geometry is reallocated, UINT32_MAX for none
+    u32                         uploadFrameBudget;
+    Bvh                         bvh;
+    bool                        bvhCulling;             // else the flat SSE loop over bounds
+    bool                        occlusionCulling;
+    bool                        softwareOcclusionCulling;
+    bool                        conditionalWater;       // else the water passes run every frame
+    bool                        meshletCulling;         // else big submeshes are drawn whole
+    bool                        meshletConeCulling;     // only sound with back faces culled, which no pass does yet
+    bool                        lodSelection;           // else every submesh draws its full level
+    u32                         reflectionLodBias;      // levels coarser in the water reflection
+    bool                        impostors;
+    f32                         impostorDistance;       // from the eye to the nearest submesh sphere
+    LightingMode                lightingMode;
+    FBOAttachmentType           gbufferView;
+
+    // Deep copy of the ImGui output, the context's own lists are rebuilt every frame
+    ImDrawData                  drawData;
+    std::vector<ImDrawList*>    drawLists;
+};
+
+#define FRAME_PACKET_COUNT 2
+
+// Queries are read back a few frames late so the CPU never waits for them
+#define GBUFFER_SAMPLE_QUERY_COUNT 3
+
+// Window space depth offset applied to the scene meshes so they always win
+// against the skybox and the water surface depth. Baked into the projection
+// instead of written to gl_FragDepth, which would disable early depth tests.
+#define SCENE_DEPTH_BIAS 0.2f
+
+#define WATER_QUERY_COUNT       GBUFFER_SAMPLE_QUERY_COUNT
+#define WATER_TIMESTAMP_COUNT   4   // around the reflection and refraction passes, then around the surface
+
+// Skipping of the reflection, refraction and water surface passes while the
+// surface is out of view, or on the GPU while the scene hid it last frame.
+// Queries and timestamps are read a few frames late.
+struct WaterVisibility
+{
+    Aabb    surfaceBounds;              // the water plane model is drawn in world space
+    bool    inView;
+    u32     slot;                       // query slot of the frame being rendered
+    GLuint  surfaceQueries[WATER_QUERY_COUNT];
+    GLuint  timestamps[WATER_QUERY_COUNT][WATER_TIMESTAMP_COUNT];
+    u64     issuedFrames[WATER_QUERY_COUNT];    // UINT64_MAX while a slot holds nothing
+    bool    conditioned[WATER_QUERY_COUNT];     // the passes of that frame depended on the previous query
+    u64     lastReadFrame;
+    bool    lastReadVisible;
+
+    u32     queryProgramIdx;
+    GLint   queryProgram_uProj;
+    GLint   queryProgram_uView;
+
+    // Milliseconds of GPU time, saved is what the passes cost the last time they ran
+    f32     passTime;
+    f32     drawnTime;
+    f32     savedTime;
+    u32     skippedFrames;
+};
+
+#define RENDER_TARGET_POOL_SIZE     4
+#define RENDER_TARGET_SETTLE_FRAMES 10      // a new Scene panel size must hold this long before targets follow it
+#define RENDER_TARGET_RETIRE_FRAMES 600     // pooled sets unused for this long are freed
+
+// Every screen sized attachment of the frame, for one size
+struct RenderTargetSet
+{
+    ivec2   size;                   // 0 while the slot holds nothing
+    u64     lastUsedFrame;
+
+    GLuint  forwardRenderAttachmentHandle;
+    GLuint  forwardDepthAttachmentHandle;
+    GLuint  forwardFrameBuffer;
+
+    GLuint  normalsAttachmentHandle;
+    GLuint  diffuseAttachmentHandle;
+    GLuint  depthAttachmentHandle;
+    GLuint  gBuffer;
+
+    GLuint  finalRenderAttachmentHandle;
+    GLuint  fBuffer;
+    GLuint  lightVolumeDepthAttachmentHandle;   // copy of the G-buffer depth, the stencil is counted in it
+    GLuint  lightVolumeBuffer;
+    GLuint  gbufferDebugAttachmentHandle;
+    GLuint  gbufferDebugBuffer;
+
+    GLuint  waterReflectionAttachmentHandle;
+    GLuint  waterReflectionDepthAttachmentHandle;
+    GLuint  waterReflectionFrameBuffer;
+    GLuint  waterRefractionAttachmentHandle;
+    GLuint  waterRefractionDepthAttachmentHandle;
+    GLuint  waterRefractionFrameBuffer;
+
+    GLuint  hiZTexture;
+    u32     hiZLevels;
+};
+
+// Render targets sized to the Scene panel. The simulation thread settles on a
+// size, the render thread keeps a small pool of sets so flipping between sizes
+// does not reallocate every time.
+struct RenderTargets
+{
+    // Simulation thread
+    ivec2               panelSize;      // content region of the Scene panel, 0 before it was laid out
+    ivec2               pendingSize;
+    u32                 pendingFrames;
+    ivec2               size;           // the size frames are rendered at
+
+    // Render thread
+    RenderTargetSet     sets[RENDER_TARGET_POOL_SIZE];
+    std::atomic<u32>    current;        // set of the last rendered frame, RENDER_TARGET_POOL_SIZE for none
+    u32                 pooledSets;
+    u32                 allocations;
+};
+
+// Counters of one rendered frame for the Gui. The render thread fills a slot
+// before releasing the frame, one more slot than packets keeps the one the
+// simulation thread reads out of reach of the frames still being rendered.
+#define RENDER_STATS_COUNT (FRAME_PACKET_COUNT + 1)
+
+struct RenderStats
+{
+    u32         glIssuedCalls;
+    u32         glSkippedCalls;
+    u32         multiDrawCalls;
+    u32         drawCommands;
+    u32         submittedCommands;
+
+    CullStats   cullStats[RENDERPASS_COUNT];
+    CullStats   clipPlaneStats[RENDERPASS_COUNT];
+    u32         clippedCount[RENDERPASS_COUNT];
+    CullStats   softwareOcclusionStats[RENDERPASS_COUNT];
+    u32         lodInstances[RENDERPASS_COUNT][LOD_MAX_COUNT];
+    u32         impostorCount;
+
+    u32         softwareOccluders;
+    u32         softwareTriangles;
+    f32         softwareRasterTime;
+    u32         occlusionCandidates;
+    u32         occlusionPhaseInstances[OCCLUSION_PHASE_COUNT];
+    u32         meshletsVisible;
+    u32         meshletsTested;
+    u32         meshletCount;
+
+    u64         gbufferSamples;
+    u32         pooledRenderTargets;
+    u32         renderTargetAllocations;
+    f32         waterPassTime;
+    f32         waterSavedTime;
+    u32         waterSkippedFrames;
+    f32         lightingTime;
+    u32         drawnLightVolumes;
+
+    u32         uploadRingUsed;
+    u32         uploadPendingBytes;
+    u32         uploadedLastFrame;
+
+    f32         renderTime;
+};
+
+struct GLFWwindow;
+
+// Single producer, single consumer handoff of frame packets between the
+// simulation thread and the render thread, which owns the GL context
+struct RenderThread
+{
+    FramePacket                 packets[FRAME_PACKET_COUNT];
+    std::atomic<u64>            produced;       // packets published by the simulation thread
+    std::atomic<u64>            consumed;       // packets the render thread is done with
+    std::atomic<bool>           quit;
+    std::thread                 thread;
+    GLFWwindow*                 window;
+
+    // 1 keeps input latency low, 2 lets simulation run a whole frame ahead
+    u32                         framesInFlight;
+    f32                         renderTime;
+
+    // Slot of frame n is n % RENDER_STATS_COUNT, published with consumed
+    RenderStats                 stats[RENDER_STATS_COUNT];
 };
 
 struct App
@@ -222,6 +1200,15 @@ struct App
     std::vector<Mesh>       meshes;
     std::vector<Model>      models;
 
+    // Global geometry storage shared by every mesh
+    GeometryHeap            geometry;
+
+    // Vertex arrays keyed by vertex heap, there is one heap per vertex layout
+    std::unordered_map<u32, Vao> vaoCache;
+
+    // Streaming of mesh and texture data
+    UploadManager           uploads;
+
     // Model indices
     u32 patrickModelIdx;
     u32 roomModelIdx;
@@ -232,7 +1219,9 @@ struct App
     u32 texturedMeshProgramIdx;
     // Deferred program indices
     u32 deferredGeometryPassProgramIdx;
+    u32 depthPrePassProgramIdx;
     u32 deferredLightingPassProgramIdx;
+    u32 gbufferDebugProgramIdx;
     u32 deferredLightProgramIdx;
     //skybox program
     u32 skyBox;
@@ -253,6 +1242,82 @@ struct App
 
     // Entities
     std::vector<Entity>     entities;
+    WorldBounds             worldBounds;
+    u64                     sceneVersion;           // bumped whenever entities, bounds or the BVH change
+    Bvh                     sceneBvh;
+    bool                    bvhCulling;
+    i32                     selectedEntity;         // picked in the Scene window, -1 for none
+    bool                    revealSelection;        // opens the selected entity in the Entities tree
+    std::vector<CullBenchmark> cullBenchmarks;
+
+    // Per pass draw lists, recorded into command lists by the workers
+    RenderQueue             renderQueues[RENDERPASS_COUNT];
+    CommandList             commandLists[RENDERPASS_COUNT];
+    JobSystem               jobs;
+    u32                     submittedCommands;
+
+    // Entities grouped by model, rebuilt every frame
+    Buffer                      instanceBuffer;
+    std::vector<InstanceGroup>  instanceGroups;
+    std::vector<u32>            instanceEntities;   // entity index of every instance
+
+    // Material parameters and the texture arrays their layers refer to
+    std::vector<TextureArray>   textureArrays;
+    Buffer                      materialBuffer;
+    IndirectStream              indirect;
+
+    // Depth pre-pass for the G-buffer and the samples it lets through
+    bool                    depthPrePass;
+    GLuint                  gbufferSampleQueries[GBUFFER_SAMPLE_QUERY_COUNT];
+    bool                    gbufferSampleQueryIssued[GBUFFER_SAMPLE_QUERY_COUNT];
+    u64                     gbufferSamples;
+
+    // Hi-Z occlusion culling of the G-buffer pass
+    bool                    occlusionCulling;
+    OcclusionCuller         occlusion;
+
+    // CPU depth buffer of the main view, tested before recording
+    bool                    softwareOcclusionCulling;
+    SoftwareOcclusion       softwareOcclusion;
+
+    // Levels of detail picked from the projected size of the submeshes
+    bool                    lodSelection;
+    i32                     reflectionLodBias;
+
+    // Every light of the frame in std430, and the tiled lighting pass reading it
+    Buffer                  lightBuffer;
+    LightingMode            lightingMode;
+    TiledLighting           tiledLighting;
+    LightVolumes            lightVolumes;
+    LightClusters           lightClusters;
+
+    // GPU time of the deferred lighting pass in whichever mode, read a few frames late
+    GLuint                  lightingTimestamps[GBUFFER_SAMPLE_QUERY_COUNT][2];
+    f32                     lightingTime;
+
+    // Baked views of every model, drawn instead of distant instances
+    bool                    impostors;
+    f32                     impostorDistance;
+    ImpostorAtlas           impostorAtlas;
+
+    // GPU culling of the meshlets of big submeshes
+    bool                    meshletCulling;
+    bool                    meshletConeCulling;
+    u32                     reloadModelIdx;         // requested from the Gui, handed to the next packet
+    u32                     uploadFrameBudget;      // Gui copy of uploads.frameBudget, which the render thread owns
+    MeshletCuller           meshlets;
+
+    // Water passes are skipped when the surface cannot contribute
+    bool                    conditionalWater;
+    WaterVisibility         water;
+    std::vector<SoftwareOcclusionBenchmark> softwareOcclusionBenchmarks;
+
+    // Simulation and render threads, frame is the packet being rendered
+    RenderThread            renderThread;
+    const FramePacket*      frame;
+
+    // Redundant state filtering for Render()
+    GLStateCache            glState;
     // Lights
     std::vector<Light>      lights;
 
@@ -269,10 +1334,16 @@ struct App
 
     // Uniforms
     GLint texturedMeshProgram_uTexture;
-    GLint texturedMeshProgram_uColor;
+    GLint texturedMeshProgram_uSkybox;
+    GLint texturedMeshProgram_uIrradiance;
+    GLint texturedMeshProgram_uCameraPos;
+    GLint texturedMeshProgram_uViewProjection;
+
+    GLint deferredGeometryProgram_uCameraPos;
+    GLint deferredGeometryProgram_uViewProjection;
+    GLint depthPrePassProgram_uViewProjection;
 
     GLint deferredGeometryProgram_uTexture;
-    GLint deferredGeometryProgram_uColor;
 
     GLint deferredGeometryProgram_uSkybox;
     GLint deferredGeometryProgram_uIrradiance;
@@ -281,17 +1352,23 @@ struct App
 
     GLint skyboxProgram_uSkybox;
 
-    GLint deferredLightingProgram_uGPosition;
+    GLint deferredLightingProgram_uDepth;
     GLint deferredLightingProgram_uGNormals;
     GLint deferredLightingProgram_uGDiffuse;
+    GLint deferredLightingProgram_uInverseViewProjection;
+    GLint deferredLightingProgram_uDirectionalOnly;
+
+    GLint gbufferDebugProgram_uDepth;
+    GLint gbufferDebugProgram_uGNormals;
+    GLint gbufferDebugProgram_uGDiffuse;
+    GLint gbufferDebugProgram_uInverseViewProjection;
+    GLint gbufferDebugProgram_uView;
 
     GLint clippedProgram_uProj;
     GLint clippedProgram_uView;
-    GLint clippedProgram_uModel;
     GLint clippedProgram_uClippingPlane;
     GLint clipperProgram_uTexture;
     GLint clipperProgram_uSkybox;
-    GLint clipperProgram_uColor;
 
     GLint waterEffectProgram_uProj;
     GLint waterEffectProgram_uView;
@@ -307,12 +1384,16 @@ struct App
     GLint waterEffectProgram_uSkybox;
 
     // Framebuffers ---------------------
-    // Deferred
+    RenderTargets renderTargets;
+
+    // Attachments of the set in use, copied from renderTargets every frame
+    // Deferred: octahedral normals (RG16_SNORM), albedo and metallic (RGBA8), depth
     GLuint gBuffer;
-    GLuint positionAttachmentHandle;
     GLuint normalsAttachmentHandle;
     GLuint diffuseAttachmentHandle;
     GLuint depthAttachmentHandle;
+    GLuint gbufferDebugBuffer;
+    GLuint gbufferDebugAttachmentHandle;
     GLuint cubeMapId;
     GLuint irradianceMapId;
 
@@ -385,13 +1466,29 @@ void Gui(App* app);
 
 void Update(App* app);
 
+// Copies the simulated state the renderer reads into a frame packet
+void FillFramePacket(App* app, FramePacket& packet);
+
+// Render thread, copies the counters of the frame just drawn for the Gui
+void FillRenderStats(App* app, RenderStats& stats);
+
+// Render thread only, draws app->frame
 void Render(App* app);
 
+void Shutdown(App* app);
+
+Image LoadImage(const char* filename);
+void FreeImage(Image image);
+
 u32 LoadTexture2D(App* app, const char* filepath);
 
 u32 LoadModel(App* app, const char* filename);
 
-GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program);
+// Frees the heap blocks of a model and allocates them again. Render thread only.
+void ReloadModelGeometry(App* app, u32 modelIdx);
+
+GLuint FindVAO(App* app, const Submesh& submesh);
+GLuint FindPositionVAO(App* app, const Submesh& submesh);
 
 u8 GetAttribComponentCount(const GLenum& type);
 
@@ -410,6 +1507,9 @@ glm::mat4 GetViewMatrix(Camera& cam);
 
 glm::mat4 GetProjectionMatrix(Camera& cam);
 
+// Shifts window space depth by -bias, same as writing gl_FragCoord.z - bias
+glm::mat4 BiasDepthProjection(const glm::mat4& projection, f32 bias);
+
 void HandleInput(App* app);
 
 void LoadSphere(App* app);
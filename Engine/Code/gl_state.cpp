@@ -0,0 +1,255 @@
+#include "gl_state.h"
+
+void InvalidateGLState(GLStateCache& state)
+{
+    state.program = UINT32_MAX;
+    state.vao = UINT32_MAX;
+    state.activeUnit = UINT32_MAX;
+    for (u32 unit = 0; unit < STATE_TEXTURE_UNITS; ++unit)
+        for (u32 target = 0; target < STATETEXTURE_COUNT; ++target)
+            state.textures[unit][target] = UINT32_MAX;
+    for (u32 binding = 0; binding < STATE_UNIFORM_BINDINGS; ++binding)
+        state.uniformRanges[binding] = UniformRange{ UINT32_MAX, 0, 0 };
+    state.blend = -1;
+    state.blendSrc = GL_NONE;
+    state.blendDst = GL_NONE;
+    state.depthTest = -1;
+    state.depthWrite = -1;
+    state.depthFunc = GL_NONE;
+    state.clipDistance0 = -1;
+    state.currentUniforms = NULL;
+}
+
+void ForgetProgramUniforms(GLStateCache& state, GLuint program)
+{
+    // Handles are recycled by the driver, a new program may get the same name
+    for (u32 i = 0; i < state.programUniforms.size(); ++i)
+    {
+        if (state.programUniforms[i].program == program)
+        {
+            state.programUniforms.erase(state.programUniforms.begin() + i);
+            break;
+        }
+    }
+    state.currentUniforms = NULL;
+    if (state.program == program)
+        state.program = UINT32_MAX;
+}
+
+void StateUseProgram(GLStateCache& state, GLuint program)
+{
+    if (state.program == program)
+    {
+        state.skippedCalls++;
+        return;
+    }
+
+    glUseProgram(program);
+    state.program = program;
+    state.issuedCalls++;
+
+    state.currentUniforms = NULL;
+    if (program == 0)
+        return;
+
+    for (ProgramUniformCache& cache : state.programUniforms)
+        if (cache.program == program)
+            state.currentUniforms = &cache;
+
+    if (!state.currentUniforms)
+    {
+        ProgramUniformCache cache = {};
+        cache.program = program;
+        state.programUniforms.push_back(cache);
+        state.currentUniforms = &state.programUniforms.back();
+    }
+}
+
+void StateBindVertexArray(GLStateCache& state, GLuint vao)
+{
+    if (state.vao == vao)
+    {
+        state.skippedCalls++;
+        return;
+    }
+
+    glBindVertexArray(vao);
+    state.vao = vao;
+    state.issuedCalls++;
+}
+
+u32 TextureTargetIndex(GLenum target)
+{
+    switch (target)
+    {
+    case GL_TEXTURE_2D:         return STATETEXTURE_2D;
+    case GL_TEXTURE_CUBE_MAP:   return STATETEXTURE_CUBE_MAP;
+    case GL_TEXTURE_2D_ARRAY:   return STATETEXTURE_2D_ARRAY;
+    default: ASSERT(false, "Texture target not tracked by the state cache"); return 0;
+    }
+}
+
+void StateBindTexture(GLStateCache& state, u32 unit, GLenum target, GLuint texture)
+{
+    ASSERT(unit < STATE_TEXTURE_UNITS, "Texture unit out of range");
+    GLuint& bound = state.textures[unit][TextureTargetIndex(target)];
+    if (bound == texture)
+    {
+        state.skippedCalls++;
+        return;
+    }
+
+    if (state.activeUnit != unit)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        state.activeUnit = unit;
+        state.issuedCalls++;
+    }
+
+    glBindTexture(target, texture);
+    bound = texture;
+    state.issuedCalls++;
+}
+
+void StateBindUniformRange(GLStateCache& state, u32 binding, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    ASSERT(binding < STATE_UNIFORM_BINDINGS, "Uniform buffer binding out of range");
+    UniformRange& range = state.uniformRanges[binding];
+    if (range.buffer == buffer && range.offset == offset && range.size == size)
+    {
+        state.skippedCalls++;
+        return;
+    }
+
+    glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, offset, size);
+    range = UniformRange{ buffer, offset, size };
+    state.issuedCalls++;
+}
+
+void StateEnable(GLStateCache& state, GLenum capability, bool enabled)
+{
+    i32* cached = NULL;
+    switch (capability)
+    {
+    case GL_BLEND:          cached = &state.blend; break;
+    case GL_DEPTH_TEST:     cached = &state.depthTest; break;
+    case GL_CLIP_DISTANCE0: cached = &state.clipDistance0; break;
+    default: ASSERT(false, "Capability not tracked by the state cache"); return;
+    }
+
+    if (*cached == (i32)enabled)
+    {
+        state.skippedCalls++;
+        return;
+    }
+
+    if (enabled) glEnable(capability);
+    else         glDisable(capability);
+    *cached = enabled ? 1 : 0;
+    state.issuedCalls++;
+}
+
+void StateBlendFunc(GLStateCache& state, GLenum src, GLenum dst)
+{
+    if (state.blendSrc == src && state.blendDst == dst)
+    {
+        state.skippedCalls++;
+        return;
+    }
+
+    glBlendFunc(src, dst);
+    state.blendSrc = src;
+    state.blendDst = dst;
+    state.issuedCalls++;
+}
+
+void StateDepthMask(GLStateCache& state, bool write)
+{
+    if (state.depthWrite == (i32)write)
+    {
+        state.skippedCalls++;
+        return;
+    }
+
+    glDepthMask(write ? GL_TRUE : GL_FALSE);
+    state.depthWrite = write ? 1 : 0;
+    state.issuedCalls++;
+}
+
+void StateDepthFunc(GLStateCache& state, GLenum func)
+{
+    if (state.depthFunc == func)
+    {
+        state.skippedCalls++;
+        return;
+    }
+
+    glDepthFunc(func);
+    state.depthFunc = func;
+    state.issuedCalls++;
+}
+
+// Returns true when the uniform value differs from the cached one (and records it)
+bool UpdateCachedUniform(GLStateCache& state, GLint location, const void* words, u32 wordCount)
+{
+    if (location < 0)
+        return false;
+
+    ProgramUniformCache* cache = state.currentUniforms;
+    if (!cache)
+        return true;
+
+    if ((u32)location >= cache->uniforms.size())
+        cache->uniforms.resize(location + 1, CachedUniform{});
+
+    CachedUniform& uniform = cache->uniforms[location];
+    if (uniform.valid && memcmp(uniform.words, words, wordCount * sizeof(u32)) == 0)
+    {
+        state.skippedCalls++;
+        return false;
+    }
+
+    memcpy(uniform.words, words, wordCount * sizeof(u32));
+    uniform.valid = true;
+    state.issuedCalls++;
+    return true;
+}
+
+void StateUniform1i(GLStateCache& state, GLint location, i32 value)
+{
+    if (UpdateCachedUniform(state, location, &value, 1))
+        glUniform1i(location, value);
+}
+
+void StateUniform1f(GLStateCache& state, GLint location, f32 value)
+{
+    if (UpdateCachedUniform(state, location, &value, 1))
+        glUniform1f(location, value);
+}
+
+void StateUniform2f(GLStateCache& state, GLint location, f32 x, f32 y)
+{
+    f32 v[] = { x, y };
+    if (UpdateCachedUniform(state, location, v, 2))
+        glUniform2f(location, x, y);
+}
+
+void StateUniform3f(GLStateCache& state, GLint location, f32 x, f32 y, f32 z)
+{
+    f32 v[] = { x, y, z };
+    if (UpdateCachedUniform(state, location, v, 3))
+        glUniform3f(location, x, y, z);
+}
+
+void StateUniform4f(GLStateCache& state, GLint location, f32 x, f32 y, f32 z, f32 w)
+{
+    f32 v[] = { x, y, z, w };
+    if (UpdateCachedUniform(state, location, v, 4))
+        glUniform4f(location, x, y, z, w);
+}
+
+void StateUniformMatrix4fv(GLStateCache& state, GLint location, const f32* values)
+{
+    if (UpdateCachedUniform(state, location, values, 16))
+        glUniformMatrix4fv(location, 1, GL_FALSE, values);
+}
@@ -0,0 +1,32 @@
+//
+// gl_state.h: Shadow GL state that filters out calls which would not change anything.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// Forgets every binding, to be called whenever code outside the cache may have touched GL state
+void InvalidateGLState(GLStateCache& state);
+
+// Drops the cached uniform values of a program that is about to be deleted
+void ForgetProgramUniforms(GLStateCache& state, GLuint program);
+
+void StateUseProgram(GLStateCache& state, GLuint program);
+void StateBindVertexArray(GLStateCache& state, GLuint vao);
+void StateBindTexture(GLStateCache& state, u32 unit, GLenum target, GLuint texture);
+void StateBindUniformRange(GLStateCache& state, u32 binding, GLuint buffer, GLintptr offset, GLsizeiptr size);
+
+void StateEnable(GLStateCache& state, GLenum capability, bool enabled);
+void StateBlendFunc(GLStateCache& state, GLenum src, GLenum dst);
+void StateDepthMask(GLStateCache& state, bool write);
+void StateDepthFunc(GLStateCache& state, GLenum func);
+
+// Uniform setters act on the program bound through StateUseProgram
+void StateUniform1i(GLStateCache& state, GLint location, i32 value);
+void StateUniform1f(GLStateCache& state, GLint location, f32 value);
+void StateUniform2f(GLStateCache& state, GLint location, f32 x, f32 y);
+void StateUniform3f(GLStateCache& state, GLint location, f32 x, f32 y, f32 z);
+void StateUniform4f(GLStateCache& state, GLint location, f32 x, f32 y, f32 z, f32 w);
+void StateUniformMatrix4fv(GLStateCache& state, GLint location, const f32* values);
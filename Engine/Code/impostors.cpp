@@ -0,0 +1,258 @@
+#include "impostors.h"
+#include "gl_state.h"
+#include "material_system.h"
+#include "command_list.h"
+#include <cfloat>
+
+vec3 OctahedralDirection(const vec2& p)
+{
+    // The upper half of the sphere maps to the inner diamond, the lower half
+    // is folded out over the corners
+    vec3 n = vec3(p.x, 1.0f - fabsf(p.x) - fabsf(p.y), p.y);
+    if (n.y < 0.0f)
+    {
+        n.x = (1.0f - fabsf(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f);
+        n.z = (1.0f - fabsf(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return glm::normalize(n);
+}
+
+GLuint CreateImpostorArray(GLenum internalFormat, u32 layers)
+{
+    const i32 size = IMPOSTOR_GRID * IMPOSTOR_FRAME_SIZE;
+
+    GLuint handle = 0;
+    glGenTextures(1, &handle);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, handle);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, IMPOSTOR_MIP_LEVELS, internalFormat, size, size, layers);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    return handle;
+}
+
+void BakeImpostors(App* app)
+{
+    ImpostorAtlas& atlas = app->impostorAtlas;
+    GLStateCache& state = app->glState;
+
+    // Object space bounding sphere of every model, over the boxes of its submeshes
+    atlas.modelLayers.assign(app->models.size(), UINT32_MAX);
+    atlas.spheres.clear();
+    for (u32 modelIdx = 0; modelIdx < app->models.size() && atlas.spheres.size() < IMPOSTOR_MAX_MODELS; ++modelIdx)
+    {
+        const Mesh& mesh = app->meshes[app->models[modelIdx].meshIdx];
+        if (mesh.submeshes.empty())
+            continue;
+
+        vec3 boxMin = mesh.submeshes[0].aabbMin;
+        vec3 boxMax = mesh.submeshes[0].aabbMax;
+        for (const Submesh& submesh : mesh.submeshes)
+        {
+            boxMin = glm::min(boxMin, submesh.aabbMin);
+            boxMax = glm::max(boxMax, submesh.aabbMax);
+        }
+
+        const f32 radius = glm::length(boxMax - boxMin) * 0.5f;
+        if (radius <= 0.0f)
+            continue;
+
+        atlas.modelLayers[modelIdx] = atlas.spheres.size();
+        atlas.spheres.push_back(vec4((boxMin + boxMax) * 0.5f, radius));
+    }
+
+    const u32 layerCount = glm::max((u32)atlas.spheres.size(), 1u);
+    atlas.albedoArray = CreateImpostorArray(GL_RGBA8, layerCount);
+    atlas.normalDepthArray = CreateImpostorArray(GL_RGBA16F, layerCount);
+
+    // Same set up as the irradiance capture, one layer of both arrays at a time
+    const i32 atlasSize = IMPOSTOR_GRID * IMPOSTOR_FRAME_SIZE;
+    GLuint framebuffer = 0;
+    GLuint depthRenderbuffer = 0;
+    glGenFramebuffers(1, &framebuffer);
+    glGenRenderbuffers(1, &depthRenderbuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, atlasSize, atlasSize);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRenderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    StateEnable(state, GL_DEPTH_TEST, true);
+    StateEnable(state, GL_BLEND, false);
+    StateEnable(state, GL_CLIP_DISTANCE0, false);
+    StateDepthMask(state, true);
+    StateDepthFunc(state, GL_LESS);
+
+    Program& bakeProgram = app->programs[atlas.bakeProgramIdx];
+    StateUseProgram(state, bakeProgram.handle);
+    StateUniform1i(state, atlas.bakeProgram_uTexture, 0);
+
+    for (u32 modelIdx = 0; modelIdx < app->models.size(); ++modelIdx)
+    {
+        const u32 layer = atlas.modelLayers[modelIdx];
+        if (layer == UINT32_MAX)
+            continue;
+
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, atlas.albedoArray, 0, layer);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, atlas.normalDepthArray, 0, layer);
+        GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glDrawBuffers(ARRAY_COUNT(buffers), buffers);
+
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            ELOG("BakeImpostors() - Incomplete impostor framebuffer");
+            atlas.modelLayers[modelIdx] = UINT32_MAX;
+            continue;
+        }
+
+        // Uncovered texels stay at zero coverage
+        glViewport(0, 0, atlasSize, atlasSize);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        const Model& model = app->models[modelIdx];
+        const Mesh& mesh = app->meshes[model.meshIdx];
+        const vec4& sphere = atlas.spheres[layer];
+        const vec3 center = vec3(sphere);
+        StateUniform4f(state, atlas.bakeProgram_uSphere, sphere.x, sphere.y, sphere.z, sphere.w);
+
+        // One orthographic frame per cell, looking at the center from the
+        // direction of the cell's middle
+        for (u32 y = 0; y < IMPOSTOR_GRID; ++y)
+        for (u32 x = 0; x < IMPOSTOR_GRID; ++x)
+        {
+            const vec2 cell = (vec2(x, y) + 0.5f) / (f32)IMPOSTOR_GRID * 2.0f - 1.0f;
+            const vec3 direction = OctahedralDirection(cell);
+            const vec3 up = fabsf(direction.y) > 0.99f ? vec3(0.0f, 0.0f, 1.0f) : vec3(0.0f, 1.0f, 0.0f);
+
+            const glm::mat4 view = glm::lookAt(center + direction * sphere.w, center, up);
+            const glm::mat4 projection = glm::ortho(-sphere.w, sphere.w, -sphere.w, sphere.w, 0.0f, 2.0f * sphere.w);
+            const glm::mat4 viewProjection = projection * view;
+
+            glViewport(x * IMPOSTOR_FRAME_SIZE, y * IMPOSTOR_FRAME_SIZE, IMPOSTOR_FRAME_SIZE, IMPOSTOR_FRAME_SIZE);
+            StateUniformMatrix4fv(state, atlas.bakeProgram_uViewProjection, &viewProjection[0][0]);
+            StateUniform3f(state, atlas.bakeProgram_uDirection, direction.x, direction.y, direction.z);
+
+            for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+            {
+                const Submesh& submesh = mesh.submeshes[i];
+                const Material& material = app->materials[model.materialIdx[i]];
+                const u32 albedoLayer = TextureLayer(app, material.albedoTextureIdx);
+
+                StateUniform3f(state, atlas.bakeProgram_uAlbedo, material.albedo.x, material.albedo.y, material.albedo.z);
+                StateUniform1i(state, atlas.bakeProgram_uAlbedoLayer, albedoLayer == NO_TEXTURE_LAYER ? -1 : (i32)albedoLayer);
+                StateBindTexture(state, 0, GL_TEXTURE_2D_ARRAY, GetAlbedoArray(app, material));
+                StateBindVertexArray(state, FindVAO(app, submesh));
+
+                glDrawElementsBaseVertex(GL_TRIANGLES, submesh.lods[0].indexCount, GL_UNSIGNED_INT,
+                                         (void*)(u64)((submesh.firstIndex + submesh.lods[0].firstIndex) * sizeof(u32)), submesh.baseVertex);
+            }
+        }
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(1, &depthRenderbuffer);
+    glDeleteFramebuffers(1, &framebuffer);
+    glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+
+    // Coverage is averaged down the chain, the shader divides it back out
+    glBindTexture(GL_TEXTURE_2D_ARRAY, atlas.albedoArray);
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, atlas.normalDepthArray);
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenBuffers(1, &atlas.sphereBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, atlas.sphereBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, layerCount * sizeof(vec4), atlas.spheres.empty() ? NULL : atlas.spheres.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    // The quad corners come from gl_VertexID, only the draw info is streamed
+    glGenVertexArrays(1, &atlas.vao);
+    StateBindVertexArray(state, atlas.vao);
+    glVertexAttribIFormat(DRAW_INFO_ATTRIBUTE, 2, GL_UNSIGNED_INT, 0);
+    glVertexAttribBinding(DRAW_INFO_ATTRIBUTE, VERTEX_BINDING_DRAW_INFO);
+    glVertexBindingDivisor(VERTEX_BINDING_DRAW_INFO, 1);
+    glEnableVertexAttribArray(DRAW_INFO_ATTRIBUTE);
+    glBindVertexBuffer(VERTEX_BINDING_DRAW_INFO, app->indirect.drawInfoBuffer.handle, 0, sizeof(DrawInfo));
+    StateBindVertexArray(state, 0);
+}
+
+void CollectImpostors(App* app, RenderQueue& queue, const vec3& eye)
+{
+    const FramePacket& frame = *app->frame;
+    const WorldBounds& bounds = frame.bounds;
+    const ImpostorAtlas& atlas = app->impostorAtlas;
+
+    queue.impostors.clear();
+    queue.impostorCount = 0;
+
+    for (const InstanceGroup& group : app->instanceGroups)
+    {
+        if (group.modelIdx >= atlas.modelLayers.size() || atlas.modelLayers[group.modelIdx] == UINT32_MAX)
+            continue;
+
+        const u32 layer = atlas.modelLayers[group.modelIdx];
+        const Mesh& mesh = app->meshes[app->models[group.modelIdx].meshIdx];
+        for (u32 instance = group.firstInstance; instance < group.firstInstance + group.instanceCount; ++instance)
+        {
+            // The whole instance switches at once, measured to its nearest submesh
+            const u32 firstBox = bounds.entityOffsets[app->instanceEntities[instance]];
+            f32 nearest = FLT_MAX;
+            bool visible = false;
+            for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+            {
+                const vec4& sphere = bounds.spheres[firstBox + i];
+                nearest = glm::min(nearest, glm::length(vec3(sphere) - eye) - sphere.w);
+                visible = visible || queue.visible[firstBox + i];
+            }
+
+            if (!visible || nearest < frame.impostorDistance)
+                continue;
+
+            for (u32 box = firstBox; box < firstBox + mesh.submeshes.size(); ++box)
+            {
+                if (!queue.visible[box])
+                    continue;
+                queue.visible[box] = 0;
+                if (box < queue.lods.size())
+                    queue.lodInstances[queue.lods[box]]--;
+            }
+            queue.impostors.push_back(DrawInfo{ instance, layer });
+        }
+    }
+
+    queue.impostorCount = queue.impostors.size();
+}
+
+void RecordImpostors(App* app, const RenderQueue& queue, const glm::mat4& viewProjection, const vec3& eye, CommandList& list)
+{
+    if (queue.impostors.empty())
+        return;
+
+    const ImpostorAtlas& atlas = app->impostorAtlas;
+
+    // After every occlusion candidate, whose draw infos must come first
+    const u32 firstDrawInfo = list.drawInfos.size();
+    list.drawInfos.insert(list.drawInfos.end(), queue.impostors.begin(), queue.impostors.end());
+
+    const Program& program = app->programs[atlas.programIdx];
+    CmdUseProgram(list, program.handle);
+    CmdUniformMatrix4(list, atlas.program_uViewProjection, viewProjection);
+    CmdUniform3f(list, atlas.program_uCameraPosition, eye.x, eye.y, eye.z);
+    CmdUniform1f(list, atlas.program_uGrid, (f32)IMPOSTOR_GRID);
+
+    CmdBindTexture(list, 1, GL_TEXTURE_CUBE_MAP, app->irradianceMapId);
+    CmdUniform1i(list, atlas.program_uIrradiance, 1);
+    CmdBindTexture(list, 2, GL_TEXTURE_CUBE_MAP, app->cubeMapId);
+    CmdUniform1i(list, atlas.program_uSkybox, 2);
+    CmdBindTexture(list, 3, GL_TEXTURE_2D_ARRAY, atlas.albedoArray);
+    CmdUniform1i(list, atlas.program_uAlbedo, 3);
+    CmdBindTexture(list, 4, GL_TEXTURE_2D_ARRAY, atlas.normalDepthArray);
+    CmdUniform1i(list, atlas.program_uNormalDepth, 4);
+
+    CmdBindVertexArray(list, atlas.vao);
+    CmdDrawArraysInstanced(list, GL_TRIANGLE_STRIP, 4, firstDrawInfo, queue.impostors.size());
+}
@@ -0,0 +1,25 @@
+//
+// impostors.h: Octahedral impostor atlases baked per model and drawn instead of distant instances.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// Unit direction of a point of the [-1, 1] square under the octahedral mapping,
+// the same as OctDecode in the impostor shaders
+vec3 OctahedralDirection(const vec2& p);
+
+// Renders every loaded model from all the directions of the grid into its atlas
+// layer. Both impostor programs must be loaded and the material textures
+// resident. GL thread only.
+void BakeImpostors(App* app);
+
+// Moves the instances of the queue that are far enough and have any visible
+// box from the regular draws to the impostor draws
+void CollectImpostors(App* app, RenderQueue& queue, const vec3& eye);
+
+// Records all the impostors of the queue as one instanced draw into the
+// G-buffer, with depth testing and writing already set up
+void RecordImpostors(App* app, const RenderQueue& queue, const glm::mat4& viewProjection, const vec3& eye, CommandList& list);
@@ -0,0 +1,88 @@
+#include "job_system.h"
+
+#define MAX_JOB_WORKERS 8
+
+void RunJobAndSignal(Job& job)
+{
+    job.function();
+    job.counter->fetch_sub(1, std::memory_order_release);
+}
+
+void WorkerLoop(JobSystem* jobs)
+{
+    for (;;)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(jobs->mutex);
+            jobs->wake.wait(lock, [jobs] { return jobs->quit || !jobs->queue.empty(); });
+            if (jobs->quit && jobs->queue.empty())
+                return;
+            job = std::move(jobs->queue.front());
+            jobs->queue.pop_front();
+        }
+        RunJobAndSignal(job);
+    }
+}
+
+void InitJobSystem(JobSystem& jobs, u32 workerCount)
+{
+    if (workerCount == 0)
+    {
+        // Leave a hardware thread to the GL thread
+        const u32 hardwareThreads = std::thread::hardware_concurrency();
+        workerCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+    }
+    workerCount = glm::min(workerCount, (u32)MAX_JOB_WORKERS);
+
+    jobs.quit = false;
+    for (u32 i = 0; i < workerCount; ++i)
+        jobs.workers.push_back(std::thread(WorkerLoop, &jobs));
+}
+
+void ShutdownJobSystem(JobSystem& jobs)
+{
+    {
+        std::lock_guard<std::mutex> lock(jobs.mutex);
+        jobs.quit = true;
+    }
+    jobs.wake.notify_all();
+
+    for (std::thread& worker : jobs.workers)
+        worker.join();
+    jobs.workers.clear();
+}
+
+void RunJob(JobSystem& jobs, JobCounter& counter, std::function<void()> function)
+{
+    counter.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(jobs.mutex);
+        jobs.queue.push_back(Job{ std::move(function), &counter });
+    }
+    jobs.wake.notify_one();
+}
+
+void WaitForJobs(JobSystem& jobs, JobCounter& counter)
+{
+    // Help out instead of sleeping, the jobs picked up may belong to other counters
+    while (counter.load(std::memory_order_acquire) > 0)
+    {
+        Job job;
+        bool found = false;
+        {
+            std::lock_guard<std::mutex> lock(jobs.mutex);
+            if (!jobs.queue.empty())
+            {
+                job = std::move(jobs.queue.front());
+                jobs.queue.pop_front();
+                found = true;
+            }
+        }
+
+        if (found)
+            RunJobAndSignal(job);
+        else
+            std::this_thread::yield();
+    }
+}
@@ -0,0 +1,19 @@
+//
+// job_system.h: Small pool of worker threads running CPU side frame work.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// Starts the workers, a count of zero picks one per spare hardware thread
+void InitJobSystem(JobSystem& jobs, u32 workerCount);
+void ShutdownJobSystem(JobSystem& jobs);
+
+// Queues a job, the counter is incremented now and decremented when the job is done.
+// Jobs run on worker threads and must never call GL.
+void RunJob(JobSystem& jobs, JobCounter& counter, std::function<void()> function);
+
+// Runs queued jobs on the calling thread until every job of the counter has finished
+void WaitForJobs(JobSystem& jobs, JobCounter& counter);
@@ -0,0 +1,198 @@
+#include "light_culling.h"
+#include "buffer_management.h"
+#include "gl_state.h"
+#include "culling.h"
+
+void UpdateLightBuffer(App* app)
+{
+    const std::vector<Light>& lights = app->frame->lights;
+
+    // std430: position + radius, color + intensity, direction + type
+    Buffer& buffer = app->lightBuffer;
+    const u32 requiredSize = glm::max((u32)lights.size(), 1u) * 3 * sizeof(vec4);
+    if (requiredSize > buffer.size)
+        buffer.size = glm::max(requiredSize, buffer.size * 2);
+
+    BindBuffer(buffer);
+    glBufferData(buffer.type, buffer.size, NULL, GL_STREAM_DRAW);
+    MapBuffer(buffer, GL_WRITE_ONLY);
+
+    for (const Light& light : lights)
+    {
+        PushVec3(buffer, light.position);
+        PushFloat(buffer, light.radius);
+        PushVec3(buffer, light.color);
+        PushFloat(buffer, light.intensity);
+        PushVec3(buffer, light.direction);
+        PushUInt(buffer, light.type);
+    }
+
+    UnmapBuffer(buffer);
+}
+
+void InitLightClusters(App* app)
+{
+    LightClusters& clusters = app->lightClusters;
+    glGenBuffers(1, &clusters.buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, LIGHT_CLUSTER_HEADER_SIZE + LIGHT_CLUSTER_COUNT * (1 + LIGHT_CLUSTER_MAX_LIGHTS) * sizeof(u32), NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void BuildLightClusters(App* app)
+{
+    const FramePacket& frame = *app->frame;
+    LightClusters& clusters = app->lightClusters;
+    GLStateCache& state = app->glState;
+
+    // The header tells every program how to find its cluster, the slices
+    // follow depth = near * exp(slice / scale). Fragments off the grid walk
+    // all the lights, whose count rides along.
+    const f32 nearPlane = frame.camera.nearPlane;
+    const f32 farPlane = frame.camera.farPlane;
+    const vec4 depth = vec4(nearPlane, LIGHT_CLUSTER_Z / logf(farPlane / nearPlane), farPlane, (f32)frame.lights.size());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.buffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(glm::mat4), &frame.viewMat[0][0]);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(glm::mat4), sizeof(glm::mat4), &frame.projectionMat[0][0]);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 2 * sizeof(glm::mat4), sizeof(vec4), &depth[0]);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    const glm::mat4 inverseProjection = glm::inverse(frame.projectionMat);
+    StateUseProgram(state, app->programs[clusters.buildProgramIdx].handle);
+    StateUniform1i(state, clusters.buildProgram_uLightCount, frame.lights.size());
+    StateUniformMatrix4fv(state, clusters.buildProgram_uInverseProjection, &inverseProjection[0][0]);
+
+    // One thread per cluster, every thread walks all the lights
+    glDispatchCompute((LIGHT_CLUSTER_COUNT + LIGHT_CLUSTER_GROUP_SIZE - 1) / LIGHT_CLUSTER_GROUP_SIZE, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void RunTiledLighting(App* app)
+{
+    const FramePacket& frame = *app->frame;
+    const TiledLighting& tiled = app->tiledLighting;
+    GLStateCache& state = app->glState;
+
+    StateUseProgram(state, app->programs[tiled.programIdx].handle);
+    StateUniformMatrix4fv(state, tiled.program_uProjection, &frame.sceneProjectionMat[0][0]);
+    StateUniformMatrix4fv(state, tiled.program_uView, &frame.viewMat[0][0]);
+    StateUniformMatrix4fv(state, tiled.program_uInverseViewProjection, &frame.inverseViewProjection[0][0]);
+    StateUniform1i(state, tiled.program_uLightCount, frame.lights.size());
+    StateUniform2f(state, tiled.program_uScreenSize, frame.displaySize.x, frame.displaySize.y);
+
+    StateUniform1i(state, tiled.program_uDepth, 1);
+    StateUniform1i(state, tiled.program_uGNormals, 2);
+    StateUniform1i(state, tiled.program_uGDiffuse, 3);
+    StateBindTexture(state, 1, GL_TEXTURE_2D, app->depthAttachmentHandle);
+    StateBindTexture(state, 2, GL_TEXTURE_2D, app->normalsAttachmentHandle);
+    StateBindTexture(state, 3, GL_TEXTURE_2D, app->diffuseAttachmentHandle);
+
+    glBindImageTexture(0, app->finalRenderAttachmentHandle, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+    glDispatchCompute((frame.displaySize.x + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE,
+                      (frame.displaySize.y + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE, 1);
+
+    // The final attachment is sampled by the scene panel and blended into by later passes
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+}
+
+GLuint CreateLightVolumeFramebuffer(GLuint finalRenderAttachment, GLuint depthStencilAttachment)
+{
+    GLuint framebuffer = 0;
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, finalRenderAttachment, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, depthStencilAttachment, 0);
+
+    GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT3 };
+    glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        ELOG("CreateLightVolumeFramebuffer() - Incomplete light volume framebuffer");
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return framebuffer;
+}
+
+void RunLightVolumes(App* app)
+{
+    const FramePacket& frame = *app->frame;
+    LightVolumes& volumes = app->lightVolumes;
+    GLStateCache& state = app->glState;
+
+    // The volumes test against a copy of the G-buffer depth, sampling the
+    // attachment they write stencil into would be a feedback loop
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, app->gBuffer);
+    glBlitFramebuffer(0, 0, frame.displaySize.x, frame.displaySize.y, 0, 0, frame.displaySize.x, frame.displaySize.y, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, volumes.framebuffer);
+
+    StateUseProgram(state, app->programs[volumes.programIdx].handle);
+    StateUniformMatrix4fv(state, volumes.program_uProjection, &frame.sceneProjectionMat[0][0]);
+    StateUniformMatrix4fv(state, volumes.program_uView, &frame.viewMat[0][0]);
+    StateUniformMatrix4fv(state, volumes.program_uInverseViewProjection, &frame.inverseViewProjection[0][0]);
+    StateUniform1i(state, volumes.program_uDepth, 1);
+    StateUniform1i(state, volumes.program_uGNormals, 2);
+    StateUniform1i(state, volumes.program_uGDiffuse, 3);
+    StateBindTexture(state, 1, GL_TEXTURE_2D, app->depthAttachmentHandle);
+    StateBindTexture(state, 2, GL_TEXTURE_2D, app->normalsAttachmentHandle);
+    StateBindTexture(state, 3, GL_TEXTURE_2D, app->diffuseAttachmentHandle);
+    StateBlendFunc(state, GL_ONE, GL_ONE);
+    StateDepthFunc(state, GL_LEQUAL);
+    StateDepthMask(state, false);
+
+    // The sphere strip winds clockwise seen from outside. Depth clamping keeps
+    // the far side of big lights from being clipped, and the cleared background
+    // at depth 1 still passes against it.
+    glFrontFace(GL_CW);
+    glCullFace(GL_FRONT);
+    glEnable(GL_DEPTH_CLAMP);
+    glEnable(GL_STENCIL_TEST);
+    glClear(GL_STENCIL_BUFFER_BIT);
+
+    // The lighting pass draws the same volume footprint as the stencil pass and shades without
+    // discarding, so it zeroes every pixel the stencil pass marked and leaves the stencil clean
+    const Frustum frustum = FrustumFromMatrix(frame.sceneProjectionMat * frame.viewMat);
+    volumes.drawnLights = 0;
+    for (u32 i = 0; i < frame.lights.size(); ++i)
+    {
+        const Light& light = frame.lights[i];
+        if (light.type != LIGHTTYPE_POINT)
+            continue;
+
+        bool inView = true;
+        for (u32 p = 0; p < 6 && inView; ++p)
+            inView = glm::dot(vec3(frustum.planes[p]), light.position) + frustum.planes[p].w >= -light.radius;
+        if (!inView)
+            continue;
+
+        StateUniform1i(state, volumes.program_uLightIndex, i);
+
+        // Stencil: non zero where the stored depth lies between the front and back faces
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        StateEnable(state, GL_DEPTH_TEST, true);
+        glDisable(GL_CULL_FACE);
+        glStencilFunc(GL_ALWAYS, 0, 0xFF);
+        glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+        glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+        RenderSphere(app);
+
+        // Lighting: the inner faces cover the whole sphere on screen, even from inside it
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        StateEnable(state, GL_DEPTH_TEST, false);
+        StateEnable(state, GL_BLEND, true);
+        glEnable(GL_CULL_FACE);
+        glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+        RenderSphere(app);
+
+        volumes.drawnLights++;
+    }
+
+    glDisable(GL_STENCIL_TEST);
+    glDisable(GL_DEPTH_CLAMP);
+    glDisable(GL_CULL_FACE);
+    glCullFace(GL_BACK);
+    glFrontFace(GL_CCW);
+    StateEnable(state, GL_DEPTH_TEST, true);
+    StateDepthMask(state, true);
+}
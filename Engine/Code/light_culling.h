@@ -0,0 +1,31 @@
+//
+// light_culling.h: Light lists per screen tile and per froxel, and stencil tested light volumes, so shading only visits the lights that can reach a pixel.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// Writes every light of the frame packet to the light storage buffer
+void UpdateLightBuffer(App* app);
+
+// Creates the cluster buffer, the build program must already be loaded
+void InitLightClusters(App* app);
+
+// Assigns the lights of the frame to the froxels of the main camera. The
+// light buffer must be bound at STORAGE_BINDING_LIGHTS.
+void BuildLightClusters(App* app);
+
+// Shades the G-buffer into the final render attachment one tile per
+// workgroup. The light buffer must be bound at STORAGE_BINDING_LIGHTS.
+void RunTiledLighting(App* app);
+
+// Framebuffer of the final render attachment over a depth and stencil of its
+// own, which the light volumes are drawn into
+GLuint CreateLightVolumeFramebuffer(GLuint finalRenderAttachment, GLuint depthStencilAttachment);
+
+// Adds every point light of the frame inside the view onto the bound light
+// volume framebuffer, one stencil and one lighting pass per light. The light
+// buffer must be bound at STORAGE_BINDING_LIGHTS.
+void RunLightVolumes(App* app);
@@ -0,0 +1,327 @@
+#include "lod.h"
+#include <algorithm>
+#include <cfloat>
+
+// New triangle normals must stay within about 80 degrees of the old ones
+#define LOD_FLIP_MIN_DOT 0.2f
+
+// Symmetric 4x4 matrix summing the squared distances to a set of planes
+struct Quadric
+{
+    f64 xx, xy, xz, xw, yy, yz, yw, zz, zw, ww;
+};
+
+void AddPlane(Quadric& q, const vec3& n, f32 d)
+{
+    q.xx += n.x * n.x; q.xy += n.x * n.y; q.xz += n.x * n.z; q.xw += n.x * d;
+    q.yy += n.y * n.y; q.yz += n.y * n.z; q.yw += n.y * d;
+    q.zz += n.z * n.z; q.zw += n.z * d;
+    q.ww += d * d;
+}
+
+void AddQuadric(Quadric& q, const Quadric& other)
+{
+    q.xx += other.xx; q.xy += other.xy; q.xz += other.xz; q.xw += other.xw;
+    q.yy += other.yy; q.yz += other.yz; q.yw += other.yw;
+    q.zz += other.zz; q.zw += other.zw;
+    q.ww += other.ww;
+}
+
+f64 QuadricError(const Quadric& a, const Quadric& b, const vec3& p)
+{
+    const f64 x = p.x, y = p.y, z = p.z;
+    const f64 error = (a.xx + b.xx) * x * x + 2.0 * (a.xy + b.xy) * x * y + 2.0 * (a.xz + b.xz) * x * z + 2.0 * (a.xw + b.xw) * x +
+                      (a.yy + b.yy) * y * y + 2.0 * (a.yz + b.yz) * y * z + 2.0 * (a.yw + b.yw) * y +
+                      (a.zz + b.zz) * z * z + 2.0 * (a.zw + b.zw) * z +
+                      (a.ww + b.ww);
+    return error > 0.0 ? error : 0.0;
+}
+
+u32 SimplifyIndices(const std::vector<vec3>& positions, const std::vector<u32>& indices, u32 targetTriangles, std::vector<u32>& result)
+{
+    const u32 vertexCount = positions.size();
+    const u32 triangleCount = indices.size() / 3;
+
+    // Vertices sharing a position (UV and hard normal seams) are welded, to
+    // find the borders and to lock the seams, which only move as a whole
+    std::vector<u32> order(vertexCount);
+    for (u32 i = 0; i < vertexCount; ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&](u32 a, u32 b)
+    {
+        const vec3& pa = positions[a];
+        const vec3& pb = positions[b];
+        return pa.x != pb.x ? pa.x < pb.x : pa.y != pb.y ? pa.y < pb.y : pa.z < pb.z;
+    });
+
+    std::vector<u32> weld(vertexCount);
+    std::vector<u8> locked(vertexCount, 0);
+    for (u32 first = 0; first < vertexCount;)
+    {
+        u32 last = first + 1;
+        while (last < vertexCount && positions[order[last]] == positions[order[first]])
+            ++last;
+        for (u32 i = first; i < last; ++i)
+        {
+            weld[order[i]] = order[first];
+            locked[order[i]] = last - first > 1;
+        }
+        first = last;
+    }
+
+    std::vector<u32> triangles(indices.begin(), indices.begin() + triangleCount * 3);
+    std::vector<u8> dead(triangleCount, 0);
+    u32 live = triangleCount;
+
+    // Welded edges not shared by exactly two triangles are borders or non manifold
+    std::vector<u64> edges;
+    edges.reserve(triangleCount * 3);
+    for (u32 t = 0; t < triangleCount; ++t)
+    {
+        const u32* tri = &triangles[t * 3];
+        if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0])
+        {
+            dead[t] = 1;
+            live--;
+            continue;
+        }
+        for (u32 k = 0; k < 3; ++k)
+        {
+            const u32 a = weld[tri[k]];
+            const u32 b = weld[tri[(k + 1) % 3]];
+            edges.push_back(((u64)glm::min(a, b) << 32) | glm::max(a, b));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    std::vector<u8> lockedWeld(vertexCount, 0);
+    for (u32 first = 0; first < edges.size();)
+    {
+        u32 last = first + 1;
+        while (last < edges.size() && edges[last] == edges[first])
+            ++last;
+        if (last - first != 2)
+        {
+            lockedWeld[edges[first] >> 32] = 1;
+            lockedWeld[edges[first] & 0xFFFFFFFF] = 1;
+        }
+        first = last;
+    }
+    for (u32 v = 0; v < vertexCount; ++v)
+        locked[v] |= lockedWeld[weld[v]];
+
+    std::vector<Quadric> quadrics(vertexCount, Quadric{});
+    for (u32 t = 0; t < triangleCount; ++t)
+    {
+        if (dead[t])
+            continue;
+        const vec3& a = positions[triangles[t * 3]];
+        const vec3 normal = glm::cross(positions[triangles[t * 3 + 1]] - a, positions[triangles[t * 3 + 2]] - a);
+        const f32 length = glm::length(normal);
+        if (length <= 0.0f)
+            continue;
+        const vec3 n = normal / length;
+        for (u32 k = 0; k < 3; ++k)
+            AddPlane(quadrics[weld[triangles[t * 3 + k]]], n, -glm::dot(n, a));
+    }
+
+    // Passes collapse the cheapest edges first, each vertex is moved or
+    // touched at most once per pass so the adjacency stays valid
+    std::vector<u32> adjacencyOffsets(vertexCount + 1);
+    std::vector<u32> adjacency;
+    std::vector<f64> bestCost(vertexCount);
+    std::vector<u32> bestTarget(vertexCount);
+    std::vector<u32> candidates;
+    std::vector<u8> touched(vertexCount);
+
+    while (live > targetTriangles)
+    {
+        std::fill(adjacencyOffsets.begin(), adjacencyOffsets.end(), 0);
+        for (u32 t = 0; t < triangleCount; ++t)
+            if (!dead[t])
+                for (u32 k = 0; k < 3; ++k)
+                    adjacencyOffsets[triangles[t * 3 + k] + 1]++;
+        for (u32 v = 0; v < vertexCount; ++v)
+            adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+        adjacency.resize(adjacencyOffsets[vertexCount]);
+        std::vector<u32> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+        for (u32 t = 0; t < triangleCount; ++t)
+            if (!dead[t])
+                for (u32 k = 0; k < 3; ++k)
+                    adjacency[fill[triangles[t * 3 + k]]++] = t;
+
+        std::fill(bestCost.begin(), bestCost.end(), -1.0);
+        for (u32 t = 0; t < triangleCount; ++t)
+        {
+            if (dead[t])
+                continue;
+            for (u32 k = 0; k < 3; ++k)
+            {
+                const u32 a = triangles[t * 3 + k];
+                if (locked[a])
+                    continue;
+                for (u32 j = 1; j < 3; ++j)
+                {
+                    const u32 b = triangles[t * 3 + (k + j) % 3];
+                    const f64 cost = QuadricError(quadrics[weld[a]], quadrics[weld[b]], positions[b]);
+                    if (bestCost[a] < 0.0 || cost < bestCost[a])
+                    {
+                        bestCost[a] = cost;
+                        bestTarget[a] = b;
+                    }
+                }
+            }
+        }
+
+        candidates.clear();
+        for (u32 v = 0; v < vertexCount; ++v)
+            if (bestCost[v] >= 0.0)
+                candidates.push_back(v);
+        std::sort(candidates.begin(), candidates.end(), [&](u32 a, u32 b) { return bestCost[a] < bestCost[b]; });
+
+        std::fill(touched.begin(), touched.end(), 0);
+        u32 collapses = 0;
+        for (u32 a : candidates)
+        {
+            if (live <= targetTriangles)
+                break;
+
+            const u32 b = bestTarget[a];
+            if (touched[a] || touched[b])
+                continue;
+
+            // Rejected when a triangle that survives would flip or degenerate
+            bool valid = true;
+            for (u32 i = adjacencyOffsets[a]; i < adjacencyOffsets[a + 1] && valid; ++i)
+            {
+                const u32* tri = &triangles[adjacency[i] * 3];
+                if (tri[0] == b || tri[1] == b || tri[2] == b)
+                    continue;
+
+                vec3 corners[3];
+                for (u32 k = 0; k < 3; ++k)
+                    corners[k] = positions[tri[k]];
+                const vec3 before = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+                for (u32 k = 0; k < 3; ++k)
+                    if (tri[k] == a)
+                        corners[k] = positions[b];
+                const vec3 after = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+                valid = glm::dot(before, after) > LOD_FLIP_MIN_DOT * glm::length(before) * glm::length(after);
+            }
+            if (!valid)
+                continue;
+
+            for (u32 i = adjacencyOffsets[a]; i < adjacencyOffsets[a + 1]; ++i)
+            {
+                const u32 t = adjacency[i];
+                u32* tri = &triangles[t * 3];
+                for (u32 k = 0; k < 3; ++k)
+                    touched[tri[k]] = 1;
+
+                if (tri[0] == b || tri[1] == b || tri[2] == b)
+                {
+                    dead[t] = 1;
+                    live--;
+                }
+                else
+                {
+                    for (u32 k = 0; k < 3; ++k)
+                        if (tri[k] == a)
+                            tri[k] = b;
+                }
+            }
+
+            AddQuadric(quadrics[weld[b]], quadrics[weld[a]]);
+            collapses++;
+        }
+
+        if (collapses == 0)
+            break;
+    }
+
+    result.clear();
+    result.reserve(live * 3);
+    for (u32 t = 0; t < triangleCount; ++t)
+        if (!dead[t])
+            result.insert(result.end(), &triangles[t * 3], &triangles[t * 3] + 3);
+
+    return live;
+}
+
+void BuildLodChain(const std::vector<vec3>& positions, std::vector<u32>& indices, SubmeshLod* lods, u32& lodCount)
+{
+    lods[0] = SubmeshLod{ 0, (u32)indices.size() };
+    lodCount = 1;
+
+    // Every level simplifies the one before, which is cheaper than starting
+    // from the full mesh each time and keeps the levels nested
+    std::vector<u32> source(indices);
+    std::vector<u32> simplified;
+    while (lodCount < LOD_MAX_COUNT)
+    {
+        const u32 sourceTriangles = source.size() / 3;
+        const u32 target = (u32)(sourceTriangles * LOD_REDUCTION);
+        if (target < LOD_MIN_TRIANGLES)
+            break;
+
+        // Meshes held in place by their seams stop making progress, a level
+        // that saves little is not worth the switch
+        const u32 triangles = SimplifyIndices(positions, source, target, simplified);
+        if (triangles > sourceTriangles * (1.0f + LOD_REDUCTION) * 0.5f)
+            break;
+
+        lods[lodCount++] = SubmeshLod{ (u32)indices.size(), triangles * 3 };
+        indices.insert(indices.end(), simplified.begin(), simplified.end());
+        source.swap(simplified);
+    }
+}
+
+f32 PixelsPerUnit(const Camera& camera, f32 screenHeight)
+{
+    return screenHeight / (2.0f * tanf(glm::radians(camera.fov) * 0.5f));
+}
+
+void SelectLods(App* app, RenderQueue& queue, const vec3& eye, f32 pixelsPerUnit, u32 bias)
+{
+    const FramePacket& frame = *app->frame;
+    const WorldBounds& bounds = frame.bounds;
+
+    // Boxes keep their index while the entities do not change
+    if (queue.lods.size() != queue.visible.size())
+        queue.lods.assign(queue.visible.size(), 0);
+    for (u32 lod = 0; lod < LOD_MAX_COUNT; ++lod)
+        queue.lodInstances[lod] = 0;
+
+    const f32 sizeScale = frame.lodSelection ? 2.0f * pixelsPerUnit * ldexpf(1.0f, -(i32)bias) : 0.0f;
+
+    for (const InstanceGroup& group : app->instanceGroups)
+    {
+        const Mesh& mesh = app->meshes[app->models[group.modelIdx].meshIdx];
+        for (u32 instance = group.firstInstance; instance < group.firstInstance + group.instanceCount; ++instance)
+        {
+            const u32 firstBox = bounds.entityOffsets[app->instanceEntities[instance]];
+            for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+            {
+                const u32 box = firstBox + i;
+                if (!queue.visible[box])
+                    continue;
+
+                // Diameter on screen, unbounded with the eye inside the sphere
+                const vec4& sphere = bounds.spheres[box];
+                const f32 distance = glm::length(vec3(sphere) - eye);
+                const f32 size = !frame.lodSelection ? FLT_MAX :
+                                 distance <= sphere.w ? FLT_MAX : sphere.w * sizeScale / distance;
+
+                // Moving a level needs the size a fraction past the threshold between them
+                const u32 lodCount = mesh.submeshes[i].lodCount;
+                u32 lod = glm::min((u32)queue.lods[box], lodCount - 1);
+                while (lod + 1 < lodCount && size < ldexpf(LOD_SCREEN_SIZE, -(i32)lod) * (1.0f - LOD_HYSTERESIS))
+                    lod++;
+                while (lod > 0 && size > ldexpf(LOD_SCREEN_SIZE, 1 - (i32)lod) * (1.0f + LOD_HYSTERESIS))
+                    lod--;
+
+                queue.lods[box] = lod;
+                queue.lodInstances[lod]++;
+            }
+        }
+    }
+}
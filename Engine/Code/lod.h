@@ -0,0 +1,24 @@
+//
+// lod.h: Quadric error simplification of submeshes into LOD chains and their per view selection.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// Collapses edges onto their cheapest neighbour until the triangle count drops
+// to the target or nothing collapses anymore. Seams and borders never move, so
+// the result keeps indexing the same vertices. Returns the triangles left.
+u32 SimplifyIndices(const std::vector<vec3>& positions, const std::vector<u32>& indices, u32 targetTriangles, std::vector<u32>& result);
+
+// Appends up to LOD_MAX_COUNT - 1 simplified levels to the indices, each with
+// about LOD_REDUCTION of the triangles of the level before
+void BuildLodChain(const std::vector<vec3>& positions, std::vector<u32>& indices, SubmeshLod* lods, u32& lodCount);
+
+// Picks the level of every visible box of the queue from its projected size,
+// biased the given number of levels coarser
+void SelectLods(App* app, RenderQueue& queue, const vec3& eye, f32 pixelsPerUnit, u32 bias);
+
+// Screen pixels covered by a unit long segment at unit distance
+f32 PixelsPerUnit(const Camera& camera, f32 screenHeight);
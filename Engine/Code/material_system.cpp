@@ -0,0 +1,152 @@
+#include "material_system.h"
+#include "buffer_management.h"
+#include "upload_manager.h"
+
+u32 MipLevelCount(ivec2 size)
+{
+    u32 levels = 1;
+    i32 largest = glm::max(size.x, size.y);
+    while (largest > 1)
+    {
+        largest >>= 1;
+        levels++;
+    }
+    return levels;
+}
+
+void AllocateArrayStorage(TextureArray& array)
+{
+    glGenTextures(1, &array.handle);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array.handle);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, array.levels, array.internalFormat, array.size.x, array.size.y, array.layerCapacity);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+// Immutable storage cannot be resized, so the layers are copied to a new array twice as deep
+void GrowTextureArray(App* app, TextureArray& array)
+{
+    // Queued uploads still point to the old array
+    FlushUploads(app);
+
+    TextureArray grown = array;
+    grown.layerCapacity = array.layerCapacity * 2;
+    AllocateArrayStorage(grown);
+
+    for (u32 level = 0; level < array.levels; ++level)
+    {
+        const i32 width = glm::max(array.size.x >> level, 1);
+        const i32 height = glm::max(array.size.y >> level, 1);
+        glCopyImageSubData(array.handle, GL_TEXTURE_2D_ARRAY, level, 0, 0, 0,
+                           grown.handle, GL_TEXTURE_2D_ARRAY, level, 0, 0, 0,
+                           width, height, array.layerCount);
+    }
+
+    glDeleteTextures(1, &array.handle);
+    array = grown;
+}
+
+u32 FindOrCreateTextureArray(App* app, ivec2 size, GLenum internalFormat)
+{
+    for (u32 i = 0; i < app->textureArrays.size(); ++i)
+    {
+        const TextureArray& array = app->textureArrays[i];
+        if (array.size == size && array.internalFormat == internalFormat)
+            return i;
+    }
+
+    TextureArray array = {};
+    array.size = size;
+    array.internalFormat = internalFormat;
+    array.levels = MipLevelCount(size);
+    array.layerCapacity = 1;
+    AllocateArrayStorage(array);
+
+    app->textureArrays.push_back(array);
+    return app->textureArrays.size() - 1;
+}
+
+u32 LoadMaterialTexture(App* app, const char* filepath)
+{
+    for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
+        if (app->textures[texIdx].filepath == filepath && app->textures[texIdx].arrayIdx != UINT32_MAX)
+            return texIdx;
+
+    Image image = LoadImage(filepath);
+    if (!image.pixels)
+        return UINT32_MAX;
+
+    GLenum internalFormat = GL_RGB8;
+    GLenum dataFormat     = GL_RGB;
+
+    switch (image.nchannels)
+    {
+        case 3: dataFormat = GL_RGB; internalFormat = GL_RGB8; break;
+        case 4: dataFormat = GL_RGBA; internalFormat = GL_RGBA8; break;
+        default: ELOG("LoadMaterialTexture() - Unsupported number of channels");
+    }
+
+    const u32 arrayIdx = FindOrCreateTextureArray(app, image.size, internalFormat);
+    TextureArray& array = app->textureArrays[arrayIdx];
+    if (array.layerCount == array.layerCapacity)
+        GrowTextureArray(app, array);
+
+    Texture tex = {};
+    tex.filepath = filepath;
+    tex.arrayIdx = arrayIdx;
+    tex.arrayLayer = array.layerCount++;
+
+    StageTextureLayerUpload(app, array.handle, tex.arrayLayer, image.size, dataFormat, GL_UNSIGNED_BYTE, image.pixels, image.stride, true);
+    FreeImage(image);
+
+    app->textures.push_back(tex);
+    return app->textures.size() - 1;
+}
+
+bool HasTexture(u32 textureIdx)
+{
+    // Materials are zero initialized, so index 0 also means no texture
+    return textureIdx < UINT32_MAX && textureIdx != 0;
+}
+
+u32 TextureLayer(App* app, u32 textureIdx)
+{
+    return HasTexture(textureIdx) ? app->textures[textureIdx].arrayLayer : NO_TEXTURE_LAYER;
+}
+
+GLuint GetAlbedoArray(App* app, const Material& material)
+{
+    if (!HasTexture(material.albedoTextureIdx))
+        return 0;
+    return app->textureArrays[app->textures[material.albedoTextureIdx].arrayIdx].handle;
+}
+
+// std430 layout: vec4 albedo, vec4 emissive + smoothness, uvec4 layers
+#define MATERIAL_STRIDE (2 * sizeof(vec4) + 4 * sizeof(u32))
+
+void UpdateMaterialBuffer(App* app)
+{
+    Buffer& buffer = app->materialBuffer;
+    const u32 requiredSize = app->materials.size() * MATERIAL_STRIDE;
+    if (requiredSize > buffer.size)
+        buffer.size = glm::max(requiredSize, buffer.size * 2);
+
+    BindBuffer(buffer);
+    glBufferData(buffer.type, buffer.size, NULL, GL_STREAM_DRAW);
+    MapBuffer(buffer, GL_WRITE_ONLY);
+
+    for (const Material& material : app->materials)
+    {
+        PushVec4(buffer, vec4(material.albedo, 1.0F));
+        PushVec4(buffer, vec4(material.emissive, material.smoothness));
+        PushUInt(buffer, TextureLayer(app, material.albedoTextureIdx));
+        PushUInt(buffer, TextureLayer(app, material.emissiveTextureIdx));
+        PushUInt(buffer, TextureLayer(app, material.specularTextureIdx));
+        PushUInt(buffer, TextureLayer(app, material.normalsTextureIdx));
+    }
+
+    UnmapBuffer(buffer);
+}
@@ -0,0 +1,21 @@
+//
+// material_system.h: Material textures packed into texture arrays and material parameters in a storage buffer.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// Loads the image into a layer of the texture array matching its size and format.
+// Returns the texture index, UINT32_MAX if the file could not be read.
+u32 LoadMaterialTexture(App* app, const char* filepath);
+
+// Layer of the texture inside its array, NO_TEXTURE_LAYER for none
+u32 TextureLayer(App* app, u32 textureIdx);
+
+// Texture array holding the material's albedo, 0 when it has none
+GLuint GetAlbedoArray(App* app, const Material& material);
+
+// Writes albedo, emissive, smoothness and texture layers of every material to the material storage buffer
+void UpdateMaterialBuffer(App* app);
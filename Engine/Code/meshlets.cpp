@@ -0,0 +1,236 @@
+#include "meshlets.h"
+#include "gl_state.h"
+#include <algorithm>
+
+// Below this the normals of a meshlet spread over a half space or more
+#define MESHLET_CONE_MIN_DOT 0.1f
+
+Meshlet MakeMeshlet(const std::vector<vec3>& positions, const std::vector<u32>& indices, u32 firstIndex, u32 indexCount)
+{
+    Meshlet meshlet = {};
+    meshlet.firstIndex = firstIndex;
+    meshlet.indexCount = indexCount;
+
+    vec3 boxMin = positions[indices[firstIndex]];
+    vec3 boxMax = boxMin;
+    for (u32 i = firstIndex; i < firstIndex + indexCount; ++i)
+    {
+        boxMin = glm::min(boxMin, positions[indices[i]]);
+        boxMax = glm::max(boxMax, positions[indices[i]]);
+    }
+
+    meshlet.center = (boxMin + boxMax) * 0.5f;
+    for (u32 i = firstIndex; i < firstIndex + indexCount; ++i)
+        meshlet.radius = glm::max(meshlet.radius, glm::length(positions[indices[i]] - meshlet.center));
+
+    // Axis along the average normal, degenerate triangles face nowhere and are left out
+    std::vector<vec3> normals;
+    vec3 normalSum = vec3(0.0f);
+    for (u32 i = firstIndex; i + 2 < firstIndex + indexCount; i += 3)
+    {
+        const vec3& a = positions[indices[i]];
+        const vec3 normal = glm::cross(positions[indices[i + 1]] - a, positions[indices[i + 2]] - a);
+        const f32 length = glm::length(normal);
+        if (length > 1.0e-12f)
+        {
+            normals.push_back(normal / length);
+            normalSum += normal / length;
+        }
+    }
+
+    meshlet.coneAxis = vec3(0.0f, 1.0f, 0.0f);
+    meshlet.coneApex = meshlet.center;
+    meshlet.coneCutoff = 2.0f;
+    if (normals.empty() || glm::length(normalSum) < 1.0e-6f)
+        return meshlet;
+
+    const vec3 axis = glm::normalize(normalSum);
+    f32 minDot = 1.0f;
+    for (const vec3& normal : normals)
+        minDot = glm::min(minDot, glm::dot(axis, normal));
+    if (minDot <= MESHLET_CONE_MIN_DOT)
+        return meshlet;
+
+    // The apex is moved back along the axis until every triangle plane is in
+    // front of it, so any eye seeing it inside the cone sees all the backs
+    f32 apexDistance = 0.0f;
+    u32 normal = 0;
+    for (u32 i = firstIndex; i + 2 < firstIndex + indexCount; i += 3)
+    {
+        const vec3& a = positions[indices[i]];
+        const vec3 triangleNormal = glm::cross(positions[indices[i + 1]] - a, positions[indices[i + 2]] - a);
+        if (glm::length(triangleNormal) <= 1.0e-12f)
+            continue;
+
+        const vec3& n = normals[normal++];
+        apexDistance = glm::max(apexDistance, glm::dot(meshlet.center - a, n) / glm::dot(axis, n));
+    }
+
+    meshlet.coneAxis = axis;
+    meshlet.coneApex = meshlet.center - axis * apexDistance;
+    meshlet.coneCutoff = sqrtf(1.0f - minDot * minDot);
+    return meshlet;
+}
+
+void BuildMeshlets(const std::vector<vec3>& positions, const std::vector<u32>& indices, std::vector<Meshlet>& meshlets)
+{
+    meshlets.clear();
+
+    // Greedy in index order, which the importer already sorted for vertex
+    // cache locality, so neighbouring triangles land together and every
+    // meshlet stays a contiguous range of the submesh's indices
+    const u32 indexCount = indices.size() - indices.size() % 3;
+    std::vector<u32> vertices;
+    vertices.reserve(MESHLET_MAX_VERTICES);
+    u32 firstIndex = 0;
+
+    for (u32 i = 0; i < indexCount; i += 3)
+    {
+        u32 newVertices[3];
+        u32 newCount = 0;
+        for (u32 corner = 0; corner < 3; ++corner)
+        {
+            const u32 vertex = indices[i + corner];
+            if (std::find(vertices.begin(), vertices.end(), vertex) == vertices.end() &&
+                std::find(newVertices, newVertices + newCount, vertex) == newVertices + newCount)
+                newVertices[newCount++] = vertex;
+        }
+
+        if (vertices.size() + newCount > MESHLET_MAX_VERTICES || (i - firstIndex) / 3 == MESHLET_MAX_TRIANGLES)
+        {
+            meshlets.push_back(MakeMeshlet(positions, indices, firstIndex, i - firstIndex));
+            firstIndex = i;
+            vertices.clear();
+        }
+
+        for (u32 corner = 0; corner < 3; ++corner)
+        {
+            const u32 vertex = indices[i + corner];
+            if (std::find(vertices.begin(), vertices.end(), vertex) == vertices.end())
+                vertices.push_back(vertex);
+        }
+    }
+
+    if (indexCount > firstIndex)
+        meshlets.push_back(MakeMeshlet(positions, indices, firstIndex, indexCount - firstIndex));
+}
+
+void InitMeshletCuller(App* app)
+{
+    MeshletCuller& culler = app->meshlets;
+
+    std::vector<Meshlet> allMeshlets;
+    for (Mesh& mesh : app->meshes)
+    {
+        for (Submesh& submesh : mesh.submeshes)
+        {
+            submesh.firstMeshlet = allMeshlets.size();
+            allMeshlets.insert(allMeshlets.end(), submesh.meshlets.begin(), submesh.meshlets.end());
+        }
+    }
+    culler.meshletCount = allMeshlets.size();
+
+    glGenBuffers(1, &culler.meshletBuffer);
+    glGenBuffers(1, &culler.drawBuffer);
+    glGenBuffers(1, &culler.counterBuffer);
+    glGenBuffers(MESHLET_STATS_COUNT, culler.statsBuffers);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.meshletBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, glm::max(culler.meshletCount, 1u) * sizeof(Meshlet), allMeshlets.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.counterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 2 * sizeof(u32), NULL, GL_DYNAMIC_COPY);
+    const u32 zero = 0;
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    for (u32 i = 0; i < MESHLET_STATS_COUNT; ++i)
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, culler.statsBuffers[i]);
+        glBufferData(GL_COPY_WRITE_BUFFER, 2 * sizeof(u32), NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    culler.drawCapacity = 1024;
+}
+
+void BeginMeshletFrame(App* app)
+{
+    MeshletCuller& culler = app->meshlets;
+    const u32 statsSlot = app->frame->frameIndex % MESHLET_STATS_COUNT;
+
+    // The slot about to be reused holds the counters of MESHLET_STATS_COUNT frames ago
+    if (culler.statsIssued[statsSlot])
+    {
+        u32 counters[2];
+        glBindBuffer(GL_COPY_READ_BUFFER, culler.statsBuffers[statsSlot]);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(counters), counters);
+        culler.tested = counters[0];
+        culler.visible = counters[1];
+    }
+
+    glBindBuffer(GL_COPY_READ_BUFFER, culler.counterBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, culler.statsBuffers[statsSlot]);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, 2 * sizeof(u32));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    culler.statsIssued[statsSlot] = true;
+
+    const u32 zero = 0;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.counterBuffer);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+
+    // Orphaned every frame like the indirect stream
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.drawBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, culler.drawCapacity * sizeof(MeshletDraw), NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    culler.drawCursor = 0;
+}
+
+void BeginMeshletList(MeshletCuller& culler, const CommandList& list)
+{
+    // A full buffer is replaced by a bigger one, dispatches already issued keep their old storage
+    const u32 drawCount = list.meshletDraws.size();
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.drawBuffer);
+    if (culler.drawCursor + drawCount > culler.drawCapacity)
+    {
+        culler.drawCapacity = glm::max(drawCount, culler.drawCapacity * 2);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, culler.drawCapacity * sizeof(MeshletDraw), NULL, GL_STREAM_DRAW);
+        culler.drawCursor = 0;
+    }
+
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, culler.drawCursor * sizeof(MeshletDraw), drawCount * sizeof(MeshletDraw), list.meshletDraws.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    culler.listFirstDraw = culler.drawCursor;
+    culler.drawCursor += drawCount;
+}
+
+void RunMeshletCull(App* app, const Command& command, const CommandList& list)
+{
+    MeshletCuller& culler = app->meshlets;
+    GLStateCache& state = app->glState;
+    const f32* view = &list.data[command.cullMeshlets.dataOffset];
+
+    // Bindings after the instance transforms and materials, which the draws keep using
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MESHLET_BINDING_COMMANDS, app->indirect.commandBuffer.handle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MESHLET_BINDING_COMMANDS + 1, culler.meshletBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MESHLET_BINDING_COMMANDS + 2, culler.drawBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MESHLET_BINDING_COMMANDS + 3, culler.counterBuffer);
+
+    // Six planes take an array upload the state cache does not track
+    StateUseProgram(state, app->programs[culler.cullProgramIdx].handle);
+    glUniform4fv(culler.cullProgram_uPlanes, 6, view);
+    StateUniform3f(state, culler.cullProgram_uCameraPosition, view[24], view[25], view[26]);
+    StateUniform4f(state, culler.cullProgram_uClipPlane, view[28], view[29], view[30], view[31]);
+    StateUniform1i(state, culler.cullProgram_uFlags, command.cullMeshlets.flags);
+
+    // One group per instance, its threads stride over the meshlets
+    for (u32 first = 0; first < command.cullMeshlets.drawCount; first += MESHLET_MAX_GROUPS)
+    {
+        StateUniform1i(state, culler.cullProgram_uFirstDraw, culler.listFirstDraw + command.cullMeshlets.firstDraw + first);
+        glDispatchCompute(glm::min(command.cullMeshlets.drawCount - first, (u32)MESHLET_MAX_GROUPS), 1, 1);
+    }
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+    for (u32 binding = MESHLET_BINDING_COMMANDS; binding < MESHLET_BINDING_COMMANDS + 4; ++binding)
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+}
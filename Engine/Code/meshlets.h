@@ -0,0 +1,25 @@
+//
+// meshlets.h: Meshlet generation at import and their per view GPU culling into compacted indirect commands.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// Splits the triangles into runs of at most MESHLET_MAX_VERTICES vertices and
+// MESHLET_MAX_TRIANGLES triangles, each with a bounding sphere and a normal cone
+void BuildMeshlets(const std::vector<vec3>& positions, const std::vector<u32>& indices, std::vector<Meshlet>& meshlets);
+
+// Uploads the meshlets of every loaded mesh and creates the buffers, the cull
+// program must already be loaded. GL thread only.
+void InitMeshletCuller(App* app);
+
+// Reads the stats of a few frames ago and starts this frame's draw buffer
+void BeginMeshletFrame(App* app);
+
+// Uploads the meshlet draws of a list, their command words already rebased
+void BeginMeshletList(MeshletCuller& culler, const CommandList& list);
+
+// Rewrites the commands of a range of meshlet draws with the visible meshlets first
+void RunMeshletCull(App* app, const Command& command, const CommandList& list);
@@ -0,0 +1,192 @@
+#include "occlusion_culling.h"
+#include "gl_state.h"
+
+// Texture unit the culling programs sample from, away from the scene pass units
+#define OCCLUSION_TEXTURE_UNIT 7
+
+void InitOcclusionCuller(OcclusionCuller& culler)
+{
+    glGenBuffers(2, culler.visibilityBuffers);
+    glGenBuffers(1, &culler.candidateBuffer);
+    glGenBuffers(1, &culler.counterBuffer);
+    glGenBuffers(OCCLUSION_STATS_COUNT, culler.statsBuffers);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.counterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, OCCLUSION_PHASE_COUNT * sizeof(u32), NULL, GL_DYNAMIC_COPY);
+    for (u32 i = 0; i < OCCLUSION_STATS_COUNT; ++i)
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, culler.statsBuffers[i]);
+        glBufferData(GL_COPY_WRITE_BUFFER, OCCLUSION_PHASE_COUNT * sizeof(u32), NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+GLuint CreateHiZTexture(ivec2 size, u32& levels)
+{
+    // Mips halve with rounding down, the odd row or column left over is folded into the border texels
+    levels = 1;
+    while ((size.x >> levels) > 0 || (size.y >> levels) > 0)
+        levels++;
+
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexStorage2D(GL_TEXTURE_2D, levels, GL_R32F, size.x, size.y);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return texture;
+}
+
+void BeginOcclusionList(OcclusionCuller& culler, const CommandList& list, u32 commandOffset, u32 firstDrawInfo)
+{
+    culler.commandOffset = commandOffset;
+    culler.commandCount = list.indirectCommands.size();
+    culler.firstDrawInfo = firstDrawInfo;
+    culler.drawInfoCount = list.drawInfos.size();
+    culler.candidateCount = list.occlusionCandidates.size();
+
+    // Orphaned every frame like the indirect stream
+    if (culler.candidateCount > culler.candidateCapacity)
+        culler.candidateCapacity = glm::max(culler.candidateCount, culler.candidateCapacity * 2);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.candidateBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, glm::max(culler.candidateCapacity, 1u) * sizeof(OcclusionCandidate), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, culler.candidateCount * sizeof(OcclusionCandidate), list.occlusionCandidates.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void ResizeVisibility(OcclusionCuller& culler, u32 boxCount)
+{
+    // Boxes start hidden, so phase 2 tests them all on the first frame
+    culler.visibilityCount = boxCount;
+    const u32 zero = 0;
+    for (u32 i = 0; i < 2; ++i)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.visibilityBuffers[i]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, glm::max(boxCount, 1u) * sizeof(u32), NULL, GL_DYNAMIC_COPY);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void BuildHiZ(App* app)
+{
+    OcclusionCuller& culler = app->occlusion;
+    GLStateCache& state = app->glState;
+
+    StateUseProgram(state, app->programs[culler.hiZBuildProgramIdx].handle);
+    StateBindTexture(state, OCCLUSION_TEXTURE_UNIT, GL_TEXTURE_2D, app->depthAttachmentHandle);
+    StateUniform1i(state, culler.hiZBuildProgram_uDepth, OCCLUSION_TEXTURE_UNIT);
+
+    // Level 0 copies the depth buffer, every other level keeps the farthest depth under it
+    ivec2 sourceSize = culler.hiZSize;
+    for (u32 level = 0; level < culler.hiZLevels; ++level)
+    {
+        const ivec2 size = glm::max(culler.hiZSize >> (i32)level, ivec2(1));
+        const u32 sourceLevel = level > 0 ? level - 1 : 0;
+
+        glBindImageTexture(0, culler.hiZTexture, sourceLevel, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        glBindImageTexture(1, culler.hiZTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        StateUniform1i(state, culler.hiZBuildProgram_uLevel, level);
+        StateUniform2f(state, culler.hiZBuildProgram_uSourceSize, sourceSize.x, sourceSize.y);
+        StateUniform2f(state, culler.hiZBuildProgram_uDestinationSize, size.x, size.y);
+
+        glDispatchCompute((size.x + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, (size.y + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, 1);
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+        sourceSize = size;
+    }
+
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+void RunOcclusionCull(App* app, u32 phase)
+{
+    OcclusionCuller& culler = app->occlusion;
+    GLStateCache& state = app->glState;
+    const FramePacket& frame = *app->frame;
+    const u32 currentVisibility = 1 - culler.previousVisibility;
+
+    if (phase == 1)
+    {
+        if (culler.visibilityCount != frame.bounds.count)
+            ResizeVisibility(culler, frame.bounds.count);
+
+        // Boxes culled by the frustum this frame read as hidden next frame
+        const u32 zero = 0;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.visibilityBuffers[currentVisibility]);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, culler.counterBuffer);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+    else
+    {
+        BuildHiZ(app);
+    }
+
+    if (culler.candidateCount > 0)
+    {
+        // Phase copies of the commands sit right after the list's own ones,
+        // their base instances already point at the matching draw info copy
+        const u32 commandBytes = culler.commandCount * sizeof(DrawElementsIndirectCommand);
+        const u32 firstCommandWord = (culler.commandOffset + phase * commandBytes) / sizeof(u32);
+        const glm::mat4 viewProjection = frame.sceneProjectionMat * frame.viewMat;
+
+        // Bindings after the instance transforms and materials, which the draws keep using
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OCCLUSION_BINDING_COMMANDS, app->indirect.commandBuffer.handle);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OCCLUSION_BINDING_COMMANDS + 1, app->indirect.drawInfoBuffer.handle);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OCCLUSION_BINDING_COMMANDS + 2, culler.candidateBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OCCLUSION_BINDING_COMMANDS + 3, culler.visibilityBuffers[culler.previousVisibility]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OCCLUSION_BINDING_COMMANDS + 4, culler.visibilityBuffers[currentVisibility]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OCCLUSION_BINDING_COMMANDS + 5, culler.counterBuffer);
+
+        StateUseProgram(state, app->programs[culler.cullProgramIdx].handle);
+        StateUniform1i(state, culler.cullProgram_uPhase, phase);
+        StateUniform1i(state, culler.cullProgram_uCandidateCount, culler.candidateCount);
+        StateUniform1i(state, culler.cullProgram_uFirstCommand, firstCommandWord);
+        StateUniform1i(state, culler.cullProgram_uFirstDrawInfo, culler.firstDrawInfo);
+        StateUniformMatrix4fv(state, culler.cullProgram_uViewProjection, &viewProjection[0][0]);
+        StateBindTexture(state, OCCLUSION_TEXTURE_UNIT, GL_TEXTURE_2D, culler.hiZTexture);
+        StateUniform1i(state, culler.cullProgram_uHiZ, OCCLUSION_TEXTURE_UNIT);
+        StateUniform2f(state, culler.cullProgram_uHiZSize, culler.hiZSize.x, culler.hiZSize.y);
+        StateUniform1i(state, culler.cullProgram_uHiZLevels, culler.hiZLevels);
+
+        glDispatchCompute((culler.candidateCount + OCCLUSION_GROUP_SIZE - 1) / OCCLUSION_GROUP_SIZE, 1, 1);
+        glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+        for (u32 binding = OCCLUSION_BINDING_COMMANDS; binding < OCCLUSION_BINDING_COMMANDS + 6; ++binding)
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+    }
+
+    if (phase == OCCLUSION_PHASE_COUNT)
+    {
+        const u32 statsSlot = frame.frameIndex % OCCLUSION_STATS_COUNT;
+        glBindBuffer(GL_COPY_READ_BUFFER, culler.counterBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, culler.statsBuffers[statsSlot]);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, OCCLUSION_PHASE_COUNT * sizeof(u32));
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        culler.statsIssued[statsSlot] = true;
+        culler.candidates = culler.candidateCount;
+
+        culler.previousVisibility = currentVisibility;
+    }
+}
+
+void ReadOcclusionStats(OcclusionCuller& culler, u64 frameIndex)
+{
+    // The slot about to be reused was written OCCLUSION_STATS_COUNT frames ago
+    const u32 statsSlot = frameIndex % OCCLUSION_STATS_COUNT;
+    if (!culler.statsIssued[statsSlot])
+        return;
+
+    glBindBuffer(GL_COPY_READ_BUFFER, culler.statsBuffers[statsSlot]);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, 0, OCCLUSION_PHASE_COUNT * sizeof(u32), culler.phaseInstances);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    culler.statsIssued[statsSlot] = false;
+}
@@ -0,0 +1,26 @@
+//
+// occlusion_culling.h: Two-phase GPU occlusion culling of the G-buffer pass against a Hi-Z pyramid.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// Creates the buffers, the programs must already be loaded. GL thread only.
+void InitOcclusionCuller(OcclusionCuller& culler);
+
+// Hi-Z pyramid for a G-buffer of the given size, owned by the render targets
+// of that size and handed to the culler while they are in use
+GLuint CreateHiZTexture(ivec2 size, u32& levels);
+
+// Uploads the candidates of an occlusion culled list and remembers where its
+// indirect data and the two phase copies landed in the stream
+void BeginOcclusionList(OcclusionCuller& culler, const CommandList& list, u32 commandOffset, u32 firstDrawInfo);
+
+// Phase 1 compacts what was visible last frame, phase 2 builds the Hi-Z
+// pyramid from the depth drawn so far and compacts what just became visible
+void RunOcclusionCull(App* app, u32 phase);
+
+// Reads the per phase instance counts of a few frames ago
+void ReadOcclusionStats(OcclusionCuller& culler, u64 frameIndex);
@@ -16,6 +16,7 @@
 #endif
 
 #include "engine.h"
+#include "render_thread.h"
 
 #include <GLFW/glfw3.h>
 #include <stdio.h>
@@ -167,7 +168,8 @@ int main()
     io.ConfigFlags |= ImGuiConfigFlags_NavEnableKeyboard;       // Enable Keyboard Controls
     //io.ConfigFlags |= ImGuiConfigFlags_NavEnableGamepad;      // Enable Gamepad Controls
     io.ConfigFlags |= ImGuiConfigFlags_DockingEnable;           // Enable Docking
-    io.ConfigFlags |= ImGuiConfigFlags_ViewportsEnable;         // Enable Multi-Viewport / Platform Windows
+    // Platform windows need both the main thread (GLFW) and the GL context, which belongs to the render thread
+    //io.ConfigFlags |= ImGuiConfigFlags_ViewportsEnable;       // Enable Multi-Viewport / Platform Windows
     //io.ConfigViewportsNoAutoMerge = true;
     //io.ConfigViewportsNoTaskBarIcon = true;
 
@@ -201,13 +203,18 @@ int main()
 
     Init(&app);
 
+    // Builds the font atlas while the context is still current here
+    ImGui_ImplOpenGL3_NewFrame();
+
+    // From now on this thread simulates, the render thread submits to GL
+    StartRenderThread(&app, window);
+
     while (app.isRunning)
     {
         // Tell GLFW to call platform callbacks
         glfwPollEvents();
 
         // ImGui
-        ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
@@ -258,30 +265,22 @@ int main()
 
         app.input.mouseDelta = glm::vec2(0.0f, 0.0f);
 
-        // Render
-        Render(&app);
-
-        // ImGui Render
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-        if (io.ConfigFlags & ImGuiConfigFlags_ViewportsEnable) {
-            GLFWwindow* backup_current_context = glfwGetCurrentContext();
-            ImGui::UpdatePlatformWindows();
-            ImGui::RenderPlatformWindowsDefault();
-            glfwMakeContextCurrent(backup_current_context);
-        }
-
-        // Present image on screen
-        glfwSwapBuffers(window);
+        // Hand the frame over to the render thread
+        FramePacket& packet = BeginFramePacket(&app);
+        FillFramePacket(&app, packet);
+        CopyImGuiDrawData(packet, ImGui::GetDrawData());
+        SubmitFramePacket(&app);
 
         // Frame time
         f64 currentFrameTime = glfwGetTime();
         app.deltaTime = (f32)(currentFrameTime - lastFrameTime);
         lastFrameTime = currentFrameTime;
-
-        // Reset frame allocator
-        GlobalFrameArenaHead = 0;
     }
 
+    StopRenderThread(&app);
+
+    Shutdown(&app);
+
     free(GlobalFrameArenaMemory);
 
     ImGui_ImplOpenGL3_Shutdown();
@@ -301,6 +300,11 @@ u32 Strlen(const char* string)
     return len;
 }
 
+void ResetFrameArena()
+{
+    GlobalFrameArenaHead = 0;
+}
+
 void* PushSize(u32 byteCount)
 {
     ASSERT(GlobalFrameArenaHead + byteCount <= GLOBAL_FRAME_ARENA_SIZE,
@@ -419,6 +423,11 @@ u64 GetFileLastWriteTimestamp(const char* filepath)
     return 0;
 }
 
+void* GetGLProcAddress(const char* name)
+{
+    return (void*)glfwGetProcAddress(name);
+}
+
 void LogString(const char* str)
 {
 #ifdef _WIN32
@@ -75,12 +75,24 @@ String GetDirectoryPart(String path);
  */
 String ReadTextFile(const char *filepath);
 
+/**
+ * Releases every temporary string handed out since the last reset. The frame arena
+ * is not thread safe, only the thread owning the GL context allocates from it.
+ */
+void ResetFrameArena();
+
 /**
  * It retrieves a timestamp indicating the last time the file was modified.
  * Can be useful in order to check for file modifications to implement hot reloads.
  */
 u64 GetFileLastWriteTimestamp(const char *filepath);
 
+/**
+ * Returns the address of an OpenGL function by name, using the same loader as glad.
+ * Useful to fetch entry points of extensions that the generated glad loader does not cover.
+ */
+void* GetGLProcAddress(const char* name);
+
 /**
  * It logs a string to whichever outputs are configured in the platform layer.
  * By default, the string is printed in the output console of VisualStudio.
@@ -0,0 +1,361 @@
+#include "render_queue.h"
+#include "gl_state.h"
+#include "buffer_management.h"
+#include "material_system.h"
+#include "command_list.h"
+
+// Key layout (most significant bits first)
+// Front to back: program (8) | depth (16) | vao (16) | material (24)
+// State:         program (8) | vao (16) | material (24) | depth (16)
+u64 MakeSortKey(SortMode mode, u32 programIdx, GLuint vao, u32 materialIdx, u32 depthBucket)
+{
+    const u64 program  = (u64)(programIdx & 0xFF);
+    const u64 vertices = (u64)(vao & 0xFFFF);
+    const u64 material = (u64)(materialIdx & 0xFFFFFF);
+    const u64 depth    = (u64)(depthBucket & 0xFFFF);
+
+    if (mode == SORTMODE_FRONT_TO_BACK)
+        return (program << 56) | (depth << 40) | (vertices << 24) | material;
+    else
+        return (program << 56) | (vertices << 40) | (material << 16) | depth;
+}
+
+u32 DepthBucket(f32 viewDepth, f32 farPlane)
+{
+    // Logarithmic buckets give more precision close to the camera
+    f32 d = viewDepth > 0.0F ? viewDepth : 0.0F;
+    f32 t = log2f(1.0F + d) / log2f(1.0F + farPlane);
+    t = t < 1.0F ? t : 1.0F;
+    return (u32)(t * 65535.0F);
+}
+
+void ClearRenderQueue(RenderQueue& queue, SortMode mode)
+{
+    queue.mode = mode;
+    queue.items.clear();
+    queue.instances.clear();
+    queue.instanceBoxes.clear();
+}
+
+void BuildInstanceGroups(App* app)
+{
+    const std::vector<Entity>& entities = app->frame->entities;
+
+    app->instanceGroups.clear();
+    app->instanceEntities.resize(entities.size());
+
+    // Count the instances of every model, groups appear in first use order
+    std::vector<u32> groupOfModel(app->models.size(), UINT32_MAX);
+    for (const Entity& entity : entities)
+    {
+        u32& groupIdx = groupOfModel[entity.modelIdx];
+        if (groupIdx == UINT32_MAX)
+        {
+            groupIdx = app->instanceGroups.size();
+            app->instanceGroups.push_back(InstanceGroup{ entity.modelIdx, 0, 0 });
+        }
+        app->instanceGroups[groupIdx].instanceCount++;
+    }
+
+    u32 firstInstance = 0;
+    for (InstanceGroup& group : app->instanceGroups)
+    {
+        group.firstInstance = firstInstance;
+        firstInstance += group.instanceCount;
+    }
+
+    std::vector<u32> filled(app->instanceGroups.size(), 0);
+    for (u32 entityIdx = 0; entityIdx < entities.size(); ++entityIdx)
+    {
+        const u32 groupIdx = groupOfModel[entities[entityIdx].modelIdx];
+        const InstanceGroup& group = app->instanceGroups[groupIdx];
+        app->instanceEntities[group.firstInstance + filled[groupIdx]++] = entityIdx;
+    }
+
+    // Orphan last frame's storage so the driver does not have to wait for it
+    Buffer& buffer = app->instanceBuffer;
+    const u32 requiredSize = app->instanceEntities.size() * INSTANCE_STRIDE;
+    if (requiredSize > buffer.size)
+        buffer.size = glm::max(requiredSize, buffer.size * 2);
+
+    BindBuffer(buffer);
+    glBufferData(buffer.type, buffer.size, NULL, GL_STREAM_DRAW);
+    MapBuffer(buffer, GL_WRITE_ONLY);
+
+    for (u32 instance = 0; instance < app->instanceEntities.size(); ++instance)
+    {
+        const Entity& entity = entities[app->instanceEntities[instance]];
+
+        buffer.head = instance * INSTANCE_STRIDE;
+        PushMat4(buffer, MatrixFromPositionRotationScale(entity.position, entity.rotation, entity.scale));
+        PushFloat(buffer, entity.metallic);
+    }
+
+    UnmapBuffer(buffer);
+
+    // Recording jobs look VAOs up without creating them, so make sure they exist
+    for (const InstanceGroup& group : app->instanceGroups)
+    {
+        const Mesh& mesh = app->meshes[app->models[group.modelIdx].meshIdx];
+        for (const Submesh& submesh : mesh.submeshes)
+        {
+            FindVAO(app, submesh);
+            FindPositionVAO(app, submesh);
+        }
+    }
+}
+
+void PushGroupDraws(App* app, RenderQueue& queue, u32 programIdx, const vec3& viewPosition, const vec3& viewDirection, f32 farPlane, const std::vector<u8>& visible, const std::vector<u8>& lods, bool positionOnly)
+{
+    const WorldBounds& bounds = app->frame->bounds;
+
+    for (const InstanceGroup& group : app->instanceGroups)
+    {
+        Model& model = app->models[group.modelIdx];
+        Mesh& mesh = app->meshes[model.meshIdx];
+
+        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+        for (u32 lod = 0; lod < mesh.submeshes[i].lodCount; ++lod)
+        {
+            // Only the instances whose box survived culling are drawn, one item
+            // per level of detail, sorted by the nearest of their spheres
+            const u32 firstVisible = queue.instances.size();
+            f32 nearest = farPlane;
+            for (u32 instance = group.firstInstance; instance < group.firstInstance + group.instanceCount; ++instance)
+            {
+                const u32 box = bounds.entityOffsets[app->instanceEntities[instance]] + i;
+                if (!visible[box] || lods[box] != lod)
+                    continue;
+
+                const vec4& sphere = bounds.spheres[box];
+                nearest = glm::min(nearest, glm::dot(vec3(sphere) - viewPosition, viewDirection) - sphere.w);
+                queue.instances.push_back(instance);
+                queue.instanceBoxes.push_back(box);
+            }
+
+            const u32 visibleCount = queue.instances.size() - firstVisible;
+            if (visibleCount == 0)
+                continue;
+
+            const Submesh& submesh = mesh.submeshes[i];
+            const u32 materialIdx = model.materialIdx[i];
+            const Material& material = app->materials[materialIdx];
+            const u32 depthBucket = DepthBucket(nearest, farPlane);
+
+            DrawItem item = {};
+            item.programIdx = programIdx;
+            item.vao = positionOnly ? FindPositionVAO(app, submesh) : FindVAO(app, submesh);
+            item.materialIdx = materialIdx;
+            item.albedoArray = positionOnly ? 0 : GetAlbedoArray(app, material);
+            item.depthBucket = depthBucket;
+            item.indexCount = submesh.lods[lod].indexCount;
+            item.firstIndex = submesh.firstIndex + submesh.lods[lod].firstIndex;
+            item.baseVertex = submesh.baseVertex;
+            item.firstInstance = firstVisible;
+            item.instanceCount = visibleCount;
+            if (lod == 0 && app->frame->meshletCulling && submesh.meshlets.size() >= MESHLET_MIN_COUNT)
+            {
+                item.firstMeshlet = submesh.firstMeshlet;
+                item.meshletCount = submesh.meshlets.size();
+            }
+            item.key = MakeSortKey(queue.mode, programIdx, item.vao, materialIdx, depthBucket);
+
+            queue.items.push_back(item);
+        }
+    }
+}
+
+void PushInstanceDraws(App* app, RenderQueue& queue, u32 programIdx, const vec3& viewPosition, const vec3& viewDirection, f32 farPlane, const std::vector<u8>& visible, const std::vector<u8>& lods)
+{
+    PushGroupDraws(app, queue, programIdx, viewPosition, viewDirection, farPlane, visible, lods, false);
+}
+
+void PushInstanceDepthDraws(App* app, RenderQueue& queue, u32 programIdx, const vec3& viewPosition, const vec3& viewDirection, f32 farPlane, const std::vector<u8>& visible, const std::vector<u8>& lods)
+{
+    PushGroupDraws(app, queue, programIdx, viewPosition, viewDirection, farPlane, visible, lods, true);
+}
+
+void SortRenderQueue(RenderQueue& queue)
+{
+    // LSD radix sort, 8 bits per pass. Passes where every key shares the
+    // same digit are skipped, which is common for the program byte.
+    std::vector<DrawItem>& src = queue.items;
+    std::vector<DrawItem>& dst = queue.scratch;
+    dst.resize(src.size());
+
+    for (u32 shift = 0; shift < 64; shift += 8)
+    {
+        u32 counts[256] = {};
+        for (const DrawItem& item : src)
+            counts[(item.key >> shift) & 0xFF]++;
+
+        if (counts[(src.empty() ? 0 : (src[0].key >> shift) & 0xFF)] == src.size())
+            continue;
+
+        u32 offsets[256];
+        u32 sum = 0;
+        for (u32 i = 0; i < 256; ++i)
+        {
+            offsets[i] = sum;
+            sum += counts[i];
+        }
+
+        for (const DrawItem& item : src)
+            dst[offsets[(item.key >> shift) & 0xFF]++] = item;
+
+        src.swap(dst);
+    }
+}
+
+void InitIndirectStream(IndirectStream& stream, u32 commandBufferSize, u32 drawInfoBufferSize)
+{
+    stream = {};
+    stream.commandBuffer = CreateBuffer(commandBufferSize, GL_DRAW_INDIRECT_BUFFER, GL_STREAM_DRAW);
+    stream.drawInfoBuffer = CreateBuffer(drawInfoBufferSize, GL_ARRAY_BUFFER, GL_STREAM_DRAW);
+}
+
+void OrphanBuffer(Buffer& buffer)
+{
+    BindBuffer(buffer);
+    glBufferData(buffer.type, buffer.size, NULL, GL_STREAM_DRAW);
+    glBindBuffer(buffer.type, 0);
+}
+
+void BeginIndirectFrame(IndirectStream& stream)
+{
+    OrphanBuffer(stream.commandBuffer);
+    OrphanBuffer(stream.drawInfoBuffer);
+    stream.commandCursor = 0;
+    stream.drawInfoCursor = 0;
+    stream.multiDrawCalls = 0;
+    stream.drawCommands = 0;
+}
+
+// Makes room for the given amount of data after the cursors. A full buffer
+// is replaced by a bigger one, draws already issued keep their old storage.
+void ReserveIndirectData(IndirectStream& stream, u32 commandCount, u32 drawInfoCount)
+{
+    const u32 commandBytes = commandCount * sizeof(DrawElementsIndirectCommand);
+    const u32 drawInfoBytes = drawInfoCount * sizeof(DrawInfo);
+
+    if (stream.commandCursor + commandBytes > stream.commandBuffer.size)
+    {
+        stream.commandBuffer.size = glm::max(commandBytes, stream.commandBuffer.size * 2);
+        OrphanBuffer(stream.commandBuffer);
+        stream.commandCursor = 0;
+    }
+    if (stream.drawInfoCursor + drawInfoBytes > stream.drawInfoBuffer.size)
+    {
+        stream.drawInfoBuffer.size = glm::max(drawInfoBytes, stream.drawInfoBuffer.size * 2);
+        OrphanBuffer(stream.drawInfoBuffer);
+        stream.drawInfoCursor = 0;
+    }
+}
+
+u32 RecordRenderQueueCommands(App* app, RenderQueue& queue, CommandList& list)
+{
+    const WorldBounds& bounds = app->frame->bounds;
+
+    // One indirect command per item, its instances read consecutive draw infos
+    const u32 firstCommand = list.indirectCommands.size();
+    const u32 firstMeshletDraw = list.meshletDraws.size();
+    queue.itemCommands.clear();
+    for (DrawItem& item : queue.items)
+    {
+        queue.itemCommands.push_back(list.indirectCommands.size() - firstCommand);
+
+        // Hi-Z candidates map one to one to draw infos, culled lists keep whole submeshes
+        if (list.occlusionCulled)
+            item.meshletCount = 0;
+
+        // Meshlet items get one command per meshlet and instance, left empty
+        // for the cull shader to fill with the visible ones
+        if (item.meshletCount > 0)
+        {
+            for (u32 i = 0; i < item.instanceCount; ++i)
+            {
+                MeshletDraw draw = {};
+                draw.firstMeshlet = item.firstMeshlet;
+                draw.meshletCount = item.meshletCount;
+                draw.commandWord = list.indirectCommands.size();
+                draw.drawInfo = list.drawInfos.size();
+                draw.firstIndex = item.firstIndex;
+                draw.baseVertex = item.baseVertex;
+                draw.transform = queue.instances[item.firstInstance + i];
+                list.meshletDraws.push_back(draw);
+                list.drawInfos.push_back(DrawInfo{ draw.transform, item.materialIdx });
+                list.indirectCommands.resize(list.indirectCommands.size() + item.meshletCount, DrawElementsIndirectCommand{});
+            }
+            continue;
+        }
+
+        DrawElementsIndirectCommand command = {};
+        command.count = item.indexCount;
+        command.instanceCount = item.instanceCount;
+        command.firstIndex = item.firstIndex;
+        command.baseVertex = item.baseVertex;
+        command.baseInstance = list.drawInfos.size();
+        const u32 commandIdx = PushIndirectCommand(list, command);
+
+        for (u32 i = 0; i < item.instanceCount; ++i)
+        {
+            list.drawInfos.push_back(DrawInfo{ queue.instances[item.firstInstance + i], item.materialIdx });
+
+            if (list.occlusionCulled)
+            {
+                const u32 box = queue.instanceBoxes[item.firstInstance + i];
+                const vec3 center = vec3(bounds.centerX[box], bounds.centerY[box], bounds.centerZ[box]);
+                const vec3 extent = vec3(bounds.extentX[box], bounds.extentY[box], bounds.extentZ[box]);
+                list.occlusionCandidates.push_back(OcclusionCandidate{ center - extent, box, center + extent, commandIdx });
+            }
+        }
+    }
+    queue.itemCommands.push_back(list.indirectCommands.size() - firstCommand);
+
+    if (list.meshletDraws.size() > firstMeshletDraw)
+        CmdCullMeshlets(list, firstMeshletDraw, list.meshletDraws.size() - firstMeshletDraw);
+
+    return firstCommand;
+}
+
+void RecordRenderQueueDraws(App* app, const RenderQueue& queue, const DrawPassParams& params, u32 firstCommand, u32 phase, CommandList& list)
+{
+
+    // Items sharing program, VAO and albedo array go out in a single call.
+    // Untextured materials never sample, so they fit in any batch, and
+    // meshlet items just add the range of commands they recorded.
+    u32 first = 0;
+    while (first < queue.items.size())
+    {
+        const DrawItem& head = queue.items[first];
+        GLuint albedoArray = head.albedoArray;
+
+        u32 last = first + 1;
+        while (last < queue.items.size() &&
+               queue.items[last].programIdx == head.programIdx &&
+               queue.items[last].vao == head.vao &&
+               (queue.items[last].albedoArray == 0 || albedoArray == 0 || queue.items[last].albedoArray == albedoArray))
+        {
+            if (albedoArray == 0)
+                albedoArray = queue.items[last].albedoArray;
+            ++last;
+        }
+
+        CmdUseProgram(list, app->programs[head.programIdx].handle);
+        CmdUniform1i(list, params.uTexture, params.textureUnit);
+        CmdBindVertexArray(list, head.vao);
+        if (albedoArray != 0)
+            CmdBindTexture(list, params.textureUnit, GL_TEXTURE_2D_ARRAY, albedoArray);
+
+        const u32 commandCount = queue.itemCommands[last] - queue.itemCommands[first];
+        CmdMultiDrawIndirect(list, firstCommand + queue.itemCommands[first], commandCount, phase);
+
+        first = last;
+    }
+}
+
+void RecordRenderQueue(App* app, RenderQueue& queue, const DrawPassParams& params, CommandList& list)
+{
+    const u32 firstCommand = RecordRenderQueueCommands(app, queue, list);
+    RecordRenderQueueDraws(app, queue, params, firstCommand, 0, list);
+}
@@ -0,0 +1,39 @@
+//
+// render_queue.h: Per pass draw lists sorted by a 64-bit key before being submitted.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+void ClearRenderQueue(RenderQueue& queue, SortMode mode);
+
+// Groups the entities of the frame packet by model and writes their per instance data to the instance buffer
+void BuildInstanceGroups(App* app);
+
+// Emits one instanced draw item per group submesh and level of detail with the instances
+// flagged as visible, with depth measured along the view direction. Levels come from SelectLods.
+void PushInstanceDraws(App* app, RenderQueue& queue, u32 programIdx, const vec3& viewPosition, const vec3& viewDirection, f32 farPlane, const std::vector<u8>& visible, const std::vector<u8>& lods);
+
+// Same draws through the position only stream, untextured so materials do not split batches
+void PushInstanceDepthDraws(App* app, RenderQueue& queue, u32 programIdx, const vec3& viewPosition, const vec3& viewDirection, f32 farPlane, const std::vector<u8>& visible, const std::vector<u8>& lods);
+
+void InitIndirectStream(IndirectStream& stream, u32 commandBufferSize, u32 drawInfoBufferSize);
+void BeginIndirectFrame(IndirectStream& stream);
+
+// Makes room after the stream cursors, replacing full buffers with bigger ones
+void ReserveIndirectData(IndirectStream& stream, u32 commandCount, u32 drawInfoCount);
+
+void SortRenderQueue(RenderQueue& queue);
+
+// Records the queue as indirect commands plus one multi-draw per run of items
+// sharing program, VAO and albedo texture array. Does not touch GL.
+void RecordRenderQueue(App* app, RenderQueue& queue, const DrawPassParams& params, CommandList& list);
+
+// The two halves of RecordRenderQueue, so occlusion culled draws can be issued
+// once per phase. The commands also produce occlusion candidates when the list
+// is culled, and return the index of the first one. Meshlet items record one
+// command per meshlet and instance plus the compute pass that fills them.
+u32 RecordRenderQueueCommands(App* app, RenderQueue& queue, CommandList& list);
+void RecordRenderQueueDraws(App* app, const RenderQueue& queue, const DrawPassParams& params, u32 firstCommand, u32 phase, CommandList& list);
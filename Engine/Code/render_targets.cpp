@@ -0,0 +1,381 @@
+#include "render_targets.h"
+#include "occlusion_culling.h"
+#include "light_culling.h"
+
+// A set can only be replaced once it stopped being current, which takes at
+// least the settle frames, so no packet in flight still shows it in the Scene panel
+static_assert(RENDER_TARGET_SETTLE_FRAMES > FRAME_PACKET_COUNT, "Render target sets could be freed while a packet still shows them");
+
+static void CheckFramebufferStatus()
+{
+    GLenum frameBufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (frameBufferStatus != GL_FRAMEBUFFER_COMPLETE)
+    {
+        switch (frameBufferStatus)
+        {
+        case GL_FRAMEBUFFER_UNDEFINED:                          ELOG("Framebuffer status error: GL_FRAMEBUFFER_UNDEFINED"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:              ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT:      ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER"); break;
+        case GL_FRAMEBUFFER_UNSUPPORTED:                        ELOG("Framebuffer status error: GL_FRAMEBUFFER_UNSUPPORTED"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE:             ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS:           ELOG("Framebuffer status error: GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS"); break;
+
+        default: ELOG("Unknown framebuffer status error"); break;
+        }
+    }
+}
+
+static void CreateRenderTargetSet(RenderTargetSet& set, ivec2 size)
+{
+    set.size = size;
+
+    // FORWARD BUFFERS
+    // [Framebuffer] Forward Buffer
+    // [Texture] Depth
+    glGenTextures(1, &set.forwardDepthAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, set.forwardDepthAttachmentHandle);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size.x, size.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // [Texture] Render
+    glGenTextures(1, &set.forwardRenderAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, set.forwardRenderAttachmentHandle);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, size.x, size.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &set.forwardFrameBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, set.forwardFrameBuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, set.forwardRenderAttachmentHandle, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, set.forwardDepthAttachmentHandle, 0);
+
+    GLenum drawForwardBuffer[] = { GL_COLOR_ATTACHMENT0 };
+    glDrawBuffers(ARRAY_COUNT(drawForwardBuffer), drawForwardBuffer);
+
+    CheckFramebufferStatus();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // DEFERRED BUFFERS
+    // [Framebuffer] GBuffer, positions are rebuilt from the depth
+    // [Texture] Normals, octahedral
+    glGenTextures(1, &set.normalsAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, set.normalsAttachmentHandle);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16_SNORM, size.x, size.y, 0, GL_RG, GL_SHORT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // [Texture] Diffuse, metallic in alpha
+    glGenTextures(1, &set.diffuseAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, set.diffuseAttachmentHandle);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.x, size.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // [Texture] Depth, in the format of the light volume depth it is blitted to
+    glGenTextures(1, &set.depthAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, set.depthAttachmentHandle);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, size.x, size.y, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &set.gBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, set.gBuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, set.normalsAttachmentHandle, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, set.diffuseAttachmentHandle, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, set.depthAttachmentHandle, 0);
+
+    GLenum drawBuffersGBuffer[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(ARRAY_COUNT(drawBuffersGBuffer), drawBuffersGBuffer);
+
+    CheckFramebufferStatus();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // [Texture] Hi-Z pyramid built from the G-buffer depth
+    set.hiZTexture = CreateHiZTexture(size, set.hiZLevels);
+
+    // [Framebuffer] FBuffer
+    glGenTextures(1, &set.finalRenderAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, set.finalRenderAttachmentHandle);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.x, size.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &set.fBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, set.fBuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, set.finalRenderAttachmentHandle, 0);
+
+    GLenum drawBuffersFBuffer[] = { GL_COLOR_ATTACHMENT3 };
+    glDrawBuffers(ARRAY_COUNT(drawBuffersFBuffer), drawBuffersFBuffer);
+
+    CheckFramebufferStatus();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // [Texture] Light volume depth, the G-buffer depth is copied in every frame.
+    // The volumes sample the G-buffer depth, which therefore cannot be attached.
+    glGenTextures(1, &set.lightVolumeDepthAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, set.lightVolumeDepthAttachmentHandle);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, size.x, size.y, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // [Framebuffer] Light volumes, the final render tested against the copied depth
+    set.lightVolumeBuffer = CreateLightVolumeFramebuffer(set.finalRenderAttachmentHandle, set.lightVolumeDepthAttachmentHandle);
+
+    // [Framebuffer] G-buffer channels decoded for the scene panel
+    glGenTextures(1, &set.gbufferDebugAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, set.gbufferDebugAttachmentHandle);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.x, size.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &set.gbufferDebugBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, set.gbufferDebugBuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, set.gbufferDebugAttachmentHandle, 0);
+    CheckFramebufferStatus();
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // [Texture] Reflection color
+    glGenTextures(1, &set.waterReflectionAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, set.waterReflectionAttachmentHandle);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.x, size.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // [Texture] Reflection depth
+    glGenTextures(1, &set.waterReflectionDepthAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, set.waterReflectionDepthAttachmentHandle);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size.x, size.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // [Framebuffer] Reflection buffer
+    glGenFramebuffers(1, &set.waterReflectionFrameBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, set.waterReflectionFrameBuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, set.waterReflectionAttachmentHandle, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, set.waterReflectionDepthAttachmentHandle, 0);
+
+    GLenum waterReflectionBuffer[] = { GL_COLOR_ATTACHMENT5 };
+    glDrawBuffers(ARRAY_COUNT(waterReflectionBuffer), waterReflectionBuffer);
+
+    CheckFramebufferStatus();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // [Texture] Refraction color
+    glGenTextures(1, &set.waterRefractionAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, set.waterRefractionAttachmentHandle);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.x, size.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // [Texture] Refraction depth
+    glGenTextures(1, &set.waterRefractionDepthAttachmentHandle);
+    glBindTexture(GL_TEXTURE_2D, set.waterRefractionDepthAttachmentHandle);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size.x, size.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // [Framebuffer] Refraction buffer
+    glGenFramebuffers(1, &set.waterRefractionFrameBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, set.waterRefractionFrameBuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT5, set.waterRefractionAttachmentHandle, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, set.waterRefractionDepthAttachmentHandle, 0);
+
+    GLenum waterRefractionBuffer[] = { GL_COLOR_ATTACHMENT5 };
+    glDrawBuffers(ARRAY_COUNT(waterRefractionBuffer), waterRefractionBuffer);
+
+    CheckFramebufferStatus();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+static void DestroyRenderTargetSet(RenderTargetSet& set)
+{
+    GLuint framebuffers[] = { set.forwardFrameBuffer, set.gBuffer, set.fBuffer, set.lightVolumeBuffer, set.gbufferDebugBuffer,
+        set.waterReflectionFrameBuffer, set.waterRefractionFrameBuffer };
+    glDeleteFramebuffers(ARRAY_COUNT(framebuffers), framebuffers);
+
+    GLuint textures[] = { set.forwardRenderAttachmentHandle, set.forwardDepthAttachmentHandle,
+        set.normalsAttachmentHandle, set.diffuseAttachmentHandle, set.depthAttachmentHandle,
+        set.finalRenderAttachmentHandle, set.lightVolumeDepthAttachmentHandle, set.gbufferDebugAttachmentHandle,
+        set.waterReflectionAttachmentHandle, set.waterReflectionDepthAttachmentHandle,
+        set.waterRefractionAttachmentHandle, set.waterRefractionDepthAttachmentHandle, set.hiZTexture };
+    glDeleteTextures(ARRAY_COUNT(textures), textures);
+
+    set = {};
+}
+
+void InitRenderTargets(App* app)
+{
+    RenderTargets& targets = app->renderTargets;
+    targets.panelSize = ivec2(0);
+    targets.pendingSize = ivec2(0);
+    targets.pendingFrames = 0;
+    targets.size = ivec2(0);
+    for (RenderTargetSet& set : targets.sets)
+        set = {};
+    targets.current.store(RENDER_TARGET_POOL_SIZE);
+    targets.pooledSets = 0;
+    targets.allocations = 0;
+}
+
+void UpdateRenderTargetSize(App* app)
+{
+    RenderTargets& targets = app->renderTargets;
+
+    // Until the Scene panel is laid out, and while it is collapsed, the last size or the window's stands
+    ivec2 wanted = targets.panelSize;
+    if (wanted.x <= 0 || wanted.y <= 0)
+        wanted = targets.size.x > 0 ? targets.size : app->displaySize;
+    wanted = glm::max(wanted, ivec2(1));
+
+    if (targets.size.x <= 0 || wanted == targets.size)
+    {
+        targets.size = wanted;
+        targets.pendingFrames = 0;
+        return;
+    }
+
+    // Dragging a splitter changes the size every frame, follow only once it holds still
+    if (wanted != targets.pendingSize)
+    {
+        targets.pendingSize = wanted;
+        targets.pendingFrames = 0;
+    }
+    if (++targets.pendingFrames >= RENDER_TARGET_SETTLE_FRAMES)
+    {
+        targets.size = wanted;
+        targets.pendingFrames = 0;
+    }
+}
+
+void AcquireRenderTargets(App* app)
+{
+    RenderTargets& targets = app->renderTargets;
+    const FramePacket& frame = *app->frame;
+    const ivec2 size = frame.displaySize;
+    const u32 current = targets.current.load(std::memory_order_relaxed);
+
+    u32 index = RENDER_TARGET_POOL_SIZE;
+    for (u32 i = 0; i < RENDER_TARGET_POOL_SIZE; ++i)
+        if (targets.sets[i].size == size)
+            index = i;
+
+    if (index == RENDER_TARGET_POOL_SIZE)
+    {
+        // An empty slot, otherwise the least recently used set
+        u64 oldest = UINT64_MAX;
+        for (u32 i = 0; i < RENDER_TARGET_POOL_SIZE; ++i)
+        {
+            const RenderTargetSet& set = targets.sets[i];
+            if (set.size.x == 0)
+            {
+                index = i;
+                break;
+            }
+            if (i != current && set.lastUsedFrame < oldest)
+            {
+                oldest = set.lastUsedFrame;
+                index = i;
+            }
+        }
+
+        RenderTargetSet& set = targets.sets[index];
+        if (set.size.x != 0)
+            DestroyRenderTargetSet(set);
+        CreateRenderTargetSet(set, size);
+        targets.allocations++;
+    }
+
+    // Sizes nobody went back to in a while give their memory back
+    targets.pooledSets = 0;
+    for (u32 i = 0; i < RENDER_TARGET_POOL_SIZE; ++i)
+    {
+        RenderTargetSet& set = targets.sets[i];
+        if (i != index && set.size.x != 0 && set.lastUsedFrame + RENDER_TARGET_RETIRE_FRAMES < frame.frameIndex)
+            DestroyRenderTargetSet(set);
+        if (set.size.x != 0)
+            targets.pooledSets++;
+    }
+
+    RenderTargetSet& set = targets.sets[index];
+    set.lastUsedFrame = frame.frameIndex;
+
+    app->forwardRenderAttachmentHandle = set.forwardRenderAttachmentHandle;
+    app->forwardDepthAttachmentHandle = set.forwardDepthAttachmentHandle;
+    app->forwardFrameBuffer = set.forwardFrameBuffer;
+    app->normalsAttachmentHandle = set.normalsAttachmentHandle;
+    app->diffuseAttachmentHandle = set.diffuseAttachmentHandle;
+    app->depthAttachmentHandle = set.depthAttachmentHandle;
+    app->gBuffer = set.gBuffer;
+    app->finalRenderAttachmentHandle = set.finalRenderAttachmentHandle;
+    app->fBuffer = set.fBuffer;
+    app->gbufferDebugAttachmentHandle = set.gbufferDebugAttachmentHandle;
+    app->gbufferDebugBuffer = set.gbufferDebugBuffer;
+    app->waterReflectionAttachmentHandle = set.waterReflectionAttachmentHandle;
+    app->waterReflectionDepthAttachmentHandle = set.waterReflectionDepthAttachmentHandle;
+    app->waterReflectionFrameBuffer = set.waterReflectionFrameBuffer;
+    app->waterRefractionAttachmentHandle = set.waterRefractionAttachmentHandle;
+    app->waterRefractionDepthAttachmentHandle = set.waterRefractionDepthAttachmentHandle;
+    app->waterRefractionFrameBuffer = set.waterRefractionFrameBuffer;
+    app->lightVolumes.framebuffer = set.lightVolumeBuffer;
+    app->occlusion.hiZTexture = set.hiZTexture;
+    app->occlusion.hiZSize = set.size;
+    app->occlusion.hiZLevels = set.hiZLevels;
+
+    targets.current.store(index, std::memory_order_release);
+}
+
+const RenderTargetSet* CurrentRenderTargets(const App* app)
+{
+    const u32 current = app->renderTargets.current.load(std::memory_order_acquire);
+    return current < RENDER_TARGET_POOL_SIZE ? &app->renderTargets.sets[current] : nullptr;
+}
@@ -0,0 +1,24 @@
+//
+// render_targets.h: Screen sized attachments that follow the Scene panel size, pooled per size.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// Starts with no sets, they are created by the first rendered frame
+void InitRenderTargets(App* app);
+
+// Settles on the size frames are rendered at from the Scene panel content
+// region of the last Gui. Simulation thread, before the camera aspect is set.
+void UpdateRenderTargetSize(App* app);
+
+// Makes the set of the frame's size current, reusing a pooled one when there
+// is one, and points the app's framebuffer handles at it. Render thread, before
+// any pass.
+void AcquireRenderTargets(App* app);
+
+// Set of the last rendered frame for the Scene panel, null before the first
+// one. Stays alive while any packet that showed it is in flight.
+const RenderTargetSet* CurrentRenderTargets(const App* app);
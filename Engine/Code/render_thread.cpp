@@ -0,0 +1,134 @@
+#include "render_thread.h"
+#include <GLFW/glfw3.h>
+#include <imgui_impl_opengl3.h>
+
+void RenderThreadLoop(App* app)
+{
+    RenderThread& rt = app->renderThread;
+
+    glfwMakeContextCurrent(rt.window);
+
+    // Uploads issued from now on come from this thread
+    app->uploads.glThread = std::this_thread::get_id();
+
+    for (;;)
+    {
+        const u64 consumed = rt.consumed.load(std::memory_order_relaxed);
+        if (consumed == rt.produced.load(std::memory_order_acquire))
+        {
+            if (rt.quit.load(std::memory_order_relaxed))
+                break;
+            std::this_thread::yield();
+            continue;
+        }
+
+        const f64 frameStart = glfwGetTime();
+
+        const FramePacket& packet = rt.packets[consumed % FRAME_PACKET_COUNT];
+        app->frame = &packet;
+
+        Render(app);
+
+        ImGui_ImplOpenGL3_NewFrame();
+        ImGui_ImplOpenGL3_RenderDrawData(const_cast<ImDrawData*>(&packet.drawData));
+
+        glfwSwapBuffers(rt.window);
+
+        ResetFrameArena();
+
+        app->frame = NULL;
+        rt.renderTime = (f32)(glfwGetTime() - frameStart);
+        FillRenderStats(app, rt.stats[consumed % RENDER_STATS_COUNT]);
+        rt.consumed.store(consumed + 1, std::memory_order_release);
+    }
+
+    glfwMakeContextCurrent(NULL);
+}
+
+void StartRenderThread(App* app, GLFWwindow* window)
+{
+    RenderThread& rt = app->renderThread;
+    rt.window = window;
+    rt.produced.store(0);
+    rt.consumed.store(0);
+    rt.quit.store(false);
+    if (rt.framesInFlight == 0)
+        rt.framesInFlight = FRAME_PACKET_COUNT;
+
+    glfwMakeContextCurrent(NULL);
+    rt.thread = std::thread(RenderThreadLoop, app);
+}
+
+void StopRenderThread(App* app)
+{
+    RenderThread& rt = app->renderThread;
+
+    // Packets already published are still rendered before the thread exits
+    rt.quit.store(true);
+    rt.thread.join();
+
+    glfwMakeContextCurrent(rt.window);
+
+    for (FramePacket& packet : rt.packets)
+    {
+        for (ImDrawList* list : packet.drawLists)
+            IM_DELETE(list);
+        packet.drawLists.clear();
+        packet.drawData.Clear();
+    }
+}
+
+FramePacket& BeginFramePacket(App* app)
+{
+    RenderThread& rt = app->renderThread;
+
+    const u64 produced = rt.produced.load(std::memory_order_relaxed);
+    const u64 framesInFlight = glm::clamp(rt.framesInFlight, 1u, (u32)FRAME_PACKET_COUNT);
+    while (produced - rt.consumed.load(std::memory_order_acquire) >= framesInFlight)
+        std::this_thread::yield();
+
+    FramePacket& packet = rt.packets[produced % FRAME_PACKET_COUNT];
+    packet.frameIndex = produced;
+    return packet;
+}
+
+const RenderStats& LatestRenderStats(const App* app)
+{
+    static const RenderStats none = {};
+    const RenderThread& rt = app->renderThread;
+    const u64 consumed = rt.consumed.load(std::memory_order_acquire);
+    return consumed > 0 ? rt.stats[(consumed - 1) % RENDER_STATS_COUNT] : none;
+}
+
+void SubmitFramePacket(App* app)
+{
+    RenderThread& rt = app->renderThread;
+    rt.produced.store(rt.produced.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void CopyImGuiDrawData(FramePacket& packet, const ImDrawData* drawData)
+{
+    // Lists are kept between frames so their buffers only grow
+    while (packet.drawLists.size() < (u32)drawData->CmdListsCount)
+        packet.drawLists.push_back(IM_NEW(ImDrawList)(NULL));
+
+    for (int i = 0; i < drawData->CmdListsCount; ++i)
+    {
+        const ImDrawList* source = drawData->CmdLists[i];
+        ImDrawList* list = packet.drawLists[i];
+        list->CmdBuffer = source->CmdBuffer;
+        list->IdxBuffer = source->IdxBuffer;
+        list->VtxBuffer = source->VtxBuffer;
+        list->Flags = source->Flags;
+    }
+
+    packet.drawData.Valid = drawData->Valid;
+    packet.drawData.CmdLists = packet.drawLists.data();
+    packet.drawData.CmdListsCount = drawData->CmdListsCount;
+    packet.drawData.TotalIdxCount = drawData->TotalIdxCount;
+    packet.drawData.TotalVtxCount = drawData->TotalVtxCount;
+    packet.drawData.DisplayPos = drawData->DisplayPos;
+    packet.drawData.DisplaySize = drawData->DisplaySize;
+    packet.drawData.FramebufferScale = drawData->FramebufferScale;
+    packet.drawData.OwnerViewport = NULL;
+}
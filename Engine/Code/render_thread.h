@@ -0,0 +1,26 @@
+//
+// render_thread.h: Render thread owning the GL context, fed with frame packets by the simulation thread.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// The calling thread gives up the GL context, the render thread makes it current
+void StartRenderThread(App* app, GLFWwindow* window);
+
+// Waits for the render thread to exit, the context is current on the caller again afterwards
+void StopRenderThread(App* app);
+
+// Simulation thread side. Begin blocks while the allowed number of frames is
+// still in flight and returns a packet no one else is reading.
+FramePacket& BeginFramePacket(App* app);
+void SubmitFramePacket(App* app);
+
+// Simulation thread side. Counters of the last frame the render thread
+// finished, left alone by it until the simulation produces more packets.
+const RenderStats& LatestRenderStats(const App* app);
+
+// Copies the draw lists so the ImGui context is free to start a new frame
+void CopyImGuiDrawData(FramePacket& packet, const ImDrawData* drawData);
@@ -0,0 +1,469 @@
+#include "software_occlusion.h"
+#include "culling.h"
+#include "job_system.h"
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE__)
+#include <xmmintrin.h>
+#define SOFTWARE_OCCLUSION_SSE 1
+#else
+#define SOFTWARE_OCCLUSION_SSE 0
+#endif
+
+#define SOFTWARE_OCCLUSION_BENCHMARK_RUNS   8
+#define SOFTWARE_OCCLUSION_TERRAIN_QUADS    128
+
+void BuildOccluderMesh(const std::vector<vec3>& positions, const std::vector<u32>& indices, const vec3& aabbMin, const vec3& aabbMax,
+                       std::vector<vec3>& occluderPositions, std::vector<u32>& occluderIndices, f32& occluderError)
+{
+    occluderPositions.clear();
+    occluderIndices.clear();
+
+    // Cells are relative to the box, a flat mesh keeps as many cells across its thin side
+    const vec3 cellScale = vec3((f32)OCCLUDER_GRID) / glm::max(aabbMax - aabbMin, vec3(1e-6f));
+    occluderError = glm::length((aabbMax - aabbMin) / (f32)OCCLUDER_GRID);
+    std::unordered_map<u32, u32> cells;
+    std::vector<vec3> sums;
+    std::vector<u32> counts;
+    std::vector<u32> remap(positions.size());
+    for (u32 i = 0; i < positions.size(); ++i)
+    {
+        const ivec3 cell = glm::clamp(ivec3((positions[i] - aabbMin) * cellScale), ivec3(0), ivec3(OCCLUDER_GRID - 1));
+        const u32 key = ((u32)cell.z * OCCLUDER_GRID + (u32)cell.y) * OCCLUDER_GRID + (u32)cell.x;
+        auto inserted = cells.insert(std::make_pair(key, (u32)sums.size()));
+        if (inserted.second)
+        {
+            sums.push_back(vec3(0.0f));
+            counts.push_back(0);
+        }
+        remap[i] = inserted.first->second;
+        sums[remap[i]] += positions[i];
+        counts[remap[i]]++;
+    }
+
+    // Triangles with two corners in one cell vanish, the rest are rotated to
+    // start at their lowest vertex so duplicates sort next to each other
+    struct Triangle { u32 v[3]; };
+    std::vector<Triangle> triangles;
+    for (u32 i = 0; i + 2 < indices.size(); i += 3)
+    {
+        u32 a = remap[indices[i]];
+        u32 b = remap[indices[i + 1]];
+        u32 c = remap[indices[i + 2]];
+        if (a == b || b == c || a == c)
+            continue;
+        while (a > b || a > c)
+        {
+            const u32 first = a;
+            a = b; b = c; c = first;
+        }
+        triangles.push_back(Triangle{ { a, b, c } });
+    }
+    auto less = [](const Triangle& l, const Triangle& r) { return std::lexicographical_compare(l.v, l.v + 3, r.v, r.v + 3); };
+    auto equal = [](const Triangle& l, const Triangle& r) { return std::equal(l.v, l.v + 3, r.v); };
+    std::sort(triangles.begin(), triangles.end(), less);
+    triangles.erase(std::unique(triangles.begin(), triangles.end(), equal), triangles.end());
+
+    // Only the cells still referenced become vertices
+    std::vector<u32> compact(sums.size(), UINT32_MAX);
+    for (const Triangle& triangle : triangles)
+    {
+        for (u32 corner = 0; corner < 3; ++corner)
+        {
+            const u32 cell = triangle.v[corner];
+            if (compact[cell] == UINT32_MAX)
+            {
+                compact[cell] = (u32)occluderPositions.size();
+                occluderPositions.push_back(sums[cell] / (f32)counts[cell]);
+            }
+            occluderIndices.push_back(compact[cell]);
+        }
+    }
+}
+
+void BeginSoftwareOcclusion(SoftwareOcclusion& occlusion, const glm::mat4& viewProjection, const vec3& eye)
+{
+    occlusion.viewProjection = viewProjection;
+    occlusion.eye = eye;
+    occlusion.depth.resize(SOFTWARE_DEPTH_WIDTH * SOFTWARE_DEPTH_HEIGHT);
+    occlusion.triangles.clear();
+    occlusion.occluders = 0;
+}
+
+static vec3 ClipToPixel(const vec4& clip)
+{
+    const vec3 ndc = vec3(clip) / clip.w;
+    return vec3((ndc.x * 0.5f + 0.5f) * SOFTWARE_DEPTH_WIDTH, (ndc.y * 0.5f + 0.5f) * SOFTWARE_DEPTH_HEIGHT, ndc.z * 0.5f + 0.5f);
+}
+
+void AddOccluder(SoftwareOcclusion& occlusion, const glm::mat4& world, const std::vector<vec3>& positions, const std::vector<u32>& indices, f32 error)
+{
+    // Clustering averages vertices, which in concave areas lands in front of
+    // the real surface. Pushed back by the error the simplified surface is
+    // behind the original along every view ray. The error is in object space.
+    const glm::mat4 toClip = occlusion.viewProjection * world;
+    const vec3 eye = vec3(glm::inverse(world) * vec4(occlusion.eye, 1.0f));
+    std::vector<vec4> clip(positions.size());
+    for (u32 i = 0; i < positions.size(); ++i)
+    {
+        const vec3 away = positions[i] - eye;
+        const f32 distance = glm::length(away);
+        const vec3 pushed = distance > 0.0f ? positions[i] + away * (error / distance) : positions[i];
+        clip[i] = toClip * vec4(pushed, 1.0f);
+    }
+
+    for (u32 i = 0; i + 2 < indices.size(); i += 3)
+    {
+        const vec4 corners[3] = { clip[indices[i]], clip[indices[i + 1]], clip[indices[i + 2]] };
+
+        // Entirely outside one side of the frustum
+        bool outside = false;
+        for (u32 axis = 0; axis < 3 && !outside; ++axis)
+        {
+            outside = (corners[0][axis] > corners[0].w && corners[1][axis] > corners[1].w && corners[2][axis] > corners[2].w) ||
+                      (corners[0][axis] < -corners[0].w && corners[1][axis] < -corners[1].w && corners[2][axis] < -corners[2].w);
+        }
+        if (outside)
+            continue;
+
+        // Near plane clip, z + w >= 0, leaves at most a quad
+        vec4 polygon[4];
+        u32 count = 0;
+        for (u32 edge = 0; edge < 3; ++edge)
+        {
+            const vec4& a = corners[edge];
+            const vec4& b = corners[(edge + 1) % 3];
+            const f32 da = a.z + a.w;
+            const f32 db = b.z + b.w;
+            if (da >= 0.0f)
+                polygon[count++] = a;
+            if ((da >= 0.0f) != (db >= 0.0f))
+                polygon[count++] = a + (b - a) * (da / (da - db));
+        }
+
+        for (u32 fan = 2; fan < count; ++fan)
+        {
+            occlusion.triangles.push_back(ClipToPixel(polygon[0]));
+            occlusion.triangles.push_back(ClipToPixel(polygon[fan - 1]));
+            occlusion.triangles.push_back(ClipToPixel(polygon[fan]));
+        }
+    }
+}
+
+void RasterizeSoftwareDepth(SoftwareOcclusion& occlusion, u32 band)
+{
+    const i32 bandRows = SOFTWARE_DEPTH_HEIGHT / SOFTWARE_DEPTH_BANDS;
+    const i32 bandMin = band * bandRows;
+    const i32 bandMax = bandMin + bandRows - 1;
+    f32* depth = occlusion.depth.data();
+    std::fill(depth + bandMin * SOFTWARE_DEPTH_WIDTH, depth + (bandMax + 1) * SOFTWARE_DEPTH_WIDTH, 1.0f);
+
+    for (u32 i = 0; i + 2 < occlusion.triangles.size(); i += 3)
+    {
+        vec3 v0 = occlusion.triangles[i];
+        vec3 v1 = occlusion.triangles[i + 1];
+        vec3 v2 = occlusion.triangles[i + 2];
+
+        // Occluders are two sided, back facing triangles just swap winding
+        f32 area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+        if (area < 0.0f)
+        {
+            std::swap(v1, v2);
+            area = -area;
+        }
+        if (area < 1e-4f)
+            continue;
+
+        // Pixels whose center is inside the box of the triangle, clamped to the band
+        const vec2 boxMin = glm::clamp(glm::min(vec2(v0), glm::min(vec2(v1), vec2(v2))), vec2(-1.0f), vec2(SOFTWARE_DEPTH_WIDTH + 1, SOFTWARE_DEPTH_HEIGHT + 1));
+        const vec2 boxMax = glm::clamp(glm::max(vec2(v0), glm::max(vec2(v1), vec2(v2))), vec2(-1.0f), vec2(SOFTWARE_DEPTH_WIDTH + 1, SOFTWARE_DEPTH_HEIGHT + 1));
+        const i32 xMin = glm::max((i32)ceilf(boxMin.x - 0.5f), 0);
+        const i32 xMax = glm::min((i32)floorf(boxMax.x - 0.5f), SOFTWARE_DEPTH_WIDTH - 1);
+        const i32 yMin = glm::max((i32)ceilf(boxMin.y - 0.5f), bandMin);
+        const i32 yMax = glm::min((i32)floorf(boxMax.y - 0.5f), bandMax);
+        if (xMin > xMax || yMin > yMax)
+            continue;
+
+        // Edge functions, positive inside, edge k weights the opposite vertex k.
+        // Depth is linear in window space and is interpolated as a plane.
+        const f32 a0 = v1.y - v2.y, b0 = v2.x - v1.x, c0 = v1.x * v2.y - v1.y * v2.x;
+        const f32 a1 = v2.y - v0.y, b1 = v0.x - v2.x, c1 = v2.x * v0.y - v2.y * v0.x;
+        const f32 a2 = v0.y - v1.y, b2 = v1.x - v0.x, c2 = v0.x * v1.y - v0.y * v1.x;
+        const f32 zA = (a0 * v0.z + a1 * v1.z + a2 * v2.z) / area;
+        const f32 zB = (b0 * v0.z + b1 * v1.z + b2 * v2.z) / area;
+        const f32 zC = (c0 * v0.z + c1 * v1.z + c2 * v2.z) / area;
+
+#if SOFTWARE_OCCLUSION_SSE
+        // Four pixels of a row at a time, starting on an aligned column. Lanes
+        // left of the box are outside the triangle so need no extra mask.
+        const i32 xStart = xMin & ~3;
+        const __m128 laneX = _mm_add_ps(_mm_set1_ps(xStart + 0.5f), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+        const __m128 step0 = _mm_set1_ps(a0 * 4.0f), step1 = _mm_set1_ps(a1 * 4.0f), step2 = _mm_set1_ps(a2 * 4.0f), stepZ = _mm_set1_ps(zA * 4.0f);
+        const __m128 zero = _mm_setzero_ps();
+        for (i32 y = yMin; y <= yMax; ++y)
+        {
+            const f32 centerY = y + 0.5f;
+            __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a0), laneX), _mm_set1_ps(b0 * centerY + c0));
+            __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a1), laneX), _mm_set1_ps(b1 * centerY + c1));
+            __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a2), laneX), _mm_set1_ps(b2 * centerY + c2));
+            __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(zA), laneX), _mm_set1_ps(zB * centerY + zC));
+            f32* row = depth + y * SOFTWARE_DEPTH_WIDTH;
+            for (i32 x = xStart; x <= xMax; x += 4)
+            {
+                const __m128 inside = _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+                if (_mm_movemask_ps(inside))
+                {
+                    const __m128 current = _mm_loadu_ps(row + x);
+                    const __m128 nearest = _mm_min_ps(current, z);
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, current)));
+                }
+                e0 = _mm_add_ps(e0, step0);
+                e1 = _mm_add_ps(e1, step1);
+                e2 = _mm_add_ps(e2, step2);
+                z = _mm_add_ps(z, stepZ);
+            }
+        }
+#else
+        for (i32 y = yMin; y <= yMax; ++y)
+        {
+            const f32 centerY = y + 0.5f;
+            f32* row = depth + y * SOFTWARE_DEPTH_WIDTH;
+            for (i32 x = xMin; x <= xMax; ++x)
+            {
+                const f32 centerX = x + 0.5f;
+                if (a0 * centerX + b0 * centerY + c0 >= 0.0f && a1 * centerX + b1 * centerY + c1 >= 0.0f && a2 * centerX + b2 * centerY + c2 >= 0.0f)
+                    row[x] = glm::min(row[x], zA * centerX + zB * centerY + zC);
+            }
+        }
+#endif
+    }
+}
+
+void UpdateSoftwareOcclusion(App* app)
+{
+    const FramePacket& frame = *app->frame;
+    const WorldBounds& bounds = frame.bounds;
+    SoftwareOcclusion& occlusion = app->softwareOcclusion;
+
+    const auto start = std::chrono::high_resolution_clock::now();
+    const glm::mat4 viewProjection = frame.projectionMat * frame.viewMat;
+    BeginSoftwareOcclusion(occlusion, viewProjection, frame.camera.position);
+
+    // The submeshes in view covering the most screen, by world radius over distance
+    struct Occluder
+    {
+        f32 size;
+        u32 entity;
+        u32 submesh;
+    };
+    std::vector<Occluder> occluders;
+    const Frustum frustum = FrustumFromMatrix(viewProjection);
+    for (u32 i = 0; i < frame.entities.size() && i < bounds.entityOffsets.size(); ++i)
+    {
+        const Mesh& mesh = app->meshes[app->models[frame.entities[i].modelIdx].meshIdx];
+        for (u32 j = 0; j < mesh.submeshes.size(); ++j)
+        {
+            if (mesh.submeshes[j].occluderIndices.empty())
+                continue;
+
+            const vec4& sphere = bounds.spheres[bounds.entityOffsets[i] + j];
+            bool inside = true;
+            for (u32 p = 0; p < 6 && inside; ++p)
+                inside = glm::dot(vec3(frustum.planes[p]), vec3(sphere)) + frustum.planes[p].w >= -sphere.w;
+
+            const f32 size = sphere.w / glm::max(glm::distance(vec3(sphere), frame.camera.position), frame.camera.nearPlane);
+            if (inside && size >= OCCLUDER_MIN_SIZE)
+                occluders.push_back(Occluder{ size, i, j });
+        }
+    }
+
+    const u32 count = glm::min((u32)occluders.size(), (u32)OCCLUDER_MAX_COUNT);
+    std::partial_sort(occluders.begin(), occluders.begin() + count, occluders.end(),
+        [](const Occluder& a, const Occluder& b) { return a.size > b.size; });
+    for (u32 i = 0; i < count; ++i)
+    {
+        const Entity& entity = frame.entities[occluders[i].entity];
+        const Submesh& submesh = app->meshes[app->models[entity.modelIdx].meshIdx].submeshes[occluders[i].submesh];
+        AddOccluder(occlusion, MatrixFromPositionRotationScale(entity.position, entity.rotation, entity.scale), submesh.occluderPositions, submesh.occluderIndices, submesh.occluderError);
+    }
+    occlusion.occluders = count;
+
+    JobCounter rasterized(0);
+    for (u32 band = 0; band < SOFTWARE_DEPTH_BANDS; ++band)
+        RunJob(app->jobs, rasterized, [&occlusion, band] { RasterizeSoftwareDepth(occlusion, band); });
+    WaitForJobs(app->jobs, rasterized);
+
+    occlusion.rasterTime = ElapsedMilliseconds(start);
+}
+
+void TestSoftwareOcclusion(const SoftwareOcclusion& occlusion, const WorldBounds& bounds, std::vector<u8>& visible, CullStats& stats)
+{
+    stats.tested = 0;
+    stats.visible = 0;
+    const glm::mat4& viewProjection = occlusion.viewProjection;
+
+    for (u32 i = 0; i < bounds.count; ++i)
+    {
+        if (!visible[i])
+            continue;
+        stats.tested++;
+
+        // Corners in clip space are the center plus or minus each scaled axis
+        const vec4 center = viewProjection * vec4(bounds.centerX[i], bounds.centerY[i], bounds.centerZ[i], 1.0f);
+        const vec4 axisX = viewProjection[0] * bounds.extentX[i];
+        const vec4 axisY = viewProjection[1] * bounds.extentY[i];
+        const vec4 axisZ = viewProjection[2] * bounds.extentZ[i];
+
+        // Any corner past the near plane keeps the box, it may cover the whole view
+        bool crossesNear = false;
+        vec3 rectMin = vec3(FLT_MAX);
+        vec3 rectMax = vec3(-FLT_MAX);
+        for (u32 corner = 0; corner < 8 && !crossesNear; ++corner)
+        {
+            const vec4 clip = center + ((corner & 1) ? axisX : -axisX) + ((corner & 2) ? axisY : -axisY) + ((corner & 4) ? axisZ : -axisZ);
+            crossesNear = clip.z + clip.w < 0.0f || clip.w <= 0.0f;
+            if (!crossesNear)
+            {
+                const vec3 pixel = ClipToPixel(clip);
+                rectMin = glm::min(rectMin, pixel);
+                rectMax = glm::max(rectMax, pixel);
+            }
+        }
+
+        // Every pixel the rectangle touches must hold something nearer than the nearest corner
+        const i32 xMin = glm::max((i32)floorf(glm::max(rectMin.x, -1.0f)), 0);
+        const i32 xMax = glm::min((i32)floorf(glm::min(rectMax.x, (f32)SOFTWARE_DEPTH_WIDTH)), SOFTWARE_DEPTH_WIDTH - 1);
+        const i32 yMin = glm::max((i32)floorf(glm::max(rectMin.y, -1.0f)), 0);
+        const i32 yMax = glm::min((i32)floorf(glm::min(rectMax.y, (f32)SOFTWARE_DEPTH_HEIGHT)), SOFTWARE_DEPTH_HEIGHT - 1);
+        bool occluded = !crossesNear && xMin <= xMax && yMin <= yMax;
+
+#if SOFTWARE_OCCLUSION_SSE
+        const i32 xStart = xMin & ~3;
+        const __m128 nearest = _mm_set1_ps(rectMin.z);
+        const __m128 laneX = _mm_add_ps(_mm_set1_ps((f32)xStart), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+        const __m128 first = _mm_set1_ps((f32)xMin);
+        const __m128 last = _mm_set1_ps((f32)xMax);
+        for (i32 y = yMin; y <= yMax && occluded; ++y)
+        {
+            const f32* row = occlusion.depth.data() + y * SOFTWARE_DEPTH_WIDTH;
+            __m128 column = laneX;
+            for (i32 x = xStart; x <= xMax && occluded; x += 4)
+            {
+                const __m128 inRect = _mm_and_ps(_mm_cmpge_ps(column, first), _mm_cmple_ps(column, last));
+                const __m128 behind = _mm_cmpge_ps(_mm_loadu_ps(row + x), nearest);
+                occluded = _mm_movemask_ps(_mm_and_ps(inRect, behind)) == 0;
+                column = _mm_add_ps(column, _mm_set1_ps(4.0f));
+            }
+        }
+#else
+        for (i32 y = yMin; y <= yMax && occluded; ++y)
+            for (i32 x = xMin; x <= xMax && occluded; ++x)
+                occluded = occlusion.depth[y * SOFTWARE_DEPTH_WIDTH + x] < rectMin.z;
+#endif
+
+        visible[i] = !occluded;
+        stats.visible += !occluded;
+    }
+}
+
+SoftwareOcclusionBenchmark RunSoftwareOcclusionBenchmark(u32 boxes)
+{
+    // Rolling hills with a ridge across the middle, seen from one side at
+    // about head height. Boxes are scattered on both sides of the ridge.
+    const u32 quads = SOFTWARE_OCCLUSION_TERRAIN_QUADS;
+    const f32 side = 128.0f;
+    std::vector<vec3> positions;
+    std::vector<u32> indices;
+    for (u32 z = 0; z <= quads; ++z)
+    {
+        for (u32 x = 0; x <= quads; ++x)
+        {
+            const f32 px = ((f32)x / quads - 0.5f) * side;
+            const f32 pz = ((f32)z / quads - 0.5f) * side;
+            const f32 height = 10.0f * expf(-pz * pz / 40.0f) + 1.5f * sinf(px * 0.2f) * cosf(pz * 0.15f);
+            positions.push_back(vec3(px, height, pz));
+        }
+    }
+    for (u32 z = 0; z < quads; ++z)
+    {
+        for (u32 x = 0; x < quads; ++x)
+        {
+            const u32 corner = z * (quads + 1) + x;
+            const u32 quad[6] = { corner, corner + quads + 1, corner + 1, corner + 1, corner + quads + 1, corner + quads + 2 };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+
+    vec3 aabbMin = vec3(FLT_MAX);
+    vec3 aabbMax = vec3(-FLT_MAX);
+    for (const vec3& position : positions)
+    {
+        aabbMin = glm::min(aabbMin, position);
+        aabbMax = glm::max(aabbMax, position);
+    }
+
+    SoftwareOcclusionBenchmark result = {};
+    result.sourceTriangles = (u32)indices.size() / 3;
+    result.boxes = boxes;
+
+    std::vector<vec3> occluderPositions;
+    std::vector<u32> occluderIndices;
+    f32 occluderError = 0.0f;
+    auto start = std::chrono::high_resolution_clock::now();
+    BuildOccluderMesh(positions, indices, aabbMin, aabbMax, occluderPositions, occluderIndices, occluderError);
+    result.simplify = ElapsedMilliseconds(start);
+    result.occluderTriangles = (u32)occluderIndices.size() / 3;
+
+    std::mt19937 random(boxes);
+    std::uniform_real_distribution<f32> spread(-side * 0.45f, side * 0.45f);
+    std::uniform_real_distribution<f32> height(0.0f, 6.0f);
+    std::uniform_real_distribution<f32> size(0.25f, 1.0f);
+    WorldBounds bounds;
+    ResizeWorldBounds(bounds, boxes);
+    for (u32 i = 0; i < boxes; ++i)
+    {
+        bounds.centerX[i] = spread(random);
+        bounds.centerY[i] = height(random) + 2.0f;
+        bounds.centerZ[i] = spread(random);
+        bounds.extentX[i] = size(random);
+        bounds.extentY[i] = size(random);
+        bounds.extentZ[i] = size(random);
+    }
+
+    const vec3 eye = vec3(0.0f, 4.0f, side * 0.45f);
+    const glm::mat4 viewProjection = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, side * 2.0f) * glm::lookAt(eye, vec3(0.0f, 4.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+    std::vector<u8> inFrustum;
+    CullStats stats;
+    CullBounds(bounds, FrustumFromMatrix(viewProjection), inFrustum, stats);
+
+    SoftwareOcclusion occlusion = {};
+    start = std::chrono::high_resolution_clock::now();
+    for (u32 run = 0; run < SOFTWARE_OCCLUSION_BENCHMARK_RUNS; ++run)
+    {
+        BeginSoftwareOcclusion(occlusion, viewProjection, eye);
+        AddOccluder(occlusion, glm::mat4(1.0f), occluderPositions, occluderIndices, occluderError);
+    }
+    result.setup = ElapsedMilliseconds(start) / SOFTWARE_OCCLUSION_BENCHMARK_RUNS;
+
+    // Bands one after the other, the cost a single worker would pay
+    start = std::chrono::high_resolution_clock::now();
+    for (u32 run = 0; run < SOFTWARE_OCCLUSION_BENCHMARK_RUNS; ++run)
+        for (u32 band = 0; band < SOFTWARE_DEPTH_BANDS; ++band)
+            RasterizeSoftwareDepth(occlusion, band);
+    result.raster = ElapsedMilliseconds(start) / SOFTWARE_OCCLUSION_BENCHMARK_RUNS;
+
+    std::vector<u8> visible;
+    start = std::chrono::high_resolution_clock::now();
+    for (u32 run = 0; run < SOFTWARE_OCCLUSION_BENCHMARK_RUNS; ++run)
+    {
+        visible = inFrustum;
+        TestSoftwareOcclusion(occlusion, bounds, visible, stats);
+    }
+    result.test = ElapsedMilliseconds(start) / SOFTWARE_OCCLUSION_BENCHMARK_RUNS;
+    result.occluded = stats.tested - stats.visible;
+
+    return result;
+}
@@ -0,0 +1,35 @@
+//
+// software_occlusion.h: Occluder simplification and a SIMD depth rasterizer culling entity boxes on the CPU.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// Vertex clustering on an OCCLUDER_GRID grid over the box: every vertex moves
+// to the average of its cell and the triangles that collapse are dropped. The
+// error is how far a vertex may have moved, the diagonal of a cell.
+void BuildOccluderMesh(const std::vector<vec3>& positions, const std::vector<u32>& indices, const vec3& aabbMin, const vec3& aabbMax,
+                       std::vector<vec3>& occluderPositions, std::vector<u32>& occluderIndices, f32& occluderError);
+
+// Starts the depth buffer of a view, with no triangles yet
+void BeginSoftwareOcclusion(SoftwareOcclusion& occlusion, const glm::mat4& viewProjection, const vec3& eye);
+
+// Clips the triangles of a mesh against the near plane and projects them to
+// pixels. Vertices are first pushed away from the eye by the simplification
+// error, so the occluder never ends up in front of the surface it stands for.
+void AddOccluder(SoftwareOcclusion& occlusion, const glm::mat4& world, const std::vector<vec3>& positions, const std::vector<u32>& indices, f32 error);
+
+// Clears and rasterizes the rows of one band. Bands share no pixels, all of them may run at once.
+void RasterizeSoftwareDepth(SoftwareOcclusion& occlusion, u32 band);
+
+// Render thread, picks the occluders of the frame and rasterizes them on the workers
+void UpdateSoftwareOcclusion(App* app);
+
+// Clears the flag of every visible box behind all the pixels it covers. Only reads
+// the depth buffer, any number of passes may test at once.
+void TestSoftwareOcclusion(const SoftwareOcclusion& occlusion, const WorldBounds& bounds, std::vector<u8>& visible, CullStats& stats);
+
+// Simplification, raster and test timings of a hilly terrain hiding random boxes
+SoftwareOcclusionBenchmark RunSoftwareOcclusionBenchmark(u32 boxes);
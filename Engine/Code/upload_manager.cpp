@@ -0,0 +1,320 @@
+#include "upload_manager.h"
+#include "buffer_management.h"
+
+// glad is generated for core 4.3, buffer storage is fetched by hand when the driver exposes it
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT   0x0080
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+static PFNGLBUFFERSTORAGEPROC glBufferStorage_ = NULL;
+
+#define STAGING_ALIGNMENT 16
+
+bool HasExtension(App* app, const char* name)
+{
+    for (int i = 0; i < app->info.numExtensions; ++i)
+        if (app->info.extensions[i] == name)
+            return true;
+    return false;
+}
+
+void InitUploadManager(App* app, u32 ringSize, u32 frameBudget)
+{
+    UploadManager& um = app->uploads;
+    um.ringSize = ringSize;
+    um.ringHead = 0;
+    um.ringTail = 0;
+    um.ringUsed = 0;
+    um.frameBudget = frameBudget;
+    um.pendingBytes = 0;
+    um.uploadedLastFrame = 0;
+    um.glThread = std::this_thread::get_id();
+
+    if (HasExtension(app, "GL_ARB_buffer_storage"))
+        glBufferStorage_ = (PFNGLBUFFERSTORAGEPROC)GetGLProcAddress("glBufferStorage");
+
+    if (glBufferStorage_)
+    {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+        glGenBuffers(1, &um.stagingBuffer);
+        glBindBuffer(GL_COPY_READ_BUFFER, um.stagingBuffer);
+        glBufferStorage_(GL_COPY_READ_BUFFER, ringSize, NULL, flags);
+        um.stagingMemory = (u8*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, ringSize, flags);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        um.persistentlyMapped = um.stagingMemory != NULL;
+    }
+
+    if (!um.persistentlyMapped)
+    {
+        // Without persistent mapping the ring lives in client memory and
+        // uploads are sourced from it directly
+        ILOG("GL_ARB_buffer_storage not available, staging uploads from client memory");
+        um.stagingMemory = (u8*)malloc(ringSize);
+    }
+}
+
+// Must be called with the manager mutex held
+bool ReserveStaging(UploadManager& um, u32 size, u32& offset, u32& ringBytes)
+{
+    const u32 alignedSize = Align(size, STAGING_ALIGNMENT);
+
+    if (um.ringUsed == 0)
+    {
+        um.ringHead = 0;
+        um.ringTail = 0;
+    }
+
+    if (um.ringHead >= um.ringTail && um.ringUsed < um.ringSize)
+    {
+        // Free space is [head, end) followed by [0, tail)
+        if (um.ringHead + alignedSize <= um.ringSize)
+        {
+            offset = um.ringHead;
+            ringBytes = alignedSize;
+        }
+        else if (alignedSize <= um.ringTail)
+        {
+            offset = 0;
+            ringBytes = (um.ringSize - um.ringHead) + alignedSize;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    else
+    {
+        // Free space is [head, tail)
+        if (um.ringHead + alignedSize > um.ringTail)
+            return false;
+
+        offset = um.ringHead;
+        ringBytes = alignedSize;
+    }
+
+    um.ringHead = offset + alignedSize;
+    um.ringUsed += ringBytes;
+    return true;
+}
+
+void RetireFinishedUploads(UploadManager& um, bool wait)
+{
+    u32 retired = 0;
+    for (; retired < um.fences.size(); ++retired)
+    {
+        UploadFence& fence = um.fences[retired];
+        GLuint64 timeout = wait ? 1000000000ull : 0ull;
+        GLenum result = glClientWaitSync(fence.sync, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, timeout);
+        if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+            break;
+
+        glDeleteSync(fence.sync);
+        um.ringTail = fence.ringTail;
+        um.ringUsed -= fence.ringBytes;
+    }
+
+    um.fences.erase(um.fences.begin(), um.fences.begin() + retired);
+}
+
+// Must be called with the manager mutex held, on the GL thread
+void IssueUploads(UploadManager& um, u32 budget)
+{
+    u32 issuedBytes = 0;
+    u32 batchBytes = 0;
+    u32 batchTail = 0;
+
+    if (um.persistentlyMapped)
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, um.stagingBuffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, um.stagingBuffer);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    // Always issue at least one request so oversized ones make progress
+    while (!um.pending.empty() && (issuedBytes == 0 || issuedBytes + um.pending.front().size <= budget))
+    {
+        const UploadRequest& req = um.pending.front();
+
+        switch (req.type)
+        {
+        case UPLOADTYPE_BUFFER:
+            glBindBuffer(GL_COPY_WRITE_BUFFER, req.dstBuffer);
+            if (um.persistentlyMapped)
+                glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, req.stagingOffset, req.dstOffset, req.size);
+            else
+                glBufferSubData(GL_COPY_WRITE_BUFFER, req.dstOffset, req.size, um.stagingMemory + req.stagingOffset);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            break;
+
+        case UPLOADTYPE_TEXTURE:
+        {
+            const void* source = um.persistentlyMapped ? (const void*)(u64)req.stagingOffset
+                                                       : (const void*)(um.stagingMemory + req.stagingOffset);
+            glBindTexture(req.bindTarget, req.texture);
+            if (req.bindTarget == GL_TEXTURE_2D_ARRAY)
+                glTexSubImage3D(req.imageTarget, 0, req.texOffset.x, req.texOffset.y, req.texLayer, req.texSize.x, req.texSize.y, 1,
+                                req.dataFormat, req.dataType, source);
+            else
+                glTexSubImage2D(req.imageTarget, 0, req.texOffset.x, req.texOffset.y, req.texSize.x, req.texSize.y,
+                                req.dataFormat, req.dataType, source);
+            if (req.generateMipmaps)
+                glGenerateMipmap(req.bindTarget);
+            glBindTexture(req.bindTarget, 0);
+        }
+        break;
+        }
+
+        issuedBytes += req.size;
+        batchBytes += req.ringBytes;
+        batchTail = req.stagingOffset + Align(req.size, STAGING_ALIGNMENT);
+        um.pendingBytes -= req.size;
+        um.pending.pop_front();
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    if (um.persistentlyMapped)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    }
+
+    if (batchBytes > 0)
+    {
+        // Client-memory uploads are consumed by the call itself, but fencing
+        // both paths the same way keeps the ring bookkeeping in one place
+        UploadFence fence = {};
+        fence.sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        fence.ringTail = batchTail;
+        fence.ringBytes = batchBytes;
+        um.fences.push_back(fence);
+    }
+
+    um.uploadedLastFrame = issuedBytes;
+}
+
+void ProcessUploads(App* app)
+{
+    UploadManager& um = app->uploads;
+    std::lock_guard<std::mutex> lock(um.mutex);
+
+    RetireFinishedUploads(um, false);
+    IssueUploads(um, um.frameBudget);
+}
+
+void FlushUploads(App* app)
+{
+    UploadManager& um = app->uploads;
+    std::lock_guard<std::mutex> lock(um.mutex);
+
+    while (!um.pending.empty())
+        IssueUploads(um, UINT32_MAX);
+    RetireFinishedUploads(um, true);
+}
+
+// Reserves ring space for a request, waiting for the GPU when the ring is full.
+// Returns with the manager mutex held by the given lock.
+void ReserveStagingBlocking(App* app, std::unique_lock<std::mutex>& lock, u32 size, u32& offset, u32& ringBytes)
+{
+    UploadManager& um = app->uploads;
+    ASSERT(Align(size, STAGING_ALIGNMENT) <= um.ringSize, "Upload chunk larger than the staging ring");
+
+    while (!ReserveStaging(um, size, offset, ringBytes))
+    {
+        if (std::this_thread::get_id() == um.glThread)
+        {
+            // Nobody else drains the ring for us, do it now
+            while (!um.pending.empty())
+                IssueUploads(um, UINT32_MAX);
+            RetireFinishedUploads(um, true);
+        }
+        else
+        {
+            lock.unlock();
+            std::this_thread::yield();
+            lock.lock();
+        }
+    }
+}
+
+u32 MaxChunkSize(const UploadManager& um)
+{
+    // Keep chunks small enough to fit in the ring next to in-flight data and within a frame budget
+    u32 chunk = um.ringSize / 4;
+    return (um.frameBudget < chunk) ? um.frameBudget : chunk;
+}
+
+void StageBufferUpload(App* app, GLuint dstBuffer, u32 dstOffset, const void* data, u32 size)
+{
+    UploadManager& um = app->uploads;
+    const u32 maxChunk = MaxChunkSize(um);
+
+    u32 done = 0;
+    while (done < size)
+    {
+        u32 chunk = (size - done < maxChunk) ? size - done : maxChunk;
+
+        std::unique_lock<std::mutex> lock(um.mutex);
+
+        UploadRequest req = {};
+        req.type = UPLOADTYPE_BUFFER;
+        req.size = chunk;
+        req.dstBuffer = dstBuffer;
+        req.dstOffset = dstOffset + done;
+        ReserveStagingBlocking(app, lock, chunk, req.stagingOffset, req.ringBytes);
+
+        memcpy(um.stagingMemory + req.stagingOffset, (const u8*)data + done, chunk);
+        um.pending.push_back(req);
+        um.pendingBytes += chunk;
+
+        done += chunk;
+    }
+}
+
+void StageTextureRows(App* app, GLuint texture, GLenum bindTarget, GLenum imageTarget, u32 layer, ivec2 size,
+                      GLenum dataFormat, GLenum dataType, const void* pixels, u32 rowBytes, bool generateMipmaps)
+{
+    UploadManager& um = app->uploads;
+    const u32 maxChunk = MaxChunkSize(um);
+    const i32 rowsPerChunk = (rowBytes < maxChunk) ? (i32)(maxChunk / rowBytes) : 1;
+
+    i32 row = 0;
+    while (row < size.y)
+    {
+        i32 rows = (size.y - row < rowsPerChunk) ? size.y - row : rowsPerChunk;
+        u32 chunk = rows * rowBytes;
+
+        std::unique_lock<std::mutex> lock(um.mutex);
+
+        UploadRequest req = {};
+        req.type = UPLOADTYPE_TEXTURE;
+        req.size = chunk;
+        req.texture = texture;
+        req.bindTarget = bindTarget;
+        req.imageTarget = imageTarget;
+        req.texLayer = layer;
+        req.texOffset = ivec2(0, row);
+        req.texSize = ivec2(size.x, rows);
+        req.dataFormat = dataFormat;
+        req.dataType = dataType;
+        req.generateMipmaps = generateMipmaps && (row + rows == size.y);
+        ReserveStagingBlocking(app, lock, chunk, req.stagingOffset, req.ringBytes);
+
+        memcpy(um.stagingMemory + req.stagingOffset, (const u8*)pixels + row * rowBytes, chunk);
+        um.pending.push_back(req);
+        um.pendingBytes += chunk;
+
+        row += rows;
+    }
+}
+
+void StageTextureUpload(App* app, GLuint texture, GLenum bindTarget, GLenum imageTarget, ivec2 size,
+                        GLenum dataFormat, GLenum dataType, const void* pixels, u32 rowBytes, bool generateMipmaps)
+{
+    StageTextureRows(app, texture, bindTarget, imageTarget, 0, size, dataFormat, dataType, pixels, rowBytes, generateMipmaps);
+}
+
+void StageTextureLayerUpload(App* app, GLuint textureArray, u32 layer, ivec2 size,
+                             GLenum dataFormat, GLenum dataType, const void* pixels, u32 rowBytes, bool generateMipmaps)
+{
+    StageTextureRows(app, textureArray, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_2D_ARRAY, layer, size, dataFormat, dataType, pixels, rowBytes, generateMipmaps);
+}
@@ -0,0 +1,23 @@
+//
+// upload_manager.h: Streaming of mesh and texture data through a staging ring.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+void InitUploadManager(App* app, u32 ringSize, u32 frameBudget);
+
+// Copies the data into the staging ring and queues the upload. Can be called from any thread.
+void StageBufferUpload(App* app, GLuint dstBuffer, u32 dstOffset, const void* data, u32 size);
+void StageTextureUpload(App* app, GLuint texture, GLenum bindTarget, GLenum imageTarget, ivec2 size,
+                        GLenum dataFormat, GLenum dataType, const void* pixels, u32 rowBytes, bool generateMipmaps);
+void StageTextureLayerUpload(App* app, GLuint textureArray, u32 layer, ivec2 size,
+                             GLenum dataFormat, GLenum dataType, const void* pixels, u32 rowBytes, bool generateMipmaps);
+
+// GL thread only: issues queued uploads up to the frame budget and recycles finished staging space.
+void ProcessUploads(App* app);
+
+// GL thread only: issues every queued upload and waits until the staging ring is idle.
+void FlushUploads(App* app);
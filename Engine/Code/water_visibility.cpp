@@ -0,0 +1,156 @@
+#include "water_visibility.h"
+#include "culling.h"
+#include "gl_state.h"
+
+void InitWaterVisibility(App* app)
+{
+    WaterVisibility& water = app->water;
+
+    const Mesh& mesh = app->meshes[app->models[app->planeModelIdx].meshIdx];
+    water.surfaceBounds = Aabb{ vec3(FLT_MAX), vec3(-FLT_MAX) };
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        water.surfaceBounds.min = glm::min(water.surfaceBounds.min, submesh.aabbMin);
+        water.surfaceBounds.max = glm::max(water.surfaceBounds.max, submesh.aabbMax);
+    }
+
+    glGenQueries(WATER_QUERY_COUNT, water.surfaceQueries);
+    glGenQueries(WATER_QUERY_COUNT * WATER_TIMESTAMP_COUNT, &water.timestamps[0][0]);
+    for (u32 i = 0; i < WATER_QUERY_COUNT; ++i)
+        water.issuedFrames[i] = UINT64_MAX;
+    water.lastReadFrame = UINT64_MAX;
+    water.inView = true;
+}
+
+// GPU time of the frame that last used the slot, or false while it is not done
+static bool ReadWaterSlot(WaterVisibility& water, u32 slot, bool& visible, f32& time)
+{
+    const GLuint lastQuery = water.timestamps[slot][WATER_TIMESTAMP_COUNT - 1];
+    GLuint available = GL_FALSE;
+    glGetQueryObjectuiv(lastQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+        return false;
+    glGetQueryObjectuiv(water.surfaceQueries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+        return false;
+
+    GLuint anySamples = GL_FALSE;
+    glGetQueryObjectuiv(water.surfaceQueries[slot], GL_QUERY_RESULT, &anySamples);
+    visible = anySamples != GL_FALSE;
+
+    GLuint64 stamps[WATER_TIMESTAMP_COUNT];
+    for (u32 i = 0; i < WATER_TIMESTAMP_COUNT; ++i)
+        glGetQueryObjectui64v(water.timestamps[slot][i], GL_QUERY_RESULT, &stamps[i]);
+    time = ((stamps[1] - stamps[0]) + (stamps[3] - stamps[2])) / 1000000.0f;
+    return true;
+}
+
+bool UpdateWaterVisibility(App* app)
+{
+    const FramePacket& frame = *app->frame;
+    WaterVisibility& water = app->water;
+    water.slot = frame.frameIndex % WATER_QUERY_COUNT;
+
+    // The frame that last used this slot. Its passes ran unless the CPU skipped
+    // them or they waited on a query that found the surface hidden.
+    if (frame.frameIndex >= WATER_QUERY_COUNT)
+    {
+        const u64 slotFrame = frame.frameIndex - WATER_QUERY_COUNT;
+        bool visible = false;
+        f32 time = 0.0f;
+        bool ran = false;
+        bool read = true;
+        if (water.issuedFrames[water.slot] == slotFrame)
+        {
+            read = ReadWaterSlot(water, water.slot, visible, time);
+            const bool previousKnown = water.lastReadFrame == slotFrame - 1;
+            ran = !water.conditioned[water.slot] || !previousKnown || water.lastReadVisible;
+        }
+
+        if (read)
+        {
+            water.passTime = time;
+            if (ran)
+                water.drawnTime = time;
+            water.savedTime = ran ? 0.0f : glm::max(water.drawnTime - time, 0.0f);
+            water.skippedFrames += ran ? 0 : 1;
+            water.lastReadFrame = slotFrame;
+            water.lastReadVisible = visible || water.issuedFrames[water.slot] != slotFrame;
+        }
+    }
+
+    // Same box test as the submeshes, against the camera frustum
+    const Frustum frustum = FrustumFromMatrix(frame.projectionMat * frame.viewMat);
+    const vec3 center = (water.surfaceBounds.min + water.surfaceBounds.max) * 0.5f;
+    const vec3 extent = (water.surfaceBounds.max - water.surfaceBounds.min) * 0.5f;
+    bool inView = true;
+    for (u32 p = 0; p < 6 && inView; ++p)
+    {
+        const vec3 normal = vec3(frustum.planes[p]);
+        inView = glm::dot(normal, center) + frustum.planes[p].w + glm::dot(glm::abs(normal), extent) >= 0.0f;
+    }
+    inView = inView || !frame.conditionalWater;
+
+    // Leaving the view drops the targets, they are redrawn before being sampled again
+    if (water.inView && !inView)
+    {
+        glInvalidateTexImage(app->waterReflectionAttachmentHandle, 0);
+        glInvalidateTexImage(app->waterReflectionDepthAttachmentHandle, 0);
+        glInvalidateTexImage(app->waterRefractionAttachmentHandle, 0);
+        glInvalidateTexImage(app->waterRefractionDepthAttachmentHandle, 0);
+    }
+    water.inView = inView;
+
+    const u32 previousSlot = (frame.frameIndex + WATER_QUERY_COUNT - 1) % WATER_QUERY_COUNT;
+    water.conditioned[water.slot] = frame.conditionalWater && frame.frameIndex > 0 && water.issuedFrames[previousSlot] == frame.frameIndex - 1;
+    water.issuedFrames[water.slot] = inView ? frame.frameIndex : UINT64_MAX;
+    return inView;
+}
+
+void BeginWaterPasses(App* app, u32 timestamp)
+{
+    WaterVisibility& water = app->water;
+    glQueryCounter(water.timestamps[water.slot][timestamp], GL_TIMESTAMP);
+
+    // No wait, if last frame's result is somehow still pending the passes just run
+    if (water.conditioned[water.slot])
+    {
+        const u32 previousSlot = (water.slot + WATER_QUERY_COUNT - 1) % WATER_QUERY_COUNT;
+        glBeginConditionalRender(water.surfaceQueries[previousSlot], GL_QUERY_NO_WAIT);
+    }
+}
+
+void EndWaterPasses(App* app, u32 timestamp)
+{
+    WaterVisibility& water = app->water;
+    if (water.conditioned[water.slot])
+        glEndConditionalRender();
+    glQueryCounter(water.timestamps[water.slot][timestamp + 1], GL_TIMESTAMP);
+}
+
+void QueryWaterSurface(App* app)
+{
+    const FramePacket& frame = *app->frame;
+    WaterVisibility& water = app->water;
+    GLStateCache& state = app->glState;
+
+    // Same transform as the water effect so the depth test matches it exactly
+    StateUseProgram(state, app->programs[water.queryProgramIdx].handle);
+    StateUniformMatrix4fv(state, water.queryProgram_uProj, &frame.sceneProjectionMat[0][0]);
+    StateUniformMatrix4fv(state, water.queryProgram_uView, &frame.viewMat[0][0]);
+    StateEnable(state, GL_DEPTH_TEST, true);
+    StateDepthMask(state, false);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+    glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, water.surfaceQueries[water.slot]);
+    const Mesh& mesh = app->meshes[app->models[app->planeModelIdx].meshIdx];
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        StateBindVertexArray(state, FindVAO(app, submesh));
+        glDrawElementsBaseVertex(GL_TRIANGLES, submesh.lods[0].indexCount, GL_UNSIGNED_INT, (void*)(u64)(submesh.firstIndex * sizeof(u32)), submesh.baseVertex);
+    }
+    glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
+
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    StateDepthMask(state, true);
+}
@@ -0,0 +1,25 @@
+//
+// water_visibility.h: Bounds check and occlusion queries deciding whether the water passes run.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "engine.h"
+
+// Creates the queries and measures the water plane, which must already be loaded. GL thread only.
+void InitWaterVisibility(App* app);
+
+// Reads the queries of a few frames ago and tests the surface against the
+// view. Returns false when the water passes are skipped on the CPU this frame.
+bool UpdateWaterVisibility(App* app);
+
+// Surround the submission of the water passes: timestamps for the profiler and,
+// when conditional, rendering that waits on the surface query of last frame.
+// timestamp is 0 around the reflection and refraction passes, 2 around the surface.
+void BeginWaterPasses(App* app, u32 timestamp);
+void EndWaterPasses(App* app, u32 timestamp);
+
+// Depth tested draw of the surface with no writes, for the query the next frame
+// depends on. The G-buffer depth must be bound and complete.
+void QueryWaterSurface(App* app);
@@ -1,3 +1,33 @@
+// Texture array layer of a material map that is not present
+#define NO_TEXTURE_LAYER 0xFFFFFFFFu
+
+vec2 SignNotZero(vec2 v)
+{
+	return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+// G-buffer normals, folded onto the octahedron around z and stored in RG16_SNORM
+vec2 EncodeGBufferNormal(vec3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	return n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * SignNotZero(n.xy);
+}
+
+vec3 DecodeGBufferNormal(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0)
+		n.xy = (1.0 - abs(e.yx)) * SignNotZero(e);
+	return normalize(n);
+}
+
+// World position of a G-buffer pixel, the G-buffer stores no positions
+vec3 GBufferPosition(vec2 texCoord, float depth, mat4 inverseViewProjection)
+{
+	vec4 position = inverseViewProjection * vec4(vec3(texCoord, depth) * 2.0 - 1.0, 1.0);
+	return position.xyz / position.w;
+}
+
 ///////////////////////////////////////////////////////////////////////
 #ifdef TEXTURED_GEOMETRY
 
@@ -58,29 +88,56 @@ layout(binding = 0, std140) uniform GlobalParams
 	Light uLight[16];
 };
 
-layout(binding = 1, std140) uniform LocalParams
+layout(location = 8) in uvec2 aDrawInfo;	// Per draw instance: transform, material
+
+struct InstanceTransform
+{
+	mat4 world;
+	vec4 params;	// x: metallic
+};
+
+layout(binding = 0, std430) readonly buffer InstanceTransforms
+{
+	InstanceTransform uTransforms[];
+};
+
+struct Material
 {
-	mat4 uWorldMatrix;
-	mat4 uWorldViewProjectionMatrix;
-	float metallic;
+	vec4 albedo;
+	vec4 emissive;	// w: smoothness
+	uvec4 layers;	// albedo, emissive, specular, normals texture array layers
 };
 
+layout(binding = 1, std430) readonly buffer Materials
+{
+	Material uMaterials[];
+};
+
+uniform mat4 uViewProjection;
+
 out vec2 vTexCoord;
 out vec3 vPosition;	// In worldspace
 out vec3 vNormal;	// In worldspace
 out vec3 vViewDir;
 out float metallicness;
+flat out vec3 vColor;
+flat out uint vAlbedoLayer;
 
 void main()
 {
+	mat4 worldMatrix = uTransforms[aDrawInfo.x].world;
+
 	vTexCoord = aTexCoord;
+	Material material = uMaterials[aDrawInfo.y];
+	vAlbedoLayer = material.layers.x;
+	vColor = vAlbedoLayer == NO_TEXTURE_LAYER ? material.albedo.rgb : vec3(1.0);
 
-	vPosition = vec3(uWorldMatrix * vec4(aPosition, 1.0));
-	vNormal = vec3(uWorldMatrix * vec4(aNormal, 0.0));
+	vPosition = vec3(worldMatrix * vec4(aPosition, 1.0));
+	vNormal = vec3(worldMatrix * vec4(aNormal, 0.0));
 	vViewDir = uCameraPosition - vPosition;
-	metallicness = metallic;
+	metallicness = uTransforms[aDrawInfo.x].params.x;
 
-	gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+	gl_Position = uViewProjection * vec4(vPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -90,28 +147,53 @@ in vec3 vPosition;	// In worldspace
 in vec3 vNormal;	// In worldspace
 in vec3 vViewDir;
 in float metallicness;
-
-uniform vec3 uColor;
+flat in vec3 vColor;
+flat in uint vAlbedoLayer;
 uniform vec3 cameraPos;
 
+// Must match the LIGHT_CLUSTER_ defines
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_MAX_LIGHTS 64
+
 struct Light
 {
-	unsigned int type;
-	vec3 color;
-	vec3 direction;
-	float intensity;
 	vec3 position;
 	float radius;
+	vec3 color;
+	float intensity;
+	vec3 direction;
+	uint type;
 };
 
-layout(binding = 0, std140) uniform GlobalParams
+layout(binding = 9, std430) readonly buffer Lights
 {
-	vec3 uCameraPosition;
-	unsigned int uLightCount;
-	Light uLight[16];
+	Light uLights[];
 };
 
-uniform sampler2D uTexture;
+layout(binding = 10, std430) readonly buffer LightClusters
+{
+	mat4 uClusterView;
+	mat4 uClusterProjection;
+	vec4 uClusterDepth;		// near, slice scale, far, light count
+	uint uClusterLights[];	// per cluster: count, then CLUSTER_MAX_LIGHTS indices
+};
+
+// First word of the main camera cluster holding the point, positions off
+// the grid use the nearest cluster on its border
+uint LightCluster(vec3 worldPosition)
+{
+	vec4 viewPosition = uClusterView * vec4(worldPosition, 1.0);
+	vec4 clipPosition = uClusterProjection * viewPosition;
+	vec2 ndc = clipPosition.w > 0.0 ? clipPosition.xy / clipPosition.w : vec2(0.0);
+	uvec2 tile = uvec2(clamp((ndc * 0.5 + 0.5) * vec2(CLUSTER_X, CLUSTER_Y), vec2(0.0), vec2(CLUSTER_X - 1, CLUSTER_Y - 1)));
+	float slice = log(max(-viewPosition.z, uClusterDepth.x) / uClusterDepth.x) * uClusterDepth.y;
+	uint z = uint(clamp(slice, 0.0, float(CLUSTER_Z - 1)));
+	return ((z * CLUSTER_Y + tile.y) * CLUSTER_X + tile.x) * (CLUSTER_MAX_LIGHTS + 1u);
+}
+
+uniform sampler2DArray uTexture;
 uniform samplerCube skybox;
 uniform samplerCube irradianceMap;
 
@@ -138,31 +220,24 @@ vec3 fresnelSchlick(float cosTheta, vec3 F0)
 
 void main()
 {
-	vec3 objectColor = texture(uTexture, vTexCoord).rgb;
-	vec3 c = objectColor*uColor;
+	vec3 objectColor = vAlbedoLayer == NO_TEXTURE_LAYER ? vec3(1.0) : texture(uTexture, vec3(vTexCoord, vAlbedoLayer)).rgb;
+	vec3 c = objectColor*vColor;
 	vec4 spec = vec4(0.0);
 
+	// Only the lights assigned to this fragment's cluster
 	vec3 lightFactor = vec3(1.0);
-	for(int i = 0; i < uLightCount; ++i)
+	uint cluster = LightCluster(vPosition);
+	uint clusterLightCount = uClusterLights[cluster];
+	for(uint i = 0u; i < clusterLightCount; ++i)
 	{
-		switch(uLight[i].type)
+		Light light = uLights[uClusterLights[cluster + 1u + i]];
+		if (light.type == 0u) // Directional
 		{
-			case 0: // Directional
-			{
-				lightFactor += DirectionalLight(uLight[i]);
-			}
-			break;
-
-			case 1: // Point
-			{
-				lightFactor += PointLight(uLight[i]);
-			}
-			break;
-
-			default:
-			{
-				break;
-			}
+			lightFactor += DirectionalLight(light);
+		}
+		else if (light.type == 1u && distance(light.position, vPosition) < light.radius) // Point
+		{
+			lightFactor += PointLight(light);
 		}
 	}
 	vec3 V = normalize(cameraPos - vPosition);
@@ -192,11 +267,10 @@ void main()
     // gamma correct
     color = pow(color, vec3(1.0/2.2)); 
 
-    oColor =mix(vec4(lightFactor, 1.0)  * vec4(uColor, 1.0), ReflectionColor, metallicness) ;
+    oColor =mix(vec4(lightFactor, 1.0)  * vec4(vColor, 1.0), ReflectionColor, metallicness) ;
 
 
 	//oColor = vec4(lightFactor, 1.0) * vec4(c, 1.0);
-	gl_FragDepth = gl_FragCoord.z - 0.2;
 }
 
 #endif
@@ -211,25 +285,55 @@ layout(location = 0) in vec3 aPosition;
 layout(location = 1) in vec3 aNormal;
 layout(location = 2) in vec2 aTexCoord;
 
-layout(binding = 1, std140) uniform LocalParams
+layout(location = 8) in uvec2 aDrawInfo;	// Per draw instance: transform, material
+
+struct InstanceTransform
+{
+	mat4 world;
+	vec4 params;	// x: metallic
+};
+
+layout(binding = 0, std430) readonly buffer InstanceTransforms
+{
+	InstanceTransform uTransforms[];
+};
+
+struct Material
+{
+	vec4 albedo;
+	vec4 emissive;	// w: smoothness
+	uvec4 layers;	// albedo, emissive, specular, normals texture array layers
+};
+
+layout(binding = 1, std430) readonly buffer Materials
 {
-	mat4 uWorldMatrix;
-	mat4 uWorldViewProjectionMatrix;
-	float metallic;
+	Material uMaterials[];
 };
 
+uniform mat4 uViewProjection;
+
+// Must match the depth pre-pass bit for bit, the pass runs with GL_EQUAL
+invariant gl_Position;
+
 out vec2 vTexCoord;
 out vec3 vPosition;
 out vec3 vNormal;
 out float metallicness;
+flat out vec3 vColor;
+flat out uint vAlbedoLayer;
 
 void main()
 {
+	mat4 worldMatrix = uTransforms[aDrawInfo.x].world;
+
 	vTexCoord = aTexCoord;
-	vPosition = vec3(uWorldMatrix * vec4(aPosition, 1.0));
-	vNormal = vec3(transpose(inverse(uWorldMatrix)) * vec4(aNormal, 1.0));
-	metallicness = metallic;
-	gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+	Material material = uMaterials[aDrawInfo.y];
+	vAlbedoLayer = material.layers.x;
+	vColor = vAlbedoLayer == NO_TEXTURE_LAYER ? material.albedo.rgb : vec3(1.0);
+	vPosition = vec3(worldMatrix * vec4(aPosition, 1.0));
+	vNormal = vec3(transpose(inverse(worldMatrix)) * vec4(aNormal, 1.0));
+	metallicness = uTransforms[aDrawInfo.x].params.x;
+	gl_Position = uViewProjection * vec4(vPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -238,26 +342,23 @@ in vec2 vTexCoord;
 in vec3 vPosition;
 in vec3 vNormal;
 in float metallicness;
+flat in vec3 vColor;
+flat in uint vAlbedoLayer;
 
-uniform sampler2D uTexture;
-uniform vec3 uColor;
+uniform sampler2DArray uTexture;
 uniform vec3 cameraPos;
 uniform samplerCube skybox;
 uniform samplerCube irradianceMap;
 
-layout(location = 0) out vec4 oPosition;
-layout(location = 1) out vec4 oNormals;
-layout(location = 2) out vec4 oColor;
-
-out float gl_FragDepth;
+layout(location = 0) out vec4 oNormals;
+layout(location = 1) out vec4 oColor;	// albedo, metallic
 
 void main()
 {
-	vec3 c = texture(uTexture, vTexCoord).rgb;
+	vec3 c = vAlbedoLayer == NO_TEXTURE_LAYER ? vec3(1.0) : texture(uTexture, vec3(vTexCoord, vAlbedoLayer)).rgb;
 	
-	oPosition = vec4(vPosition, 1.0);
-	oNormals = vec4(normalize(vNormal), 1.0);
-	oColor = vec4(c*uColor, 1.0);
+	oNormals = vec4(EncodeGBufferNormal(normalize(vNormal)), 0.0, 1.0);
+	oColor = vec4(c*vColor, 1.0);
 
 	vec3 I = normalize(vPosition - cameraPos);
     vec3 R = reflect(I, normalize(vNormal));
@@ -266,287 +367,1302 @@ void main()
 	vec3 ambient = texture(irradianceMap, vNormal).rgb;
 
 
-    oColor = mix(vec4(uColor, 1.0), ReflectionColor, metallicness) * 1.7*vec4(ambient, 1.0);
+    oColor = mix(vec4(vColor, 1.0), ReflectionColor, metallicness) * 1.7*vec4(ambient, 1.0);
+	oColor.a = metallicness;
 
 	// * vec4(ambient, 1.0)
 
-	gl_FragDepth = gl_FragCoord.z - 0.2;
 }
 
 #endif
 #endif
 
 ///////////////////////////////////////////////////////////////////////
-#ifdef DEFERRED_LIGHTING_PASS
+#ifdef DEPTH_PREPASS
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
 layout(location = 0) in vec3 aPosition;
-layout(location = 1) in vec2 aTexCoord;
 
-struct Light
+layout(location = 8) in uvec2 aDrawInfo;	// Per draw instance: transform, material
+
+struct InstanceTransform
 {
-	unsigned int type;
-	vec3 color;
-	vec3 direction;
-	float intensity;
-	vec3 position;
-	float radius;
+	mat4 world;
+	vec4 params;	// x: metallic
 };
 
-layout(binding = 0, std140) uniform GlobalParams
+layout(binding = 0, std430) readonly buffer InstanceTransforms
 {
-	vec3 uCameraPosition;
-	unsigned int uLightCount;
-	Light uLight[16];
+	InstanceTransform uTransforms[];
 };
 
-out vec2 vTexCoord;
+uniform mat4 uViewProjection;
+
+// Same computation as the geometry pass, which tests against this depth with GL_EQUAL
+invariant gl_Position;
 
 void main()
 {
-	vTexCoord = aTexCoord;
+	mat4 worldMatrix = uTransforms[aDrawInfo.x].world;
 
-	gl_Position = vec4(aPosition, 1.0);
+	vec3 position = vec3(worldMatrix * vec4(aPosition, 1.0));
+	gl_Position = uViewProjection * vec4(position, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
-in vec2 vTexCoord;
-
-struct Light
-{
-	unsigned int type;
-	vec3 color;
-	vec3 direction;
-	float intensity;
-	vec3 position;
-	float radius;
-};
-
-layout(binding = 0, std140) uniform GlobalParams
-{
-	vec3 uCameraPosition;
-	unsigned int uLightCount;
-	Light uLight[16];
-};
-
-layout(location = 0) out vec4 oFinalRender;
-
-uniform sampler2D uGPosition;
-uniform sampler2D uGNormals;
-uniform sampler2D uGDiffuse;
-
-vec3 DirectionalLight(Light light, vec3 Normal, vec3 Diffuse)
+void main()
 {
-	float cosAngle = max(dot(Normal, -light.direction), 0.0); 
-    vec3 ambient = 0.1 * light.color;
-    vec3 diffuse = 0.9 * light.color * cosAngle * light.intensity;
-
-    return (ambient + diffuse) * Diffuse;
 }
 
-vec3 PointLight(Light light, vec3 FragPos, vec3 Normal)
-{
-	vec3 N = normalize(Normal);
-	vec3 L = normalize(light.position - FragPos);
-
-	float threshold = 1.0;
-
-	float shadowIntensity = 1.0;
-
-	float dist = distance(light.position, FragPos);
-
-	if(dist > light.radius)
-		shadowIntensity = 1.0 - ((dist - light.radius) / threshold);
+#endif
+#endif
 
-	// Hardcoded specular parameter
-    vec3 specularMat = vec3(1.0);
+///////////////////////////////////////////////////////////////////////
+#ifdef IMPOSTOR_BAKE
 
+#if defined(VERTEX) ///////////////////////////////////////////////////
 
-	// Specular
-    float specularIntensity = pow(max(0.0, dot(N, L)), 1.0);
-    vec3 specular = specularMat * specularIntensity;
+layout(location = 0) in vec3 aPosition;
+layout(location = 1) in vec3 aNormal;
+layout(location = 2) in vec2 aTexCoord;
 
-	// Diffuse
-    float diffuseIntensity = max(0.0, dot(N, L));
+uniform mat4 uViewProjection;
+uniform vec4 uSphere;		// object space bounds of the model
+uniform vec3 uDirection;	// from the center towards the view
 
-	return vec3(specular + diffuseIntensity) * shadowIntensity * light.intensity * light.color;
-}
+out vec3 vNormal;
+out vec2 vTexCoord;
+out float vDepth;
 
 void main()
 {
-	vec3 FragPos = texture(uGPosition, vTexCoord).rgb;
-    vec3 Normal = texture(uGNormals, vTexCoord).rgb;
-    vec3 Diffuse = texture(uGDiffuse, vTexCoord).rgb;
+	vNormal = aNormal;
+	vTexCoord = aTexCoord;
+	vDepth = dot(aPosition - uSphere.xyz, uDirection) / uSphere.w;
+	gl_Position = uViewProjection * vec4(aPosition, 1.0);
+}
 
-	vec3 viewDir = normalize(uCameraPosition - FragPos);
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
 
-	vec3 lighting = Diffuse * 1.0;
-    for(int i = 0; i < uLightCount; ++i)
-    {
-		switch(uLight[i].type)
-		{
-			case 0: // Directional
-			{
-                lighting += DirectionalLight(uLight[i], Normal, Diffuse);
-			}
-			break;
+in vec3 vNormal;
+in vec2 vTexCoord;
+in float vDepth;
 
-			case 1: // Point
-			{
-				float distance = length(uLight[i].position - FragPos);
-				if(distance < uLight[i].radius)
-				{
-					lighting += PointLight(uLight[i], FragPos, Normal);
-				}
-			}
-			break;
+uniform sampler2DArray uTexture;
+uniform vec3 uAlbedo;
+uniform int uAlbedoLayer;	// -1 without texture
 
-			default:
-			{
-				
-			}
-			break;
-		}
-    }
+layout(location = 0) out vec4 oAlbedo;
+layout(location = 1) out vec4 oNormalDepth;
 
-	oFinalRender = vec4(lighting * Diffuse, 1.0);
+void main()
+{
+	vec3 albedo = uAlbedoLayer < 0 ? uAlbedo : texture(uTexture, vec3(vTexCoord, uAlbedoLayer)).rgb;
 
+	// Alpha marks the covered texels, everything else is cleared to zero
+	oAlbedo = vec4(albedo, 1.0);
+	oNormalDepth = vec4(normalize(vNormal) * 0.5 + 0.5, vDepth * 0.5 + 0.5);
 }
 
 #endif
 #endif
 
 ///////////////////////////////////////////////////////////////////////
-#ifdef CLIPPED_MESHES
+#ifdef IMPOSTOR
+
+// Must match OctahedralDirection, which placed the baked views
+vec2 OctEncode(vec3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	return n.y >= 0.0 ? n.xz : (1.0 - abs(n.zx)) * SignNotZero(n.xz);
+}
+
+vec3 OctDecode(vec2 p)
+{
+	vec3 n = vec3(p.x, 1.0 - abs(p.x) - abs(p.y), p.y);
+	if (n.y < 0.0)
+		n.xz = (1.0 - abs(p.yx)) * SignNotZero(p);
+	return normalize(n);
+}
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
-layout(location=0) in vec3 aPosition;
-layout(location=1) in vec3 aNormal;
-layout(location=2) in vec2 aTexCoord;
+layout(location = 8) in uvec2 aDrawInfo;	// Per draw instance: transform, atlas layer
 
-struct Light
+struct InstanceTransform
 {
-	unsigned int type;
-	vec3 color;
-	vec3 direction;
-	float intensity;
-	vec3 position;
-	float radius;
+	mat4 world;
+	vec4 params;	// x: metallic
 };
 
-layout(binding = 0, std140) uniform GlobalParams
+layout(binding = 0, std430) readonly buffer InstanceTransforms
 {
-	vec3 uCameraPosition;
-	unsigned int uLightCount;
-	Light uLight[50];
+	InstanceTransform uTransforms[];
 };
 
-layout(binding = 1, std140) uniform LocalParams
+layout(binding = 8, std430) readonly buffer ImpostorSpheres
 {
-	mat4 uWorldMatrix;
-	mat4 uWorldViewProjectionMatrix;
+	vec4 uSpheres[];	// object space bounds of every atlas layer
 };
 
-uniform mat4 uProj;
-uniform mat4 uView;
-uniform mat4 uModel;
-
-uniform vec4 uClippingPlane;
+uniform mat4 uViewProjection;
+uniform vec3 uCameraPosition;
+uniform float uGrid;
 
-out vec2 vTexCoord;
 out vec3 vPosition;
-out vec3 vNormal;
+out vec2 vTexCoord;
+flat out vec3 vDepthAxis;	// world offset of a baked depth of one
+flat out mat3 vNormalMatrix;
+flat out float vLayer;
+flat out float vMetallic;
 
 void main()
 {
-	vTexCoord = aTexCoord;
-
-	vPosition = vec3(uWorldMatrix * vec4(aPosition, 1.0));
-
-	vNormal = vec3(transpose(inverse(uWorldMatrix)) * vec4(aNormal, 1.0));
-
-	vec4 clipDistanceDisplacement = vec4(0.0, 0.0, 0.0, length(vec3(uView * vec4(aPosition, 1.0)))/100.0);
-	gl_ClipDistance[0] = dot(vec4(vPosition, 1.0), uClippingPlane);
-
-	gl_Position = uProj * uView * uModel * vec4(aPosition, 1.0);
+	InstanceTransform transform = uTransforms[aDrawInfo.x];
+	mat4 world = transform.world;
+	vec4 sphere = uSpheres[aDrawInfo.y];
+
+	// The view direction in object space picks the nearest baked frame
+	vec3 scale = vec3(length(world[0].xyz), length(world[1].xyz), length(world[2].xyz));
+	mat3 rotation = mat3(world[0].xyz / scale.x, world[1].xyz / scale.y, world[2].xyz / scale.z);
+	vec3 center = vec3(world * vec4(sphere.xyz, 1.0));
+	vec3 objectView = normalize(transpose(rotation) * (uCameraPosition - center));
+	vec2 cell = min(floor((OctEncode(objectView) * 0.5 + 0.5) * uGrid), vec2(uGrid - 1.0));
+	vec3 direction = OctDecode((cell + 0.5) / uGrid * 2.0 - 1.0);
+
+	// Same axes the frame was baked with, so the quad covers exactly its image
+	vec3 up0 = abs(direction.y) > 0.99 ? vec3(0.0, 0.0, 1.0) : vec3(0.0, 1.0, 0.0);
+	vec3 right = normalize(cross(up0, direction));
+	vec3 up = cross(direction, right);
+
+	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+	vec3 objectPosition = sphere.xyz + (right * corner.x + up * corner.y) * sphere.w;
+
+	vPosition = vec3(world * vec4(objectPosition, 1.0));
+	vTexCoord = (cell + corner * 0.5 + 0.5) / uGrid;
+	vDepthAxis = mat3(world) * direction * sphere.w;
+	vNormalMatrix = transpose(inverse(mat3(world)));
+	vLayer = float(aDrawInfo.y);
+	vMetallic = transform.params.x;
+	gl_Position = uViewProjection * vec4(vPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
-in vec2 vTexCoord;
 in vec3 vPosition;
-in vec3 vNormal;
-
-struct Light
-{
-	unsigned int type;
-	vec3 color;
-	vec3 direction;
-	float intensity;
-	vec3 position;
-	float radius;
-};
+in vec2 vTexCoord;
+flat in vec3 vDepthAxis;
+flat in mat3 vNormalMatrix;
+flat in float vLayer;
+flat in float vMetallic;
+
+uniform mat4 uViewProjection;
+uniform vec3 uCameraPosition;
+uniform sampler2DArray uAlbedo;
+uniform sampler2DArray uNormalDepth;
+uniform samplerCube uSkybox;
+uniform samplerCube uIrradiance;
 
-layout(binding = 0, std140) uniform GlobalParams
-{
-	vec3 uCameraPosition;
-	unsigned int uLightCount;
-	Light uLight[50];
-};
+layout(location = 0) out vec4 oNormals;
+layout(location = 1) out vec4 oColor;	// albedo, metallic
 
-layout(binding = 1, std140) uniform LocalParams
+void main()
 {
-	mat4 uWorldMatrix;
-	mat4 uWorldViewProjectionMatrix;
-};
+	vec4 albedo = texture(uAlbedo, vec3(vTexCoord, vLayer));
+	if (albedo.a < 0.5)
+		discard;
 
-uniform sampler2D uTexture;
-uniform samplerCube uSkybox;
-uniform vec3 uColor;
+	// Mips average with the empty texels around the silhouette, undo it
+	vec4 normalDepth = texture(uNormalDepth, vec3(vTexCoord, vLayer)) / albedo.a;
+	albedo.rgb /= albedo.a;
 
-out float gl_FragDepth;
+	vec3 normal = normalize(vNormalMatrix * (normalDepth.xyz * 2.0 - 1.0));
+	vec3 position = vPosition + vDepthAxis * (normalDepth.w * 2.0 - 1.0);
 
-layout(location=0) out vec4 oColor;
+	vec4 clipPosition = uViewProjection * vec4(position, 1.0);
+	gl_FragDepth = clipPosition.z / clipPosition.w * 0.5 + 0.5;
 
-void main()
-{
-	vec3 c = texture(uTexture, vTexCoord).rgb;
-	c *= uColor;
-	
+	// Same outputs and shading as the geometry pass, the position comes from the depth
+	oNormals = vec4(EncodeGBufferNormal(normal), 0.0, 1.0);
 
-	/*vec3 I = normalize(vPosition - uCameraPosition);
-	vec3 R = reflect(I, normalize(vNormal));
-	vec4 reflections = vec4(texture(uSkybox, R).rgb, 1.0);*/
-	oColor = vec4(c, 1.0);
+	vec3 I = normalize(position - uCameraPosition);
+	vec3 R = reflect(I, normal);
+	vec4 reflectionColor = vec4(texture(uSkybox, R).rgb, 1.0);
+	vec3 ambient = texture(uIrradiance, normal).rgb;
 
-	gl_FragDepth = gl_FragCoord.z - 0.2;
+	oColor = mix(vec4(albedo.rgb, 1.0), reflectionColor, vMetallic) * 1.7 * vec4(ambient, 1.0);
+	oColor.a = vMetallic;
 }
 
 #endif
 #endif
 
 ///////////////////////////////////////////////////////////////////////
-#ifdef WATER_EFFECT
+#ifdef HIZ_BUILD
 
-#if defined(VERTEX) ///////////////////////////////////////////////////
+#if defined(COMPUTE) //////////////////////////////////////////////////
 
-layout (location = 0) in vec3 aPosition;
-layout (location = 1) in vec3 aNormal;
-layout(location = 2) in vec2 aTexCoord;
+layout(local_size_x = 8, local_size_y = 8) in;
 
-uniform mat4 uProj;
-uniform mat4 uView;
+layout(binding = 0, r32f) readonly uniform image2D uSource;
+layout(binding = 1, r32f) writeonly uniform image2D uDestination;
 
-out Data
+uniform sampler2D uDepth;
+uniform int uLevel;
+uniform vec2 uSourceSize;
+uniform vec2 uDestinationSize;
+
+float SourceDepth(ivec2 texel, ivec2 sourceSize)
+{
+	return imageLoad(uSource, min(texel, sourceSize - 1)).r;
+}
+
+void main()
+{
+	ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+	ivec2 destinationSize = ivec2(uDestinationSize);
+	if (texel.x >= destinationSize.x || texel.y >= destinationSize.y)
+		return;
+
+	float depth;
+	if (uLevel == 0)
+	{
+		depth = texelFetch(uDepth, texel, 0).r;
+	}
+	else
+	{
+		// Farthest depth below, so the pyramid never claims something is nearer than it is
+		ivec2 sourceSize = ivec2(uSourceSize);
+		ivec2 source = texel * 2;
+		depth = max(max(SourceDepth(source, sourceSize), SourceDepth(source + ivec2(1, 0), sourceSize)),
+		            max(SourceDepth(source + ivec2(0, 1), sourceSize), SourceDepth(source + ivec2(1, 1), sourceSize)));
+
+		// Odd sizes leave a last column or row that only the border texels cover
+		bool extraColumn = (sourceSize.x & 1) != 0 && texel.x == destinationSize.x - 1;
+		bool extraRow = (sourceSize.y & 1) != 0 && texel.y == destinationSize.y - 1;
+		if (extraColumn)
+			depth = max(depth, max(SourceDepth(source + ivec2(2, 0), sourceSize), SourceDepth(source + ivec2(2, 1), sourceSize)));
+		if (extraRow)
+			depth = max(depth, max(SourceDepth(source + ivec2(0, 2), sourceSize), SourceDepth(source + ivec2(1, 2), sourceSize)));
+		if (extraColumn && extraRow)
+			depth = max(depth, SourceDepth(source + ivec2(2, 2), sourceSize));
+	}
+
+	imageStore(uDestination, texel, vec4(depth));
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+#ifdef OCCLUSION_CULL
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+layout(local_size_x = 64) in;
+
+struct Candidate
+{
+	vec3 boxMin;
+	uint box;
+	vec3 boxMax;
+	uint command;
+};
+
+// DrawElementsIndirectCommand is five words: count, instanceCount, firstIndex, baseVertex, baseInstance
+layout(binding = 2, std430) buffer Commands
+{
+	uint uCommands[];
+};
+
+layout(binding = 3, std430) buffer DrawInfos
+{
+	uvec2 uDrawInfos[];
+};
+
+layout(binding = 4, std430) readonly buffer Candidates
+{
+	Candidate uCandidates[];
+};
+
+layout(binding = 5, std430) readonly buffer PreviousVisibility
+{
+	uint uPreviousVisibility[];
+};
+
+layout(binding = 6, std430) writeonly buffer Visibility
+{
+	uint uVisibility[];
+};
+
+layout(binding = 7, std430) buffer Counters
+{
+	uint uCounters[];
+};
+
+uniform int uPhase;
+uniform int uCandidateCount;
+uniform int uFirstCommand;
+uniform int uFirstDrawInfo;
+uniform mat4 uViewProjection;
+uniform sampler2D uHiZ;
+uniform vec2 uHiZSize;
+uniform int uHiZLevels;
+
+bool IsOccluded(vec3 boxMin, vec3 boxMax)
+{
+	vec3 ndcMin = vec3(1.0e30);
+	vec3 ndcMax = vec3(-1.0e30);
+	for (int i = 0; i < 8; ++i)
+	{
+		vec3 corner = mix(boxMin, boxMax, vec3(i & 1, (i >> 1) & 1, (i >> 2) & 1));
+		vec4 clip = uViewProjection * vec4(corner, 1.0);
+
+		// Boxes crossing the camera plane have no bounded footprint on screen
+		if (clip.w <= 0.0)
+			return false;
+
+		vec3 ndc = clip.xyz / clip.w;
+		ndcMin = min(ndcMin, ndc);
+		ndcMax = max(ndcMax, ndc);
+	}
+
+	vec2 uvMin = clamp(ndcMin.xy * 0.5 + 0.5, 0.0, 1.0);
+	vec2 uvMax = clamp(ndcMax.xy * 0.5 + 0.5, 0.0, 1.0);
+	float nearestDepth = ndcMin.z * 0.5 + 0.5;
+
+	// Level where the footprint is at most a texel wide, so its four corners cover it
+	vec2 extent = (uvMax - uvMin) * uHiZSize;
+	float level = clamp(ceil(log2(max(max(extent.x, extent.y), 1.0))), 0.0, float(uHiZLevels - 1));
+
+	float farthest = max(max(textureLod(uHiZ, uvMin, level).r, textureLod(uHiZ, vec2(uvMax.x, uvMin.y), level).r),
+	                     max(textureLod(uHiZ, vec2(uvMin.x, uvMax.y), level).r, textureLod(uHiZ, uvMax, level).r));
+	return nearestDepth > farthest;
+}
+
+void main()
+{
+	int i = int(gl_GlobalInvocationID.x);
+	if (i >= uCandidateCount)
+		return;
+
+	Candidate candidate = uCandidates[i];
+	bool wasVisible = uPreviousVisibility[candidate.box] != 0u;
+
+	bool draw;
+	if (uPhase == 1)
+	{
+		draw = wasVisible;
+	}
+	else
+	{
+		// Pre-pass and G-buffer candidates of a box reach the same result, their writes can race
+		bool visible = !IsOccluded(candidate.boxMin, candidate.boxMax);
+		uVisibility[candidate.box] = visible ? 1u : 0u;
+		draw = visible && !wasVisible;
+	}
+
+	if (!draw)
+		return;
+
+	// Compacted into the phase copy of the candidate's command
+	int command = uFirstCommand + int(candidate.command) * 5;
+	uint slot = atomicAdd(uCommands[command + 1], 1u);
+	uDrawInfos[uCommands[command + 4] + slot] = uDrawInfos[uFirstDrawInfo + i];
+	atomicAdd(uCounters[uPhase - 1], 1u);
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+#ifdef MESHLET_CULL
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+layout(local_size_x = 64) in;
+
+struct InstanceTransform
+{
+	mat4 world;
+	vec4 params;
+};
+
+struct Meshlet
+{
+	vec3 center;
+	float radius;
+	vec3 coneApex;
+	float coneCutoff;	// above 1 when the meshlet has no usable cone
+	vec3 coneAxis;
+	uint firstIndex;
+	uint indexCount;
+	uint padding0, padding1, padding2;
+};
+
+struct MeshletDraw
+{
+	uint firstMeshlet;
+	uint meshletCount;
+	uint commandWord;
+	uint drawInfo;
+	uint firstIndex;
+	uint baseVertex;
+	uint transform;
+	uint padding;
+};
+
+layout(binding = 0, std430) readonly buffer InstanceTransforms
+{
+	InstanceTransform uTransforms[];
+};
+
+// DrawElementsIndirectCommand is five words: count, instanceCount, firstIndex, baseVertex, baseInstance
+layout(binding = 2, std430) writeonly buffer Commands
+{
+	uint uCommands[];
+};
+
+layout(binding = 3, std430) readonly buffer Meshlets
+{
+	Meshlet uMeshlets[];
+};
+
+layout(binding = 4, std430) readonly buffer MeshletDraws
+{
+	MeshletDraw uDraws[];
+};
+
+layout(binding = 5, std430) buffer Counters
+{
+	uint uCounters[];	// tested, visible
+};
+
+uniform int uFirstDraw;
+uniform vec4 uPlanes[6];
+uniform vec3 uCameraPosition;
+uniform vec4 uClipPlane;
+uniform int uFlags;		// 1: clip plane, 2: normal cones
+
+shared uint sVisible;
+
+void main()
+{
+	MeshletDraw draw = uDraws[uFirstDraw + int(gl_WorkGroupID.x)];
+	if (gl_LocalInvocationIndex == 0u)
+		sVisible = 0u;
+	barrier();
+
+	mat4 world = uTransforms[draw.transform].world;
+	vec3 scales = vec3(length(world[0].xyz), length(world[1].xyz), length(world[2].xyz));
+	float scale = max(scales.x, max(scales.y, scales.z));
+
+	// Cones move as directions, which only holds without shear or uneven scale
+	bool cones = (uFlags & 2) != 0 && max(abs(scales.x - scales.y), abs(scales.x - scales.z)) <= 0.01 * scale;
+
+	for (uint i = gl_LocalInvocationIndex; i < draw.meshletCount; i += gl_WorkGroupSize.x)
+	{
+		Meshlet meshlet = uMeshlets[draw.firstMeshlet + i];
+		vec3 center = vec3(world * vec4(meshlet.center, 1.0));
+		float radius = meshlet.radius * scale;
+
+		bool visible = true;
+		for (int p = 0; p < 6; ++p)
+			visible = visible && dot(uPlanes[p].xyz, center) + uPlanes[p].w >= -radius;
+		if ((uFlags & 1) != 0)
+			visible = visible && dot(uClipPlane.xyz, center) + uClipPlane.w >= -radius;
+
+		// Every triangle faces away from an eye inside the cone behind the apex
+		if (cones && meshlet.coneCutoff <= 1.0)
+		{
+			vec3 apex = vec3(world * vec4(meshlet.coneApex, 1.0));
+			vec3 axis = normalize(mat3(world) * meshlet.coneAxis);
+			visible = visible && dot(normalize(apex - uCameraPosition), axis) < meshlet.coneCutoff;
+		}
+
+		if (!visible)
+			continue;
+
+		uint command = draw.commandWord + atomicAdd(sVisible, 1u) * 5u;
+		uCommands[command + 0u] = meshlet.indexCount;
+		uCommands[command + 1u] = 1u;
+		uCommands[command + 2u] = draw.firstIndex + meshlet.firstIndex;
+		uCommands[command + 3u] = draw.baseVertex;
+		uCommands[command + 4u] = draw.drawInfo;
+	}
+
+	memoryBarrierShared();
+	barrier();
+
+	// Commands past the visible ones draw nothing
+	uint visibleCount = sVisible;
+	for (uint i = visibleCount + gl_LocalInvocationIndex; i < draw.meshletCount; i += gl_WorkGroupSize.x)
+	{
+		uCommands[draw.commandWord + i * 5u + 0u] = 0u;
+		uCommands[draw.commandWord + i * 5u + 1u] = 0u;
+	}
+
+	if (gl_LocalInvocationIndex == 0u)
+	{
+		atomicAdd(uCounters[0], draw.meshletCount);
+		atomicAdd(uCounters[1], visibleCount);
+	}
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+#ifdef DEFERRED_LIGHTING_PASS
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+layout(location = 1) in vec2 aTexCoord;
+
+out vec2 vTexCoord;
+
+void main()
+{
+	vTexCoord = aTexCoord;
+
+	gl_Position = vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+in vec2 vTexCoord;
+
+struct Light
+{
+	vec3 position;
+	float radius;
+	vec3 color;
+	float intensity;
+	vec3 direction;
+	uint type;
+};
+
+// Only the header of the global params, the lights come from the same
+// unsized storage block as the tiled path so there is no cap on them
+layout(binding = 0, std140) uniform GlobalParams
+{
+	vec3 uCameraPosition;
+	unsigned int uLightCount;
+};
+
+layout(binding = 9, std430) readonly buffer Lights
+{
+	Light uLights[];
+};
+
+layout(location = 0) out vec4 oFinalRender;
+
+uniform sampler2D uDepth;
+uniform sampler2D uGNormals;
+uniform sampler2D uGDiffuse;
+uniform mat4 uInverseViewProjection;
+uniform int uDirectionalOnly;	// the point lights are drawn as volumes afterwards
+
+vec3 DirectionalLight(Light light, vec3 Normal, vec3 Diffuse)
+{
+	float cosAngle = max(dot(Normal, -light.direction), 0.0); 
+    vec3 ambient = 0.1 * light.color;
+    vec3 diffuse = 0.9 * light.color * cosAngle * light.intensity;
+
+    return (ambient + diffuse) * Diffuse;
+}
+
+vec3 PointLight(Light light, vec3 FragPos, vec3 Normal)
+{
+	vec3 N = normalize(Normal);
+	vec3 L = normalize(light.position - FragPos);
+
+	float threshold = 1.0;
+
+	float shadowIntensity = 1.0;
+
+	float dist = distance(light.position, FragPos);
+
+	if(dist > light.radius)
+		shadowIntensity = 1.0 - ((dist - light.radius) / threshold);
+
+	// Hardcoded specular parameter
+    vec3 specularMat = vec3(1.0);
+
+
+	// Specular
+    float specularIntensity = pow(max(0.0, dot(N, L)), 1.0);
+    vec3 specular = specularMat * specularIntensity;
+
+	// Diffuse
+    float diffuseIntensity = max(0.0, dot(N, L));
+
+	return vec3(specular + diffuseIntensity) * shadowIntensity * light.intensity * light.color;
+}
+
+void main()
+{
+	float depth = texture(uDepth, vTexCoord).r;
+    vec3 Diffuse = texture(uGDiffuse, vTexCoord).rgb;
+
+	// The skybox only wrote its colour, nothing was rasterised there
+	if (depth == 1.0)
+	{
+		oFinalRender = vec4(Diffuse, 1.0);
+		return;
+	}
+
+	vec3 FragPos = GBufferPosition(vTexCoord, depth, uInverseViewProjection);
+    vec3 Normal = DecodeGBufferNormal(texture(uGNormals, vTexCoord).rg);
+
+	vec3 viewDir = normalize(uCameraPosition - FragPos);
+
+	vec3 lighting = Diffuse * 1.0;
+    for(uint i = 0u; i < uLightCount; ++i)
+    {
+		Light light = uLights[i];
+		switch(light.type)
+		{
+			case 0u: // Directional
+			{
+                lighting += DirectionalLight(light, Normal, Diffuse);
+			}
+			break;
+
+			case 1u: // Point
+			{
+				float distance = length(light.position - FragPos);
+				if(uDirectionalOnly == 0 && distance < light.radius)
+				{
+					lighting += PointLight(light, FragPos, Normal);
+				}
+			}
+			break;
+
+			default:
+			{
+				
+			}
+			break;
+		}
+    }
+
+	oFinalRender = vec4(lighting * Diffuse, 1.0);
+
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+#ifdef TILED_LIGHTING
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+// Must match LIGHT_TILE_SIZE and LIGHT_TILE_MAX_LIGHTS
+#define TILE_SIZE 16
+#define TILE_MAX_LIGHTS 256
+
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE) in;
+
+struct Light
+{
+	vec3 position;
+	float radius;
+	vec3 color;
+	float intensity;
+	vec3 direction;
+	uint type;
+};
+
+layout(binding = 9, std430) readonly buffer Lights
+{
+	Light uLights[];
+};
+
+layout(binding = 0, rgba8) writeonly uniform image2D uOutput;
+
+uniform sampler2D uDepth;
+uniform sampler2D uGNormals;
+uniform sampler2D uGDiffuse;
+uniform mat4 uProjection;
+uniform mat4 uView;
+uniform mat4 uInverseViewProjection;
+uniform int uLightCount;
+uniform vec2 uScreenSize;
+
+shared uint sMinDepth;
+shared uint sMaxDepth;
+shared uint sLightCount;
+shared uint sLights[TILE_MAX_LIGHTS];
+
+// Same lighting as the full screen pass
+vec3 DirectionalLight(Light light, vec3 Normal, vec3 Diffuse)
+{
+	float cosAngle = max(dot(Normal, -light.direction), 0.0);
+	vec3 ambient = 0.1 * light.color;
+	vec3 diffuse = 0.9 * light.color * cosAngle * light.intensity;
+
+	return (ambient + diffuse) * Diffuse;
+}
+
+vec3 PointLight(Light light, vec3 FragPos, vec3 Normal)
+{
+	vec3 N = normalize(Normal);
+	vec3 L = normalize(light.position - FragPos);
+
+	float threshold = 1.0;
+	float shadowIntensity = 1.0;
+	float dist = distance(light.position, FragPos);
+	if (dist > light.radius)
+		shadowIntensity = 1.0 - ((dist - light.radius) / threshold);
+
+	vec3 specularMat = vec3(1.0);
+	float specularIntensity = pow(max(0.0, dot(N, L)), 1.0);
+	vec3 specular = specularMat * specularIntensity;
+	float diffuseIntensity = max(0.0, dot(N, L));
+
+	return vec3(specular + diffuseIntensity) * shadowIntensity * light.intensity * light.color;
+}
+
+// Row of the projection, a clip space plane as a view space one
+vec4 ProjectionRow(int row)
+{
+	return vec4(uProjection[0][row], uProjection[1][row], uProjection[2][row], uProjection[3][row]);
+}
+
+vec4 NormalizePlane(vec4 plane)
+{
+	return plane / length(plane.xyz);
+}
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+	bool inside = pixel.x < int(uScreenSize.x) && pixel.y < int(uScreenSize.y);
+	uint thread = gl_LocalInvocationIndex;
+
+	if (thread == 0)
+	{
+		sMinDepth = 0x7F7FFFFFu;	// FLT_MAX, positive floats order like their bits
+		sMaxDepth = 0u;
+		sLightCount = 0u;
+	}
+	barrier();
+
+	// Linear depth range of the tile, the cleared background does not count
+	float depth = inside ? texelFetch(uDepth, pixel, 0).r : 1.0;
+	if (depth < 1.0)
+	{
+		float linearDepth = uProjection[3][2] / (depth * 2.0 - 1.0 + uProjection[2][2]);
+		atomicMin(sMinDepth, floatBitsToUint(linearDepth));
+		atomicMax(sMaxDepth, floatBitsToUint(linearDepth));
+	}
+	barrier();
+
+	float minDepth = uintBitsToFloat(sMinDepth);
+	float maxDepth = uintBitsToFloat(sMaxDepth);
+
+	// Side planes of the tile through the eye, pointing inwards
+	vec2 tileMin = vec2(gl_WorkGroupID.xy * TILE_SIZE) / uScreenSize * 2.0 - 1.0;
+	vec2 tileMax = vec2((gl_WorkGroupID.xy + 1u) * TILE_SIZE) / uScreenSize * 2.0 - 1.0;
+	vec4 row0 = ProjectionRow(0);
+	vec4 row1 = ProjectionRow(1);
+	vec4 row3 = ProjectionRow(3);
+	vec4 planes[4];
+	planes[0] = NormalizePlane(row0 - tileMin.x * row3);
+	planes[1] = NormalizePlane(tileMax.x * row3 - row0);
+	planes[2] = NormalizePlane(row1 - tileMin.y * row3);
+	planes[3] = NormalizePlane(tileMax.y * row3 - row1);
+
+	// The tile's threads stride over the lights, directional ones reach every tile
+	for (uint i = thread; i < uint(uLightCount); i += TILE_SIZE * TILE_SIZE)
+	{
+		Light light = uLights[i];
+		bool visible = true;
+		if (light.type == 1u)
+		{
+			vec3 center = vec3(uView * vec4(light.position, 1.0));
+			float lightDepth = -center.z;
+			visible = minDepth <= maxDepth && lightDepth + light.radius >= minDepth && lightDepth - light.radius <= maxDepth;
+			for (int p = 0; p < 4 && visible; ++p)
+				visible = dot(planes[p].xyz, center) + planes[p].w >= -light.radius;
+		}
+
+		if (visible)
+		{
+			uint slot = atomicAdd(sLightCount, 1u);
+			if (slot < TILE_MAX_LIGHTS)
+				sLights[slot] = i;
+		}
+	}
+	barrier();
+
+	if (!inside)
+		return;
+
+	vec3 Diffuse = texelFetch(uGDiffuse, pixel, 0).rgb;
+	if (depth == 1.0)
+	{
+		imageStore(uOutput, pixel, vec4(Diffuse, 1.0));	// skybox, unlit
+		return;
+	}
+
+	vec3 FragPos = GBufferPosition((vec2(pixel) + 0.5) / uScreenSize, depth, uInverseViewProjection);
+	vec3 Normal = DecodeGBufferNormal(texelFetch(uGNormals, pixel, 0).rg);
+
+	vec3 lighting = Diffuse * 1.0;
+	uint lightCount = min(sLightCount, uint(TILE_MAX_LIGHTS));
+	for (uint i = 0u; i < lightCount; ++i)
+	{
+		Light light = uLights[sLights[i]];
+		if (light.type == 0u)
+		{
+			lighting += DirectionalLight(light, Normal, Diffuse);
+		}
+		else if (light.type == 1u && length(light.position - FragPos) < light.radius)
+		{
+			lighting += PointLight(light, FragPos, Normal);
+		}
+	}
+
+	imageStore(uOutput, pixel, vec4(lighting * Diffuse, 1.0));
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+#ifdef LIGHT_VOLUME
+
+// One point light over the pixels its sphere reaches, the stencil pass
+// before it left them non zero. Blended additively onto the final render.
+
+struct Light
+{
+	vec3 position;
+	float radius;
+	vec3 color;
+	float intensity;
+	vec3 direction;
+	uint type;
+};
+
+layout(binding = 9, std430) readonly buffer Lights
+{
+	Light uLights[];
+};
+
+uniform int uLightIndex;
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+
+uniform mat4 uProjection;
+uniform mat4 uView;
+
+// The flat faces of the 64 segment sphere sit inside the unit sphere
+#define VOLUME_SCALE 1.005
+
+void main()
+{
+	Light light = uLights[uLightIndex];
+	vec3 position = light.position + aPosition * light.radius * VOLUME_SCALE;
+	gl_Position = uProjection * uView * vec4(position, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+layout(location = 0) out vec4 oFinalRender;
+
+uniform sampler2D uDepth;
+uniform sampler2D uGNormals;
+uniform sampler2D uGDiffuse;
+uniform mat4 uInverseViewProjection;
+
+// Same lighting as the full screen pass, which only calls it inside the radius
+vec3 PointLight(Light light, vec3 FragPos, vec3 Normal)
+{
+	vec3 N = normalize(Normal);
+	vec3 L = normalize(light.position - FragPos);
+
+	vec3 specularMat = vec3(1.0);
+	float specularIntensity = pow(max(0.0, dot(N, L)), 1.0);
+	vec3 specular = specularMat * specularIntensity;
+	float diffuseIntensity = max(0.0, dot(N, L));
+
+	return vec3(specular + diffuseIntensity) * light.intensity * light.color;
+}
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	vec2 texCoord = gl_FragCoord.xy / vec2(textureSize(uDepth, 0));
+	float depth = texelFetch(uDepth, pixel, 0).r;
+	vec3 FragPos = GBufferPosition(texCoord, depth, uInverseViewProjection);
+	vec3 Normal = DecodeGBufferNormal(texelFetch(uGNormals, pixel, 0).rg);
+	vec3 Diffuse = texelFetch(uGDiffuse, pixel, 0).rgb;
+
+	// Pixels of the shell between the sphere and the radius add nothing, but
+	// are not discarded: both passes have to update their stencil
+	Light light = uLights[uLightIndex];
+	bool lit = depth < 1.0 && length(light.position - FragPos) < light.radius;
+	vec3 lighting = lit ? PointLight(light, FragPos, Normal) * Diffuse : vec3(0.0);
+	oFinalRender = vec4(lighting, 1.0);
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+#ifdef GBUFFER_DEBUG
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+layout(location = 1) in vec2 aTexCoord;
+
+out vec2 vTexCoord;
+
+void main()
+{
+	vTexCoord = aTexCoord;
+	gl_Position = vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+in vec2 vTexCoord;
+
+uniform sampler2D uDepth;
+uniform sampler2D uGNormals;
+uniform sampler2D uGDiffuse;
+uniform mat4 uInverseViewProjection;
+uniform int uView;	// Must match FBOAttachmentType: position, normals, diffuse, metallic
+
+layout(location = 0) out vec4 oColor;
+
+// Decodes one channel of the compact G-buffer for the scene panel
+void main()
+{
+	float depth = texture(uDepth, vTexCoord).r;
+	vec4 albedo = texture(uGDiffuse, vTexCoord);
+	switch (uView)
+	{
+		case 0:
+			oColor = vec4(depth < 1.0 ? GBufferPosition(vTexCoord, depth, uInverseViewProjection) : vec3(0.0), 1.0);
+			break;
+		case 1:
+			oColor = vec4(DecodeGBufferNormal(texture(uGNormals, vTexCoord).rg), 1.0);
+			break;
+		case 2:
+			oColor = vec4(albedo.rgb, 1.0);
+			break;
+		default:
+			oColor = vec4(vec3(albedo.a), 1.0);
+			break;
+	}
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+#ifdef LIGHT_CLUSTER_BUILD
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+// Must match the LIGHT_CLUSTER_ defines
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_MAX_LIGHTS 64
+
+layout(local_size_x = 64) in;
+
+struct Light
+{
+	vec3 position;
+	float radius;
+	vec3 color;
+	float intensity;
+	vec3 direction;
+	uint type;
+};
+
+layout(binding = 9, std430) readonly buffer Lights
+{
+	Light uLights[];
+};
+
+layout(binding = 10, std430) buffer LightClusters
+{
+	mat4 uClusterView;
+	mat4 uClusterProjection;
+	vec4 uClusterDepth;		// near, slice scale, far, light count
+	uint uClusterLights[];	// per cluster: count, then CLUSTER_MAX_LIGHTS indices
+};
+
+uniform int uLightCount;
+uniform mat4 uInverseProjection;
+
+// View space direction through a point of the screen, scaled to a depth of one
+vec3 ViewRay(vec2 ndc)
+{
+	vec4 p = uInverseProjection * vec4(ndc, -1.0, 1.0);
+	p.xyz /= p.w;
+	return p.xyz / -p.z;
+}
+
+void main()
+{
+	uint cluster = gl_GlobalInvocationID.x;
+	if (cluster >= CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+		return;
+
+	uvec3 cell = uvec3(cluster % CLUSTER_X, (cluster / CLUSTER_X) % CLUSTER_Y, cluster / (CLUSTER_X * CLUSTER_Y));
+
+	// View space box around the froxel's eight corners
+	float nearDepth = uClusterDepth.x * exp(float(cell.z) / uClusterDepth.y);
+	float farDepth = uClusterDepth.x * exp(float(cell.z + 1u) / uClusterDepth.y);
+	vec2 ndcMin = vec2(cell.xy) / vec2(CLUSTER_X, CLUSTER_Y) * 2.0 - 1.0;
+	vec2 ndcMax = vec2(cell.xy + 1u) / vec2(CLUSTER_X, CLUSTER_Y) * 2.0 - 1.0;
+
+	vec3 boxMin = vec3(1.0e30);
+	vec3 boxMax = vec3(-1.0e30);
+	for (int corner = 0; corner < 4; ++corner)
+	{
+		vec3 ray = ViewRay(vec2((corner & 1) == 0 ? ndcMin.x : ndcMax.x, (corner & 2) == 0 ? ndcMin.y : ndcMax.y));
+		boxMin = min(boxMin, min(ray * nearDepth, ray * farDepth));
+		boxMax = max(boxMax, max(ray * nearDepth, ray * farDepth));
+	}
+
+	// Directional lights reach every cluster, point lights the ones their sphere touches
+	uint base = cluster * (CLUSTER_MAX_LIGHTS + 1u);
+	uint count = 0u;
+	for (int i = 0; i < uLightCount && count < CLUSTER_MAX_LIGHTS; ++i)
+	{
+		Light light = uLights[i];
+		bool reaches = light.type == 0u;
+		if (light.type == 1u)
+		{
+			vec3 center = vec3(uClusterView * vec4(light.position, 1.0));
+			vec3 offset = center - clamp(center, boxMin, boxMax);
+			reaches = dot(offset, offset) <= light.radius * light.radius;
+		}
+
+		if (reaches)
+			uClusterLights[base + 1u + count++] = uint(i);
+	}
+	uClusterLights[base] = count;
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+#ifdef CLIPPED_MESHES
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+layout(location=1) in vec3 aNormal;
+layout(location=2) in vec2 aTexCoord;
+
+struct Light
+{
+	unsigned int type;
+	vec3 color;
+	vec3 direction;
+	float intensity;
+	vec3 position;
+	float radius;
+};
+
+layout(binding = 0, std140) uniform GlobalParams
+{
+	vec3 uCameraPosition;
+	unsigned int uLightCount;
+	Light uLight[50];
+};
+
+layout(location = 8) in uvec2 aDrawInfo;	// Per draw instance: transform, material
+
+struct InstanceTransform
+{
+	mat4 world;
+	vec4 params;	// x: metallic
+};
+
+layout(binding = 0, std430) readonly buffer InstanceTransforms
+{
+	InstanceTransform uTransforms[];
+};
+
+struct Material
+{
+	vec4 albedo;
+	vec4 emissive;	// w: smoothness
+	uvec4 layers;	// albedo, emissive, specular, normals texture array layers
+};
+
+layout(binding = 1, std430) readonly buffer Materials
+{
+	Material uMaterials[];
+};
+
+uniform mat4 uProj;
+uniform mat4 uView;
+
+uniform vec4 uClippingPlane;
+
+out vec2 vTexCoord;
+out vec3 vPosition;
+out vec3 vNormal;
+flat out vec3 vColor;
+flat out uint vAlbedoLayer;
+
+void main()
+{
+	mat4 worldMatrix = uTransforms[aDrawInfo.x].world;
+
+	vTexCoord = aTexCoord;
+	Material material = uMaterials[aDrawInfo.y];
+	vAlbedoLayer = material.layers.x;
+	vColor = vAlbedoLayer == NO_TEXTURE_LAYER ? material.albedo.rgb : vec3(1.0);
+
+	vPosition = vec3(worldMatrix * vec4(aPosition, 1.0));
+
+	vNormal = vec3(transpose(inverse(worldMatrix)) * vec4(aNormal, 1.0));
+
+	vec4 clipDistanceDisplacement = vec4(0.0, 0.0, 0.0, length(vec3(uView * vec4(aPosition, 1.0)))/100.0);
+	gl_ClipDistance[0] = dot(vec4(vPosition, 1.0), uClippingPlane);
+
+	gl_Position = uProj * uView * vec4(vPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+in vec2 vTexCoord;
+in vec3 vPosition;
+in vec3 vNormal;
+flat in vec3 vColor;
+flat in uint vAlbedoLayer;
+
+// Must match the LIGHT_CLUSTER_ defines
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_MAX_LIGHTS 64
+
+struct Light
+{
+	vec3 position;
+	float radius;
+	vec3 color;
+	float intensity;
+	vec3 direction;
+	uint type;
+};
+
+layout(binding = 9, std430) readonly buffer Lights
+{
+	Light uLights[];
+};
+
+layout(binding = 10, std430) readonly buffer LightClusters
+{
+	mat4 uClusterView;
+	mat4 uClusterProjection;
+	vec4 uClusterDepth;		// near, slice scale, far, light count
+	uint uClusterLights[];	// per cluster: count, then CLUSTER_MAX_LIGHTS indices
+};
+
+#define CLUSTER_NONE 0xFFFFFFFFu
+
+// First word of the main camera cluster holding the point. Reflected
+// fragments are mostly off that grid, a border cluster would lose the lights
+// that reach them, so they get CLUSTER_NONE and walk every light instead.
+uint LightCluster(vec3 worldPosition)
+{
+	vec4 viewPosition = uClusterView * vec4(worldPosition, 1.0);
+	vec4 clipPosition = uClusterProjection * viewPosition;
+	if (clipPosition.w <= 0.0 || -viewPosition.z < uClusterDepth.x || -viewPosition.z > uClusterDepth.z)
+		return CLUSTER_NONE;
+	vec2 ndc = clipPosition.xy / clipPosition.w;
+	if (any(greaterThan(abs(ndc), vec2(1.0))))
+		return CLUSTER_NONE;
+	uvec2 tile = uvec2(clamp((ndc * 0.5 + 0.5) * vec2(CLUSTER_X, CLUSTER_Y), vec2(0.0), vec2(CLUSTER_X - 1, CLUSTER_Y - 1)));
+	float slice = log(max(-viewPosition.z, uClusterDepth.x) / uClusterDepth.x) * uClusterDepth.y;
+	uint z = uint(clamp(slice, 0.0, float(CLUSTER_Z - 1)));
+	return ((z * CLUSTER_Y + tile.y) * CLUSTER_X + tile.x) * (CLUSTER_MAX_LIGHTS + 1u);
+}
+
+uniform sampler2DArray uTexture;
+uniform samplerCube uSkybox;
+
+layout(location=0) out vec4 oColor;
+
+void main()
+{
+	vec3 c = vAlbedoLayer == NO_TEXTURE_LAYER ? vec3(1.0) : texture(uTexture, vec3(vTexCoord, vAlbedoLayer)).rgb;
+	c *= vColor;
+
+	// Same lights as the forward pass, from the main camera's clusters when on the grid
+	vec3 N = normalize(vNormal);
+	vec3 lightFactor = vec3(1.0);
+	uint cluster = LightCluster(vPosition);
+	uint clusterLightCount = cluster == CLUSTER_NONE ? uint(uClusterDepth.w) : uClusterLights[cluster];
+	for (uint i = 0u; i < clusterLightCount; ++i)
+	{
+		Light light = uLights[cluster == CLUSTER_NONE ? i : uClusterLights[cluster + 1u + i]];
+		if (light.type == 0u)
+		{
+			lightFactor += light.color * dot(normalize(light.direction), N);
+		}
+		else if (light.type == 1u && distance(light.position, vPosition) < light.radius)
+		{
+			lightFactor += light.color * dot(normalize(light.position - vPosition), N);
+		}
+	}
+	c *= lightFactor;
+
+	/*vec3 I = normalize(vPosition - uCameraPosition);
+	vec3 R = reflect(I, normalize(vNormal));
+	vec4 reflections = vec4(texture(uSkybox, R).rgb, 1.0);*/
+	oColor = vec4(c, 1.0);
+
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+#ifdef WATER_EFFECT
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout (location = 0) in vec3 aPosition;
+layout (location = 1) in vec3 aNormal;
+layout(location = 2) in vec2 aTexCoord;
+
+uniform mat4 uProj;
+uniform mat4 uView;
+
+out Data
 {
 	vec3 positionViewspace;
 	vec3 normalViewspace;
 }VSOut;
 out vec2 vTexCoord;
 
+// The surface query draws the same positions before it
+invariant gl_Position;
+
 void main()
 {
 	vTexCoord = aTexCoord;
@@ -577,6 +1693,48 @@ uniform sampler2D dudvMap;
 
 uniform samplerCube skyBox;
 
+// Must match the LIGHT_CLUSTER_ defines
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_MAX_LIGHTS 64
+
+struct Light
+{
+	vec3 position;
+	float radius;
+	vec3 color;
+	float intensity;
+	vec3 direction;
+	uint type;
+};
+
+layout(binding = 9, std430) readonly buffer Lights
+{
+	Light uLights[];
+};
+
+layout(binding = 10, std430) readonly buffer LightClusters
+{
+	mat4 uClusterView;
+	mat4 uClusterProjection;
+	vec4 uClusterDepth;		// near, slice scale, far, light count
+	uint uClusterLights[];	// per cluster: count, then CLUSTER_MAX_LIGHTS indices
+};
+
+// First word of the main camera cluster holding the point, positions off
+// the grid use the nearest cluster on its border
+uint LightCluster(vec3 worldPosition)
+{
+	vec4 viewPosition = uClusterView * vec4(worldPosition, 1.0);
+	vec4 clipPosition = uClusterProjection * viewPosition;
+	vec2 ndc = clipPosition.w > 0.0 ? clipPosition.xy / clipPosition.w : vec2(0.0);
+	uvec2 tile = uvec2(clamp((ndc * 0.5 + 0.5) * vec2(CLUSTER_X, CLUSTER_Y), vec2(0.0), vec2(CLUSTER_X - 1, CLUSTER_Y - 1)));
+	float slice = log(max(-viewPosition.z, uClusterDepth.x) / uClusterDepth.x) * uClusterDepth.y;
+	uint z = uint(clamp(slice, 0.0, float(CLUSTER_Z - 1)));
+	return ((z * CLUSTER_Y + tile.y) * CLUSTER_X + tile.x) * (CLUSTER_MAX_LIGHTS + 1u);
+}
+
 in Data
 {
 	vec3 positionViewspace;
@@ -599,8 +1757,6 @@ vec3 reconstructPixelPosition(float depth)
 	return positionEyespace.xyz;
 }
 
-out float gl_FragDepth;
-
 void main()
 {
 	vec3 N = normalize(FSIn.normalViewspace);
@@ -633,12 +1789,55 @@ void main()
 	vec3 F = fresnelSchlick(max(0.0, dot(V, N)), F0);
 	oColor = vec4(mix(refractionColor, reflectionColor, F), 1.0);
 	oColor = mix(ref, oColor, 0.5);
+
+	// Highlights of the point lights in the surface's cluster
+	vec3 Nw = normalize(mat3(viewMatInv) * N);
+	vec3 Vw = normalize(mat3(viewMatInv) * V);
+	uint cluster = LightCluster(Pw);
+	uint clusterLightCount = uClusterLights[cluster];
+	for (uint i = 0u; i < clusterLightCount; ++i)
+	{
+		Light light = uLights[uClusterLights[cluster + 1u + i]];
+		float dist = distance(light.position, Pw);
+		if (light.type == 1u && dist < light.radius)
+		{
+			vec3 H = normalize(normalize(light.position - Pw) + Vw);
+			float falloff = 1.0 - dist / light.radius;
+			oColor.rgb += light.color * light.intensity * pow(max(dot(Nw, H), 0.0), 64.0) * falloff;
+		}
+	}
 	//oColor = vec4(texture(dudvMap, vTexCoord).rgb, 1.0);
 	//oColor = vec4(reflectionColor, 1.0);
 
-	gl_FragDepth = gl_FragCoord.z - 0.2;
 
 }
 
 #endif
-#endif
\ No newline at end of file
+#endif
+
+///////////////////////////////////////////////////////////////////////
+#ifdef WATER_QUERY
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+
+uniform mat4 uProj;
+uniform mat4 uView;
+
+// Same computation as the water effect, the query stands in for its depth test
+invariant gl_Position;
+
+void main()
+{
+	gl_Position = uProj * vec4(vec3(uView * vec4(aPosition, 1.0)), 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+void main()
+{
+}
+
+#endif
+#endif